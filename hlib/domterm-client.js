@@ -300,6 +300,8 @@ function loadHandler(event) {
     if (! DomTerm.server_key && (m = params.get('server-key')) != null) {
         DomTerm.server_key = m;
     }
+    if ((m = params.get('unix-socket')) != null)
+        DomTerm.unixSocket = m;
     if (DomTerm.usingQtWebEngine && ! DomTerm.isInIFrame()) {
         new QWebChannel(qt.webChannelTransport, setupQWebChannel);
     }
@@ -392,7 +394,7 @@ function loadHandler(event) {
     }
     let paneParams = new URLSearchParams();
     let copyParams = ['server-key', 'js-verbosity', 'log-string-max',
-                      'log-to-server', 'headless', 'qtdocking'];
+                      'log-to-server', 'headless', 'qtdocking', 'unix-socket'];
     for (let i = copyParams.length;  --i >= 0; ) {
         let pname = copyParams[i];
         let pvalue = params.get(pname);
@@ -1894,6 +1894,13 @@ class DTParser {
             term.updateSettings();
             term._initializeDomTerm(term.topNode);
             break;
+        case 87:
+            try {
+                term.updateGlobalSettings(JSON.parse(text));
+            } catch(e) {
+                console.log("error parsing settings delta: "+e);
+            }
+            break;
         case 89:
             try {
                 term.setSettings(JSON.parse(text));
@@ -1939,6 +1946,10 @@ class DTParser {
         case 102:
             DTParser.sendSavedHtml(term, term.getAsHTML(true));
             break;
+        case 124: // server agreed to framed output, from the next message
+            if (Number(text) == Terminal.FRAMED_OUTPUT_VERSION)
+                term._framedOutput = true;
+            break;
         case 103: // restore saved snapshot
             var comma = text.indexOf(",");
             var rcount = Number(text.substring(0,comma));
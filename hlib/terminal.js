@@ -837,6 +837,14 @@ Terminal.URGENT_FIRST_COUNTED = 23; // '\x17'
 Terminal.URGENT_FIRST_NONCOUNTED = 22; // '\x16'
 Terminal.URGENT_END = 20; // \024' - device control 4
 
+// Framed output protocol; see FRAMED_OUTPUT_PREFIX in lws-term/server.h.
+Terminal.FRAMED_OUTPUT_VERSION = 1;
+Terminal.FRAMED_OUTPUT_PREFIX = 0xFE;
+Terminal.FRAME_KIND_DATA = 68; // 'D'
+Terminal.FRAME_KIND_CONTROL = 67; // 'C'
+Terminal.FRAME_KIND_CONTROL_BEGIN = 66; // 'B'
+Terminal.FRAME_KIND_CONTROL_END = 69; // 'E'
+
 Terminal.prototype._deleteData = function(text, start, count) {
     if (count == 0)
         return;
@@ -5697,6 +5705,26 @@ Terminal.prototype.setSettings = function(obj) {
     this.updateSettings();
 }
 
+/* Apply a settings delta (as sent by OSC 87) to the global settings.
+ * The delta is only valid relative to the settings generation "#base". */
+Terminal.prototype.updateGlobalSettings = function(delta) {
+    if (this._settingsCounterInstance !== delta["#base"]) {
+        this.log("settings delta for generation "+delta["#base"]
+                 +" but have "+this._settingsCounterInstance);
+        return;
+    }
+    let obj = Object.assign({}, this._globalOptions);
+    for (const prop in delta) {
+        if (prop === "#base")
+            continue;
+        if (delta[prop] === null)
+            delete obj[prop];
+        else
+            obj[prop] = delta[prop];
+    }
+    this.setSettings(obj);
+}
+
 Terminal.prototype.updateSettings = function() {
     let getOption = (name, dflt = undefined) => this.getOption(name, dflt);
     let val;
@@ -6821,18 +6849,7 @@ Terminal.prototype.insertBytes = function(bytes) {
             startIndex = urgent_begin + 1;
 
         } else {
-            let cstate = this._savedControlState;
-            if (cstate && cstate.urgent === undefined) {
-                startIndex += cstate.setFromFollowingByte(bytes[startIndex]);
-                if (! cstate.urgent && cstate.deferredBytes) {
-                    this._savedControlState = cstate._savedControlState;
-                    let defb = cstate.deferredBytes;
-                    cstate.deferredBytes = undefined;
-                    this._savedControlState = cstate._savedControlState;
-                    this.parseBytes(defb);
-                    this._savedControlState = cstate;
-                }
-            }
+            startIndex = this._startControlState(bytes, startIndex);
             if (urgent_end >= 0) {
                 this.parseBytes(bytes, startIndex, urgent_end);
                 this.popControlState();
@@ -6851,6 +6868,77 @@ Terminal.prototype.insertBytes = function(bytes) {
     }
 }
 
+/* If we just started an urgent/out-of-band message, use its first
+ * byte (at startIndex) to determine its type.
+ * Return the index of the first byte of the message proper. */
+Terminal.prototype._startControlState = function(bytes, startIndex,
+                                                 endIndex = bytes.length) {
+    let cstate = this._savedControlState;
+    if (cstate && cstate.urgent === undefined && startIndex < endIndex) {
+        startIndex += cstate.setFromFollowingByte(bytes[startIndex]);
+        if (! cstate.urgent && cstate.deferredBytes) {
+            let defb = cstate.deferredBytes;
+            cstate.deferredBytes = undefined;
+            this._savedControlState = cstate._savedControlState;
+            this.parseBytes(defb);
+            this._savedControlState = cstate;
+        }
+    }
+    return startIndex;
+}
+
+/* Handle output using the framed protocol (see FRAMED_OUTPUT_PREFIX
+ * in lws-term/server.h).  Equivalent to insertBytes on the unframed
+ * data, but urgent/out-of-band messages are delimited by record
+ * headers, so we don't need to scan the data for them.
+ * 'bytes' is a Uint8Array whose first byte is FRAMED_OUTPUT_PREFIX. */
+Terminal.prototype.insertFramedBytes = function(bytes) {
+    const endIndex = bytes.length;
+    let index = 1;
+    if (DomTerm.verbosity >= 2)
+        this.log("insertFramedBytes "+this.name+" count:"+endIndex+" received:"+this._receivedCount);
+    while (index + 5 <= endIndex) {
+        const kind = bytes[index];
+        const rlen = ((bytes[index+1] << 24) | (bytes[index+2] << 16)
+                      | (bytes[index+3] << 8) | bytes[index+4]) >>> 0;
+        let start = index + 5;
+        const end = Math.min(start + rlen, endIndex);
+        index = end;
+        switch (kind) {
+        case Terminal.FRAME_KIND_DATA:
+            start = this._startControlState(bytes, start, end);
+            if (index < endIndex
+                && (bytes[index] == Terminal.FRAME_KIND_CONTROL
+                    || bytes[index] == Terminal.FRAME_KIND_CONTROL_BEGIN)) {
+                // Same as insertBytes: defer in case the following
+                // message is urgent.
+                if (end > start)
+                    this.parser._deferredBytes =
+                        this.parser.withDeferredBytes(bytes, start, end);
+            } else
+                this.parseBytes(bytes, start, end);
+            break;
+        case Terminal.FRAME_KIND_CONTROL:
+        case Terminal.FRAME_KIND_CONTROL_BEGIN:
+            this.pushControlState();
+            // fall through
+        case Terminal.FRAME_KIND_CONTROL_END:
+            start = this._startControlState(bytes, start, end);
+            this.parseBytes(bytes, start, end);
+            if (kind != Terminal.FRAME_KIND_CONTROL_BEGIN) {
+                this.popControlState();
+                let defb = this.parser._deferredBytes;
+                if (index >= endIndex && defb) {
+                    this.parser._deferredBytes = undefined;
+                    this.parseBytes(defb);
+                }
+            }
+            break;
+        }
+        this._maybeConfirmReceived();
+    }
+}
+
 Terminal.prototype.pushControlState = function() {
     const dt = this;
     var saved = {
@@ -9408,7 +9496,12 @@ DomTerm._handleOutputData = function(dt, data) {
     }
     var dlen;
     if (data instanceof ArrayBuffer) {
-        dt.insertBytes(new Uint8Array(data));
+        let bytes = new Uint8Array(data);
+        if (dt._framedOutput && bytes.length > 0
+            && bytes[0] == Terminal.FRAMED_OUTPUT_PREFIX)
+            dt.insertFramedBytes(bytes);
+        else
+            dt.insertBytes(bytes);
         dlen = data.byteLength;
         // updating _receivedCount is handled by insertBytes
     } else {
@@ -9512,10 +9605,20 @@ Terminal.connectWS = function(name, wspath, wsprotocol, topNode=null, no_session
                 topNode = DomTerm.makeElement(name, topNode);
             wt.initializeTerminal(topNode);
         }
-        wt.reportEvent("VERSION", JSON.stringify(DomTerm.versions));
+        wt._reportVersion();
     };
 }
 
+/* Send VERSION event on a newly opened WebSocket.
+ * Also request framed output (see insertFramedBytes); output is
+ * unframed until the server agrees (see "\e]124;" in domterm-parser.js). */
+Terminal.prototype._reportVersion = function() {
+    this._framedOutput = false;
+    let versions = Object.assign({ framing: Terminal.FRAMED_OUTPUT_VERSION },
+                                 DomTerm.versions);
+    this.reportEvent("VERSION", JSON.stringify(versions));
+}
+
 Terminal.prototype.showConnectFailure = function(ecode, reconnect=null, toRemote=true)  {
     if (this._showConnectFailElement)
         return;
@@ -9584,10 +9687,166 @@ Terminal.prototype.showConnectFailure = function(ecode, reconnect=null, toRemote
     div.addEventListener("click", handler, false);
 };
 
+/** A WebSocket client connected to the server's Unix domain socket
+ * (the server.unix-socket setting), using Node's net module.
+ * Only Electron allows that; this implements the part of the WebSocket
+ * API that newWS uses.
+ */
+class UnixWebSocket {
+    constructor(socketPath, wspath, wsprotocol) {
+        this._Buffer = electronAccess.require('buffer').Buffer;
+        this._crypto = electronAccess.require('crypto');
+        this.binaryType = "arraybuffer";
+        this.onopen = null;
+        this.onmessage = null;
+        this.onerror = null;
+        this.onclose = null;
+        this._open = false;
+        this._closeCode = 1006;
+        this._input = null;
+        this._fragments = [];
+        this._opcode = 0;
+        let m = wspath.match(/^wss?:\/\/[^\/]*(\/.*)$/);
+        let key = this._crypto.randomBytes(16).toString('base64');
+        let request = "GET " + (m ? m[1] : "/") + " HTTP/1.1\r\n"
+            + "Host: localhost\r\n"
+            + "Upgrade: websocket\r\n"
+            + "Connection: Upgrade\r\n"
+            + "Sec-WebSocket-Key: " + key + "\r\n"
+            + "Sec-WebSocket-Version: 13\r\n"
+            + "Sec-WebSocket-Protocol: " + wsprotocol + "\r\n\r\n";
+        this._socket = electronAccess.require('net').connect(socketPath, () => {
+            this._socket.write(request);
+        });
+        this._socket.on('data', (data) => this._receive(data));
+        this._socket.on('error', (e) => {
+            if (this.onerror)
+                this.onerror(e);
+        });
+        this._socket.on('close', () => {
+            this._open = false;
+            if (this.onclose)
+                this.onclose({code: this._closeCode});
+        });
+    }
+
+    _receive(data) {
+        let buf = this._input ? this._Buffer.concat([this._input, data]) : data;
+        if (! this._open) {
+            let end = buf.indexOf("\r\n\r\n");
+            if (end < 0) {
+                this._input = buf;
+                return;
+            }
+            if (! /^HTTP\/1\.1 101 /.test(buf.toString('latin1', 0, end))) {
+                this._socket.destroy();
+                return;
+            }
+            buf = buf.subarray(end + 4);
+            this._open = true;
+            if (this.onopen)
+                this.onopen({});
+        }
+        for (;;) {
+            if (buf.length < 2)
+                break;
+            let len = buf[1] & 0x7F, pos = 2;
+            if (len == 126) {
+                if (buf.length < 4)
+                    break;
+                len = buf.readUInt16BE(2);
+                pos = 4;
+            } else if (len == 127) {
+                if (buf.length < 10)
+                    break;
+                len = Number(buf.readBigUInt64BE(2));
+                pos = 10;
+            }
+            if (buf.length < pos + len)
+                break;
+            // Frames from the server are not masked.
+            let fin = (buf[0] & 0x80) != 0, opcode = buf[0] & 0xF;
+            let payload = buf.subarray(pos, pos + len);
+            buf = buf.subarray(pos + len);
+            if (opcode == 8) { // close
+                if (payload.length >= 2)
+                    this._closeCode = payload.readUInt16BE(0);
+                this._sendFrame(8, payload.subarray(0, 2));
+                this._socket.end();
+                continue;
+            }
+            if (opcode == 9) { // ping
+                this._sendFrame(10, payload);
+                continue;
+            }
+            if (opcode == 10)
+                continue;
+            if (opcode != 0)
+                this._opcode = opcode;
+            this._fragments.push(payload);
+            if (! fin)
+                continue;
+            let message = this._Buffer.concat(this._fragments);
+            this._fragments = [];
+            if (this.onmessage)
+                this.onmessage({data: this._opcode == 1
+                                ? message.toString('utf8')
+                                : message.buffer.slice(message.byteOffset,
+                                                       message.byteOffset
+                                                       + message.length)});
+        }
+        this._input = buf.length > 0 ? buf : null;
+    }
+
+    _sendFrame(opcode, payload) {
+        let len = payload.length;
+        let hlen = len < 126 ? 2 : len < 0x10000 ? 4 : 10;
+        let frame = this._Buffer.alloc(hlen + 4 + len);
+        frame[0] = 0x80 | opcode;
+        if (len < 126)
+            frame[1] = 0x80 | len;
+        else if (len < 0x10000) {
+            frame[1] = 0x80 | 126;
+            frame.writeUInt16BE(len, 2);
+        } else {
+            frame[1] = 0x80 | 127;
+            frame.writeBigUInt64BE(BigInt(len), 2);
+        }
+        // Frames from a client must be masked.
+        let mask = this._crypto.randomBytes(4);
+        mask.copy(frame, hlen);
+        for (let i = 0; i < len; i++)
+            frame[hlen + 4 + i] = payload[i] ^ mask[i & 3];
+        this._socket.write(frame);
+    }
+
+    send(data) {
+        if (typeof data == "string")
+            this._sendFrame(1, this._Buffer.from(data, 'utf8'));
+        else if (data instanceof ArrayBuffer)
+            this._sendFrame(2, this._Buffer.from(data));
+        else
+            this._sendFrame(2, this._Buffer.from(data.buffer, data.byteOffset,
+                                                 data.byteLength));
+    }
+
+    close() {
+        if (this._open) {
+            this._sendFrame(8, this._Buffer.alloc(0));
+            this._open = false;
+        }
+        this._socket.end();
+    }
+}
+
 Terminal.newWS = function(wspath, wsprotocol, wt) {
     let wsocket;
     try {
-        wsocket = new WebSocket(wspath, wsprotocol);
+        if (DomTerm.unixSocket && DomTerm.isElectron()
+            && window.electronAccess)
+            wsocket = new UnixWebSocket(DomTerm.unixSocket, wspath, wsprotocol);
+        else
+            wsocket = new WebSocket(wspath, wsprotocol);
         if (DomTerm.verbosity > 0)
             DomTerm.log("created WebSocket on  "+wspath);
     } catch (e) {
@@ -9654,7 +9913,7 @@ Terminal.newWS = function(wspath, wsprotocol, wt) {
                            + "&rsession=" + wt.sstate.sessionNumber);
             let wsocket = Terminal.newWS(wspath, wsprotocol, wt);
             wsocket.onopen = function(e) {
-                wt.reportEvent("VERSION", JSON.stringify(DomTerm.versions));
+                wt._reportVersion();
                 wt._confirmedCount = wt._receivedCount;
                 wt._socketOpen = true;
                 wt._handleSavedLog();
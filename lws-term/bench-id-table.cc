@@ -0,0 +1,211 @@
+/* Scaling benchmark for the session and connection tables.
+ * Creates many sessions and connections (using the same id_table
+ * and string_index classes as ldomterm, but without any ptys or sockets),
+ * and measures the latency of attach (lookup by name + new connection),
+ * detach, and status (iterate over all sessions and their connections).
+ *
+ * Usage: bench-id-table [-s SESSIONS] [-c CONNECTIONS] [-r ROUNDS]
+ * Not built by default: "make bench" builds and runs it.
+ */
+#include "id-table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench_connection;
+
+struct bench_session {
+    int index() { return session_number; }
+    bool avoid_index(int) { return true; }
+    int session_number;
+    char session_name[32];
+    char ttyname[32];
+    struct bench_connection *first_connection;
+};
+
+struct bench_connection {
+    int index() { return connection_number; }
+    bool avoid_index(int) { return true; }
+    int connection_number;
+    struct bench_session *session;
+    struct bench_connection *next_connection;
+};
+
+static id_numbering numbering;
+static id_table<bench_session> sessions(&numbering);
+static id_table<bench_connection> connections(&numbering);
+static string_index<bench_session> sessions_by_name;
+static string_index<bench_session> sessions_by_tty;
+
+static double
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static void
+report(const char *what, double *samples, int n, const char *unit)
+{
+    qsort(samples, n, sizeof(double), compare_doubles);
+    printf("%-24s p50: %10.1f %s  p99: %10.1f %s  max: %10.1f %s\n",
+           what, samples[n / 2], unit, samples[(n * 99) / 100], unit,
+           samples[n - 1], unit);
+}
+
+static struct bench_session *
+new_session(int i)
+{
+    struct bench_session *s = (struct bench_session *)
+        calloc(1, sizeof(struct bench_session));
+    s->session_number = sessions.enter(s, -1);
+    snprintf(s->session_name, sizeof(s->session_name), "session-%d", i);
+    snprintf(s->ttyname, sizeof(s->ttyname), "/dev/pts/%d", i);
+    sessions_by_name.add(s->session_name, s);
+    sessions_by_tty.add(s->ttyname, s);
+    return s;
+}
+
+static void
+close_session(struct bench_session *s)
+{
+    sessions_by_name.remove(s->session_name, s);
+    sessions_by_tty.remove(s->ttyname, s);
+    sessions.remove(s);
+}
+
+static struct bench_connection *
+attach(const char *name)
+{
+    int nfound;
+    struct bench_session *s = sessions_by_name.find(name, &nfound);
+    if (s == NULL || nfound != 1)
+        return NULL;
+    struct bench_connection *c = (struct bench_connection *)
+        calloc(1, sizeof(struct bench_connection));
+    c->connection_number = connections.enter(c, -1);
+    c->session = s;
+    c->next_connection = s->first_connection;
+    s->first_connection = c;
+    return c;
+}
+
+static void
+detach(struct bench_connection *c)
+{
+    struct bench_connection **p = &c->session->first_connection;
+    while (*p != c)
+        p = &(*p)->next_connection;
+    *p = c->next_connection;
+    connections.remove(c);
+    free(c);
+}
+
+/* Like "domterm status": visit every session and its connections. */
+static long
+status()
+{
+    long sum = 0;
+    for (struct bench_session *s = sessions.first(); s != nullptr;
+         s = sessions.next(s)) {
+        sum += s->session_number;
+        for (struct bench_connection *c = s->first_connection; c != NULL;
+             c = c->next_connection)
+            sum += c->connection_number;
+    }
+    return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+    int nsessions = 10000, nconnections = 20000, rounds = 2000;
+    int ch;
+    while ((ch = getopt(argc, argv, "s:c:r:")) != -1) {
+        switch (ch) {
+        case 's': nsessions = atoi(optarg); break;
+        case 'c': nconnections = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s sessions] [-c connections] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nsessions <= 0 || nconnections < 0 || rounds <= 0)
+        return 1;
+    srand(12345); // results should be comparable between runs
+
+    double start = now_ns();
+    struct bench_session **all = (struct bench_session **)
+        calloc(nsessions, sizeof(struct bench_session *));
+    for (int i = 0; i < nsessions; i++)
+        all[i] = new_session(i);
+    double t = now_ns();
+    printf("%-24s %10.1f ns/session\n", "create sessions",
+           (t - start) / nsessions);
+    char name[32];
+    start = now_ns();
+    for (int i = 0; i < nconnections; i++) {
+        snprintf(name, sizeof(name), "session-%d", i % nsessions);
+        attach(name);
+    }
+    t = now_ns();
+    if (nconnections > 0)
+        printf("%-24s %10.1f ns/connection\n", "create connections",
+               (t - start) / nconnections);
+    printf("%-24s %d sessions, %d connections\n", "tables",
+           sessions.size(), connections.size());
+
+    double *samples = (double *) calloc(rounds, sizeof(double));
+    for (int r = 0; r < rounds; r++) {
+        snprintf(name, sizeof(name), "session-%d", rand() % nsessions);
+        start = now_ns();
+        struct bench_connection *c = attach(name);
+        samples[r] = now_ns() - start;
+        if (c)
+            detach(c);
+    }
+    report("attach by name", samples, rounds, "ns");
+
+    for (int r = 0; r < rounds; r++) {
+        snprintf(name, sizeof(name), "/dev/pts/%d", rand() % nsessions);
+        start = now_ns();
+        volatile struct bench_session *s = sessions_by_tty.find(name);
+        samples[r] = now_ns() - start;
+        (void) s;
+    }
+    report("find by tty", samples, rounds, "ns");
+
+    for (int r = 0; r < rounds; r++) {
+        int i = rand() % nsessions;
+        struct bench_session *s = all[i];
+        while (s->first_connection)
+            detach(s->first_connection);
+        start = now_ns();
+        close_session(s);
+        all[i] = new_session(i);
+        samples[r] = now_ns() - start;
+        free(s);
+    }
+    report("close+create session", samples, rounds, "ns");
+
+    int status_rounds = rounds < 200 ? rounds : 200;
+    volatile long sink = 0;
+    for (int r = 0; r < status_rounds; r++) {
+        start = now_ns();
+        sink += status();
+        samples[r] = (now_ns() - start) / 1000.0;
+    }
+    report("status", samples, status_rounds, "us");
+    return 0;
+}
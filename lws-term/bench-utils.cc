@@ -0,0 +1,338 @@
+/* Microbenchmarks for the utility primitives in utils.cc:
+ * sbuf_append/sbuf_printf (and sbuf_extend), base64_encode,
+ * parse_args, url_encode, check_conditional, getenv_from_array,
+ * copy_strings, and parse_settings (the settings file parser).
+ * Inputs are generated with a fixed seed, so results are comparable
+ * between runs (and between versions of utils.cc).
+ *
+ * Usage: bench-utils [-r ROUNDS] [-b BASE64-KBYTES] [-n SETTINGS-LINES]
+ *   [BENCHMARK-NAME...]
+ * Not built by default: "make bench" builds and runs it.
+ */
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct options *main_options = NULL; // only used by printf_error
+
+static int rounds = 20;
+static int base64_kbytes = 1024;
+static int settings_lines = 5000;
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+/* Report the median time of one round (which does ops operations
+ * on a total of bytes bytes, if bytes > 0). */
+static void
+report(const char *what, double *samples, long ops, size_t bytes)
+{
+    qsort(samples, rounds, sizeof(double), compare_doubles);
+    double median = samples[rounds / 2];
+    printf("%-24s %10.1f ns/op", what, median / ops);
+    if (bytes > 0)
+        printf("  %8.1f MB/s", bytes / median * 1e3);
+    printf("  (min %.1f ns/op)\n", samples[0] / ops);
+}
+
+static volatile long sink;
+
+static void
+bench_sbuf_append(double *samples)
+{
+    const long n = 1000000;
+    const char chunk[] = "0123456789abcdef";
+    for (int r = 0; r < rounds; r++) {
+        struct sbuf sb;
+        sbuf_init(&sb);
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++)
+            sbuf_append(&sb, chunk, sizeof(chunk) - 1);
+        samples[r] = monotonic_ns() - start;
+        sink += sb.len;
+        sbuf_free(&sb);
+    }
+    report("sbuf_append(16)", samples, n, n * 16);
+}
+
+static void
+bench_sbuf_append_large(double *samples)
+{
+    const long n = 1000;
+    const size_t chunk_size = 65536;
+    char *chunk = challoc(chunk_size);
+    memset(chunk, 'x', chunk_size);
+    for (int r = 0; r < rounds; r++) {
+        struct sbuf sb;
+        sbuf_init(&sb);
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++)
+            sbuf_append(&sb, chunk, chunk_size);
+        samples[r] = monotonic_ns() - start;
+        sink += sb.len;
+        sbuf_free(&sb);
+    }
+    free(chunk);
+    report("sbuf_append(64K)", samples, n, n * chunk_size);
+}
+
+static void
+bench_sbuf_printf(double *samples)
+{
+    const long n = 200000;
+    for (int r = 0; r < rounds; r++) {
+        struct sbuf sb;
+        sbuf_init(&sb);
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++)
+            sbuf_printf(&sb, "\033]72;%ld;%s\007", i, "session-name");
+        samples[r] = monotonic_ns() - start;
+        sink += sb.len;
+        sbuf_free(&sb);
+    }
+    report("sbuf_printf", samples, n, 0);
+}
+
+static void
+bench_base64(double *samples)
+{
+    size_t len = (size_t) base64_kbytes * 1024;
+    unsigned char *data = (unsigned char *) xmalloc(len);
+    for (size_t i = 0; i < len; i++)
+        data[i] = rand() & 0xFF;
+    for (int r = 0; r < rounds; r++) {
+        int64_t start = monotonic_ns();
+        char *encoded = base64_encode(data, len);
+        samples[r] = monotonic_ns() - start;
+        sink += encoded[0];
+        free(encoded);
+    }
+    free(data);
+    report("base64_encode", samples, 1, len);
+}
+
+static void
+bench_parse_args(double *samples)
+{
+    const long n = 20000;
+    const char *cmd = "/usr/bin/ssh -o 'ControlPath=~/.ssh/cm-%r@%h:%p' "
+        "-t user@example.com \"domterm --browser-pipe attach\" "
+        "--settings=\\\"a b\\\" $'tab\\there' x y z";
+    for (int r = 0; r < rounds; r++) {
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++) {
+            argblob_t args = parse_args(cmd, true);
+            sink += args != NULL;
+            free((void *) args);
+        }
+        samples[r] = monotonic_ns() - start;
+    }
+    report("parse_args", samples, n, n * strlen(cmd));
+}
+
+static void
+bench_url_encode(double *samples)
+{
+    const long n = 20000;
+    struct sbuf sb;
+    sbuf_init(&sb);
+    for (int i = 0; i < 20; i++)
+        sbuf_printf(&sb, "/home/user/My Documents/project %d/file?name=%d&x", i, i);
+    char *path = sbuf_strdup(&sb);
+    sbuf_free(&sb);
+    for (int r = 0; r < rounds; r++) {
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++) {
+            char *encoded = url_encode(path, 0);
+            sink += encoded != NULL;
+            free(encoded);
+        }
+        samples[r] = monotonic_ns() - start;
+    }
+    report("url_encode", samples, n, n * strlen(path));
+    free(path);
+}
+
+static bool
+test_clause(const char *clause, void *data)
+{
+    return strcmp(clause, (const char *) data) == 0;
+}
+
+static void
+bench_check_conditional(double *samples)
+{
+    const long n = 200000;
+    const char *tmplate = "{with-chrome|with-firefox|!electron}"
+        "{linux|macos|wsl}/usr/bin/xdg-open %U";
+    for (int r = 0; r < rounds; r++) {
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++)
+            sink += check_conditional(tmplate, test_clause,
+                                      (void *) "wsl") != NULL;
+        samples[r] = monotonic_ns() - start;
+    }
+    report("check_conditional", samples, n, 0);
+}
+
+static char **
+make_env(int count)
+{
+    char **env = (char **) xmalloc((count + 1) * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        char buf[100];
+        snprintf(buf, sizeof(buf), "VARIABLE_NUMBER_%d=/some/value/%d:%x",
+                 i, i, rand());
+        env[i] = xstrdup(buf);
+    }
+    env[count] = NULL;
+    return env;
+}
+
+static void
+free_env(char **env)
+{
+    for (char **p = env; *p; p++)
+        free(*p);
+    free(env);
+}
+
+static void
+bench_getenv(double *samples)
+{
+    const long n = 20000;
+    const int count = 300;
+    char **env = make_env(count);
+    char key[50];
+    snprintf(key, sizeof(key), "VARIABLE_NUMBER_%d", count - 1);
+    for (int r = 0; r < rounds; r++) {
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++)
+            sink += getenv_from_array(key, env) != NULL;
+        samples[r] = monotonic_ns() - start;
+    }
+    report("getenv_from_array(300)", samples, n, 0);
+    free_env(env);
+}
+
+static void
+bench_copy_strings(double *samples)
+{
+    const long n = 5000;
+    char **env = make_env(300);
+    for (int r = 0; r < rounds; r++) {
+        int64_t start = monotonic_ns();
+        for (long i = 0; i < n; i++) {
+            argblob_t copy = copy_strings(env);
+            sink += copy[0][0];
+            free((void *) copy);
+        }
+        samples[r] = monotonic_ns() - start;
+    }
+    report("copy_strings(300)", samples, n, 0);
+    free_env(env);
+}
+
+static void
+count_setting(char *key, char *value, void *data)
+{
+    (*(long *) data) += strlen(key) + strlen(value);
+}
+
+static void
+bench_parse_settings(double *samples)
+{
+    struct sbuf sb;
+    sbuf_init(&sb);
+    for (int i = 0; i < settings_lines; i++) {
+        switch (i % 5) {
+        case 0:
+            sbuf_printf(&sb, "# Comment line %d\n", i);
+            break;
+        case 1:
+            sbuf_printf(&sb, "style.user-%d = div.domterm { color: #%06x }\n",
+                        i, rand() & 0xFFFFFF);
+            break;
+        case 2:
+            sbuf_printf(&sb, "style.qt-%d =\n |span.x%d { margin: 0 }\n |span.y%d { padding: 1px }\n",
+                        i, i, i);
+            break;
+        case 3:
+            sbuf_printf(&sb, "\n");
+            break;
+        default:
+            sbuf_printf(&sb, "command.x%d = {linux}xdg-open %%U;{macos}open %%U\n", i);
+            break;
+        }
+    }
+    size_t len = sb.len;
+    char *text = challoc(len + 1);
+    for (int r = 0; r < rounds; r++) {
+        memcpy(text, sb.buffer, len); // parse_settings modifies the text
+        long total = 0, err_offset;
+        int64_t start = monotonic_ns();
+        const char *emsg = parse_settings(text, text + len, count_setting,
+                                          &total, &err_offset);
+        samples[r] = monotonic_ns() - start;
+        if (emsg != NULL)
+            fprintf(stderr, "parse_settings error at %ld%s\n", err_offset, emsg);
+        sink += total;
+    }
+    report("parse_settings", samples, settings_lines, len);
+    free(text);
+    sbuf_free(&sb);
+}
+
+static struct benchmark {
+    const char *name;
+    void (*run)(double *samples);
+} benchmarks[] = {
+    { "sbuf_append", bench_sbuf_append },
+    { "sbuf_append_large", bench_sbuf_append_large },
+    { "sbuf_printf", bench_sbuf_printf },
+    { "base64_encode", bench_base64 },
+    { "parse_args", bench_parse_args },
+    { "url_encode", bench_url_encode },
+    { "check_conditional", bench_check_conditional },
+    { "getenv_from_array", bench_getenv },
+    { "copy_strings", bench_copy_strings },
+    { "parse_settings", bench_parse_settings },
+    { NULL, NULL }
+};
+
+int
+main(int argc, char **argv)
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "r:b:n:")) != -1) {
+        switch (ch) {
+        case 'r': rounds = atoi(optarg); break;
+        case 'b': base64_kbytes = atoi(optarg); break;
+        case 'n': settings_lines = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] [-b base64-kbytes] [-n settings-lines] [name...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (rounds <= 0 || base64_kbytes <= 0 || settings_lines <= 0)
+        return 1;
+    double *samples = (double *) calloc(rounds, sizeof(double));
+    for (struct benchmark *b = benchmarks; b->name; b++) {
+        bool selected = optind == argc;
+        for (int i = optind; i < argc; i++)
+            if (strcmp(argv[i], b->name) == 0)
+                selected = true;
+        if (selected) {
+            srand(12345); // inputs should be the same between runs
+            b->run(samples);
+        }
+    }
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef CALLBACK_TIMING_H
+#define CALLBACK_TIMING_H
+
+/** Timing of libwebsockets callbacks, to find what stalls the event loop.
+ * Enabled by the log.slow-callback setting, which is a threshold in
+ * milliseconds.  When enabled, the duration of every callback is added
+ * to a histogram for its (callback, reason) pair, and callbacks that take
+ * longer than the threshold are logged (and fire the domterm:slow__callback
+ * USDT probe, if <sys/sdt.h> was available).
+ * When disabled the cost is one test of callback_timing_enabled.
+ */
+
+enum callback_kind {
+    CALLBACK_HTTP,
+    CALLBACK_TTY,
+    CALLBACK_PTY,
+    CALLBACK_CMD,
+    CALLBACK_PROXY,
+    CALLBACK_SSH_STDERR,
+    CALLBACK_URING,
+    CALLBACK_KINDS
+};
+extern const char *callback_kind_names[CALLBACK_KINDS];
+
+// Reasons numbered CALLBACK_REASONS-1 or higher share one histogram.
+#define CALLBACK_REASONS 128
+
+extern bool callback_timing_enabled;
+extern void set_callback_timing(double threshold_ms);
+// The histogram (in microseconds) for kind and reason, or NULL if unused.
+extern struct histogram *callback_histogram(int kind, int reason);
+
+/** Declare one of these at the start of a callback.
+ * Times from construction to the end of the enclosing block. */
+class callback_timer {
+    int64_t start;
+    int kind, reason;
+    int session, connection;
+    void begin(int kind, int reason, struct pty_client *pclient,
+               struct tty_client *tclient);
+    void done();
+public:
+    callback_timer(int kind, int reason, struct pty_client *pclient,
+                   struct tty_client *tclient) {
+        start = 0;
+        if (callback_timing_enabled)
+            begin(kind, reason, pclient, tclient);
+    }
+    ~callback_timer() {
+        if (start != 0)
+            done();
+    }
+};
+#endif
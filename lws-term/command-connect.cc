@@ -12,6 +12,7 @@
 #include <sys/uio.h>
 
 char *backend_socket_name;
+char *ws_socket_name; // see server.unix-socket setting
 static const char *server_socket_path = NULL;
 
 static void server_atexit_handler(void) {
@@ -19,6 +20,10 @@ static void server_atexit_handler(void) {
         unlink(server_socket_path);
         server_socket_path = NULL;
     }
+    if (ws_socket_name != NULL) {
+        unlink(ws_socket_name);
+        ws_socket_name = NULL;
+    }
     if (main_html_url != NULL) {
         unlink(main_html_path);
         main_html_path = NULL;
@@ -39,9 +44,18 @@ setblocking(int fd, int state)
     }
 }
 
-/* Create command server socket. */
+/* Remove the command socket (and the main html file) on exit. */
+void
+unlink_command_socket_at_exit(const char *socket_path)
+{
+    server_socket_path = socket_path;
+    atexit(server_atexit_handler);
+}
+
+/* Create a listening Unix domain socket at socket_path,
+ * that only the user can connect to. */
 int
-create_command_socket(const char *socket_path)
+create_unix_socket(const char *socket_path)
 {
     struct sockaddr_un      sa;
     mode_t                  mask;
@@ -68,8 +82,6 @@ create_command_socket(const char *socket_path)
     if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1)
         return (-1);
     umask(mask);
-    server_socket_path = socket_path;
-    atexit(server_atexit_handler);
 
     if (listen(fd, 128) == -1)
         return (-1);
@@ -78,6 +90,16 @@ create_command_socket(const char *socket_path)
     return (fd);
 }
 
+/* Create command server socket. */
+int
+create_command_socket(const char *socket_path)
+{
+    int fd = create_unix_socket(socket_path);
+    if (fd >= 0)
+        unlink_command_socket_at_exit(socket_path);
+    return fd;
+}
+
 static struct json_object *
 state_to_json(int argc, char *const*argv, char *const *env)
 {
@@ -230,15 +252,11 @@ static const struct lws_protocols cmd_protocols[] = {
 };
 #endif
 
-/** Send command from client to server, using socket. */
-int
-client_send_command(int socket, int argc, char *const*argv, char *const *env)
+/* Send the state (as json, followed by '\f') to the server.
+ * If PASS_STDFILES_UNIX_SOCKET, our stdin/stdout/stderr are sent too. */
+static ssize_t
+send_state(int socket, json_object *jobj)
 {
-    int tin = STDIN_FILENO;
-    if (isatty(tin)) {
-        tty_save_set_raw(tin);
-    }
-    json_object *jobj = state_to_json(argc, argv, env);
     const char *state_as_json = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
 
     size_t jlen = strlen(state_as_json);
@@ -248,20 +266,6 @@ client_send_command(int socket, int argc, char *const*argv, char *const *env)
     iov[0].iov_len = jlen;
     iov[1].iov_base = (void*) "\f";
     iov[1].iov_len = 1;
-
-    info.protocols = cmd_protocols;
-    context = lws_create_context(&info);
-    vhost = lws_create_vhost(context, &info);
-    lws_sock_file_fd_type fd;
-    fd.filefd = socket;
-    struct lws *cmdwsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd, "cmd-socket", NULL);
-    lwsl_notice("cmd-socket fd:%d wsi:%p\n", socket, cmdwsi);
-    struct cmd_socket_client *cclient = (struct cmd_socket_client *) lws_wsi_user(cmdwsi);
-    cclient->socket = socket;
-    cclient->exit_code = 0;
-    cclient->rsize = 5000;
-    cclient->rbuffer = (unsigned char*) xmalloc(cclient->rsize);
-
 #if PASS_STDFILES_UNIX_SOCKET
     struct msghdr msg;
     int myfds[3];
@@ -286,9 +290,39 @@ client_send_command(int socket, int argc, char *const*argv, char *const *env)
     msg.msg_iovlen = 2;
     msg.msg_flags = 0;
     errno = 0;
+    return sendmsg(socket, &msg, 0);
+#else
+    return writev(socket, iov, 2);
+#endif
+}
+
+/** Send command from client to server, using socket. */
+int
+client_send_command(int socket, int argc, char *const*argv, char *const *env)
+{
+    int tin = STDIN_FILENO;
+    if (isatty(tin)) {
+        tty_save_set_raw(tin);
+    }
+    json_object *jobj = state_to_json(argc, argv, env);
+
+    info.protocols = cmd_protocols;
+    context = lws_create_context(&info);
+    vhost = lws_create_vhost(context, &info);
+    lws_sock_file_fd_type fd;
+    fd.filefd = socket;
+    struct lws *cmdwsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd, "cmd-socket", NULL);
+    lwsl_notice("cmd-socket fd:%d wsi:%p\n", socket, cmdwsi);
+    struct cmd_socket_client *cclient = (struct cmd_socket_client *) lws_wsi_user(cmdwsi);
+    cclient->socket = socket;
+    cclient->exit_code = 0;
+    cclient->rsize = 5000;
+    cclient->rbuffer = (unsigned char*) xmalloc(cclient->rsize);
+
+#if PASS_STDFILES_UNIX_SOCKET
     lwsl_notice("sending command '%s' to server\n",
                 argc ? argv[0] : "(implicit-new)");
-    ssize_t n1 = sendmsg(socket, &msg, 0);
+    ssize_t n1 = send_state(socket, jobj);
     //don't close STDERR_FILENO, for the sake of lwsl_notice below
 #else
     fd.filefd = STDIN_FILENO;
@@ -297,7 +331,7 @@ client_send_command(int socket, int argc, char *const*argv, char *const *env)
     iclient->socket = socket;
     iclient->rsize = cclient->rsize;
     iclient->rbuffer = cclient->rbuffer;
-    int r  = writev(socket, iov, 2);
+    int r  = send_state(socket, jobj);
     lwsl_notice("client cmd write %d\n", r);
 #endif
     json_object_put(jobj);
@@ -311,17 +345,265 @@ client_send_command(int socket, int argc, char *const*argv, char *const *env)
     return ret;
 }
 
+/* Run a batch of commands in the server, over one connection.
+ * Each element of jcommands is an array of arguments, as argv for a
+ * single command.  The server runs them in order, and sends the exit
+ * code of each as it finishes (if !PASS_STDFILES_UNIX_SOCKET, after
+ * the command's stdout/stderr, which we copy to ours).  Set statuses[i]
+ * to the exit code of command i, and return the number of commands
+ * whose exit code we got (fewer than all if the connection was lost). */
+int
+client_run_batch(int socket, json_object *jcommands, char *const *env,
+                 int *statuses)
+{
+    json_object *jobj = state_to_json(0, NULL, env);
+    json_object_object_add(jobj, "commands", json_object_get(jcommands));
+    ssize_t n = send_state(socket, jobj);
+    json_object_put(jobj);
+    if (n <= 0)
+        return 0;
+    int ncommands = json_object_array_length(jcommands);
+    int done = 0;
+#if !PASS_STDFILES_UNIX_SOCKET
+    int cur_out = STDOUT_FILENO;
+    bool exit_code_next = false;
+#endif
+    unsigned char buf[5000];
+    while (done < ncommands) {
+        n = read(socket, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+#if PASS_STDFILES_UNIX_SOCKET
+        for (ssize_t i = 0; i < n && done < ncommands; i++)
+            statuses[done++] = buf[i];
+#else
+        ssize_t start = 0;
+        for (ssize_t i = 0; i <= n; i++) {
+            int ch = i == n ? -1 : buf[i];
+            if (exit_code_next && ch >= 0) {
+                if (done < ncommands)
+                    statuses[done++] = ch;
+                exit_code_next = false;
+                start = i + 1;
+            } else if (ch <= '\003') {
+                if (i > start
+                    && write(cur_out, buf + start, i - start) != i - start)
+                    lwsl_err("write failed\n");
+                start = i + 1;
+                if (ch == PASS_STDFILES_SWITCH_TO_STDERR)
+                    cur_out = STDERR_FILENO;
+                else if (ch == PASS_STDFILES_SWITCH_TO_STDOUT)
+                    cur_out = STDOUT_FILENO;
+                else if (ch == PASS_STDFILES_EXIT_CODE)
+                    exit_code_next = true;
+            }
+        }
+#endif
+    }
+    return done;
+}
+
+/* Run a command from a client, given the client's state (jobj)
+ * and the command's arguments (jargv, which may be NULL). */
+static int
+run_client_command(struct lws *wsi, struct options *opts,
+                   struct json_object *jobj, struct json_object *jargv)
+{
+    struct json_object *jcwd = NULL;
+    struct json_object *jenv = NULL;
+    struct json_object *joptions = NULL;
+    const char *cwd = NULL;
+    // if (!json_object_object_get_ex(jobj, "cwd", &jcwd))
+    //   fatal("jswon no cwd");
+    int argc = -1;
+    const char **argv = NULL;
+    const char**env = NULL;
+    if (json_object_object_get_ex(jobj, "cwd", &jcwd)
+        && (cwd = strdup(json_object_get_string(jcwd))) != NULL) {
+    }
+    if (jargv != NULL) {
+        argc = json_object_array_length(jargv);
+        argv = (const char**) xmalloc(sizeof(const char*) * (argc+1));
+        for (int i = 0; i <argc; i++) {
+          argv[i] = strdup(json_object_get_string(json_object_array_get_idx(jargv, i)));
+        }
+        argv[argc] = NULL;
+    }
+    if (json_object_object_get_ex(jobj, "env", &jenv)) {
+        int nenv = json_object_array_length(jenv);
+        env = (const char**) xmalloc(sizeof(const char*) * (nenv+1));
+        for (int i = 0; i <nenv; i++) {
+          env[i] = json_object_get_string(json_object_array_get_idx(jenv, i));
+        }
+        env[nenv] = NULL;
+    }
+    if (json_object_object_get_ex(jobj, "options", &joptions)) {
+        if (opts->cmd_settings)
+            json_object_put(opts->cmd_settings);
+        opts->cmd_settings = json_object_get(joptions);
+    }
+    optind = 1;
+    set_settings(opts);
+    opts->env = copy_strings(env);
+    opts->cwd = cwd;
+    free(env);
+    process_options(argc, argv, opts);
+    return handle_command(argc-optind, argv+optind, wsi, opts);
+    // FIXME: free argv, cwd, env
+}
+
+/* Write the exit code (ret) of a command from a client,
+ * close the connection, and release opts. */
+void
+finish_client_command(struct options *opts, int ret)
+{
+    int sockfd = opts->fd_cmd_socket;
+#if PASS_STDFILES_UNIX_SOCKET
+    close(opts->fd_in);
+    close(opts->fd_out);
+    close(opts->fd_err);
+    char r[1];
+    r[0] = (char) ret;
+#else
+    char r[2];
+    r[0] = PASS_STDFILES_EXIT_CODE;
+    r[1] = (char) ret;
+#endif
+    options::release(opts);
+    if (write(sockfd, r, sizeof(r)) != sizeof(r))
+        lwsl_err("write failed sockfd:%d\n", sockfd);
+    close(sockfd);
+}
+
+struct offloaded_command {
+    struct command *command;
+    int argc;
+    arglist_t argv;
+    struct lws *wsi;
+    struct options *opts;
+    int ret;
+    int64_t start_time;
+};
+
+static void
+offloaded_command_run(void *arg)
+{
+    struct offloaded_command *oc = (struct offloaded_command *) arg;
+    oc->ret = (*oc->command->action)(oc->argc, oc->argv, oc->wsi, oc->opts);
+}
+
+static void
+offloaded_command_done(void *arg)
+{
+    struct offloaded_command *oc = (struct offloaded_command *) arg;
+    lwsl_notice("offloaded command '%s' done\n", oc->command->name);
+    if (oc->ret != EXIT_WAIT)
+        finish_client_command(oc->opts, oc->ret);
+    histogram_add(&server_stats.command_latency,
+                  (monotonic_ns() - oc->start_time) / 1000);
+    free(oc);
+}
+
+/* Run a COMMAND_OFFLOAD command received from a client in a worker
+ * thread, and finish the command (as callback_cmd would) when done.
+ * Return false if the caller should run it itself. */
+bool
+offload_command(struct command *command, int argc, arglist_t argv,
+                struct lws *wsi, struct options *opts)
+{
+    if (opts == main_options || opts->fd_cmd_socket < 0)
+        return false; // not from a client, or part of a batch
+    struct offloaded_command *oc = (struct offloaded_command *)
+        xmalloc(sizeof(struct offloaded_command));
+    oc->command = command;
+    oc->argc = argc;
+    oc->argv = argv;
+    oc->wsi = wsi;
+    oc->opts = opts;
+    oc->ret = EXIT_FAILURE;
+    oc->start_time = monotonic_ns();
+    if (! offload_work(offloaded_command_run, offloaded_command_done, oc)) {
+        free(oc);
+        return false;
+    }
+    lwsl_notice("offloaded command '%s'\n", command->name);
+    return true;
+}
+
+/* Run the commands of a "domterm batch" one after the other,
+ * writing the exit code of each to the client as it finishes.
+ * The commands don't get the client's stdin, which the client
+ * may be reading the batch from. */
+static void
+run_batch(struct lws *wsi, struct options *opts, struct json_object *jobj,
+          struct json_object *jcommands, int sockfd)
+{
+    int ncommands = json_object_array_length(jcommands);
+    int null_in = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    int fd_out = opts->fd_out, fd_err = opts->fd_err;
+#if PASS_STDFILES_UNIX_SOCKET
+    close(opts->fd_in);
+#endif
+    lwsl_notice("running batch of %d commands\n", ncommands);
+    bool kept = false;
+    for (int i = 0; i < ncommands; i++) {
+        struct options *copts = i == 0 ? opts : link_options(NULL);
+        // Each command gets its own descriptor, in case it keeps it.
+        copts->fd_in = dup(null_in);
+        copts->fd_out = fd_out;
+        copts->fd_err = fd_err;
+        copts->fd_cmd_socket = -1;
+        int ret = run_client_command(wsi, copts, jobj,
+                                     json_object_array_get_idx(jcommands, i));
+        if (ret == EXIT_WAIT) {
+            // The command kept the connection (for example a remote
+            // session), with its own references to copts and its
+            // descriptors - the rest of the batch is not run.
+            lwsl_notice("batch command %d did not finish - batch ends\n", i);
+            options::release(copts);
+            kept = true;
+            break;
+        }
+        close(copts->fd_in);
+        options::release(copts);
+#if PASS_STDFILES_UNIX_SOCKET
+        char r[1];
+        r[0] = (char) ret;
+#else
+        char r[2];
+        r[0] = PASS_STDFILES_EXIT_CODE;
+        r[1] = (char) ret;
+#endif
+        if (write(sockfd, r, sizeof(r)) != sizeof(r)) {
+            lwsl_err("write failed sockfd:%d\n", sockfd);
+            break;
+        }
+    }
+    close(null_in);
+    if (kept)
+        return; // the connection is the command's now
+#if PASS_STDFILES_UNIX_SOCKET
+    close(fd_out);
+    close(fd_err);
+#endif
+    close(sockfd);
+}
+
 int
 callback_cmd(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
     struct cmd_client *cclient = (struct cmd_client *) user;
     int socket;
+    callback_timer timer(CALLBACK_CMD, reason, NULL, NULL);
     switch (reason) {
     case LWS_CALLBACK_TIMER: // invoked from do_exit
             do_exit(0, false);
             break;
     case LWS_CALLBACK_RAW_RX_FILE: {
             socket = cclient->socket;
+            int64_t start_time = monotonic_ns();
             //fprintf(stderr, "callback_cmd RAW_RX reason:%d socket:%d getpid:%d\n", (int) reason, socket, getpid());
             struct sockaddr sa;
             socklen_t slen = sizeof sa;
@@ -391,66 +673,24 @@ callback_cmd(struct lws *wsi, enum lws_callback_reasons reason,
               = json_tokener_parse(jbuf);
             if (jobj == NULL)
               fatal("json parse fail");
-            struct json_object *jcwd = NULL;
-            struct json_object *jargv = NULL;
-            struct json_object *jenv = NULL;
-            struct json_object *joptions = NULL;
-            const char *cwd = NULL;
-            // if (!json_object_object_get_ex(jobj, "cwd", &jcwd))
-            //   fatal("jswon no cwd");
-            int argc = -1;
-            const char **argv = NULL;
-            const char**env = NULL;
-            if (json_object_object_get_ex(jobj, "cwd", &jcwd)
-                && (cwd = strdup(json_object_get_string(jcwd))) != NULL) {
+            free(jbuf);
+            struct json_object *jcommands = NULL;
+            if (json_object_object_get_ex(jobj, "commands", &jcommands)) {
+                run_batch(wsi, opts, jobj, jcommands, sockfd);
+                json_object_put(jobj);
+                histogram_add(&server_stats.command_latency,
+                              (monotonic_ns() - start_time) / 1000);
+                break;
             }
-            if (json_object_object_get_ex(jobj, "argv", &jargv)) {
-                argc = json_object_array_length(jargv);
-                argv = (const char**) xmalloc(sizeof(const char*) * (argc+1));
-                for (int i = 0; i <argc; i++) {
-                  argv[i] = strdup(json_object_get_string(json_object_array_get_idx(jargv, i)));
-                }
-                argv[argc] = NULL;
-            }
-            if (json_object_object_get_ex(jobj, "env", &jenv)) {
-                int nenv = json_object_array_length(jenv);
-                env = (const char**) xmalloc(sizeof(const char*) * (nenv+1));
-                for (int i = 0; i <nenv; i++) {
-                  env[i] = json_object_get_string(json_object_array_get_idx(jenv, i));
-                }
-                env[nenv] = NULL;
-            }
-            if (json_object_object_get_ex(jobj, "options", &joptions)) {
-                if (opts->cmd_settings)
-                    json_object_put(opts->cmd_settings);
-                opts->cmd_settings = json_object_get(joptions);
-            }
-            optind = 1;
-            set_settings(opts);
-            opts->env = copy_strings(env);
-            opts->cwd = cwd;
+            struct json_object *jargv = NULL;
+            json_object_object_get_ex(jobj, "argv", &jargv);
+            int ret = run_client_command(wsi, opts, jobj, jargv);
             json_object_put(jobj);
-            free(env);
-            process_options(argc, argv, opts);
-            int ret = handle_command(argc-optind, argv+optind, wsi, opts);
             if (ret == EXIT_WAIT)
                 break; // FIXME when to options::release
-#if PASS_STDFILES_UNIX_SOCKET
-            close(opts->fd_in);
-            close(opts->fd_out);
-            close(opts->fd_err);
-            char r[1];
-            r[0] = (char) ret;
-#else
-            char r[2];
-            r[0] = PASS_STDFILES_EXIT_CODE;
-            r[1] = (char) ret;
-#endif
-            options::release(opts);
-            if (write(sockfd, r, sizeof(r)) != sizeof(r))
-                lwsl_err("write failed sockfd:%d\n", sockfd);
-            close(sockfd);
-            // FIXME: free argv, cwd, env
+            finish_client_command(opts, ret);
+            histogram_add(&server_stats.command_latency,
+                          (monotonic_ns() - start_time) / 1000);
         }
         break;
     default:
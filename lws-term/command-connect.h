@@ -33,5 +33,11 @@ struct cmd_socket_client {
 extern int client_connect (char *socket_path);
 extern int client_send_command(int socket, int argc, char *const*argv,
                                char *const *env);
+extern int client_run_batch(int socket, struct json_object *jcommands,
+                            char *const *env, int *statuses);
+extern int create_unix_socket(const char *);
 extern int create_command_socket(const char *);
+extern void finish_client_command(struct options *opts, int ret);
+extern void unlink_command_socket_at_exit(const char *);
+extern void setblocking(int fd, int state);
 #endif
@@ -4,8 +4,8 @@
 #if HAVE_LIBMAGIC
 #include <magic.h>
 #endif
-#include <sys/mman.h>
 #include <sys/stat.h>
+#include <poll.h>
 
 #define DO_HTML_ACTION_IN_SERVER PASS_STDFILES_UNIX_SOCKET
 
@@ -53,6 +53,373 @@ static void print_base_element(const char*base_url, struct sbuf *sbuf)
     }
 }
 
+#define HTML_CHUNK 16384 // bytes of html read at a time
+#define HTML_PENDING_MAX (4 * HTML_CHUNK) // then split at a newline anyway
+#define HTML_STACK_MAX 32 // open elements whose names we remember
+#define HTML_READ_TIMEOUT_MS 10000 // give up if no input for this long
+
+/* The html from hcat and html is sent as it is read, split into
+ * separate OSC 72 sequences, each of which must be well-formed for
+ * _scrubAndInsertHTML.  So we only split between top-level elements
+ * (or lines of top-level text).  To make that possible for a complete
+ * document, the <html>, <head> and <body> tags (which would enclose
+ * everything) and <!DOCTYPE> are dropped.  Each sequence starts with
+ * the same <base> element, since relative URLs are resolved separately
+ * for each.  Open elements are kept on a stack, so that elements whose
+ * end tag is optional (p, li, td, tr, option, ...) are closed, as a
+ * browser would, by a start tag they can't contain or by the end tag
+ * of an enclosing element.  If a top-level element is still open when
+ * more than HTML_PENDING_MAX bytes are pending (malformed html, or a
+ * huge element), we split at the next newline regardless, so memory
+ * use stays bounded. */
+enum html_stream_state {
+    HS_TEXT, HS_TAG_OPEN, HS_TAG_NAME, HS_TAG, HS_TAG_QUOTED,
+    HS_COMMENT, HS_DECL, HS_RAWTEXT
+};
+
+struct html_stream {
+    struct sbuf pending; // html not yet sent
+    size_t split; // pending up to here is well-formed
+    struct sbuf prefix; // "\033]72;" and <base> element
+    enum html_stream_state state;
+    int depth; // number of open elements
+    char open_tags[HTML_STACK_MAX][12]; // names of the outermost ones
+    size_t tag_start; // offset in pending of current '<'
+    char tag_name[12]; // lowercase, truncated
+    int tag_name_len;
+    char raw_name[12]; // element whose contents are raw text
+    char quote;
+    bool end_tag, self_closing;
+    bool skip_space; // after a dropped tag
+    int dashes; // consecutive '-' in a comment
+#if DO_HTML_ACTION_IN_SERVER
+    // The session to send to.  Not a pointer, since the session
+    // may be closed while we wait for input (without the lock).
+    int session_number;
+    int session_pid;
+#endif
+    bool ok;
+};
+
+static bool
+html_name_in(const char *name, const char *const *names)
+{
+    for (const char *const *p = names; *p; p++)
+        if (strcmp(name, *p) == 0)
+            return true;
+    return false;
+}
+
+static bool
+html_void_element(const char *name)
+{
+    static const char *const names[] = {
+        "area", "base", "br", "col", "embed", "hr", "img", "input",
+        "link", "meta", "param", "source", "track", "wbr", NULL
+    };
+    return html_name_in(name, names);
+}
+
+/* True if a start tag for name implicitly closes an open element
+ * (whose end tag is optional) called open. */
+static bool
+html_implicitly_closes(const char *open, const char *name)
+{
+    static const char *const p_closers[] = {
+        "address", "article", "aside", "blockquote", "details", "div",
+        "dl", "fieldset", "figcaption", "figure", "footer", "form",
+        "h1", "h2", "h3", "h4", "h5", "h6", "header", "hgroup", "hr",
+        "main", "menu", "nav", "ol", "p", "pre", "section", "table",
+        "ul", NULL
+    };
+    static const char *const dt_closers[] = { "dt", "dd", NULL };
+    static const char *const td_closers[] = {
+        "td", "th", "tr", "tbody", "thead", "tfoot", NULL
+    };
+    static const char *const tbody_closers[] = { "tbody", "tfoot", NULL };
+    static const char *const option_closers[] = {
+        "option", "optgroup", NULL
+    };
+    if (strcmp(open, "p") == 0)
+        return html_name_in(name, p_closers);
+    if (strcmp(open, "li") == 0 || strcmp(open, "optgroup") == 0)
+        return strcmp(name, open) == 0;
+    if (strcmp(open, "dt") == 0 || strcmp(open, "dd") == 0)
+        return html_name_in(name, dt_closers);
+    if (strcmp(open, "td") == 0 || strcmp(open, "th") == 0)
+        return html_name_in(name, td_closers);
+    if (strcmp(open, "tr") == 0)
+        return html_name_in(name, td_closers + 2);
+    if (strcmp(open, "thead") == 0 || strcmp(open, "tbody") == 0)
+        return html_name_in(name, tbody_closers);
+    if (strcmp(open, "option") == 0)
+        return html_name_in(name, option_closers);
+    return false;
+}
+
+static void
+html_stream_tag_done(struct html_stream *hs)
+{
+    const char *name = hs->tag_name;
+    if (strcmp(name, "html") == 0 || strcmp(name, "head") == 0
+        || strcmp(name, "body") == 0) {
+        hs->pending.len = hs->tag_start; // drop it
+        hs->skip_space = true;
+    } else if (hs->end_tag) {
+        if (hs->depth > HTML_STACK_MAX)
+            hs->depth--;
+        else {
+            // Close the innermost open element called name, and any
+            // (with optional end tags) inside it; ignore a stray end tag.
+            for (int i = hs->depth; --i >= 0; ) {
+                if (strcmp(hs->open_tags[i], name) == 0) {
+                    hs->depth = i;
+                    break;
+                }
+            }
+        }
+    } else {
+        while (hs->depth > 0 && hs->depth <= HTML_STACK_MAX
+               && html_implicitly_closes(hs->open_tags[hs->depth-1], name))
+            hs->depth--;
+        if (hs->depth == 0)
+            hs->split = hs->tag_start;
+        if (! hs->self_closing && ! html_void_element(name)) {
+            if (hs->depth < HTML_STACK_MAX)
+                strcpy(hs->open_tags[hs->depth], name);
+            hs->depth++;
+            if (strcmp(name, "script") == 0 || strcmp(name, "style") == 0
+                || strcmp(name, "title") == 0
+                || strcmp(name, "textarea") == 0) {
+                strcpy(hs->raw_name, name);
+                hs->state = HS_RAWTEXT;
+                return;
+            }
+        }
+    }
+    hs->state = HS_TEXT;
+    if (hs->depth == 0)
+        hs->split = hs->pending.len;
+}
+
+/* Append html to hs->pending, updating where it may be split. */
+static void
+html_stream_scan(struct html_stream *hs, const char *data, size_t length)
+{
+    sbuf_extend(&hs->pending, length);
+    for (size_t i = 0; i < length; i++) {
+        char ch = data[i];
+        hs->pending.buffer[hs->pending.len++] = ch;
+        char lower = ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+        switch (hs->state) {
+        case HS_TEXT:
+            if (hs->skip_space) {
+                if (ch == ' ' || (ch >= '\t' && ch <= '\r')) {
+                    hs->pending.len--;
+                    break;
+                }
+                hs->skip_space = false;
+            }
+            if (ch == '<') {
+                hs->tag_start = hs->pending.len - 1;
+                hs->state = HS_TAG_OPEN;
+            } else if (ch == '\n' && hs->depth == 0)
+                hs->split = hs->pending.len;
+            else if (ch == '\n' && hs->pending.len > HTML_PENDING_MAX) {
+                // Give up on keeping the open elements together.
+                hs->depth = 0;
+                hs->split = hs->pending.len;
+            }
+            break;
+        case HS_TAG_OPEN:
+            hs->tag_name_len = 0;
+            hs->end_tag = false;
+            hs->self_closing = false;
+            if (ch == '!') {
+                hs->dashes = 0;
+                hs->state = HS_DECL;
+            } else if (ch == '/') {
+                hs->end_tag = true;
+                hs->state = HS_TAG_NAME;
+            } else if (lower >= 'a' && lower <= 'z') {
+                hs->tag_name[hs->tag_name_len++] = lower;
+                hs->state = HS_TAG_NAME;
+            } else
+                hs->state = HS_TEXT; // not a tag
+            break;
+        case HS_TAG_NAME:
+            if ((lower >= 'a' && lower <= 'z') || (ch >= '0' && ch <= '9')
+                || ch == '-' || ch == ':') {
+                if (hs->tag_name_len < (int) sizeof(hs->tag_name) - 1)
+                    hs->tag_name[hs->tag_name_len++] = lower;
+                break;
+            }
+            hs->tag_name[hs->tag_name_len] = '\0';
+            hs->state = HS_TAG;
+            /* fall through */
+        case HS_TAG:
+            if (ch == '"' || ch == '\'') {
+                hs->quote = ch;
+                hs->state = HS_TAG_QUOTED;
+            } else if (ch == '>')
+                html_stream_tag_done(hs);
+            else if (ch > ' ')
+                hs->self_closing = ch == '/';
+            break;
+        case HS_TAG_QUOTED:
+            if (ch == hs->quote)
+                hs->state = HS_TAG;
+            break;
+        case HS_DECL:
+            // "<!--" starts a comment; anything else (<!DOCTYPE ...>)
+            // is dropped at its '>'.
+            if (ch == '-' && hs->dashes >= 0 && ++hs->dashes == 2) {
+                hs->dashes = 0;
+                hs->state = HS_COMMENT;
+            } else if (ch == '>') {
+                hs->pending.len = hs->tag_start;
+                hs->skip_space = true;
+                hs->state = HS_TEXT;
+            } else if (ch != '-')
+                hs->dashes = -1;
+            break;
+        case HS_COMMENT:
+            if (ch == '>' && hs->dashes >= 2) {
+                hs->state = HS_TEXT;
+                if (hs->depth == 0)
+                    hs->split = hs->pending.len;
+            }
+            hs->dashes = ch == '-' ? hs->dashes + 1 : 0;
+            break;
+        case HS_RAWTEXT:
+            // Look for "</" followed by raw_name.
+            if (ch == '>') {
+                size_t nlen = strlen(hs->raw_name);
+                const char *p = hs->pending.buffer + hs->pending.len - 1;
+                size_t avail = hs->pending.len - hs->tag_start;
+                if (avail >= nlen + 3 && strncasecmp(p - nlen, hs->raw_name,
+                                                     nlen) == 0
+                    && p[-nlen-1] == '/' && p[-nlen-2] == '<') {
+                    hs->depth--;
+                    hs->state = HS_TEXT;
+                    if (hs->depth == 0)
+                        hs->split = hs->pending.len;
+                }
+            }
+            break;
+        }
+    }
+}
+
+static void
+html_stream_write(struct html_stream *hs, const char *data, size_t length)
+{
+#if DO_HTML_ACTION_IN_SERVER
+    struct pty_client *pclient = pty_clients(hs->session_number);
+    if (pclient == NULL || pclient->pid != hs->session_pid)
+        return; // closed (and maybe its number reused)
+    FOREACH_WSCLIENT(tclient, pclient) {
+        sbuf_append(&tclient->ob, data, length);
+        tclient->ocount += length;
+        wsi_writable(tclient->out_wsi);
+    }
+#else
+    int fd = get_tty_out();
+    while (hs->ok && length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            lwsl_err("write failed\n");
+            hs->ok = false;
+        } else {
+            data += n;
+            length -= n;
+        }
+    }
+#endif
+}
+
+/* Send pending html up to hs->split (or all of it, if at_end). */
+static void
+html_stream_flush(struct html_stream *hs, bool at_end)
+{
+    size_t len = at_end ? hs->pending.len : hs->split;
+    if (len == 0)
+        return;
+    struct sbuf sb;
+    sbuf_init(&sb);
+    sbuf_extend(&sb, hs->prefix.len + len + 1);
+    sbuf_append(&sb, hs->prefix.buffer, hs->prefix.len);
+    sbuf_append(&sb, hs->pending.buffer, len);
+    sbuf_append(&sb, "\007", 1);
+    html_stream_write(hs, sb.buffer, sb.len);
+    sbuf_free(&sb);
+    size_t rest = hs->pending.len - len;
+    memmove(hs->pending.buffer, hs->pending.buffer + len, rest);
+    hs->pending.len = rest;
+    if (at_end) { // start afresh, even after an unterminated tag
+        hs->state = HS_TEXT;
+        hs->depth = 0;
+    } else if (hs->state != HS_TEXT)
+        hs->tag_start -= len;
+    hs->split = 0;
+}
+
+static void
+html_stream_start(struct html_stream *hs)
+{
+    memset(hs, 0, sizeof(*hs));
+    sbuf_init(&hs->pending);
+    sbuf_init(&hs->prefix);
+    sbuf_printf(&hs->prefix, "\033]72;");
+    hs->state = HS_TEXT;
+    hs->ok = true;
+}
+
+/* Send the html read from fd, a chunk at a time.
+ * Fail if there is no input for HTML_READ_TIMEOUT_MS, so a stalled
+ * pipe doesn't tie up the thread running the command for ever. */
+static bool
+html_stream_fd(struct html_stream *hs, int fd)
+{
+    char *buf = challoc(HTML_CHUNK);
+    ssize_t n;
+    for (;;) {
+        {
+            service_unlock unlocked; // fd belongs to this command
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            n = poll(&pfd, 1, HTML_READ_TIMEOUT_MS);
+            if (n > 0)
+                n = read(fd, buf, HTML_CHUNK);
+            else if (n == 0) {
+                lwsl_err("html: no input for %d seconds\n",
+                         HTML_READ_TIMEOUT_MS / 1000);
+                n = -1;
+                errno = ETIMEDOUT;
+            }
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        html_stream_scan(hs, buf, n);
+        html_stream_flush(hs, false);
+    }
+    free(buf);
+    return n == 0;
+}
+
+static void
+html_stream_end(struct html_stream *hs)
+{
+    html_stream_flush(hs, true);
+    sbuf_free(&hs->pending);
+    sbuf_free(&hs->prefix);
+}
+
 int html_action(int argc, arglist_t argv, struct lws *wsi,
                 struct options *opts)
 {
@@ -79,10 +446,27 @@ int html_action(int argc, arglist_t argv, struct lws *wsi,
             break;
     }
 
-    struct sbuf sb;
-    sbuf_init(&sb);
-    sbuf_printf(&sb, "\033]72;");
-
+    struct html_stream hs;
+    html_stream_start(&hs);
+#if DO_HTML_ACTION_IN_SERVER
+    const char *domterm_env = getenv_from_array("DOMTERM", opts->env);
+    const char *t1;
+    if (domterm_env && (t1 = strstr(domterm_env, ";tty="))) {
+        t1 += 5;
+        const char *t2 = strchr(t1, ';');
+        size_t tlen = t2 == NULL ? strlen(t1) : t2 - t1;
+        char *tname = challoc(tlen+1);
+        strncpy(tname, t1, tlen);
+        tname[tlen] = 0;
+        struct pty_client *pclient = find_session_by_tty(tname);
+        free(tname);
+        if (pclient != NULL) {
+            hs.session_number = pclient->session_number;
+            hs.session_pid = pclient->pid;
+        }
+    }
+#endif
+    int ret = EXIT_SUCCESS;
     if (is_hcat && i < argc) {
         while (i < argc)  {
             const char *fname = argv[i++];
@@ -92,75 +476,212 @@ int html_action(int argc, arglist_t argv, struct lws *wsi,
                 fname_abs = challoc(strlen(cwd) + strlen(fname) +2);
                 sprintf(fname_abs, "%s/%s", cwd, fname);
             }
-            FILE *fin = fopen(fname_abs ? fname_abs : fname, "r");
+            int fin = open(fname_abs ? fname_abs : fname, O_RDONLY);
             if (fname_abs != NULL)
                 free(fname_abs);
-            if (fin == NULL) {
+            if (fin < 0) {
                 printf_error(opts, "missing html file '%s'", fname);
-                return EXIT_FAILURE;
+                ret = EXIT_FAILURE;
+                break;
             }
+            hs.prefix.len = 0;
+            sbuf_printf(&hs.prefix, "\033]72;");
             if (base_url != NULL)
-                print_base_element(base_url, &sb);
+                print_base_element(base_url, &hs.prefix);
             else {
                 char *rpath = realpath(fname, NULL);
-                print_base_element(rpath, &sb);
+                print_base_element(rpath, &hs.prefix);
                 free(rpath);
             }
-            sbuf_copy_file(&sb, fin);
-            fclose(fin);
+            bool read_ok = html_stream_fd(&hs, fin);
+            close(fin);
+            // Each file is sent separately, so its <base> applies.
+            html_stream_flush(&hs, true);
+            if (! read_ok) {
+                printf_error(opts, "error reading html file '%s'", fname);
+                ret = EXIT_FAILURE;
+                break;
+            }
         }
     } else {
         if (base_url == NULL)
             base_url = opts->cwd != NULL ? strdup(opts->cwd) : getcwd(NULL, 0);
         if (base_url != NULL) {
-            print_base_element(base_url, &sb);
+            print_base_element(base_url, &hs.prefix);
         }
         if (i == argc) {
-            FILE *in = fdopen(dup(opts->fd_in), "r");
-            sbuf_copy_file(&sb, in);
-            fclose(in);
+            if (! html_stream_fd(&hs, opts->fd_in)) {
+                printf_error(opts, "%s: error reading standard input",
+                             argv[0]);
+                ret = EXIT_FAILURE;
+            }
         } else {
             while (i < argc)  {
-                sbuf_append(&sb, argv[i++], -1);
+                const char *arg = argv[i++];
+                html_stream_scan(&hs, arg, strlen(arg));
             }
         }
     }
-    int ret = EXIT_SUCCESS;
-    sbuf_append(&sb, "\007", 1);
-#if DO_HTML_ACTION_IN_SERVER
-    char **ee = env;
-    while (*ee && strncmp(*ee, "DOMTERM=", 8) != 0)
-        ee++;
-    char *t1;
-    if (*ee && (t1 = strstr(*ee, ";tty="))) {
-        t1 += 5;
-        char *t2 = strchr(t1, ';');
-        size_t tlen = t2 == NULL ? strlen(t1) : t2 - t1;
-        char *tname = xmalloc(tlen+1);
-        strncpy(tname, t1, tlen);
-        tname[tlen] = 0;
-        FOREACH_PCLIENT(pclient) {
-            if (strcmp(pclient->ttyname, tname) == 0) {
-                FOREACH_WSCLIENT(tclient, pclient) {
-                    sbuf_extend(&tclient->ob, sb.len);
-                    memcpy(tclient->ob.buffer+tclient->ob.len,
-                           sb.buffer, sb.len);
-                    tclient->ob.len += sb.len;
-                    tclient->ocount += sb.len;
-                    lws_callback_on_writable(tclient->out_wsi);
-                }
-                sbuf_free(&sb);
-                return EXIT_SUCCESS;
-            }
+    html_stream_end(&hs);
+    if (! hs.ok)
+        ret = EXIT_FAILURE;
+    return ret;
+}
+
+#define IMGCAT_CHUNK (3 * 16384) // bytes of image per write (multiple of 3)
+
+#if HAVE_LIBMAGIC
+static magic_t magic_cookie; // loaded on first use
+
+static const char *
+magic_mime_type(const void *data, size_t length)
+{
+    if (magic_cookie == NULL) {
+        magic_cookie = magic_open(MAGIC_MIME_TYPE);
+        if (magic_cookie != NULL && magic_load(magic_cookie, NULL) != 0) {
+            magic_close(magic_cookie);
+            magic_cookie = NULL;
         }
+        if (magic_cookie == NULL)
+            return NULL;
     }
-#else
-    if (write(get_tty_out(), sb.buffer, sb.len) != sb.len) {
+    return magic_buffer(magic_cookie, data, length);
+}
+#endif
+
+static bool
+write_fully(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static ssize_t
+read_fully(int fd, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* For imgcat --fit: if the image in fimg (of type mime) is bigger than
+ * the window, write a scaled-down copy, linked to the original.
+ * Return false (with fimg back at offset pos) to write the image as is. */
+static bool
+imgcat_thumbnail(int fimg, off_t pos, const char *mime,
+                 const char *attrs, bool n_arg, const char *overflow,
+                 int *ret)
+{
+    struct winsize ws;
+    int tty_out = get_tty_out();
+    if (ioctl(tty_out, TIOCGWINSZ, &ws) != 0
+        || ws.ws_xpixel == 0 || ws.ws_ypixel == 0)
+        return false;
+    struct thumbnail thumb;
+    if (! image_thumbnail(fimg, mime, ws.ws_xpixel, ws.ws_ypixel, &thumb)) {
+        lseek(fimg, pos, SEEK_SET);
+        return false;
+    }
+    struct sbuf sb;
+    sbuf_init(&sb);
+    sbuf_printf(&sb,
+                n_arg ? "\033]72;%s<a href='%s'><img%s src='data:%s;base64,"
+                : "\033]72;<div style='overflow-x: %s'><a href='%s'><img%s src='data:%s;base64,",
+                overflow, thumb.original, attrs, thumb.mime);
+    size_t start = sb.len;
+    sbuf_extend(&sb, (thumb.data.len + 2) / 3 * 4);
+    sb.len += base64_encode_to((const unsigned char *) thumb.data.buffer,
+                               thumb.data.len, sb.buffer + start);
+    sbuf_printf(&sb, n_arg ? "'/></a>\007" : "'/></a></div>\007");
+    if (! write_fully(tty_out, sb.buffer, sb.len)) {
         lwsl_err("write failed\n");
-        ret = EXIT_FAILURE;
+        *ret = EXIT_FAILURE;
+    } else
+        *ret = EXIT_SUCCESS;
+    sbuf_free(&sb);
+    sbuf_free(&thumb.data);
+    free(thumb.original);
+    return true;
+}
+
+/* Write the image in fimg to the terminal as an <img> element
+ * with a data: URL.  The file is read, base64-encoded and written
+ * a chunk at a time, so memory use doesn't depend on the image size. */
+static int
+imgcat_file(const char *fname, int fimg, const char *attrs, bool n_arg,
+            bool fit, const char *overflow, struct options *opts)
+{
+    unsigned char *chunk = (unsigned char *) challoc(IMGCAT_CHUNK);
+    char *encoded = challoc(IMGCAT_CHUNK / 3 * 4);
+    ssize_t n = read_fully(fimg, chunk, IMGCAT_CHUNK);
+    const char *mime = NULL;
+#if HAVE_LIBMAGIC
+    if (n > 0)
+        mime = magic_mime_type(chunk, n);
+    if (mime == NULL || strcmp(mime, "text/plain") == 0) {
+        // This is mainly for svg.
+        const char *mime2 = get_mimetype(fname);
+        if (mime2)
+            mime = mime2;
     }
+#else
+    mime = get_mimetype(fname);
 #endif
-    sbuf_free(&sb);
+    int ret = EXIT_SUCCESS;
+    if (n < 0) {
+        printf_error(opts, "imgcat: cannot read %s: %s", fname,
+                     strerror(errno));
+        ret = EXIT_FAILURE;
+    } else if (mime == NULL) {
+        printf_error(opts, "imgcat: unknown file type: %s", fname);
+        ret = EXIT_FAILURE;
+    } else if (! fit
+               || ! imgcat_thumbnail(fimg, n, mime, attrs, n_arg,
+                                     overflow, &ret)) {
+        int tty_out = get_tty_out();
+        struct sbuf sb;
+        sbuf_init(&sb);
+        sbuf_printf(&sb,
+                    n_arg ? "\033]72;%s<img%s src='data:%s;base64,"
+                    : "\033]72;<div style='overflow-x: %s'><img%s src='data:%s;base64,",
+                    overflow, attrs, mime);
+        bool ok = write_fully(tty_out, sb.buffer, sb.len);
+        sbuf_free(&sb);
+        while (ok && n > 0) {
+            ok = write_fully(tty_out, encoded,
+                             base64_encode_to(chunk, n, encoded));
+            n = n < IMGCAT_CHUNK ? 0 : read_fully(fimg, chunk, IMGCAT_CHUNK);
+        }
+        // On a read error, still end the element (and the OSC).
+        const char *end = n_arg ? "'/>\007" : "'/></div>\007";
+        if (! write_fully(tty_out, end, strlen(end)) || ! ok) {
+            lwsl_err("write failed\n");
+            ret = EXIT_FAILURE;
+        } else if (n < 0) {
+            printf_error(opts, "imgcat: cannot read %s: %s", fname,
+                         strerror(errno));
+            ret = EXIT_FAILURE;
+        }
+    }
+    free(chunk);
+    free(encoded);
     return ret;
 }
 
@@ -176,6 +697,7 @@ int imgcat_action(int argc, arglist_t argv, struct lws *wsi,
     char *aptr = abuf;
     const char *overflow = NULL;
     bool n_arg = false;
+    bool fit = false;
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
         if (arg[0] == '-') {
@@ -198,6 +720,8 @@ int imgcat_action(int argc, arglist_t argv, struct lws *wsi,
                 overflow = eq + 1;
             } else if (arg[1] == 'n' && arg[2] == 0)
               n_arg = true;
+            else if (strcmp(arg, "--fit") == 0)
+              fit = true;
             else {
                 printf_error(opts, "%s: Invalid argument '%s'",
                              argv[0], arg);
@@ -209,59 +733,26 @@ int imgcat_action(int argc, arglist_t argv, struct lws *wsi,
                 printf_error(opts, "imgcat: No such file: %s", arg);
                 return EXIT_FAILURE;
             }
-            int fimg = open(arg, O_RDONLY);
-            struct stat stbuf;
-            if (fstat(fimg, &stbuf) != 0 || (!S_ISREG(stbuf.st_mode))) {
-              /* Handle error FIXME */
-            }
-            off_t len = stbuf.st_size;
-            unsigned char *img = (unsigned char*)
-                mmap(NULL, len, PROT_READ, MAP_PRIVATE, fimg, 0);
-            const char *mime;
-#if HAVE_LIBMAGIC
-            magic_t magic; // FIXME should cache
-            magic = magic_open(MAGIC_MIME_TYPE); 
-            magic_load(magic, NULL);
-            magic_compile(magic, NULL);
-            mime = magic_buffer(magic, img, len);
-            if (mime && strcmp(mime, "text/plain") == 0) {
-                // This is mainly for svg.
-                const char *mime2 = get_mimetype(arg);
-                if (mime2)
-                    mime = mime2;
-            }
-#else
-            mime = get_mimetype(arg);
-#endif
-            if (mime == NULL) {
-                printf_error(opts, "imgcat: unknown file type: %s", arg);
-                return EXIT_FAILURE;
-            }
             if (n_arg)
                 overflow = "";
             else if (overflow == NULL)
                 overflow = "auto";
-            char *b64 = base64_encode(img, len);
-            munmap(img, len);
-            int rsize = 100+strlen(mime)+strlen(b64)+ strlen(abuf);
-            char *response = challoc(rsize);
-            int n = snprintf(response, rsize,
-                    n_arg ? "\033]72;%s<img%s src='data:%s;base64,%s'/>\007"
-                    : "\033]72;<div style='overflow-x: %s'><img%s src='data:%s;base64,%s'/></div>\007",
-                    overflow, abuf, mime, b64);
-            if (n >= rsize)
-                 fatal("buffer overflow");
-#if HAVE_LIBMAGIC
-            magic_close(magic);
-#endif
-            free(abuf);
-            free(b64);
-            if (write(get_tty_out(), response, strlen(response)) <= 0) {
-                lwsl_err("write failed\n");
+            int fimg = open(arg, O_RDONLY);
+            if (fimg < 0) {
+                printf_error(opts, "imgcat: cannot open %s: %s",
+                             arg, strerror(errno));
+                free(abuf);
                 return EXIT_FAILURE;
             }
+            int r = imgcat_file(arg, fimg, abuf, n_arg, fit, overflow, opts);
+            close(fimg);
+            if (r != EXIT_SUCCESS) {
+                free(abuf);
+                return r;
+            }
         }
     }
+    free(abuf);
     return EXIT_SUCCESS;
 }
 
@@ -460,10 +951,32 @@ int add_stylerule_action(int argc, arglist_t argv, struct lws *wsi,
     return EXIT_SUCCESS;
 }
 
+/* Write the output of a command (collected with open_memstream),
+ * then free it.  Other threads may run meanwhile, since a slow
+ * client shouldn't hold up the server. */
+static void
+write_command_output(struct options *opts, char *buf, size_t len)
+{
+    service_unlock unlocked;
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(opts->fd_out, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        len -= n;
+    }
+    free(buf);
+}
+
 int list_action(int argc, arglist_t argv, struct lws *wsi, struct options *opts)
 {
     int nclients = 0;
-    FILE *out = fdopen(dup(opts->fd_out), "w");
+    char *obuf;
+    size_t olen;
+    FILE *out = open_memstream(&obuf, &olen);
     FOREACH_PCLIENT(pclient)  {
         fprintf(out, "pid: %d", pclient->pid);
         fprintf(out, ", session#: %d", pclient->session_number);
@@ -478,6 +991,7 @@ int list_action(int argc, arglist_t argv, struct lws *wsi, struct options *opts)
     if (nclients == 0)
         fprintf(out, "(no domterm sessions or server)\n");
     fclose(out);
+    write_command_output(opts, obuf, olen);
     return EXIT_SUCCESS;
 }
 
@@ -548,6 +1062,13 @@ static void pclient_status_info(struct pty_client *pclient, FILE *out)
         fprintf(out, ", name: %s", pclient->session_name); // FIXME-quote?
     if (pclient->paused)
         fprintf(out, ", paused");
+    fprintf(out, ", memory: %zuK", (session_memory(pclient) + 1023) >> 10);
+    size_t raw, stored;
+    if (session_compressed_sizes(pclient, &raw, &stored))
+        fprintf(out, " (compressed from %zuK)", (raw + 1023) >> 10);
+    if (pclient->preserved_dropped > 0)
+        fprintf(out, " (%lldK dropped)",
+                (long long) (pclient->preserved_dropped + 1023) >> 10);
 }
 
 static void show_connection_info(struct tty_client *tclient,
@@ -608,10 +1129,42 @@ static void status_by_session(FILE * out, int verbosity)
         fprintf(out, "(no domterm sessions or server)\n");
 }
 
+static void window_session_info(struct tty_client *tclient, FILE *out)
+{
+    struct pty_client *pclient = tclient->pclient;
+    if (pclient == NULL) {
+        fprintf(out, "  disconnected .%d\n", tclient->connection_number);
+        return;
+    }
+    fprintf(out, "  session#%d", pclient->session_number);
+    fprintf(out, ": ");
+    pclient_status_info(pclient, out);
+    fprintf(out, "\n");
+}
+
 static void status_by_connection(FILE *out, int verbosity)
 {
     struct tty_client *tclient, *sub_client;
     int nclients = 0, nsessions = 0;
+    // Make a list of the sub-windows of each main window (indexed by
+    // connection_number), so we don't have to search for them.
+    int limit = tty_clients.index_limit();
+    struct tty_client **sub_lists = (struct tty_client **)
+        calloc(3 * limit + 1, sizeof(struct tty_client *));
+    struct tty_client **first_sub = sub_lists;
+    struct tty_client **last_sub = sub_lists + limit;
+    struct tty_client **next_sub = sub_lists + 2 * limit;
+    FORALL_WSCLIENT(sub_client) {
+        int main_number = sub_client->main_window;
+        if (main_number <= 0 || main_number >= limit
+            || main_number == sub_client->connection_number)
+            continue;
+        if (last_sub[main_number] == NULL)
+            first_sub[main_number] = sub_client;
+        else
+            next_sub[last_sub[main_number]->connection_number] = sub_client;
+        last_sub[main_number] = sub_client;
+    }
     FORALL_WSCLIENT(tclient) {
         nclients++;
         if (tclient->proxyMode == proxy_remote) {
@@ -626,22 +1179,15 @@ static void status_by_connection(FILE *out, int verbosity)
             fprintf(out, "Window: ");
         tclient_status_info(tclient, out);
         fprintf(out, "\n");
-        FORALL_WSCLIENT(sub_client) {
-            if (sub_client->main_window != number
-                && sub_client->connection_number != number)
-                continue;
-
-            struct pty_client *pclient = sub_client->pclient;
-            if (pclient == NULL) {
-                fprintf(out, "  disconnected .%d\n", sub_client->connection_number);
-                continue;
-            }
-            fprintf(out, "  session#%d", pclient->session_number);
-            fprintf(out, ": ");
-            pclient_status_info(pclient, out);
-            fprintf(out, "\n");
+        window_session_info(tclient, out);
+        if (number <= 0 || number >= limit)
+            continue;
+        for (sub_client = first_sub[number]; sub_client != NULL;
+             sub_client = next_sub[sub_client->connection_number]) {
+            window_session_info(sub_client, out);
         }
     }
+    free(sub_lists);
     FOREACH_PCLIENT(pclient) {
         int nremote = 0;
         struct tty_client *single_tclient = NULL;
@@ -691,30 +1237,430 @@ static void status_by_connection(FILE *out, int verbosity)
         fprintf(out, "(no domterm sessions or server)\n");
 }
 
+static size_t
+preserved_length(struct pty_client *pclient)
+{
+    return pclient->preserved_output == NULL ? 0
+        : pclient->preserved_end - pclient->preserved_start;
+}
+
+static int64_t
+paused_ns(struct pty_client *pclient)
+{
+    int64_t t = pclient->paused_ns;
+    if (pclient->paused)
+        t += monotonic_ns() - pclient->paused_since;
+    return t;
+}
+
+static json_object *
+histogram_json(struct histogram *h)
+{
+    json_object *jobj = json_object_new_object();
+    json_object_object_add(jobj, "count", json_object_new_int64(h->count));
+    json_object_object_add(jobj, "sum", json_object_new_int64(h->sum));
+    json_object_object_add(jobj, "p50",
+                           json_object_new_int64(histogram_percentile(h, 50)));
+    json_object_object_add(jobj, "p99",
+                           json_object_new_int64(histogram_percentile(h, 99)));
+    json_object_object_add(jobj, "max", json_object_new_int64(h->max));
+    return jobj;
+}
+
+/* Same information as print_metrics, for "domterm status --json". */
+static json_object *
+status_json()
+{
+    json_object *jobj = json_object_new_object();
+    json_object_object_add(jobj, "version",
+                           json_object_new_string(LDOMTERM_VERSION));
+    json_object_object_add(jobj, "pid", json_object_new_int(getpid()));
+    json_object *jsessions = json_object_new_array();
+    FOREACH_PCLIENT(pclient) {
+        json_object *jsession = json_object_new_object();
+        json_object_object_add(jsession, "session",
+                               json_object_new_int(pclient->session_number));
+        if (pclient->session_name)
+            json_object_object_add(jsession, "name",
+                                   json_object_new_string(pclient->session_name));
+        json_object_object_add(jsession, "pid",
+                               json_object_new_int(pclient->pid));
+        json_object_object_add(jsession, "pty_bytes_read",
+                               json_object_new_int64(pclient->bytes_read));
+        json_object_object_add(jsession, "paused",
+                               json_object_new_boolean(pclient->paused));
+        json_object_object_add(jsession, "pause_count",
+                               json_object_new_int64(pclient->pause_count));
+        json_object_object_add(jsession, "paused_seconds",
+                               json_object_new_double(paused_ns(pclient) * 1e-9));
+        json_object_object_add(jsession, "preserved_output_bytes",
+                               json_object_new_int64(preserved_length(pclient)));
+        json_object_object_add(jsession, "preserved_output_allocated",
+                               json_object_new_int64(pclient->preserved_output == NULL ? 0 : pclient->preserved_size));
+        json_object_object_add(jsession, "reconnects",
+                               json_object_new_int(pclient->reconnect_count));
+        json_object_object_add(jsession, "memory_bytes",
+                               json_object_new_int64(session_memory(pclient)));
+        json_object_object_add(jsession, "preserved_dropped_bytes",
+                               json_object_new_int64(pclient->preserved_dropped));
+        size_t raw, stored;
+        if (session_compressed_sizes(pclient, &raw, &stored)) {
+            json_object_object_add(jsession, "compressed_raw_bytes",
+                                   json_object_new_int64(raw));
+            json_object_object_add(jsession, "compressed_bytes",
+                                   json_object_new_int64(stored));
+        }
+        if (pclient->recording)
+            json_object_object_add(jsession, "recording",
+                                   json_object_new_string(recording_filename(pclient)));
+        if (pclient->journal)
+            json_object_object_add(jsession, "journal",
+                                   json_object_new_string(journal_filename(pclient)));
+        json_object_array_add(jsessions, jsession);
+    }
+    json_object_object_add(jobj, "sessions", jsessions);
+    json_object *jconnections = json_object_new_array();
+    struct tty_client *tclient;
+    FORALL_WSCLIENT(tclient) {
+        json_object *jconn = json_object_new_object();
+        json_object_object_add(jconn, "connection",
+                               json_object_new_int(tclient->connection_number));
+        if (tclient->pclient)
+            json_object_object_add(jconn, "session",
+                                   json_object_new_int(tclient->pclient->session_number));
+        json_object_object_add(jconn, "bytes_written",
+                               json_object_new_int64(tclient->bytes_written));
+        json_object_object_add(jconn, "unconfirmed_bytes",
+                               json_object_new_int64((tclient->sent_count - tclient->confirmed_count) & MASK28));
+        json_object_object_add(jconn, "ob_bytes",
+                               json_object_new_int64(tclient->ob.len));
+        json_object_object_add(jconn, "ob_allocated",
+                               json_object_new_int64(tclient->ob.size));
+        json_object_object_add(jconn, "inb_bytes",
+                               json_object_new_int64(tclient->inb.len));
+        json_object_object_add(jconn, "inb_allocated",
+                               json_object_new_int64(tclient->inb.size));
+        json_object_array_add(jconnections, jconn);
+    }
+    json_object_object_add(jobj, "connections", jconnections);
+    json_object *jserver = json_object_new_object();
+    json_object_object_add(jserver, "pty_bytes_read",
+                           json_object_new_int64(server_stats.pty_bytes_read));
+    json_object_object_add(jserver, "pty_read_syscalls",
+                           json_object_new_int64(server_stats.pty_read_syscalls));
+    json_object_object_add(jserver, "ws_bytes_written",
+                           json_object_new_int64(server_stats.ws_bytes_written));
+    json_object_object_add(jserver, "ws_frames_written",
+                           json_object_new_int64(server_stats.ws_frames_written));
+    json_object_object_add(jserver, "pause_count",
+                           json_object_new_int64(server_stats.pause_count));
+    json_object_object_add(jserver, "resize_events",
+                           json_object_new_int64(server_stats.resize_events));
+    json_object_object_add(jserver, "resize_applied",
+                           json_object_new_int64(server_stats.resize_applied));
+    json_object_object_add(jserver, "preserved_bytes",
+                           json_object_new_int64(server_stats.preserved_bytes));
+    json_object_object_add(jserver, "preserved_dropped_bytes",
+                           json_object_new_int64(server_stats.preserved_dropped));
+    json_object_object_add(jserver, "log_records_dropped",
+                           json_object_new_int64(log_sink_dropped()));
+    json_object_object_add(jserver, "output_latency_us",
+                           histogram_json(&server_stats.output_latency));
+    json_object_object_add(jserver, "loop_iteration_us",
+                           histogram_json(&server_stats.loop_iteration));
+    json_object_object_add(jserver, "command_latency_us",
+                           histogram_json(&server_stats.command_latency));
+    json_object_object_add(jobj, "server", jserver);
+    if (callback_timing_enabled) {
+        json_object *jcallbacks = json_object_new_array();
+        for (int kind = 0; kind < CALLBACK_KINDS; kind++) {
+            for (int reason = 0; reason < CALLBACK_REASONS; reason++) {
+                struct histogram *h = callback_histogram(kind, reason);
+                if (h == NULL)
+                    continue;
+                json_object *jcb = histogram_json(h);
+                json_object_object_add(jcb, "callback",
+                                       json_object_new_string(callback_kind_names[kind]));
+                json_object_object_add(jcb, "reason",
+                                       json_object_new_int(reason));
+                json_object_array_add(jcallbacks, jcb);
+            }
+        }
+        json_object_object_add(jobj, "callbacks_us", jcallbacks);
+    }
+    return jobj;
+}
+
+static void
+metric_header(struct sbuf *out, const char *name, const char *type,
+              const char *help)
+{
+    sbuf_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Print the samples of histogram h (in microseconds) in seconds.
+ * labels is empty or a comma-terminated list of label="value" pairs. */
+static void
+metric_histogram_samples(struct sbuf *out, const char *name,
+                         const char *labels, struct histogram *h)
+{
+    int last = HISTOGRAM_BUCKETS - 1;
+    while (last > 0 && h->buckets[last] == 0)
+        last--;
+    int64_t cumulative = 0;
+    for (int i = 0; i <= last; i++) {
+        cumulative += h->buckets[i];
+        // Bucket i has (integer microsecond) values up to 2**(i+1)-1.
+        sbuf_printf(out, "%s_bucket{%sle=\"%g\"} %lld\n", name, labels,
+                    (double) (((int64_t) 2 << i) - 1) * 1e-6,
+                    (long long) cumulative);
+    }
+    sbuf_printf(out, "%s_bucket{%sle=\"+Inf\"} %lld\n", name, labels,
+                (long long) h->count);
+    size_t llen = strlen(labels);
+    // Drop the trailing comma.
+    const char *lbrace = llen ? "{" : "", *rbrace = llen ? "}" : "";
+    int lprint = llen ? (int) llen - 1 : 0;
+    sbuf_printf(out, "%s_sum%s%.*s%s %g\n", name, lbrace, lprint, labels,
+                rbrace, h->sum * 1e-6);
+    sbuf_printf(out, "%s_count%s%.*s%s %lld\n", name, lbrace, lprint, labels,
+                rbrace, (long long) h->count);
+}
+
+static void
+metric_histogram(struct sbuf *out, const char *name, const char *help,
+                 struct histogram *h)
+{
+    metric_header(out, name, "histogram", help);
+    metric_histogram_samples(out, name, "", h);
+}
+
+/* Per-session metrics in the Prometheus text format. */
+#define SESSION_METRIC(NAME, TYPE, HELP, FORMAT, VALUE) \
+    metric_header(out, NAME, TYPE, HELP);                    \
+    FOREACH_PCLIENT(pclient)                                 \
+        sbuf_printf(out, NAME "{session=\"%d\"} " FORMAT "\n", \
+                    pclient->session_number, VALUE)
+#define CONNECTION_METRIC(NAME, TYPE, HELP, VALUE)           \
+    metric_header(out, NAME, TYPE, HELP);                    \
+    FORALL_WSCLIENT(tclient)                                 \
+        sbuf_printf(out, NAME "{connection=\"%d\",session=\"%d\"} %lld\n", \
+                    tclient->connection_number,              \
+                    tclient->pclient ? tclient->pclient->session_number : -1, \
+                    (long long) (VALUE))
+
+/** Print server metrics in the Prometheus text exposition format.
+ * Used for the /metrics page. */
+void
+print_metrics(struct sbuf *out)
+{
+    metric_header(out, "domterm_session_info", "gauge",
+                  "Session name and process id; value is always 1.");
+    FOREACH_PCLIENT(pclient) {
+        sbuf_printf(out, "domterm_session_info{session=\"%d\",pid=\"%d\",name=\"",
+                    pclient->session_number, pclient->pid);
+        for (const char *p = pclient->session_name; p && *p; p++) {
+            if (*p == '"' || *p == '\\')
+                sbuf_append(out, "\\", 1);
+            if (*p == '\n')
+                sbuf_append(out, "\\n", 2);
+            else
+                sbuf_append(out, p, 1);
+        }
+        sbuf_printf(out, "\"} 1\n");
+    }
+    SESSION_METRIC("domterm_session_pty_read_bytes_total", "counter",
+                   "Bytes read from the session's pty.",
+                   "%lld", (long long) pclient->bytes_read);
+    SESSION_METRIC("domterm_session_paused", "gauge",
+                   "1 if output is currently paused by flow control.",
+                   "%d", pclient->paused ? 1 : 0);
+    SESSION_METRIC("domterm_session_pauses_total", "counter",
+                   "Times the session was paused by flow control.",
+                   "%lld", (long long) pclient->pause_count);
+    SESSION_METRIC("domterm_session_paused_seconds_total", "counter",
+                   "Time spent paused by flow control.",
+                   "%g", paused_ns(pclient) * 1e-9);
+    SESSION_METRIC("domterm_session_preserved_output_bytes", "gauge",
+                   "Output kept for attaching or reconnecting windows.",
+                   "%lld", (long long) preserved_length(pclient));
+    SESSION_METRIC("domterm_session_reconnects_total", "counter",
+                   "Connections to the session that were reconnects.",
+                   "%d", pclient->reconnect_count);
+    SESSION_METRIC("domterm_session_memory_bytes", "gauge",
+                   "Memory used by the session's buffers.",
+                   "%zu", session_memory(pclient));
+    SESSION_METRIC("domterm_session_preserved_dropped_bytes_total", "counter",
+                   "Preserved output dropped because of memory limits.",
+                   "%lld", (long long) pclient->preserved_dropped);
+    struct tty_client *tclient;
+    CONNECTION_METRIC("domterm_connection_written_bytes_total", "counter",
+                      "Bytes written to the connection.",
+                      tclient->bytes_written);
+    CONNECTION_METRIC("domterm_connection_unconfirmed_bytes", "gauge",
+                      "Bytes sent but not yet confirmed by the client.",
+                      (tclient->sent_count - tclient->confirmed_count) & MASK28);
+    CONNECTION_METRIC("domterm_connection_output_buffer_bytes", "gauge",
+                      "Bytes waiting in the output buffer (ob).",
+                      tclient->ob.len);
+    CONNECTION_METRIC("domterm_connection_input_buffer_bytes", "gauge",
+                      "Bytes waiting in the input buffer (inb).",
+                      tclient->inb.len);
+    CONNECTION_METRIC("domterm_connection_buffer_allocated_bytes", "gauge",
+                      "Bytes allocated for the ob and inb buffers.",
+                      tclient->ob.size + tclient->inb.size);
+
+    metric_header(out, "domterm_pty_read_bytes_total", "counter",
+                  "Bytes read from all ptys.");
+    sbuf_printf(out, "domterm_pty_read_bytes_total %lld\n",
+                (long long) server_stats.pty_bytes_read);
+    metric_header(out, "domterm_pty_read_syscalls_total", "counter",
+                  "System calls (read, or io_uring submits) to read ptys.");
+    sbuf_printf(out, "domterm_pty_read_syscalls_total %lld\n",
+                (long long) server_stats.pty_read_syscalls);
+    metric_header(out, "domterm_ws_written_bytes_total", "counter",
+                  "Bytes written to WebSocket connections.");
+    sbuf_printf(out, "domterm_ws_written_bytes_total %lld\n",
+                (long long) server_stats.ws_bytes_written);
+    metric_header(out, "domterm_ws_frames_total", "counter",
+                  "Messages written to WebSocket connections.");
+    sbuf_printf(out, "domterm_ws_frames_total %lld\n",
+                (long long) server_stats.ws_frames_written);
+    metric_header(out, "domterm_pauses_total", "counter",
+                  "Times any session was paused by flow control.");
+    sbuf_printf(out, "domterm_pauses_total %lld\n",
+                (long long) server_stats.pause_count);
+    metric_header(out, "domterm_resize_events_total", "counter",
+                  "Window size changes reported by windows.");
+    sbuf_printf(out, "domterm_resize_events_total %lld\n",
+                (long long) server_stats.resize_events);
+    metric_header(out, "domterm_resize_applied_total", "counter",
+                  "Window size changes passed on to ptys (SIGWINCH).");
+    sbuf_printf(out, "domterm_resize_applied_total %lld\n",
+                (long long) server_stats.resize_applied);
+    metric_header(out, "domterm_preserved_bytes", "gauge",
+                  "Memory allocated for preserved output of all sessions.");
+    sbuf_printf(out, "domterm_preserved_bytes %lld\n",
+                (long long) server_stats.preserved_bytes);
+    metric_header(out, "domterm_log_dropped_total", "counter",
+                  "Log records dropped because the log buffer was full.");
+    sbuf_printf(out, "domterm_log_dropped_total %lld\n",
+                (long long) log_sink_dropped());
+    metric_histogram(out, "domterm_output_latency_seconds",
+                     "Time from reading pty output to writing it to a WebSocket.",
+                     &server_stats.output_latency);
+    metric_histogram(out, "domterm_loop_iteration_seconds",
+                     "Duration of event loop iterations (including waiting).",
+                     &server_stats.loop_iteration);
+    metric_histogram(out, "domterm_command_latency_seconds",
+                     "Time to handle a command-socket request.",
+                     &server_stats.command_latency);
+    if (callback_timing_enabled) {
+        const char *name = "domterm_callback_duration_seconds";
+        metric_header(out, name, "histogram",
+                      "Duration of libwebsockets callbacks, by reason.");
+        for (int kind = 0; kind < CALLBACK_KINDS; kind++) {
+            for (int reason = 0; reason < CALLBACK_REASONS; reason++) {
+                struct histogram *h = callback_histogram(kind, reason);
+                if (h == NULL)
+                    continue;
+                char labels[60];
+                snprintf(labels, sizeof(labels),
+                         "callback=\"%s\",reason=\"%d\",",
+                         callback_kind_names[kind], reason);
+                metric_histogram_samples(out, name, labels, h);
+            }
+        }
+    }
+}
+
+/* Print a line for each (callback, reason) with timing information. */
+static void
+print_callback_timing(FILE *out)
+{
+    fprintf(out, "Callback timing (us):\n");
+    for (int kind = 0; kind < CALLBACK_KINDS; kind++) {
+        for (int reason = 0; reason < CALLBACK_REASONS; reason++) {
+            struct histogram *h = callback_histogram(kind, reason);
+            if (h != NULL)
+                fprintf(out, "  callback_%s reason:%d count:%lld p50:%lld p99:%lld max:%lld\n",
+                        callback_kind_names[kind], reason,
+                        (long long) h->count,
+                        (long long) histogram_percentile(h, 50),
+                        (long long) histogram_percentile(h, 99),
+                        (long long) h->max);
+        }
+    }
+}
+
 int status_action(int argc, arglist_t argv, struct lws *wsi, struct options *opts)
 {
     int verbosity = 0;
-    bool by_session = false;
+    bool by_session = false, as_json = false;
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
         if (strcmp(arg, "--by-session") == 0)
             by_session = true;
         else if (strcmp(arg, "--verbose") == 0)
             verbosity++;
+        else if (strcmp(arg, "--json") == 0)
+            as_json = true;
+    }
+    char *obuf;
+    size_t olen;
+    FILE *out = open_memstream(&obuf, &olen);
+    if (as_json) {
+        json_object *jobj = status_json();
+        // jobj is a copy, so other threads may run while we format it.
+        service_unlock unlocked;
+        fprintf(out, "%s\n",
+                json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PRETTY));
+        json_object_put(jobj);
+        fclose(out);
+        write_command_output(opts, obuf, olen);
+        return EXIT_SUCCESS;
     }
-    FILE *out = fdopen(dup(opts->fd_out), "w");
     print_version(out);
     if (settings_fname)
         fprintf(out, "Reading settings from: %s\n", settings_fname);
     fprintf(out, "Backend pid:%d", getpid());
     if (backend_socket_name != NULL)
         fprintf(out, " command-socket:%s", backend_socket_name);
+    if (ws_socket_name != NULL)
+        fprintf(out, " ws-socket:%s", ws_socket_name);
     fprintf(out, "\n");
     if (by_session)
         status_by_session(out, verbosity);
     else
         status_by_connection(out, verbosity);
+    if (verbosity > 0) {
+        struct histogram *lat = &server_stats.output_latency;
+        fprintf(out, "Output: pty-read:%lld pty-syscalls:%lld ws-written:%lld ws-frames:%lld pauses:%lld\n",
+                (long long) server_stats.pty_bytes_read,
+                (long long) server_stats.pty_read_syscalls,
+                (long long) server_stats.ws_bytes_written,
+                (long long) server_stats.ws_frames_written,
+                (long long) server_stats.pause_count);
+        fprintf(out, "Resizes: reported:%lld applied:%lld\n",
+                (long long) server_stats.resize_events,
+                (long long) server_stats.resize_applied);
+        fprintf(out, "Memory: preserved:%lldK dropped:%lldK limits (MB): session:%g total:%g\n",
+                (long long) (server_stats.preserved_bytes + 1023) >> 10,
+                (long long) (server_stats.preserved_dropped + 1023) >> 10,
+                setting_number(main_options, memory_session_limit_opt,
+                               DEFAULT_SESSION_MEMORY_LIMIT),
+                setting_number(main_options, memory_total_limit_opt,
+                               DEFAULT_TOTAL_MEMORY_LIMIT));
+        fprintf(out, "Output latency (us): samples:%lld p50:%lld p99:%lld max:%lld\n",
+                (long long) lat->count,
+                (long long) histogram_percentile(lat, 50),
+                (long long) histogram_percentile(lat, 99),
+                (long long) lat->max);
+        if (callback_timing_enabled)
+            print_callback_timing(out);
+    }
     fclose(out);
+    write_command_output(opts, obuf, olen);
     return EXIT_SUCCESS;
 }
 
@@ -729,6 +1675,29 @@ int kill_server_action(int argc, arglist_t argv, struct lws *wsi, struct options
     return EXIT_SUCCESS;
 }
 
+/* Hand the sessions over to a new server process (see upgrade.cc). */
+int upgrade_server_action(int argc, arglist_t argv, struct lws *wsi,
+                          struct options *opts)
+{
+    if (opts == main_options) { // client mode
+        printf_error(opts, "no domterm server found");
+        return EXIT_FAILURE;
+    }
+    if (argc > 1) {
+        printf_error(opts, "domterm upgrade-server: invalid argument '%s'",
+                     argv[1]);
+        return EXIT_FAILURE;
+    }
+    const char *err = upgrade_server(opts);
+    if (err != NULL) {
+        printf_error(opts, "domterm upgrade-server: %s", err);
+        return EXIT_FAILURE;
+    }
+    if (opts->fd_cmd_socket >= 0)
+        return EXIT_WAIT; // finished when the new server replies
+    return EXIT_SUCCESS; // in a batch: the result is only logged
+}
+
 int view_saved_action(int argc, arglist_t argv, struct lws *wsi,
                   struct options *opts)
 {
@@ -810,6 +1779,178 @@ int settings_action(int argc, arglist_t argv, struct lws *wsi,
     return EXIT_SUCCESS;
 }
 
+/* The session named by --session=SPEC, or else the session
+ * that the command was run in (from the DOMTERM environment variable). */
+static struct pty_client *
+command_session(const char *spec, struct options *opts)
+{
+    if (spec != NULL) {
+        struct pty_client *pclient = find_session(spec);
+        if (pclient == NULL)
+            printf_error(opts, "no session '%s' found", spec);
+        return pclient;
+    }
+    const char *dt = getenv_from_array("DOMTERM", opts->env);
+    const char *t = dt ? strstr(dt, ";tty=") : NULL;
+    struct pty_client *pclient = t ? find_session_by_tty(t + 5) : NULL;
+    if (pclient == NULL)
+        printf_error(opts, "not running in a domterm session - use --session=SPEC");
+    return pclient;
+}
+
+int record_action(int argc, arglist_t argv, struct lws *wsi,
+                  struct options *opts)
+{
+    const char *spec = NULL, *file = NULL;
+    bool stop = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--stop") == 0)
+            stop = true;
+        else if (strncmp(arg, "--session=", 10) == 0)
+            spec = arg + 10;
+        else if (arg[0] == '-' || file != NULL) {
+            printf_error(opts, "domterm record: invalid argument '%s'", arg);
+            return EXIT_FAILURE;
+        } else
+            file = arg;
+    }
+    if (stop ? file != NULL : file == NULL) {
+        printf_error(opts, stop ? "domterm record: --stop takes no file name"
+                     : "domterm record: missing file name");
+        return EXIT_FAILURE;
+    }
+    struct pty_client *pclient = command_session(spec, opts);
+    if (pclient == NULL)
+        return EXIT_FAILURE;
+    if (stop) {
+        if (pclient->recording == NULL) {
+            printf_error(opts, "domterm record: session #%d is not being recorded",
+                         pclient->session_number);
+            return EXIT_FAILURE;
+        }
+        recording_stop(pclient);
+        return EXIT_SUCCESS;
+    }
+    char *fname = NULL;
+    if (file[0] != '/' && opts->cwd != NULL) {
+        fname = challoc(strlen(opts->cwd) + strlen(file) + 2);
+        sprintf(fname, "%s/%s", opts->cwd, file);
+        file = fname;
+    }
+    const char *err = recording_start(pclient, file);
+    if (err)
+        printf_error(opts, "domterm record: cannot write %s: %s", file, err);
+    free(fname);
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Write an asciicast file to fd_out, with the recorded timing
+ * (scaled by 1/speed), or as fast as possible if speed is 0.
+ * A session journal (see journal.cc) is written without timing. */
+int replay_action(int argc, arglist_t argv, struct lws *wsi,
+                  struct options *opts)
+{
+    double speed = 1.0;
+    const char *file = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--max-speed") == 0)
+            speed = 0;
+        else if (strncmp(arg, "--speed=", 8) == 0
+                 && (speed = strtod(arg + 8, NULL)) > 0)
+            ;
+        else if (arg[0] == '-' || file != NULL) {
+            printf_error(opts, "domterm replay: invalid argument '%s'", arg);
+            return EXIT_FAILURE;
+        } else
+            file = arg;
+    }
+    if (file == NULL) {
+        printf_error(opts, "domterm replay: missing file name");
+        return EXIT_FAILURE;
+    }
+    if (is_journal_file(file)) {
+        FILE *out = fdopen(dup(opts->fd_out), "w");
+        long bytes = journal_replay(file, out);
+        fclose(out);
+        if (bytes < 0) {
+            printf_error(opts, "domterm replay: cannot read %s: %s",
+                         file, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    FILE *in = fopen(file, "r");
+    if (in == NULL) {
+        printf_error(opts, "domterm replay: cannot read %s: %s",
+                     file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    FILE *out = fdopen(dup(opts->fd_out), "w");
+    char *line = NULL;
+    size_t line_size = 0;
+    int64_t start = monotonic_ns();
+    int64_t bytes = 0;
+    int lineno = 0;
+    int ret = EXIT_SUCCESS;
+    while (getline(&line, &line_size, in) > 0) {
+        lineno++;
+        json_object *jobj = json_tokener_parse(line);
+        if (lineno == 1 || jobj == NULL) {
+            // The first line is the header.
+            if (jobj == NULL && line[0] != '\n') {
+                printf_error(opts, "domterm replay: %s:%d: invalid JSON",
+                             file, lineno);
+                ret = EXIT_FAILURE;
+            }
+            json_object_put(jobj);
+            if (ret != EXIT_SUCCESS)
+                break;
+            continue;
+        }
+        json_object *jtime = json_object_array_get_idx(jobj, 0);
+        const char *code = json_object_get_string(json_object_array_get_idx(jobj, 1));
+        json_object *jdata = json_object_array_get_idx(jobj, 2);
+        if (speed > 0 && jtime != NULL) {
+            int64_t due = start
+                + (int64_t) (json_object_get_double(jtime) * 1e9 / speed);
+            int64_t now = monotonic_ns();
+            if (due > now) {
+                fflush(out);
+                struct timespec ts;
+                ts.tv_sec = (due - now) / 1000000000;
+                ts.tv_nsec = (due - now) % 1000000000;
+                while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+                    ;
+            }
+        }
+        if (code != NULL && jdata != NULL && strcmp(code, "o") == 0) {
+            int len = json_object_get_string_len(jdata);
+            fwrite(json_object_get_string(jdata), 1, len, out);
+            bytes += len;
+        } else if (code != NULL && jdata != NULL && strcmp(code, "r") == 0) {
+            int cols, rows;
+            if (sscanf(json_object_get_string(jdata), "%dx%d",
+                       &cols, &rows) == 2)
+                fprintf(out, "\033[8;%d;%dt", rows, cols);
+        }
+        json_object_put(jobj);
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+    if (speed == 0 && ret == EXIT_SUCCESS) {
+        double secs = (monotonic_ns() - start) * 1e-9;
+        FILE *err = fdopen(dup(opts->fd_err), "w");
+        fprintf(err, "replayed %lld bytes in %.3f seconds (%.1f MB/s)\n",
+                (long long) bytes, secs,
+                secs > 0 ? bytes / secs / 1e6 : 0.0);
+        fclose(err);
+    }
+    return ret;
+}
+
 int reverse_video_action(int argc, arglist_t argv, struct lws *wsi,
                          struct options *opts)
 {
@@ -952,7 +2093,7 @@ int window_action(int argc, arglist_t argv, struct lws *wsi,
                 switch (w_op_kind) {
                 default:
                     printf_to_browser(tclient, seq);
-                    lws_callback_on_writable(tclient->wsi);
+                    wsi_writable(tclient->wsi);
                 }
                 seen = true;
             }
@@ -973,13 +2114,180 @@ int window_action(int argc, arglist_t argv, struct lws *wsi,
     }
 }
 
+#define BATCH_REPORTED (-1) // failed, and the error was reported
+
+enum batch_kind {
+    batch_unknown, batch_in_client, batch_in_server, batch_if_no_server
+};
+
+/* Where a command in a batch runs.  Options (in --name=value form)
+ * may precede the command name; set *nopts to their number. */
+static enum batch_kind
+batch_command_kind(arglist_t args, int *nopts)
+{
+    int n = 0;
+    while (args[n] != NULL && args[n][0] == '-')
+        n++;
+    *nopts = n;
+    const char *name = args[n];
+    if (name == NULL)
+        return batch_unknown;
+    struct command *command = find_command(name);
+    if (command == NULL)
+        return strchr(name, '/') != NULL || strchr(name, '@') != NULL
+            ? batch_in_server // new session
+            : batch_unknown;
+    if ((command->options & COMMAND_IN_CLIENT) != 0)
+        return batch_in_client;
+    if ((command->options & COMMAND_IN_CLIENT_IF_NO_SERVER) != 0)
+        return batch_if_no_server;
+    return batch_in_server;
+}
+
+/* Run the commands in a file (or standard input), one per line,
+ * as if each were the arguments of a separate "domterm" command.
+ * Consecutive commands that the server handles are sent to it together,
+ * over one connection (see client_run_batch); those handled by the
+ * client are run in this process, in order. */
+int batch_action(int argc, arglist_t argv, struct lws *wsi,
+                 struct options *opts)
+{
+    if (argc > 2) {
+        printf_error(opts, "domterm batch: too many arguments");
+        return EXIT_FAILURE;
+    }
+    const char *fname = argc < 2 ? "-" : argv[1];
+    FILE *in = strcmp(fname, "-") == 0 ? fdopen(dup(opts->fd_in), "r")
+        : fopen(fname, "r");
+    if (in == NULL) {
+        printf_error(opts, "domterm batch: cannot read %s: %s",
+                     fname, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    // Read (and parse) all of it first: the commands don't get our stdin.
+    int ncommands = 0, nalloc = 0;
+    argblob_t *commands = NULL;
+    int *linenos = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    int lineno = 0;
+    while (getline(&line, &line_size, in) > 0) {
+        lineno++;
+        size_t len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+        const char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+        argblob_t args = parse_args(p, false);
+        if (args == NULL || args[0] == NULL) {
+            free((void *) args);
+            continue;
+        }
+        if (ncommands == nalloc) {
+            nalloc = nalloc ? 2 * nalloc : 16;
+            commands = (argblob_t *)
+                xrealloc(commands, nalloc * sizeof(argblob_t));
+            linenos = (int *) xrealloc(linenos, nalloc * sizeof(int));
+        }
+        commands[ncommands] = args;
+        linenos[ncommands++] = lineno;
+    }
+    free(line);
+    fclose(in);
+
+    int ret = EXIT_SUCCESS;
+    int *statuses = (int *) xmalloc((ncommands + 1) * sizeof(int));
+    // Only connect just before sending commands: the server waits
+    // for them once we do.
+    int socket = -1;
+    bool have_server = false;
+    for (int i = 0; i < ncommands; ) {
+        int nopts;
+        int first = i;
+        enum batch_kind kind = batch_command_kind(commands[i], &nopts);
+        if (kind == batch_in_server || kind == batch_if_no_server) {
+            socket = client_connect(make_socket_name(false));
+            have_server = socket >= 0;
+            if (kind == batch_if_no_server)
+                kind = have_server ? batch_in_server : batch_in_client;
+        }
+        if (kind == batch_unknown) {
+            printf_error(opts, "domterm batch: %s:%d: unknown command",
+                         fname, linenos[i]);
+            statuses[i++] = BATCH_REPORTED;
+        } else if (kind == batch_in_client && nopts > 0) {
+            printf_error(opts,
+                         "domterm batch: %s:%d: options not supported for '%s'",
+                         fname, linenos[i], commands[i][nopts]);
+            statuses[i++] = BATCH_REPORTED;
+        } else if (kind == batch_in_client) {
+            arglist_t args = commands[i];
+            // Some actions close fd_out when done.
+            int saved_out = opts->fd_out;
+            int fd_out = dup(saved_out);
+            opts->fd_out = fd_out;
+            optind = 1;
+            statuses[i++] = (*find_command(args[0])->action)
+                (count_args(args), args, NULL, opts);
+            close(fd_out);
+            opts->fd_out = saved_out;
+        } else {
+            // Send this and following commands for the server together.
+            json_object *jcommands = json_object_new_array();
+            for (; i < ncommands; i++) {
+                enum batch_kind k = batch_command_kind(commands[i], &nopts);
+                if (i > first && k != batch_in_server
+                    && (k != batch_if_no_server || ! have_server))
+                    break;
+                json_object *jargv = json_object_new_array();
+                json_object_array_add(jargv, json_object_new_string("domterm"));
+                for (arglist_t a = commands[i]; *a; a++)
+                    json_object_array_add(jargv, json_object_new_string(*a));
+                json_object_array_add(jcommands, jargv);
+            }
+            int done = socket < 0 ? 0
+                : client_run_batch(socket, jcommands, environ,
+                                   statuses + first);
+            json_object_put(jcommands);
+            if (socket >= 0)
+                close(socket);
+            socket = -1; // the server closes it after a batch
+            for (int j = first + done; j < i; j++) {
+                printf_error(opts, "domterm batch: %s:%d: %s",
+                             fname, linenos[j],
+                             have_server ? "lost connection to server"
+                             : "no domterm server running");
+                statuses[j] = BATCH_REPORTED;
+            }
+        }
+        for (int j = first; j < i; j++) {
+            if (statuses[j] == EXIT_SUCCESS)
+                continue;
+            if (statuses[j] == BATCH_REPORTED)
+                statuses[j] = EXIT_FAILURE;
+            else
+                printf_error(opts, "domterm batch: %s:%d: exit status %d",
+                             fname, linenos[j], statuses[j]);
+            if (ret == EXIT_SUCCESS)
+                ret = statuses[j];
+        }
+    }
+    for (int i = 0; i < ncommands; i++)
+        free((void *) commands[i]);
+    free(commands);
+    free(linenos);
+    free(statuses);
+    return ret;
+}
+
 struct command commands[] = {
   { .name = "is-domterm",
     .options = COMMAND_IN_CLIENT,
     .action = is_domterm_action },
   { .name ="html",
 #if DO_HTML_ACTION_IN_SERVER
-    .options = COMMAND_IN_SERVER|COMMAND_CHECK_DOMTERM,
+    .options = COMMAND_IN_SERVER|COMMAND_CHECK_DOMTERM|COMMAND_OFFLOAD,
 #else
     .options = COMMAND_IN_CLIENT|COMMAND_CHECK_DOMTERM,
 #endif
@@ -1022,13 +2330,13 @@ struct command commands[] = {
     .options = COMMAND_IN_SERVER|COMMAND_ALIAS },
   { .name = "browse", .options = COMMAND_IN_SERVER,
     .action = browse_action},
-  { .name = "view-saved", .options = COMMAND_IN_SERVER,
+  { .name = "view-saved", .options = COMMAND_IN_SERVER|COMMAND_OFFLOAD,
     .action = view_saved_action},
   { .name = "list",
-    .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER,
+    .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER|COMMAND_OFFLOAD,
     .action = list_action },
   { .name = "status",
-    .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER,
+    .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER|COMMAND_OFFLOAD,
     .action = status_action },
   { .name = "reverse-video",
     .options = COMMAND_IN_CLIENT,
@@ -1045,6 +2353,15 @@ struct command commands[] = {
   { .name = "kill-server",
     .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER,
     .action = kill_server_action },
+  { .name = "upgrade-server",
+    .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER,
+    .action = upgrade_server_action },
+  { .name = "record", .options = COMMAND_IN_SERVER,
+    .action = record_action },
+  { .name = "replay", .options = COMMAND_IN_CLIENT,
+    .action = replay_action },
+  { .name = "batch", .options = COMMAND_IN_CLIENT,
+    .action = batch_action },
   { .name = 0 }
   };
 
@@ -149,6 +149,9 @@ check_auth(struct lws *wsi) {
 
 bool check_server_key(struct lws *wsi, char *arg, size_t alen)
 {
+    // The Unix socket's file permissions already restrict it to the user.
+    if (unix_vhost != NULL && lws_get_vhost(wsi) == unix_vhost)
+        return true;
     const char*server_key_arg = lws_get_urlarg_by_name(wsi, "server-key=", arg, alen);
     if (server_key_arg != NULL &&
         memcmp(server_key_arg, server_key, SERVER_KEY_LENGTH) == 0)
@@ -193,6 +196,7 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
     struct http_client *hclient = (struct http_client *) user;
     unsigned char buffer[LBUFSIZE + LWS_PRE], *p, *end;
     char buf[256];
+    callback_timer timer(CALLBACK_HTTP, reason, NULL, NULL);
 
     switch (reason) {
     case LWS_CALLBACK_HTTP: {
@@ -290,6 +294,24 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                     close(fd);
                 return ret;
             }
+            if (strcmp((const char *) in, "/metrics") == 0) {
+                int blen = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_URI_ARGS);
+                char *buf = challoc(blen+1);
+                bool ok = check_server_key(wsi, buf, blen);
+                free(buf);
+                if (! ok)
+                    return -1;
+                struct sbuf sb[1];
+                sbuf_init(sb);
+                print_metrics(sb);
+                char *data = sb->buffer;
+                int dlen = sb->len;
+                sb->buffer = NULL;
+                sbuf_free(sb);
+                return write_simple_response(wsi, hclient,
+                                             "text/plain; version=0.0.4",
+                                             data, dlen, true, buffer);
+            }
             const char* fname = (char*) in;
             if (fname == NULL || strcmp(fname, "/") == 0) {
                 if (main_options->http_server)
@@ -310,6 +332,29 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                 break;
             }
 
+            // Originals of images scaled by "imgcat --fit".  The names
+            // are keyed hashes of the contents (see thumbnail.cc),
+            // so no server key is needed.
+            const char thumbnails_prefix[] = "/thumbnails/";
+            size_t thumbnails_prefix_len = sizeof(thumbnails_prefix)-1;
+            if (!strncmp(fname, thumbnails_prefix, thumbnails_prefix_len)) {
+                const char *name = fname + thumbnails_prefix_len;
+                const char *dir = thumbnail_dir();
+                size_t nlen = strspn(name, "0123456789abcdef-x.");
+                if (dir == NULL || nlen == 0 || name[nlen] != '\0'
+                    || name[0] == '.' || strstr(name, "..") != NULL) {
+                    lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+                    goto try_to_reuse;
+                }
+                char *path = challoc(strlen(dir) + nlen + 2);
+                sprintf(path, "%s/%s", dir, name);
+                int n = lws_serve_http_file(wsi, path, content_type, NULL, 0);
+                free(path);
+                if (n < 0 || ((n > 0) && lws_http_transaction_completed(wsi)))
+                    return -1; /* error or can't reuse connection: close the socket */
+                break;
+            }
+
             const char resource_prefix[] = "/RESOURCE/";
             size_t resource_prefix_len = sizeof(resource_prefix)-1;
             const char* url_rest;
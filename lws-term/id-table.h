@@ -0,0 +1,278 @@
+#ifndef ID_TABLE_H
+#define ID_TABLE_H
+#include <stdlib.h>
+#include <string.h>
+
+/** Allocator for the index numbers used by one or more id_tables.
+ * Sessions (pty_client) and connections (tty_client) share one
+ * id_numbering, so that a number names at most one of each,
+ * and "#N" is rarely ambiguous.  (A session created for a connection
+ * is explicitly given the same number, as a hint to enter.)
+ * Freed numbers, and numbers skipped over by a hint, are kept on
+ * a stack of ranges, so allocation is (amortized) O(1), and so is
+ * claiming a hint, however large.
+ */
+class id_numbering {
+    unsigned char *users = nullptr; // number of tables using each index
+    int sz = 0; // allocated size of users
+    struct range { int lo, hi; }; // lo..hi inclusive
+    struct range *free_ranges = nullptr; // stack of indexes that were freed
+    int nfree = 0;
+    int free_size = 0; // allocated size of free_ranges
+    int limit = 1; // indexes >= limit have never been used
+    void reserve(int n) {
+        if (n > sz) {
+            int newsize = 3 * sz >> 1;
+            if (newsize < n)
+                newsize = n < 20 ? 20 : n;
+            users = (unsigned char*) realloc(users, newsize);
+            memset(users + sz, 0, newsize - sz);
+            sz = newsize;
+        }
+    }
+    void push_free(int lo, int hi) {
+        if (nfree == free_size) {
+            free_size = free_size < 20 ? 20 : 3 * free_size >> 1;
+            free_ranges = (struct range*)
+                realloc(free_ranges, free_size * sizeof(struct range));
+        }
+        free_ranges[nfree].lo = lo;
+        free_ranges[nfree].hi = hi;
+        nfree++;
+    }
+public:
+    int allocate() {
+        // An index in a free range may since have been claimed
+        // (using a hint), in which case just skip it.
+        while (nfree > 0) {
+            struct range *r = &free_ranges[nfree - 1];
+            int i = r->lo++;
+            if (r->lo > r->hi)
+                nfree--;
+            if (users[i] == 0) {
+                users[i]++;
+                return i;
+            }
+        }
+        int i = limit++;
+        reserve(limit);
+        users[i]++;
+        return i;
+    }
+    bool in_use(int i) { return i > 0 && i < sz && users[i] > 0; }
+    void claim(int i) {
+        reserve(i + 1);
+        // Indexes skipped over are now free.
+        if (limit < i)
+            push_free(limit, i - 1);
+        if (limit <= i)
+            limit = i + 1;
+        users[i]++;
+    }
+    void release(int i) {
+        if (i > 0 && i < sz && users[i] > 0 && --users[i] == 0)
+            push_free(i, i);
+    }
+};
+
+/** Maps between entries of type T and their (positive integer) indexes.
+ * Assume each T has an index() method that returns the number
+ * that was returned by enter, and an avoid_index(I) method that
+ * returns true if entry should not take I (used by another table)
+ * even as a hint.
+ * Lookup, enter, and remove are O(1); iteration (using first and next)
+ * only visits valid entries, in the order they were entered.
+ */
+template<typename T>
+class id_table {
+    // If I is a valid index, elements[I] is the entry whose index() is I;
+    // otherwise (if I < sz) elements[I] is nullptr.
+    // Valid entries are also on a doubly-linked list through links.
+    // 0 (never a valid index) is used as the list terminator.
+    struct link { int prev, next; };
+    T** elements = nullptr;
+    struct link *links = nullptr;
+    int sz = 0; // allocated size of elements and links
+    int head = 0, tail = 0;
+    int count = 0;
+    id_numbering *numbering;
+    void reserve(int n) {
+        if (n > sz) {
+            int newsize = 3 * sz >> 1;
+            if (newsize < n)
+                newsize = n < 20 ? 20 : n;
+            elements = (T**) realloc(elements, newsize * sizeof(T*));
+            links = (struct link*) realloc(links, newsize * sizeof(struct link));
+            for (int i = sz; i < newsize; i++) {
+                elements[i] = nullptr;
+                links[i].prev = links[i].next = 0;
+            }
+            sz = newsize;
+        }
+    }
+public:
+    id_table(id_numbering *numbering) : numbering(numbering) { }
+    T* first() { return head ? elements[head] : nullptr; }
+    // It is OK to remove entry (but not also its successor) before calling
+    // next(entry), so an iteration can remove the current entry.
+    T* next(T* entry) {
+        int n = links[entry->index()].next;
+        return n ? elements[n] : nullptr;
+    }
+    T* operator[](int i) { return elements[i]; } // fast/unsafe lookup
+    /** Enter a new entry, and return its index.
+     * Use hint as the index if it is positive, not in use in this table,
+     * and not used in another table in a way entry should avoid;
+     * otherwise allocate a fresh index. */
+    int enter(T* entry, int hint) {
+        int snum;
+        if (hint > 0 && ! valid_index(hint)
+            && ! (numbering->in_use(hint) && entry->avoid_index(hint))) {
+            numbering->claim(hint);
+            snum = hint;
+        } else
+            snum = numbering->allocate();
+        reserve(snum + 1);
+        elements[snum] = entry;
+        links[snum].prev = tail;
+        links[snum].next = 0;
+        if (tail)
+            links[tail].next = snum;
+        else
+            head = snum;
+        tail = snum;
+        count++;
+        return snum;
+    }
+    void remove(T* entry) {
+        if (entry == nullptr)
+            return;
+        int index = entry->index();
+        if (! valid_index(index) || elements[index] != entry)
+            return;
+        elements[index] = nullptr;
+        int prev = links[index].prev, next = links[index].next;
+        if (prev)
+            links[prev].next = next;
+        else
+            head = next;
+        if (next)
+            links[next].prev = prev;
+        else
+            tail = prev;
+        // links[index].next is left as is - see next().
+        count--;
+        numbering->release(index);
+    }
+    bool valid_index(int i) {
+        return i > 0 && i < sz && elements[i] != nullptr;
+    }
+    T* operator()(int i) { return valid_index(i) ? elements[i] : nullptr; }
+    int size() { return count; } // number of valid entries
+    int index_limit() { return sz; } // all valid indexes are less than this
+};
+
+/** A hash table from strings to entries of type T.
+ * More than one entry may have the same key.
+ * Keys are not copied: a key must not be modified or freed
+ * while its entry is in the index.
+ */
+template<typename T>
+class string_index {
+    struct node {
+        const char *key;
+        unsigned hash;
+        T *value;
+        struct node *next;
+    };
+    struct node **buckets = nullptr;
+    unsigned nbuckets = 0; // 0 or a power of 2
+    int count = 0;
+    static unsigned hash_string(const char *str) {
+        unsigned h = 2166136261u; // FNV-1a
+        for (; *str; str++)
+            h = (h ^ (unsigned char) *str) * 16777619u;
+        return h;
+    }
+    void resize(unsigned newsize) {
+        struct node **nb = (struct node**) calloc(newsize, sizeof(struct node*));
+        for (unsigned i = 0; i < nbuckets; i++) {
+            struct node *n = buckets[i];
+            while (n != nullptr) {
+                struct node *next = n->next;
+                struct node **bucket = &nb[n->hash & (newsize - 1)];
+                n->next = *bucket;
+                *bucket = n;
+                n = next;
+            }
+        }
+        free(buckets);
+        buckets = nb;
+        nbuckets = newsize;
+    }
+public:
+    void add(const char *key, T *value) {
+        if (key == nullptr)
+            return;
+        if (2 * count >= (int) nbuckets)
+            resize(nbuckets < 16 ? 16 : 2 * nbuckets);
+        struct node *n = (struct node*) malloc(sizeof(struct node));
+        n->key = key;
+        n->hash = hash_string(key);
+        n->value = value;
+        struct node **bucket = &buckets[n->hash & (nbuckets - 1)];
+        n->next = *bucket;
+        *bucket = n;
+        count++;
+    }
+    void remove(const char *key, T *value) {
+        if (key == nullptr || nbuckets == 0)
+            return;
+        unsigned h = hash_string(key);
+        for (struct node **p = &buckets[h & (nbuckets - 1)]; *p != nullptr;
+             p = &(*p)->next) {
+            struct node *n = *p;
+            if (n->value == value && n->hash == h && strcmp(n->key, key) == 0) {
+                *p = n->next;
+                free(n);
+                count--;
+                return;
+            }
+        }
+    }
+    /** Find an entry whose key is equal to key, or nullptr.
+     * If nfound is non-null, set it to the number of matching entries. */
+    T *find(const char *key, int *nfound = nullptr) {
+        T *result = nullptr;
+        int matches = 0;
+        if (key != nullptr && nbuckets != 0) {
+            unsigned h = hash_string(key);
+            for (struct node *n = buckets[h & (nbuckets - 1)]; n != nullptr;
+                 n = n->next) {
+                if (n->hash == h && strcmp(n->key, key) == 0) {
+                    if (result == nullptr)
+                        result = n->value;
+                    matches++;
+                }
+            }
+        }
+        if (nfound)
+            *nfound = matches;
+        return result;
+    }
+    /** Store (up to max) entries whose key is equal to key in results.
+     * Return the number stored. */
+    int find_all(const char *key, T **results, int max) {
+        int matches = 0;
+        if (key != nullptr && nbuckets != 0) {
+            unsigned h = hash_string(key);
+            for (struct node *n = buckets[h & (nbuckets - 1)];
+                 n != nullptr && matches < max; n = n->next) {
+                if (n->hash == h && strcmp(n->key, key) == 0)
+                    results[matches++] = n->value;
+            }
+        }
+        return matches;
+    }
+};
+#endif
@@ -0,0 +1,298 @@
+/* Compression of the buffers of idle detached sessions.
+ * A session that has had no windows and no output for memory.compress-idle
+ * seconds has its preserved output and saved window contents handed
+ * to a background thread, which compresses them with zlib.
+ * They are decompressed (by session_expand) when a window attaches
+ * or there is new output, so other code never sees the compressed form.
+ * When memory.total-limit is exceeded, detached sessions are compressed
+ * even if they are not idle (compress_for_memory).
+ */
+#include "server.h"
+#include <zlib.h>
+
+#define COMPRESS_MIN_SIZE 4096 // don't bother with less
+#define COMPRESS_SWEEP_NS 1000000000 // look for idle sessions every second
+
+enum { COMPRESS_QUEUED, COMPRESS_RUNNING, COMPRESS_DONE };
+
+struct compressed_state {
+    struct compressed_state *next; // in the job queue
+    int state;
+    // Original data, owned by this until compressed (and then freed).
+    char *output; // preserved output, or NULL
+    size_t output_length;
+    char *window_contents; // saved window contents, or NULL
+    size_t window_length; // strlen(window_contents)
+    // Compressed data, or NULL if compression failed or didn't help.
+    unsigned char *zoutput;
+    size_t zoutput_length;
+    unsigned char *zwindow;
+    size_t zwindow_length;
+};
+
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER; // job added
+static pthread_cond_t compress_done = PTHREAD_COND_INITIALIZER;
+static struct compressed_state *jobs_first = NULL, **jobs_last = &jobs_first;
+static pid_t compressor_pid = -1; // process the thread is running in
+
+/* Compress data (unless NULL); on success set *zlength and return
+ * the (malloc'ed) result, else return NULL. */
+static unsigned char *
+compress_data(const char *data, size_t length, size_t *zlength)
+{
+    if (data == NULL || length < COMPRESS_MIN_SIZE)
+        return NULL;
+    uLongf zlen = compressBound(length);
+    unsigned char *zdata = (unsigned char *) malloc(zlen);
+    if (zdata == NULL)
+        return NULL;
+    if (compress2(zdata, &zlen, (const Bytef *) data, length,
+                  Z_BEST_SPEED) != Z_OK
+        || zlen >= length - (length >> 3)) { // not worth it
+        free(zdata);
+        return NULL;
+    }
+    *zlength = zlen;
+    return (unsigned char *) xrealloc(zdata, zlen);
+}
+
+static void *
+compressor(void *)
+{
+    pthread_mutex_lock(&compress_lock);
+    for (;;) {
+        while (jobs_first == NULL)
+            pthread_cond_wait(&compress_cond, &compress_lock);
+        struct compressed_state *c = jobs_first;
+        jobs_first = c->next;
+        if (jobs_first == NULL)
+            jobs_last = &jobs_first;
+        c->state = COMPRESS_RUNNING;
+        pthread_mutex_unlock(&compress_lock);
+        // Only this thread touches c while it is RUNNING.
+        c->zoutput = compress_data(c->output, c->output_length,
+                                   &c->zoutput_length);
+        if (c->zoutput) {
+            free(c->output);
+            c->output = NULL;
+        }
+        c->zwindow = compress_data(c->window_contents, c->window_length,
+                                   &c->zwindow_length);
+        if (c->zwindow) {
+            free(c->window_contents);
+            c->window_contents = NULL;
+        }
+        pthread_mutex_lock(&compress_lock);
+        c->state = COMPRESS_DONE;
+        pthread_cond_broadcast(&compress_done);
+    }
+    return NULL;
+}
+
+/* Wait until the compression of c (if queued or running) is done.
+ * Must be called with compress_lock held. */
+static void
+compress_finish(struct compressed_state *c)
+{
+    if (c->state == COMPRESS_QUEUED) {
+        // Not started - just take it off the queue.
+        struct compressed_state **p = &jobs_first;
+        while (*p != c)
+            p = &(*p)->next;
+        *p = c->next;
+        if (*p == NULL)
+            jobs_last = p;
+        c->state = COMPRESS_DONE;
+    }
+    while (c->state != COMPRESS_DONE)
+        pthread_cond_wait(&compress_done, &compress_lock);
+}
+
+static char *
+uncompress_data(const unsigned char *zdata, size_t zlength, size_t length,
+                int extra)
+{
+    char *data = challoc(length + extra);
+    uLongf len = length;
+    if (uncompress((Bytef *) data, &len, zdata, zlength) != Z_OK
+        || len != length) {
+        lwsl_err("failed to uncompress saved session data\n");
+        memset(data, 0, length + extra);
+    }
+    return data;
+}
+
+static void
+compress_session(struct pty_client *pclient)
+{
+    struct compressed_state *c = (struct compressed_state *)
+        xmalloc(sizeof(struct compressed_state));
+    memset(c, 0, sizeof(struct compressed_state));
+    if (pclient->preserved_output != NULL) {
+        c->output_length = pclient->preserved_end - pclient->preserved_start;
+        if (pclient->preserved_start == 0)
+            c->output = (char *) xrealloc(pclient->preserved_output,
+                                          c->output_length + 1);
+        else {
+            c->output = challoc(c->output_length + 1);
+            memcpy(c->output,
+                   pclient->preserved_output + pclient->preserved_start,
+                   c->output_length);
+            free(pclient->preserved_output);
+        }
+        pclient->preserved_output = NULL;
+        set_preserved_size(pclient, 0);
+    }
+    if (pclient->saved_window_contents != NULL) {
+        c->window_contents = pclient->saved_window_contents;
+        c->window_length = strlen(c->window_contents);
+        pclient->saved_window_contents = NULL;
+    }
+    pclient->compressed = c;
+    pthread_mutex_lock(&compress_lock);
+    // Threads don't survive fork (for example daemon), so (re)start
+    // the compressor the first time it is needed in this process.
+    if (compressor_pid != getpid()) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compressor, NULL) == 0) {
+            pthread_detach(thread);
+            compressor_pid = getpid();
+        }
+    }
+    c->state = COMPRESS_QUEUED;
+    c->next = NULL;
+    *jobs_last = c;
+    jobs_last = &c->next;
+    pthread_cond_signal(&compress_cond);
+    pthread_mutex_unlock(&compress_lock);
+}
+
+/* Restore the preserved output and saved window contents of pclient,
+ * if they were compressed. */
+void
+session_expand(struct pty_client *pclient)
+{
+    struct compressed_state *c = pclient->compressed;
+    if (c == NULL)
+        return;
+    pthread_mutex_lock(&compress_lock);
+    compress_finish(c);
+    pthread_mutex_unlock(&compress_lock);
+    pclient->compressed = NULL;
+    if (c->output || c->zoutput) {
+        pclient->preserved_output = c->zoutput
+            ? uncompress_data(c->zoutput, c->zoutput_length,
+                              c->output_length, 1)
+            : c->output;
+        pclient->preserved_start = 0;
+        pclient->preserved_end = c->output_length;
+        set_preserved_size(pclient, c->output_length + 1);
+    }
+    if (c->window_contents || c->zwindow) {
+        char *contents = c->zwindow
+            ? uncompress_data(c->zwindow, c->zwindow_length,
+                              c->window_length, 1)
+            : c->window_contents;
+        contents[c->window_length] = '\0';
+        pclient->saved_window_contents = contents;
+    }
+    free(c->zoutput);
+    free(c->zwindow);
+    free(c);
+    pclient->idle_since = monotonic_ns();
+}
+
+/* Free compressed data, when the session is closed. */
+void
+session_free_compressed(struct pty_client *pclient)
+{
+    struct compressed_state *c = pclient->compressed;
+    if (c == NULL)
+        return;
+    pthread_mutex_lock(&compress_lock);
+    compress_finish(c);
+    pthread_mutex_unlock(&compress_lock);
+    pclient->compressed = NULL;
+    free(c->output);
+    free(c->window_contents);
+    free(c->zoutput);
+    free(c->zwindow);
+    free(c);
+}
+
+/* If pclient's buffers are compressed (or being compressed), set *raw
+ * to their original size and *stored to the memory they use now,
+ * and return true. */
+bool
+session_compressed_sizes(struct pty_client *pclient,
+                         size_t *raw, size_t *stored)
+{
+    struct compressed_state *c = pclient->compressed;
+    if (c == NULL)
+        return false;
+    pthread_mutex_lock(&compress_lock);
+    *raw = c->output_length + c->window_length;
+    *stored = (c->zoutput ? c->zoutput_length : c->output_length)
+        + (c->zwindow ? c->zwindow_length : c->window_length);
+    pthread_mutex_unlock(&compress_lock);
+    return true;
+}
+
+/* Called from the main loop: compress sessions that have been
+ * detached and without output for memory.compress-idle seconds. */
+void
+compress_idle_sessions()
+{
+    static int64_t last_sweep;
+    int64_t now = monotonic_ns();
+    if (now - last_sweep < COMPRESS_SWEEP_NS)
+        return;
+    last_sweep = now;
+    double idle = setting_number(main_options, memory_compress_idle_opt,
+                                 DEFAULT_COMPRESS_IDLE);
+    if (idle <= 0)
+        return;
+    int64_t idle_ns = (int64_t) (idle * 1e9);
+    FOREACH_PCLIENT(pclient) {
+        if (pclient->compressed == NULL && pclient->first_tclient == NULL
+            && now - pclient->idle_since >= idle_ns
+            && ((pclient->preserved_output != NULL
+                 && pclient->preserved_end - pclient->preserved_start
+                 >= COMPRESS_MIN_SIZE)
+                || (pclient->saved_window_contents != NULL
+                    && strlen(pclient->saved_window_contents)
+                    >= COMPRESS_MIN_SIZE)))
+            compress_session(pclient);
+    }
+}
+
+/* Called by check_memory_limits when the preserved output of all
+ * sessions exceeds limit: compress detached sessions other than except,
+ * largest first, whether or not they are idle, until it doesn't.
+ * (The memory is freed when the background thread is done with it.) */
+void
+compress_for_memory(struct pty_client *except, size_t limit)
+{
+    while ((size_t) server_stats.preserved_bytes > limit) {
+        struct pty_client *largest = NULL;
+        size_t largest_length = 0;
+        FOREACH_PCLIENT(pclient) {
+            if (pclient == except || pclient->compressed != NULL
+                || pclient->first_tclient != NULL
+                || pclient->preserved_output == NULL)
+                continue;
+            size_t length = pclient->preserved_end - pclient->preserved_start;
+            if (length >= COMPRESS_MIN_SIZE && length > largest_length) {
+                largest = pclient;
+                largest_length = length;
+            }
+        }
+        if (largest == NULL)
+            break;
+        lwsl_notice("session %d: compressing %zu bytes of preserved output"
+                    " (memory limit)\n",
+                    largest->session_number, largest_length);
+        compress_session(largest);
+    }
+}
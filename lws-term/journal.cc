@@ -0,0 +1,517 @@
+/* Per-session journal of output and window-contents snapshots.
+ * If the journal.directory setting is set, each session appends
+ * the output it preserves (see backup_output) and each saved window
+ * contents snapshot to DIRECTORY/session-PID-N.journal.
+ *
+ * The file is mapped into memory (and extended as needed), so writing
+ * a record is a memcpy: no system call, and the data is still there
+ * if the server crashes.  (The session itself does not survive that:
+ * its process loses its pty.)  The journal is used to:
+ * - replay output that was dropped from memory because of a memory limit
+ *   (the "spill" stage of check_memory_limits);
+ * - restore a session's history in a new server (journal_restore);
+ * - view what a session printed, after a crash ("domterm replay FILE");
+ *   when a server starts, it renames the journals of servers that are
+ *   gone to crashed-PID-N.journal, so they are kept (journal_recover).
+ * When a journal grows beyond journal.max-size, it is compacted
+ * to the last snapshot and the output after it (or half the maximum).
+ * The journal is deleted when the session exits.
+ *
+ * File format: a 64-byte header (JOURNAL_MAGIC, then the session number
+ * and the server and child pids as 32-bit integers), followed by records.
+ * Each record is a 12-byte header - type (1 byte), 3 bytes padding,
+ * count (4 bytes: the output count, modulo MASK28, at the start
+ * of the data), length (4 bytes) - followed by length bytes of data.
+ * A zero type byte marks the end.  (The type byte of a record is
+ * written last, after the end marker following it.)
+ */
+#include "server.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+
+#define JOURNAL_MAGIC "DomTerm-journal1"
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_RECORD_HEADER 12
+#define JOURNAL_CHUNK (1 << 20) // grow the file by multiples of this
+
+enum {
+    JOURNAL_END = 0,
+    JOURNAL_OUTPUT = 'o',
+    JOURNAL_WINDOW = 'w' // data is saved window contents
+};
+
+struct journal {
+    int fd;
+    char *path;
+    char *map; // mapping of the whole file
+    size_t map_size; // size of the file and the mapping
+    size_t used; // offset of the end of the last record
+    size_t max_size;
+};
+
+struct journal_record {
+    int type;
+    long count;
+    size_t length;
+    const char *data;
+};
+
+static uint32_t
+get_u32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void
+put_u32(char *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+/* Read the record at offset *pos of a mapped journal, and advance *pos.
+ * Return false at the end (or at a damaged record). */
+static bool
+next_record(const char *map, size_t size, size_t *pos,
+            struct journal_record *rec)
+{
+    size_t p = *pos;
+    if (p + JOURNAL_RECORD_HEADER > size || map[p] == JOURNAL_END)
+        return false;
+    rec->type = (unsigned char) map[p];
+    rec->count = get_u32(map + p + 4);
+    rec->length = get_u32(map + p + 8);
+    if (rec->length > size - p - JOURNAL_RECORD_HEADER)
+        return false;
+    rec->data = map + p + JOURNAL_RECORD_HEADER;
+    *pos = p + JOURNAL_RECORD_HEADER + rec->length;
+    return true;
+}
+
+static bool
+journal_map(struct journal *j, size_t size)
+{
+    if (j->map != NULL)
+        munmap(j->map, j->map_size);
+    j->map = NULL;
+    if (ftruncate(j->fd, size) != 0)
+        return false;
+    void *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, j->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    j->map = (char *) map;
+    j->map_size = size;
+    return true;
+}
+
+static void
+journal_free(struct journal *j)
+{
+    if (j->map != NULL)
+        munmap(j->map, j->map_size);
+    if (j->fd >= 0)
+        close(j->fd);
+    free(j->path);
+    free(j);
+}
+
+static void
+write_header(struct journal *j, struct pty_client *pclient)
+{
+    memset(j->map, 0, JOURNAL_HEADER_SIZE);
+    memcpy(j->map, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+    put_u32(j->map + 16, pclient->session_number);
+    put_u32(j->map + 20, getpid());
+    put_u32(j->map + 24, pclient->pid);
+}
+
+static size_t
+journal_max_size()
+{
+    double mb = setting_number(main_options, journal_max_size_opt,
+                               DEFAULT_JOURNAL_MAX_SIZE);
+    size_t max = mb > 0 ? (size_t) (mb * 1e6) : 0;
+    return max < 2 * JOURNAL_CHUNK ? 2 * JOURNAL_CHUNK : max;
+}
+
+/* Return journal.directory (creating it if needed), or NULL if it is
+ * not set, or is not a directory that only we can write. */
+static const char *
+journal_directory()
+{
+    const char *dir = setting_string(main_options, journal_directory_opt);
+    if (dir == NULL || dir[0] == '\0')
+        return NULL;
+    mkdir(dir, 0700);
+    struct stat st;
+    if (lstat(dir, &st) != 0 || ! S_ISDIR(st.st_mode)
+        || st.st_uid != getuid() || (st.st_mode & (S_IWGRP|S_IWOTH)) != 0) {
+        lwsl_err("journal.directory %s is not a private directory"
+                 " - no journals\n", dir);
+        return NULL;
+    }
+    return dir;
+}
+
+/* Start a journal for pclient, if journal.directory is set. */
+void
+journal_start(struct pty_client *pclient)
+{
+    const char *dir = journal_directory();
+    if (dir == NULL)
+        return;
+    struct journal *j = (struct journal *) xmalloc(sizeof(struct journal));
+    j->path = challoc(strlen(dir) + 50);
+    sprintf(j->path, "%s/session-%d-%d.journal", dir, getpid(),
+            pclient->session_number);
+    // A file of that name is left over from a process with our pid.
+    // Never write through a link someone else put there.
+    unlink(j->path);
+    j->fd = open(j->path, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+    j->map = NULL;
+    j->max_size = journal_max_size();
+    if (j->fd < 0 || ! journal_map(j, JOURNAL_CHUNK)) {
+        lwsl_err("cannot create journal %s: %s\n", j->path, strerror(errno));
+        if (j->fd >= 0)
+            unlink(j->path);
+        journal_free(j);
+        return;
+    }
+    write_header(j, pclient);
+    j->used = JOURNAL_HEADER_SIZE;
+    pclient->journal = j;
+}
+
+/* Rewrite the journal, keeping the last window snapshot and the output
+ * after it - but not more than half of max_size. */
+static void
+journal_compact(struct pty_client *pclient, struct journal *j)
+{
+    size_t keep_limit = j->max_size / 2;
+    // Offsets of records, to find where to start.
+    size_t pos = JOURNAL_HEADER_SIZE, last_window = 0;
+    struct journal_record rec;
+    size_t rpos = pos;
+    while (next_record(j->map, j->used, &pos, &rec)) {
+        if (rec.type == JOURNAL_WINDOW)
+            last_window = rpos;
+        rpos = pos;
+    }
+    size_t start = last_window > 0 ? last_window : JOURNAL_HEADER_SIZE;
+    if (j->used - start > keep_limit) {
+        // Skip whole records from start until the rest fits.
+        pos = start;
+        while (j->used - pos > keep_limit
+               && next_record(j->map, j->used, &pos, &rec))
+            start = pos;
+    }
+    size_t keep = j->used - start;
+    memmove(j->map + JOURNAL_HEADER_SIZE, j->map + start, keep);
+    j->used = JOURNAL_HEADER_SIZE + keep;
+    j->map[j->used] = JOURNAL_END;
+    lwsl_notice("session %d: compacted journal to %zu bytes\n",
+                pclient->session_number, j->used);
+}
+
+static void
+journal_append(struct pty_client *pclient, int type, long count,
+               const char *data, size_t length)
+{
+    struct journal *j = pclient->journal;
+    // +1 for the end marker
+    size_t rec_size = JOURNAL_RECORD_HEADER + length + 1;
+    if (rec_size > j->max_size / 2) // a single huge record - skip it
+        return;
+    if (j->used + rec_size > j->map_size) {
+        if (j->map_size >= j->max_size)
+            journal_compact(pclient, j);
+        if (j->used + rec_size > j->map_size) {
+            size_t nsize = 2 * j->map_size;
+            if (nsize > j->max_size) // but compact before growing more
+                nsize = j->max_size;
+            if (nsize < j->used + rec_size)
+                nsize = (j->used + rec_size + JOURNAL_CHUNK - 1)
+                    & ~(size_t) (JOURNAL_CHUNK - 1);
+            if (! journal_map(j, nsize)) {
+                lwsl_err("journal %s: %s - stopped\n",
+                         j->path, strerror(errno));
+                journal_close(pclient, true);
+                return;
+            }
+        }
+    }
+    char *p = j->map + j->used;
+    memcpy(p + JOURNAL_RECORD_HEADER, data, length);
+    // The rest of the file may have old records (after journal_compact).
+    p[JOURNAL_RECORD_HEADER + length] = JOURNAL_END;
+    put_u32(p + 4, count & MASK28);
+    put_u32(p + 8, length);
+    p[0] = type; // last, so a partial record is not seen
+    j->used += JOURNAL_RECORD_HEADER + length;
+}
+
+void
+journal_output(struct pty_client *pclient, long count,
+               const char *data, size_t length)
+{
+    if (length > 0)
+        journal_append(pclient, JOURNAL_OUTPUT, count, data, length);
+}
+
+void
+journal_window_contents(struct pty_client *pclient, long count,
+                        const char *contents)
+{
+    journal_append(pclient, JOURNAL_WINDOW, count, contents,
+                   strlen(contents));
+}
+
+/* Append to out the output in records from pos to size,
+ * starting at count *want (and stopping after max bytes).
+ * Update *want to the count after the last byte appended. */
+static size_t
+gather_output(const char *map, size_t size, size_t pos, long *want,
+              size_t max, struct sbuf *out)
+{
+    size_t total = 0;
+    struct journal_record rec;
+    while (total < max && next_record(map, size, &pos, &rec)) {
+        if (rec.type != JOURNAL_OUTPUT)
+            continue;
+        size_t offset = (*want - rec.count) & MASK28;
+        if (offset >= rec.length) // already seen, or after a gap
+            continue;
+        size_t n = rec.length - offset;
+        if (n > max - total)
+            n = max - total;
+        sbuf_append(out, rec.data + offset, n);
+        *want = (*want + n) & MASK28;
+        total += n;
+    }
+    return total;
+}
+
+/* Append to out the length bytes of output starting at count.
+ * Return false (and append nothing) if not all are in the journal. */
+bool
+journal_read_output(struct pty_client *pclient, long count, size_t length,
+                    struct sbuf *out)
+{
+    struct journal *j = pclient->journal;
+    if (j == NULL || length == 0)
+        return j != NULL;
+    size_t old_len = out->len;
+    long want = count & MASK28;
+    if (gather_output(j->map, j->used, JOURNAL_HEADER_SIZE, &want,
+                      length, out) < length) {
+        out->len = old_len;
+        return false;
+    }
+    return true;
+}
+
+/* Stop journaling pclient.  If remove, delete the file;
+ * otherwise leave it for a new server (see journal_restore). */
+void
+journal_close(struct pty_client *pclient, bool remove)
+{
+    struct journal *j = pclient->journal;
+    if (j == NULL)
+        return;
+    pclient->journal = NULL;
+    if (remove)
+        unlink(j->path);
+    else if (j->map != NULL)
+        msync(j->map, j->used, MS_ASYNC);
+    journal_free(j);
+}
+
+const char *
+journal_filename(struct pty_client *pclient)
+{
+    return pclient->journal ? pclient->journal->path : NULL;
+}
+
+/* Map an existing journal file read-only.  Return NULL on error. */
+static char *
+map_journal_file(const char *path, size_t *sizep, int *fdp)
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0
+        || (size_t) st.st_size < JOURNAL_HEADER_SIZE) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED
+        || memcmp(map, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0) {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+    *sizep = st.st_size;
+    *fdp = fd;
+    return (char *) map;
+}
+
+bool
+is_journal_file(const char *path)
+{
+    size_t size;
+    int fd;
+    char *map = map_journal_file(path, &size, &fd);
+    if (map == NULL)
+        return false;
+    munmap(map, size);
+    close(fd);
+    return true;
+}
+
+/* Write the output in a journal file to out (for "domterm replay").
+ * Return the number of bytes written, or -1 on error. */
+long
+journal_replay(const char *path, FILE *out)
+{
+    size_t size;
+    int fd;
+    char *map = map_journal_file(path, &size, &fd);
+    if (map == NULL)
+        return -1;
+    long bytes = 0;
+    size_t pos = JOURNAL_HEADER_SIZE;
+    struct journal_record rec;
+    while (next_record(map, size, &pos, &rec)) {
+        if (rec.type == JOURNAL_OUTPUT) {
+            fwrite(rec.data, 1, rec.length, out);
+            bytes += rec.length;
+        }
+    }
+    munmap(map, size);
+    close(fd);
+    return bytes;
+}
+
+/* Load the history of a session from the journal at path
+ * (written by a previous server): the last window contents snapshot
+ * becomes saved_window_contents, and the output after it becomes the
+ * preserved output.  Then continue journaling pclient to the same file.
+ * Return false if the file is not a valid journal. */
+bool
+journal_restore(struct pty_client *pclient, const char *path)
+{
+    size_t size;
+    int fd;
+    char *map = map_journal_file(path, &size, &fd);
+    if (map == NULL)
+        return false;
+    size_t pos = JOURNAL_HEADER_SIZE, used = pos;
+    struct journal_record rec, window;
+    window.data = NULL;
+    long start_count = -1;
+    while (next_record(map, size, &pos, &rec)) {
+        if (rec.type == JOURNAL_WINDOW)
+            window = rec;
+        else if (rec.type == JOURNAL_OUTPUT && start_count < 0)
+            start_count = rec.count;
+        used = pos;
+    }
+    if (window.data != NULL) {
+        free(pclient->saved_window_contents);
+        char *contents = challoc(window.length + 1);
+        memcpy(contents, window.data, window.length);
+        contents[window.length] = '\0';
+        pclient->saved_window_contents = contents;
+        pclient->saved_window_sent_count = window.count;
+        start_count = window.count;
+    }
+    if (start_count >= 0) {
+        // The output from the snapshot (if any) on.
+        struct sbuf output;
+        sbuf_init(&output);
+        long want = start_count;
+        gather_output(map, used, JOURNAL_HEADER_SIZE, &want, SIZE_MAX,
+                      &output);
+        free(pclient->preserved_output);
+        pclient->preserved_output = output.buffer;
+        pclient->preserved_start = 0;
+        pclient->preserved_end = output.len;
+        pclient->preserved_sent_count = start_count;
+        set_preserved_size(pclient, output.size);
+    }
+    munmap(map, size);
+    close(fd);
+
+    // Continue writing the same file.
+    journal_close(pclient, true);
+    struct journal *j = (struct journal *) xmalloc(sizeof(struct journal));
+    j->path = xstrdup(path);
+    j->fd = open(path, O_RDWR|O_NOFOLLOW|O_CLOEXEC);
+    j->map = NULL;
+    j->max_size = journal_max_size();
+    if (j->fd < 0 || ! journal_map(j, size < JOURNAL_CHUNK ? JOURNAL_CHUNK
+                                   : size)) {
+        journal_free(j);
+        return true;
+    }
+    write_header(j, pclient);
+    j->used = used;
+    pclient->journal = j;
+    return true;
+}
+
+/* Called when the server starts: rename the journals of servers that
+ * are no longer running (because they crashed) from session-PID-N.journal
+ * to crashed-PID-N.journal, so they are neither overwritten nor mistaken
+ * for live ones, and say where they are (see "domterm replay").
+ * The server is the one in the header, not the file name: after
+ * upgrade-server, the new server continues the old server's files. */
+void
+journal_recover()
+{
+    const char *dir = journal_directory();
+    if (dir == NULL)
+        return;
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        int name_pid, snum, end = 0;
+        if (sscanf(ent->d_name, "session-%d-%d.journal%n",
+                   &name_pid, &snum, &end) != 2
+            || ent->d_name[end] != '\0')
+            continue;
+        char *path = challoc(strlen(dir) + strlen(ent->d_name) + 2);
+        sprintf(path, "%s/%s", dir, ent->d_name);
+        struct stat st;
+        size_t size;
+        int fd;
+        char *map = lstat(path, &st) == 0 && S_ISREG(st.st_mode)
+            ? map_journal_file(path, &size, &fd) : NULL;
+        if (map != NULL) {
+            int server_pid = (int) get_u32(map + 20);
+            munmap(map, size);
+            close(fd);
+            if (server_pid != getpid() && kill(server_pid, 0) != 0
+                && errno == ESRCH) {
+                char *crashed = challoc(strlen(dir) + 50);
+                sprintf(crashed, "%s/crashed-%d-%d.journal",
+                        dir, server_pid, snum);
+                if (rename(path, crashed) == 0)
+                    lwsl_warn("session %d of server %d (which crashed):"
+                              " see domterm replay %s\n",
+                              snum, server_pid, crashed);
+                free(crashed);
+            }
+        }
+        free(path);
+    }
+    closedir(d);
+}
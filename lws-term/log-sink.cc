@@ -0,0 +1,186 @@
+/* Asynchronous log output.
+ * Log lines (from lwsl_* via lws_set_log_level) are copied into a
+ * fixed-size ring buffer, and written to the log file by a background
+ * thread, so logging does not block the event loop on file I/O.
+ * The ring is a bounded lock-free queue (multiple producers, one consumer),
+ * so it is safe to log from worker threads.  If the ring is full
+ * the record is dropped and counted; the writer reports the count.
+ * The writer is only woken (sem_post) for the first record after it
+ * last looked, not for every line (see log_wake_pending).
+ * Until log_sink_start (and in forked children) lines are written
+ * synchronously.
+ */
+#include "server.h"
+#include <atomic>
+#include <semaphore.h>
+
+#define LOG_SLOTS 2048 // must be a power of 2
+#define LOG_SLOT_SIZE 512 // longer lines are truncated
+
+struct log_slot {
+    std::atomic<size_t> seq;
+    int len;
+    char text[LOG_SLOT_SIZE];
+};
+
+static struct log_slot *log_ring;
+static std::atomic<size_t> log_tail; // next slot to fill
+static size_t log_head; // next slot to write (only used by the writer)
+static std::atomic<int64_t> log_dropped;
+static int64_t log_dropped_reported;
+static FILE *log_file;
+static sem_t log_available;
+// Set by the producer that posts log_available, cleared by the writer
+// before it drains: while it is set, a wake-up is already on its way.
+static std::atomic<bool> log_wake_pending;
+static pthread_t log_thread;
+static std::atomic<bool> log_thread_running;
+static bool log_stopping;
+
+static void
+write_sync(int level, const char *line)
+{
+    char buf[50];
+    lwsl_timestamp(level, buf, sizeof(buf));
+    fprintf(log_file, "%s%s", buf, line);
+    fflush(log_file);
+}
+
+/* Write all pending records; return true if any. */
+static bool
+log_drain()
+{
+    bool any = false;
+    for (;;) {
+        struct log_slot *slot = &log_ring[log_head & (LOG_SLOTS - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != log_head + 1)
+            break;
+        fwrite(slot->text, 1, slot->len, log_file);
+        slot->seq.store(log_head + LOG_SLOTS, std::memory_order_release);
+        log_head++;
+        any = true;
+    }
+    int64_t dropped = log_dropped.load(std::memory_order_relaxed);
+    if (dropped != log_dropped_reported) {
+        fprintf(log_file, "[%lld log records dropped]\n",
+                (long long) (dropped - log_dropped_reported));
+        log_dropped_reported = dropped;
+        any = true;
+    }
+    return any;
+}
+
+static void *
+log_writer(void *)
+{
+    for (;;) {
+        while (sem_wait(&log_available) != 0 && errno == EINTR)
+            ;
+        // Records added after this wake us again.  (The exchange
+        // also makes records whose producer saw true visible.)
+        log_wake_pending.exchange(false, std::memory_order_acq_rel);
+        // Wake-ups are counted, so we may find nothing to do.
+        if (log_drain())
+            fflush(log_file);
+        if (log_stopping)
+            return NULL;
+    }
+}
+
+/* In a forked child the writer thread does not exist. */
+static void
+log_after_fork_child()
+{
+    log_thread_running.store(false);
+}
+
+void
+log_sink_emit(int level, const char *line)
+{
+    if (! log_thread_running.load(std::memory_order_acquire)) {
+        write_sync(level, line);
+        return;
+    }
+    size_t pos = log_tail.load(std::memory_order_relaxed);
+    struct log_slot *slot;
+    for (;;) {
+        slot = &log_ring[pos & (LOG_SLOTS - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (log_tail.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            log_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else
+            pos = log_tail.load(std::memory_order_relaxed);
+    }
+    lwsl_timestamp(level, slot->text, LOG_SLOT_SIZE);
+    size_t tlen = strlen(slot->text);
+    size_t llen = strlen(line);
+    if (tlen + llen > LOG_SLOT_SIZE) {
+        llen = LOG_SLOT_SIZE - tlen;
+        if (llen > 0)
+            memcpy(slot->text + tlen, line, llen - 1);
+        slot->text[LOG_SLOT_SIZE - 1] = '\n';
+    } else
+        memcpy(slot->text + tlen, line, llen);
+    slot->len = tlen + llen;
+    slot->seq.store(pos + 1, std::memory_order_release);
+    if (! log_wake_pending.exchange(true, std::memory_order_acq_rel))
+        sem_post(&log_available);
+}
+
+void
+log_sink_set_file(FILE *file)
+{
+    log_file = file;
+}
+
+/* Start the writer thread, if there is a log file. */
+void
+log_sink_start()
+{
+    if (log_file == NULL || log_thread_running.load())
+        return;
+    if (log_ring == NULL) {
+        log_ring = (struct log_slot *)
+            xmalloc(LOG_SLOTS * sizeof(struct log_slot));
+        for (size_t i = 0; i < LOG_SLOTS; i++)
+            log_ring[i].seq.store(i);
+        log_tail.store(0);
+        log_head = 0;
+        sem_init(&log_available, 0, 0);
+        pthread_atfork(NULL, NULL, log_after_fork_child);
+        atexit(log_sink_stop);
+    }
+    log_stopping = false;
+    log_wake_pending.store(false);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) == 0)
+        log_thread_running.store(true, std::memory_order_release);
+}
+
+/* Write pending records and stop the writer thread.
+ * Called before daemonizing (as threads don't survive fork) and on exit. */
+void
+log_sink_stop()
+{
+    if (! log_thread_running.load())
+        return;
+    log_thread_running.store(false);
+    log_stopping = true;
+    sem_post(&log_available);
+    pthread_join(log_thread, NULL);
+    // Records from producers that saw log_thread_running just before
+    // it was cleared.
+    log_drain();
+    fflush(log_file);
+}
+
+int64_t
+log_sink_dropped()
+{
+    return log_dropped.load(std::memory_order_relaxed);
+}
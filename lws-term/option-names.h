@@ -13,6 +13,32 @@ OPTION_S(geometry, "geometry", OPTION_MISC_TYPE)
 OPTION_S(openfile_application, "open.file.application", OPTION_MISC_TYPE)
 OPTION_S(openlink_application, "open.link.application", OPTION_MISC_TYPE)
 OPTION_S(log_file, "log.file", OPTION_STRING_TYPE)
+/** Log callbacks that take longer than this many milliseconds,
+ * and collect callback timing histograms.  Disabled if 0 or unset. */
+OPTION_S(log_slow_callback, "log.slow-callback", OPTION_NUMBER_TYPE)
+/** Record new sessions (asciicast format) to files named by this pattern:
+ * %S is replaced by the session number, %P by the server process id. */
+OPTION_S(record_file, "record.file", OPTION_STRING_TYPE)
+/** Memory budgets in megabytes, for one session and for all sessions.
+ * When exceeded, the oldest preserved output is dropped. 0 means no limit. */
+OPTION_S(memory_session_limit, "memory.session-limit", OPTION_NUMBER_TYPE)
+OPTION_S(memory_total_limit, "memory.total-limit", OPTION_NUMBER_TYPE)
+/** Compress the buffers of sessions detached and idle this many seconds. */
+OPTION_S(memory_compress_idle, "memory.compress-idle", OPTION_NUMBER_TYPE)
+/** Directory for session journals (output and window snapshots). */
+OPTION_S(journal_directory, "journal.directory", OPTION_STRING_TYPE)
+/** Compact a session's journal when it reaches this many megabytes. */
+OPTION_S(journal_max_size, "journal.max-size", OPTION_NUMBER_TYPE)
+/** While a window is being resized, pass its size on to the
+ * application at most once per this many milliseconds. */
+OPTION_S(terminal_resize_delay, "terminal.resize-delay", OPTION_NUMBER_TYPE)
+/** Number of threads for running slow commands (see service-threads.cc). */
+OPTION_S(server_command_threads, "server.command-threads", OPTION_NUMBER_TYPE)
+/** If "no", don't read pty output with io_uring (see uring.cc). */
+OPTION_S(server_io_uring, "server.io-uring", OPTION_STRING_TYPE)
+/** If "yes" (or a file name), also listen for HTTP and WebSockets
+ * on a Unix domain socket. */
+OPTION_S(server_unix_socket, "server.unix-socket", OPTION_STRING_TYPE)
 
 /* front-end options */
 OPTION_F(style_user, "style.user", OPTION_MISC_TYPE)
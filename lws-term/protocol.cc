@@ -13,9 +13,6 @@ clipboard_c* clipboard_manager = NULL;
 #define BUF_SIZE 1024
 
 #define USE_RXFLOW (LWS_LIBRARY_VERSION_NUMBER >= (2*1000000+4*1000))
-// Maximum number of unconfirmed bytes before pausing
-// Must be at least as much as "flow-confirm-every" setting.
-#define MAX_UNCONFIRMED 8000
 // Maximum number of unconfirmed bytes to continue after pausing
 // Must be at least as much as "flow-confirm-every" setting.
 #define MAX_CONTINUE 4000
@@ -34,8 +31,13 @@ static char request_contents_message[] = URGENT_WRAP("\033[81u");
 static char start_replay_mode[] = "\033[97u";
 static char end_replay_mode[] = "\033[98u";
 
-id_table<pty_client> pty_clients;
-id_table<tty_client> tty_clients;
+id_numbering client_numbering;
+id_table<pty_client> pty_clients(&client_numbering);
+id_table<tty_client> tty_clients(&client_numbering);
+string_index<pty_client> pty_clients_by_name;
+string_index<pty_client> pty_clients_by_tty;
+string_index<pty_client> pty_clients_by_pid;
+struct server_stats server_stats;
 
 static struct pty_client *
 handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client *tclient);
@@ -103,6 +105,14 @@ check_host_origin(struct lws *wsi) {
 }
 #endif
 
+void
+set_preserved_size(struct pty_client *pclient, size_t size)
+{
+    server_stats.preserved_bytes += (int64_t) size
+        - (int64_t) pclient->preserved_size;
+    pclient->preserved_size = size;
+}
+
 // Maybe remove unneeded preserved output
 void trim_preserved(struct pty_client *pclient)
 {
@@ -138,12 +148,131 @@ void trim_preserved(struct pty_client *pclient)
      pclient->preserved_end = max_unconfirmed;
      pclient->preserved_sent_count = (pclient->preserved_sent_count + unneeded) & MASK28;
      if (pclient->preserved_size >= 2 * max_unconfirmed) {
-         pclient->preserved_size = max_unconfirmed + 512;
+         set_preserved_size(pclient, max_unconfirmed + 512);
          pclient->preserved_output = (char*)
              xrealloc(pclient->preserved_output, pclient->preserved_size);
      }
 }
 
+/* Memory used by a session's buffers: preserved output, saved
+ * window contents, and the input and output buffers of its connections. */
+size_t
+session_memory(struct pty_client *pclient)
+{
+    size_t total = pclient->preserved_output ? pclient->preserved_size : 0;
+    if (pclient->saved_window_contents)
+        total += strlen(pclient->saved_window_contents);
+    size_t raw, stored;
+    if (session_compressed_sizes(pclient, &raw, &stored))
+        total += stored;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        total += tclient->ob.size + tclient->inb.size;
+    }
+    return total;
+}
+
+/* Discard the oldest preserved output, keeping at most keep bytes.
+ * A window that (re)attaches and needed the dropped output gets it
+ * from the journal if there is one, else a marker - see output_was_dropped. */
+static void
+drop_preserved(struct pty_client *pclient, size_t keep)
+{
+    size_t length = pclient->preserved_end - pclient->preserved_start;
+    if (pclient->preserved_output == NULL || length <= keep)
+        return;
+    size_t drop = length - keep;
+    if (pclient->preserved_dropped == 0
+        || pclient->dropped_end != pclient->preserved_sent_count)
+        pclient->dropped_start = pclient->preserved_sent_count;
+    memmove(pclient->preserved_output,
+            pclient->preserved_output + pclient->preserved_start + drop,
+            keep);
+    pclient->preserved_start = 0;
+    pclient->preserved_end = keep;
+    pclient->preserved_sent_count =
+        (pclient->preserved_sent_count + drop) & MASK28;
+    pclient->dropped_end = pclient->preserved_sent_count;
+    pclient->preserved_dropped += drop;
+    server_stats.preserved_dropped += drop;
+    size_t nsize = keep + (keep >> 1);
+    if (nsize < 1024)
+        nsize = 1024;
+    if (nsize < pclient->preserved_size) {
+        set_preserved_size(pclient, nsize);
+        pclient->preserved_output = (char*)
+            xrealloc(pclient->preserved_output, nsize);
+    }
+    lwsl_notice("session %d: %s %zu bytes of preserved output (memory limit)\n",
+                pclient->session_number,
+                pclient->journal ? "spilled to journal" : "dropped", drop);
+}
+
+/* True if output starting at count rcount was dropped by drop_preserved. */
+static bool
+output_was_dropped(struct pty_client *pclient, long rcount)
+{
+    return pclient->preserved_dropped > 0
+        && pclient->dropped_end == pclient->preserved_sent_count
+        && ((rcount - pclient->dropped_start) & MASK28)
+        < ((pclient->dropped_end - pclient->dropped_start) & MASK28);
+}
+
+/* Enforce the memory.session-limit and memory.total-limit settings,
+ * after pclient's preserved output has grown.  In order:
+ * - discard output no window needs (trim_preserved);
+ * - compress detached sessions (total limit only - pclient itself
+ *   has just had output, so it would be expanded again right away);
+ * - spill: drop the oldest preserved output of sessions with a journal,
+ *   which can still replay it from there (see journal.cc);
+ * - drop the oldest preserved output of other sessions.
+ * Dropping goes down to half the limit, so this doesn't happen again
+ * for a while. */
+static void
+check_memory_limits(struct pty_client *pclient)
+{
+    double session_mb = setting_number(main_options, memory_session_limit_opt,
+                                       DEFAULT_SESSION_MEMORY_LIMIT);
+    double total_mb = setting_number(main_options, memory_total_limit_opt,
+                                     DEFAULT_TOTAL_MEMORY_LIMIT);
+    size_t session_limit = session_mb > 0 ? (size_t) (session_mb * 1e6) : 0;
+    size_t total_limit = total_mb > 0 ? (size_t) (total_mb * 1e6) : 0;
+    size_t used = session_memory(pclient);
+    if (session_limit > 0 && used > session_limit) {
+        trim_preserved(pclient);
+        used = session_memory(pclient);
+    }
+    if (session_limit > 0 && used > session_limit) {
+        size_t other = used - pclient->preserved_size;
+        drop_preserved(pclient, other < session_limit / 2
+                       ? session_limit / 2 - other : 0);
+    }
+    if (total_limit == 0
+        || (size_t) server_stats.preserved_bytes <= total_limit)
+        return;
+    compress_for_memory(pclient, total_limit);
+    // Take from the sessions with the most preserved output,
+    // first those with a journal.
+    for (int spill = 1; spill >= 0; spill--) {
+        while ((size_t) server_stats.preserved_bytes > total_limit) {
+            struct pty_client *largest = NULL;
+            size_t largest_length = 0;
+            FOREACH_PCLIENT(p) {
+                if (spill && p->journal == NULL)
+                    continue;
+                size_t length = p->preserved_output == NULL ? 0
+                    : p->preserved_end - p->preserved_start;
+                if (length > largest_length) {
+                    largest = p;
+                    largest_length = length;
+                }
+            }
+            if (largest == NULL || largest_length < 1024)
+                break;
+            drop_preserved(largest, largest_length / 2);
+        }
+    }
+}
+
 bool
 should_backup_output(struct pty_client *pclient)
 {
@@ -160,15 +289,16 @@ do_exit(int exit_code, bool kill_clients)
             if (tclient->out_wsi) {
                 printf_to_browser(tclient,
                                   OUT_OF_BAND_START_STRING "\033]97;kill\007" URGENT_END_STRING);
-                lws_callback_on_writable(tclient->out_wsi);
+                wsi_writable(tclient->out_wsi);
                 wait_needed = true;
             }
         }
     }
     if (wait_needed) {
-        lws_set_timer_usecs(cmdwsi, 500 * LWS_USEC_PER_SEC/1000);
+        wsi_set_timer(cmdwsi, 500 * LWS_USEC_PER_SEC/1000);
         return;
     }
+    recordings_finish();
     force_exit = true;
     lws_cancel_service(context);
     exit(exit_code);
@@ -190,10 +320,21 @@ pclient_close(struct pty_client *pclient, bool xxtimed_out)
     lwsl_notice("exited application for session %d\n", snum);
     // stop event loop
     pclient->exit = true;
+    if (pclient->recording) {
+        recording_stop(pclient);
+        recording_drain(); // the file is complete once the session is gone
+    }
+    pty_clients_by_name.remove(pclient->session_name, pclient);
+    if (pclient->pid > 0)
+        pty_clients_by_pid.remove(pclient->pid_key, pclient);
     if (pclient->ttyname != NULL) {
+        pty_clients_by_tty.remove(pclient->ttyname, pclient);
         free(pclient->ttyname);
         pclient->ttyname = NULL;
     }
+    session_free_compressed(pclient);
+    journal_close(pclient, true);
+    uring_pty_close(pclient);
     if (pclient->saved_window_contents != NULL) {
         free(pclient->saved_window_contents);
         pclient->saved_window_contents = NULL;
@@ -201,6 +342,7 @@ pclient_close(struct pty_client *pclient, bool xxtimed_out)
     if (pclient->preserved_output != NULL) {
         free(pclient->preserved_output);
         pclient->preserved_output = NULL;
+        set_preserved_size(pclient, 0);
     }
     if (pclient->cur_pclient) {
         pclient->cur_pclient->cur_pclient = NULL;
@@ -209,7 +351,16 @@ pclient_close(struct pty_client *pclient, bool xxtimed_out)
     free((void*)pclient->argv);
 
     int status = -1;
-    if (pclient->pid > 0) {
+    if (pclient->pid > 0 && pclient->adopted) {
+        // Not our child (see upgrade.cc), so it is reaped by someone
+        // else, and the pid may have been reused - check it still
+        // owns the pty before sending a signal.
+#ifdef TIOCGSID
+        pid_t sid;
+        if (ioctl(pclient->pty, TIOCGSID, &sid) == 0 && sid == pclient->pid)
+            kill(pclient->pid, server->options.sig_code);
+#endif
+    } else if (pclient->pid > 0) {
         // kill process and free resource
         lwsl_notice("sending signal %d to process %d\n",
                     server->options.sig_code, pclient->pid);
@@ -253,7 +404,7 @@ pclient_close(struct pty_client *pclient, bool xxtimed_out)
 #endif
             }
         }
-        lws_callback_on_writable(tclient->out_wsi);
+        wsi_writable(tclient->out_wsi);
     }
 
     if (WEXITSTATUS(status) == 0xFF && connection_failure) {
@@ -309,12 +460,14 @@ unlink_tty_from_pty(struct pty_client *pclient,
         }
     }
     struct tty_client *first_tclient = pclient->first_tclient;
+    if (first_tclient == NULL)
+        pclient->idle_since = monotonic_ns();
     if ((tclient->proxyMode != proxy_command_local && first_tclient == NULL && pclient->detach_count == 0
          && (tclient->close_requested
              || ! tclient->detach_on_disconnect))
         || tclient->proxyMode == proxy_display_local) {
         lwsl_notice("- close pty pmode:%d\n", tclient->proxyMode);
-        lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_SYNC);
+        wsi_kill(pclient->pty_wsi);
     }
 
     // If only one client left, do detachSaveSend
@@ -341,6 +494,7 @@ tty_client_destroy(struct lws *wsi, struct tty_client *tclient,
     lwsl_notice("tty_client_destroy %p conn#%d keep:%d\n", tclient, tclient->connection_number, keep_client);
     sbuf_free(&tclient->inb);
     sbuf_free(&tclient->ob);
+    splice_relay_close(tclient);
     if (tclient->version_info != NULL && !keep_client) {
         free(tclient->version_info);
         tclient->version_info = NULL;
@@ -379,10 +533,19 @@ void
 link_clients(struct tty_client *tclient, struct pty_client *pclient)
 {
     tclient->pclient = pclient; // sometimes redundant
+    session_expand(pclient);
     *pclient->last_tclient_ptr = tclient;
     pclient->last_tclient_ptr = &tclient->next_tclient;
 }
 
+static void
+set_unpaused(struct pty_client *pclient)
+{
+    pclient->paused = 0;
+    pclient->paused_ns += monotonic_ns() - pclient->paused_since;
+    uring_pty_resume(pclient);
+}
+
 void link_command(struct lws *wsi, struct tty_client *tclient,
                   struct pty_client *pclient)
 {
@@ -414,8 +577,8 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
         oclient->pty_window_number = 0;
         tclient->detachSaveSend = true;
         oclient->detachSaveSend = true;
-        lws_callback_on_writable(wsi);
-        lws_callback_on_writable(oclient->out_wsi);
+        wsi_writable(wsi);
+        wsi_writable(oclient->out_wsi);
     }
     lwsl_notice("link_command wsi:%p tclient:%p pclient:%p\n",
                 wsi, tclient, pclient);
@@ -429,10 +592,11 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
 #if USE_RXFLOW
         lwsl_info("session %d unpaused (flow control)\n",
                   pclient->session_number);
-        lws_rx_flow_control(pclient->pty_wsi,
-                            1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+        if (pclient->uring == NULL)
+            wsi_rx_flow(pclient->pty_wsi,
+                        1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
 #endif
-        pclient->paused = 0;
+        set_unpaused(pclient);
     }
 }
 
@@ -454,63 +618,14 @@ void put_to_env_array(const char **arr, int max, const char* eval)
     }
 }
 
-template<typename T>
-int id_table<T>::enter(T *entry, int hint)
-{
-    int snum = 1;
-    if (hint > 0 && ! valid_index(hint) && ! T::avoid_index(hint))
-        snum = hint;
-    for (; ; snum++) {
-        if (snum >= sz) {
-            int newsize = 3 * sz >> 1;
-            if (newsize < 20)
-                newsize = 20;
-            elements = (T**) realloc(elements, newsize * sizeof(T*));
-            for (int i = sz; i < newsize; i++)
-                elements[i] = nullptr;
-            sz = newsize;
-        }
-        T*next = elements[snum];
-        if (next == NULL || next->index() > snum) {
-            if ((hint < 0 || snum != hint)
-                && T::avoid_index(snum))
-                continue;
-            // Maintain invariant
-            for (int iprev = snum;
-                 --iprev >= 0 && elements[iprev] == next; ) {
-                elements[iprev] = entry;
-            }
-            elements[snum] = entry;
-            //pclient->session_number = snum;
-            break;
-        }
-    }
-    return snum;
-}
-template<typename T>
-void id_table<T>::remove(T* entry)
-{
-    if (entry == nullptr)
-        return;
-    int index = entry->index();
-    if (! valid_index(index))
-        return;
-    T* next = elements[index+1];
-    for (; index >= 0 && elements[index] == entry; index--)
-            elements[index] = next;
-}
-
-bool
-pty_client::avoid_index(int i)
-{
-    return tty_clients.valid_index(i);
-}
+static struct pty_client *
+new_pclient(int master, int slave, char *tname, bool packet_mode, int hint,
+            const char *cmd, arglist_t argv);
 
 static struct pty_client *
 create_pclient(const char *cmd, arglist_t argv, struct options *opts,
                bool ssh_remoting, struct tty_client *t_hint)
 {
-    struct lws *outwsi;
     int master;
     int slave;
     bool packet_mode = false;
@@ -541,22 +656,60 @@ create_pclient(const char *cmd, arglist_t argv, struct options *opts,
 #endif
     char *tname = strdup(ttyname(slave));
 
+    int hint = t_hint ? t_hint->connection_number : -1;
+    if (hint > 0 &&
+        (! tty_clients.valid_index(hint) || pty_clients.valid_index(hint)))
+        hint = -1;
+    struct pty_client *pclient =
+        new_pclient(master, slave, tname, packet_mode, hint, cmd, argv);
+    if (! ssh_remoting) {
+        journal_start(pclient);
+        uring_pty_start(pclient);
+    }
+    const char *record_pattern = setting_string(opts, record_file_opt);
+    if (record_pattern && *record_pattern && ! ssh_remoting) {
+        char *fname = recording_expand_filename(record_pattern, pclient);
+        const char *err = recording_start(pclient, fname);
+        if (err)
+            lwsl_err("cannot record session %d to %s: %s\n",
+                     pclient->session_number, fname, err);
+        free(fname);
+    }
+    return pclient;
+}
+
+/* Create a pty_client for the pty master of an existing session,
+ * handed over by a previous server (see upgrade.cc).
+ * The caller sets the remaining fields. */
+struct pty_client *
+adopt_pclient(int master, char *tname, bool packet_mode, int session_number,
+              const char *cmd, arglist_t argv)
+{
+    struct pty_client *pclient =
+        new_pclient(master, -1, tname, packet_mode, session_number, cmd, argv);
+    pclient->adopted = true;
+    return pclient;
+}
+
+/* Allocate (as the user data of a new "pty" wsi for master)
+ * and initialize a pty_client. */
+static struct pty_client *
+new_pclient(int master, int slave, char *tname, bool packet_mode, int hint,
+            const char *cmd, arglist_t argv)
+{
     lws_sock_file_fd_type fd;
     fd.filefd = master;
-    //if (tclient == NULL)              return NULL;
-    outwsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd,
-                                        "pty", NULL);
+    struct lws *outwsi =
+        lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd,
+                                   "pty", NULL);
     struct pty_client *pclient = (struct pty_client *) lws_wsi_user(outwsi);
     pclient->ttyname = tname;
     pclient->uses_packet_mode = packet_mode;
     server->session_count++;
 
-    int hint = t_hint ? t_hint->connection_number : -1;
-    if (hint > 0 &&
-        (! tty_clients.valid_index(hint) || pty_clients.valid_index(hint)))
-        hint = -1;
     int snum = pty_clients.enter(pclient, hint);
     pclient->session_number = snum;
+    pty_clients_by_tty.add(tname, pclient);
 
     pclient->pid = -1;
     pclient->pty = master;
@@ -568,8 +721,22 @@ create_pclient(const char *cmd, arglist_t argv, struct options *opts,
     pclient->pixw = -1;
     pclient->detach_count = 0;
     pclient->paused = 0;
+    pclient->bytes_read = 0;
+    pclient->pause_count = 0;
+    pclient->resize_pending = false;
+    pclient->resized_at = 0;
+    pclient->paused_ns = 0;
+    pclient->paused_since = 0;
+    pclient->reconnect_count = 0;
+    pclient->recording = NULL;
     pclient->saved_window_contents = NULL;
     pclient->preserved_output = NULL;
+    pclient->preserved_size = 0;
+    pclient->preserved_dropped = 0;
+    pclient->compressed = NULL;
+    pclient->journal = NULL;
+    pclient->uring = NULL;
+    pclient->idle_since = monotonic_ns();
     pclient->preserve_mode = 1;
     pclient->first_tclient = NULL;
     pclient->last_tclient_ptr = &pclient->first_tclient;
@@ -580,6 +747,7 @@ create_pclient(const char *cmd, arglist_t argv, struct options *opts,
     pclient->is_ssh_pclient = false;
     pclient->has_primary_window = false;
     pclient->uses_packet_mode = false;
+    pclient->adopted = false;
     pclient->pty_wsi = outwsi;
     pclient->cmd = cmd;
     pclient->argv = copy_strings(argv);
@@ -711,6 +879,8 @@ run_command(const char *cmd, arglist_t argv, const char*cwd,
             close(slave);
 
             pclient->pid = pid;
+            snprintf(pclient->pid_key, sizeof(pclient->pid_key), "%d", pid);
+            pty_clients_by_pid.add(pclient->pid_key, pclient);
             if (pclient->nrows >= 0)
                setWindowSize(pclient);
             // lws_change_pollfd ??
@@ -724,30 +894,37 @@ run_command(const char *cmd, arglist_t argv, const char*cwd,
 struct pty_client *
 find_session(const char *specifier)
 {
-    struct pty_client *session = NULL;
-    char *pend;
-    pid_t pid = strtol(specifier, &pend, 10);
-    if (*pend != '\0' || *specifier == '\0')
-        pid = -1;
-
-    FOREACH_PCLIENT(pclient) {
-        int match = 0;
-        if (pclient->pid == pid && pid != -1)
-            return pclient;
-        if (pclient->session_name != NULL
-            && strcmp(specifier, pclient->session_name) == 0)
-            match = 1;
-        else if ((specifier[0] == '#' || specifier[0] == ':'/*DEPRECATED*/)
-                 && strtol(specifier+1, NULL, 10) == pclient->session_number)
-          match = 1;
-        if (match) {
-          if (session != NULL)
-            return NULL; // ambiguous
-          else
-            session = pclient;
-        }
-    }
-    return session;
+    struct pty_client *by_pid = pty_clients_by_pid.find(specifier);
+    if (by_pid != NULL)
+        return by_pid;
+    int nfound;
+    struct pty_client *session = pty_clients_by_name.find(specifier, &nfound);
+    if (specifier[0] == '#' || specifier[0] == ':'/*DEPRECATED*/) {
+        struct pty_client *numbered =
+            pty_clients(strtol(specifier+1, NULL, 10));
+        if (numbered != NULL && numbered != session) {
+            session = numbered;
+            nfound++;
+        }
+    }
+    return nfound == 1 ? session : NULL; // NULL if none or ambiguous
+}
+
+/** Find the session whose ttyname matches tname,
+ * which is terminated by ';' or the end of the string. */
+struct pty_client *
+find_session_by_tty(const char *tname)
+{
+    const char *semi = strchr(tname, ';');
+    if (semi == NULL)
+        return pty_clients_by_tty.find(tname);
+    size_t tlen = semi - tname;
+    char *tbuf = challoc(tlen + 1);
+    memcpy(tbuf, tname, tlen);
+    tbuf[tlen] = '\0';
+    struct pty_client *pclient = pty_clients_by_tty.find(tbuf);
+    free(tbuf);
+    return pclient;
 }
 
 static char localhost_localdomain[] = "localhost.localdomain";
@@ -950,16 +1127,24 @@ handle_tlink(const char *tmplate, json_object *obj)
     return r;
 }
 
-static void
+void
 backup_output(struct pty_client *pclient, char *data_start, int data_length)
 {
+    session_expand(pclient);
+    pclient->idle_since = monotonic_ns();
     if (pclient->preserved_output == NULL) {
         pclient->preserved_start = PRESERVE_MIN;
         pclient->preserved_end = 0;
-        pclient->preserved_size = 0;
+        set_preserved_size(pclient, 0);
     }
+    if (pclient->journal)
+        journal_output(pclient,
+                       pclient->preserved_sent_count
+                       + (pclient->preserved_end - pclient->preserved_start),
+                       data_start, data_length);
     size_t needed = pclient->preserved_end + data_length;
-    if (needed > pclient->preserved_size) {
+    bool grew = needed > pclient->preserved_size;
+    if (grew) {
         size_t nsize = (3 * pclient->preserved_size) >> 1;
         if (nsize < 1024)
             nsize = 1024;
@@ -967,18 +1152,21 @@ backup_output(struct pty_client *pclient, char *data_start, int data_length)
             nsize = needed;
         char * nbuffer = (char *) xrealloc(pclient->preserved_output, nsize);
         pclient->preserved_output = nbuffer;
-        pclient->preserved_size = nsize;
+        set_preserved_size(pclient, nsize);
     }
     memcpy(pclient->preserved_output + pclient->preserved_end,
            data_start, data_length);
     pclient->preserved_end += data_length;
+    // Only check when the buffer grew, which is rare.
+    if (grew)
+        check_memory_limits(pclient);
 }
 
 void
 handle_link(json_object *obj)
 {
     if (json_object_object_get_ex(obj, "filename", NULL)) {
-        const char *tmplate = get_setting(main_options->settings, "open.file.application");
+        const char *tmplate = setting_string(main_options, openfile_application_opt);
         if (tmplate == NULL)
             tmplate =
               "{in-atom}{with-position|!.html}atom;"
@@ -988,7 +1176,7 @@ handle_link(json_object *obj)
         if (handle_tlink(tmplate, obj))
             return;
     }
-    const char *tmplate = get_setting(main_options->settings, "open.link.application");
+    const char *tmplate = setting_string(main_options, openlink_application_opt);
     if (tmplate == NULL)
         tmplate = "{!mailto:}browser;{!mailto:}chrome;{!mailto:}firefox";
     handle_tlink(tmplate, obj);
@@ -1008,7 +1196,40 @@ reconnect(struct lws *wsi, struct tty_client *client,
     link_command(wsi, client, pclient);
     printf_to_browser(client,
                       URGENT_WRAP("\033[99;95u\033]72;<p><i>(Attempting reconnect to %s using ssh.)</i></p>\007"), host_arg);
-    lws_callback_on_writable(client->out_wsi);
+    wsi_writable(client->out_wsi);
+}
+
+/* Pass the window size of pclient (nrows etc) on to its pty
+ * (which sends SIGWINCH to the application) and recording,
+ * and tell its windows. */
+static void
+apply_window_size(struct pty_client *pclient)
+{
+    pclient->resize_pending = false;
+    pclient->resized_at = monotonic_ns();
+    server_stats.resize_applied++;
+    if (pclient->pty >= 0)
+        setWindowSize(pclient);
+    if (pclient->recording)
+        recording_resize(pclient);
+    bool need_backup = should_backup_output(pclient);
+    FOREACH_WSCLIENT(wclient, pclient) {
+        if (wclient->out_wsi != NULL) {
+            int olen = wclient->ob.len;
+            printf_to_browser(wclient,
+                              OUT_OF_BAND_START_STRING "\027"
+                              "\033[8;%d;%d;%dt"
+                              URGENT_END_STRING,
+                              pclient->nrows, pclient->ncols, 8);
+            int n = wclient->ob.len - olen;
+            wclient->ocount += n;
+            wsi_writable(wclient->out_wsi);
+            if (need_backup) {
+                backup_output(pclient, wclient->ob.buffer + olen, n);
+                need_backup = false;
+            }
+        }
+    }
 }
 
 /** Handle an "event" encoded in the stream from the browser.
@@ -1034,31 +1255,37 @@ reportEvent(const char *name, char *data, size_t dlen,
             && client->is_primary_window
             && sscanf(data, "%d %d %g %g", &pclient->nrows, &pclient->ncols,
                       &pclient->pixh, &pclient->pixw) == 4) {
-          if (pclient->pty >= 0)
-            setWindowSize(pclient);
-          bool need_backup = should_backup_output(pclient);
-          FOREACH_WSCLIENT(wclient, pclient) {
-              if (wclient->out_wsi != NULL) {
-                  int olen = wclient->ob.len;
-                  printf_to_browser(wclient,
-                                    OUT_OF_BAND_START_STRING "\027"
-                                    "\033[8;%d;%d;%dt"
-                                    URGENT_END_STRING,
-                                    pclient->nrows, pclient->ncols, 8);
-                  int n = wclient->ob.len - olen;
-                  wclient->ocount += n;
-                  lws_callback_on_writable(wclient->out_wsi);
-                  if (need_backup) {
-                      backup_output(pclient, wclient->ob.buffer + olen, n);
-                      need_backup = false;
-                  }
-              }
-          }
+            server_stats.resize_events++;
+            // While the window is being resized (for example by dragging
+            // a pane splitter) only apply one size per resize-delay,
+            // and then the latest, from the LWS_CALLBACK_TIMER.
+            int64_t delay = (int64_t)
+                (setting_number(main_options, terminal_resize_delay_opt,
+                                DEFAULT_RESIZE_DELAY) * 1e6);
+            int64_t now = monotonic_ns();
+            if (pclient->resize_pending
+                && now - pclient->resized_at < 2 * delay)
+                return true; // timer still to come
+            int64_t remaining = pclient->resized_at + delay - now;
+            if (proxyMode == no_proxy && remaining > 0) {
+                pclient->resize_pending = true;
+                wsi_set_timer(wsi, remaining / 1000);
+            } else
+                apply_window_size(pclient);
         }
     } else if (strcmp(name, "VERSION") == 0) {
         char *version_info = challoc(dlen+1);
         strcpy(version_info, data);
         client->version_info = version_info;
+        json_object *vobj = json_tokener_parse(data);
+        json_object *jframing = NULL;
+        client->framed_output = vobj != NULL
+            && json_object_object_get_ex(vobj, "framing", &jframing)
+            && json_object_get_int(jframing) >= FRAMED_OUTPUT_VERSION;
+        json_object_put(vobj);
+        client->framed_in_control = false;
+        client->framed_output_acked = false;
+        client->settings_sent = -1; // new page has no settings yet
         if (proxyMode == proxy_display_local)
             return false;
         client->initialized = 0;
@@ -1074,7 +1301,7 @@ reportEvent(const char *name, char *data, size_t dlen,
             free((void*)pclient->argv); pclient->argv = NULL;
         }
         if (pclient->saved_window_contents != NULL)
-            lws_callback_on_writable(wsi);
+            wsi_writable(wsi);
     } else if (strcmp(name, "RECEIVED") == 0) {
         if (proxyMode == proxy_display_local)
             return false;
@@ -1087,10 +1314,11 @@ reportEvent(const char *name, char *data, size_t dlen,
             lwsl_info("session %d unpaused (flow control) (sent:%ld confirmed:%ld)\n",
                       pclient->session_number,
                       client->sent_count, client->confirmed_count);
-            lws_rx_flow_control(pclient->pty_wsi,
-                                1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+            if (pclient->uring == NULL)
+                wsi_rx_flow(pclient->pty_wsi,
+                            1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
 #endif
-            pclient->paused = 0;
+            set_unpaused(pclient);
         }
         if (pclient != NULL)
             trim_preserved(pclient);
@@ -1119,7 +1347,7 @@ reportEvent(const char *name, char *data, size_t dlen,
         if (isCanon && kstr0 != 3 && kstr0 != 4 && kstr0 != 26) {
             printf_to_browser(client, OUT_OF_BAND_WRAP("\033]%d;%.*s\007"),
                               isEchoing ? 74 : 73, (int) dlen, data);
-            lws_callback_on_writable(wsi);
+            wsi_writable(wsi);
         } else {
             int to_drain = 0;
             if (pclient->paused) {
@@ -1152,32 +1380,35 @@ reportEvent(const char *name, char *data, size_t dlen,
         int klen = json_object_get_string_len(obj);
         char *session_name = challoc(klen+1);
         strcpy(session_name, kstr);
-        if (pclient->session_name)
+        if (pclient->session_name) {
+            pty_clients_by_name.remove(pclient->session_name, pclient);
             free(pclient->session_name);
+        }
         pclient->session_name = session_name;
+        pty_clients_by_name.add(session_name, pclient);
         pclient->session_name_unique = true;
         json_object_put(obj);
-        FOREACH_PCLIENT(p) {
-            if (p != pclient && p->session_name != NULL
-                && strcmp(session_name, p->session_name) == 0) {
-                struct pty_client *pp = p;
+        int nsame;
+        pty_clients_by_name.find(session_name, &nsame);
+        if (nsame > 1) {
+            // Update the windows of all the sessions with this name.
+            struct pty_client **same = (struct pty_client **)
+                xmalloc(nsame * sizeof(struct pty_client *));
+            nsame = pty_clients_by_name.find_all(session_name, same, nsame);
+            for (int i = 0; i < nsame; i++) {
+                struct pty_client *p = same[i];
                 p->session_name_unique = false;
-                for (;;) {
-                    FOREACH_WSCLIENT(t, pp) {
-                        t->pty_window_update_needed = true;
-                        lws_callback_on_writable(t->out_wsi);
-                    }
-                    if (! pclient->session_name_unique || pp == pclient)
-                        break;
-                    pp = pclient;
+                FOREACH_WSCLIENT(t, p) {
+                    t->pty_window_update_needed = true;
+                    wsi_writable(t->out_wsi);
                 }
-                pclient->session_name_unique = false;
             }
+            free(same);
         }
     } else if (strcmp(name, "SESSION-NUMBER-ECHO") == 0) {
         struct options *options = client->options;
         if (proxyMode == proxy_display_local && options) {
-            set_setting(&options->cmd_settings, REMOTE_SESSIONNUMBER_KEY, data);
+            set_cmd_setting(options, REMOTE_SESSIONNUMBER_KEY, data);
         }
         return true;
     } else if (strcmp(name, "OPEN-WINDOW") == 0) {
@@ -1196,7 +1427,7 @@ reportEvent(const char *name, char *data, size_t dlen,
             geom[glen] = 0;
             if (! options)
                 client->options = options = link_options(NULL);
-            set_setting(&options->cmd_settings, "geometry", geom);
+            set_cmd_setting(options, "geometry", geom);
         }
         const char* url = !data[0] || (data[0] == '#' && g0 == data + 1) ? NULL
             : data;
@@ -1246,7 +1477,7 @@ reportEvent(const char *name, char *data, size_t dlen,
                               json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN));
             free(clipText);
             json_object_put(jobj);
-            lws_callback_on_writable(wsi);
+            wsi_writable(wsi);
         }
 #endif
     } else if (strcmp(name, "WINDOW-CONTENTS") == 0) {
@@ -1265,6 +1496,8 @@ reportEvent(const char *name, char *data, size_t dlen,
         pclient->saved_window_contents = strdup(q+1);
         client->requesting_contents = 0;
         pclient->saved_window_sent_count = rcount;
+        if (pclient->journal)
+            journal_window_contents(pclient, rcount, q+1);
         trim_preserved(pclient);
     } else if (strcmp(name, "LOG") == 0) {
         static bool note_written = false;
@@ -1281,7 +1514,7 @@ reportEvent(const char *name, char *data, size_t dlen,
         const char *kstr = json_object_get_string(obj);
         FOREACH_WSCLIENT(t, pclient) {
             printf_to_browser(t, URGENT_WRAP("%s"), kstr);
-            lws_callback_on_writable(t->out_wsi);
+            wsi_writable(t->out_wsi);
         }
         json_object_put(obj);
     } else if (strcmp(name, "RECONNECT") == 0) {
@@ -1312,8 +1545,14 @@ void init_tclient_struct(struct tty_client *client)
     client->close_requested = false;
     client->close_expected = false;
     client->detach_on_disconnect = true;
+    client->framed_output = false;
+    client->framed_in_control = false;
+    client->framed_output_acked = false;
     client->detachSaveSend = false;
     client->uploadSettingsNeeded = true;
+    client->settings_sent = -1;
+    client->ob_read_time = 0;
+    client->bytes_written = 0;
     client->requesting_contents = 0;
     client->wsi = NULL;
     client->out_wsi = NULL;
@@ -1330,15 +1569,33 @@ void init_tclient_struct(struct tty_client *client)
     client->connection_number = -1;
     client->pty_window_number = -1;
     client->pty_window_update_needed = false;
+    client->splice_pipe[0] = client->splice_pipe[1] = -1;
+    client->splice_copy_pipe[0] = client->splice_copy_pipe[1] = -1;
+    client->splice_pending = 0;
+    client->splice_disabled = false;
     client->ssh_connection_info = NULL;
     client->next_tclient = NULL;
     lwsl_notice("init_tclient_struct conn#%d\n",  client->connection_number);
 }
 
+/* A new session may share its number with a connection
+ * (the one it is created for), unless the connection already
+ * belongs to a session. */
+bool
+pty_client::avoid_index(int i)
+{
+    struct tty_client *tclient = tty_clients(i);
+    return tclient != NULL && tclient->pclient != NULL;
+}
+
+/* A new connection may share its number with its own session,
+ * or with a session that has no windows yet (that it is for). */
 bool
 tty_client::avoid_index(int i)
 {
-    return pty_clients.valid_index(i);
+    struct pty_client *session = pty_clients(i);
+    return session != NULL && session != pclient
+        && session->first_tclient != NULL;
 }
 
 static void
@@ -1366,7 +1623,7 @@ handle_input(struct lws *wsi, struct tty_client *client,
         pclient->recent_tclient = client;
     // FIXME handle PENDING
     int start = 0;
-    lwsl_info("handle_input len:%zu conn#%d pmode:%d pty:%d\n", clen, client->connection_number, proxyMode, pclient==NULL? -99 : pclient->pty);
+    lwsl_hot("handle_input len:%zu conn#%d pmode:%d pty:%d\n", clen, client->connection_number, proxyMode, pclient==NULL? -99 : pclient->pty);
     for (int i = 0; ; i++) {
         if (i+1 == clen && msg[i] >= 128)
             break;
@@ -1427,6 +1684,78 @@ handle_input(struct lws *wsi, struct tty_client *client,
     return 0;
 }
 
+static void
+append_frame(struct sbuf *out, char kind, const char *data, size_t len)
+{
+    unsigned char *hdr = (unsigned char *) sbuf_blank(out, 5);
+    hdr[0] = kind;
+    hdr[1] = (len >> 24) & 0xFF;
+    hdr[2] = (len >> 16) & 0xFF;
+    hdr[3] = (len >> 8) & 0xFF;
+    hdr[4] = len & 0xFF;
+    sbuf_append(out, data, len);
+}
+
+/* Convert output (as written for the in-band protocol) into typed records.
+ * Each OUT_OF_BAND_START_STRING ... URGENT_END_STRING sequence becomes
+ * a FRAME_KIND_CONTROL record; everything else is passed through
+ * unchanged as FRAME_KIND_DATA.  If a control message is not terminated
+ * in this buffer, *in_control is set, and the rest of the message
+ * (in a later buffer) is terminated by a FRAME_KIND_CONTROL_END record.
+ */
+static void
+frame_output(struct sbuf *out, const char *data, size_t len, bool *in_control)
+{
+    sbuf_extend(out, len + 16);
+    out->buffer[out->len++] = (char) FRAMED_OUTPUT_PREFIX;
+    const char *end = data + len;
+    while (data < end) {
+        if (*in_control) {
+            const char *stop = (const char *)
+                memchr(data, URGENT_END_STRING[0], end - data);
+            if (stop == NULL) {
+                append_frame(out, FRAME_KIND_DATA, data, end - data);
+                break;
+            }
+            append_frame(out, FRAME_KIND_CONTROL_END, data, stop - data);
+            *in_control = false;
+            data = stop + 1;
+            continue;
+        }
+        const char *start = (const char *)
+            memchr(data, OUT_OF_BAND_START_STRING[0], end - data);
+        if (start == NULL) {
+            append_frame(out, FRAME_KIND_DATA, data, end - data);
+            break;
+        }
+        if (start > data)
+            append_frame(out, FRAME_KIND_DATA, data, start - data);
+        start++;
+        const char *stop = (const char *)
+            memchr(start, URGENT_END_STRING[0], end - start);
+        if (stop == NULL) {
+            append_frame(out, FRAME_KIND_CONTROL_BEGIN, start, end - start);
+            *in_control = true;
+            break;
+        }
+        append_frame(out, FRAME_KIND_CONTROL, start, stop - start);
+        data = stop + 1;
+    }
+}
+
+/* True if unframed output ends inside a control message. */
+static bool
+ends_in_control(const char *data, size_t len)
+{
+    for (size_t i = len; i > 0; i--) {
+        if (data[i-1] == URGENT_END_STRING[0])
+            return false;
+        if (data[i-1] == OUT_OF_BAND_START_STRING[0])
+            return true;
+    }
+    return false;
+}
+
 static int
 handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_proxy)
 {
@@ -1453,8 +1782,7 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
                 if (client->out_wsi && client->out_wsi != client->wsi) {
                     lwsl_notice("set_timeout clear tc:%p\n", client->wsi);
                     client->close_expected = true;
-                    lws_set_timeout(client->wsi,
-                                    PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_SYNC);
+                    wsi_kill(client->wsi);
                 }
                 client->out_wsi = NULL;
                 maybe_daemonize();
@@ -1474,6 +1802,12 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         }
     }
 
+    // Output spliced to the proxy (but not yet written) goes first.
+    if (to_proxy && ! splice_relay_flush(client)) {
+        wsi_writable(client->out_wsi);
+        return 0;
+    }
+
     lwsl_info("handle_output conn#%d initialized:%d pmode:%d len0:%zu pty_up_n:%d\n", client->connection_number, client->initialized, proxyMode, client->ob.len, client->pty_window_update_needed);
     bool nonProxy = proxyMode != proxy_command_local && proxyMode != proxy_display_local;
     struct sbuf buf;
@@ -1483,11 +1817,18 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         sbuf_blank(bufp, LWS_PRE);
     if (client->uploadSettingsNeeded) { // proxyMode != proxy_local ???
         client->uploadSettingsNeeded = false;
-        if (settings_as_json != NULL) {
+        if (settings_delta_json != NULL && proxyMode == no_proxy
+            && client->settings_sent == settings_delta_base) {
+            sbuf_printf(bufp, URGENT_WRAP("\033]87;%s\007"),
+                        settings_delta_json);
+        } else if (settings_as_json != NULL) {
             sbuf_printf(bufp, URGENT_WRAP("\033]89;%s\007"),
                         settings_as_json);
         }
+        client->settings_sent = settings_counter;
     }
+    if (client->initialized < 2 && pclient)
+        session_expand(pclient);
     if (client->initialized == 0 && proxyMode != proxy_command_local) {
         if (client->options && client->options->cmd_settings) {
             //json_object_put(client->cmd_settings);
@@ -1524,11 +1865,30 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         long read_count = pclient->preserved_sent_count + (pend - pstart);
         long rcount = client->sent_count;
         long unconfirmed = (read_count - rcount - client->ocount) & MASK28;
-        if (unconfirmed > 0 && pend - pstart >= unconfirmed) {
-            pstart = pend - unconfirmed;
+        long available = pend - pstart;
+        // If output was dropped because of a memory limit, say so
+        // and replay what is left.
+        long lost = unconfirmed > available
+            && output_was_dropped(pclient, rcount)
+            ? unconfirmed - available : 0;
+        if (unconfirmed > 0 && available + lost >= unconfirmed) {
+            pstart = pend - (unconfirmed - lost);
+            // Output dropped from memory may still be in the journal.
+            struct sbuf spilled;
+            sbuf_init(&spilled);
+            if (lost > 0
+                && ! journal_read_output(pclient,
+                                         (read_count - unconfirmed) & MASK28,
+                                         lost, &spilled))
+                sbuf_printf(bufp,
+                            URGENT_WRAP("\033[7m[%ld bytes of output dropped (memory limit)]\033[m\r\n"),
+                            lost);
             sbuf_append(bufp, start_replay_mode, -1);
+            if (spilled.len > 0)
+                sbuf_append(bufp, spilled.buffer, spilled.len);
+            sbuf_free(&spilled);
             sbuf_append(bufp, pclient->preserved_output+pstart,
-                        (int) unconfirmed);
+                        (int) (unconfirmed - lost));
             sbuf_append(bufp, end_replay_mode, -1);
             rcount += unconfirmed;
         }
@@ -1598,16 +1958,56 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         }
         // data in tclient->ob.
         size_t n = write(client->proxy_fd_out, bufp->buffer, bufp->len);
+        if ((ssize_t) n > 0)
+            client->bytes_written += n;
         lwsl_notice("proxy RAW_WRITEABLE %d len:%zu written:%zu pclient:%p\n",
                     client->proxy_fd_out, bufp->len, n, client->pclient);
     } else {
         struct lws *wsi = client->wsi;
         int written = bufp->len - LWS_PRE;
-        lwsl_info("tty SERVER_WRITEABLE conn#%d written:%d sent: %ld to %p\n", client->connection_number, written, (long) client->sent_count, wsi);
-        if (written > 0
-            && lws_write(wsi, (unsigned char*) bufp->buffer+LWS_PRE,
-                         written, LWS_WRITE_BINARY) != written)
-            lwsl_err("lws_write\n");
+        lwsl_hot("tty SERVER_WRITEABLE conn#%d written:%d sent: %ld to %p\n", client->connection_number, written, (long) client->sent_count, wsi);
+        // The framing flags share a word with bitfields that other
+        // threads change (holding the lock), so copy them first.
+        bool framed = client->framed_output && client->framed_output_acked;
+        bool in_control = client->framed_in_control;
+        if (client->framed_output && ! client->framed_output_acked
+            && written > 0
+            && ! ends_in_control(bufp->buffer + LWS_PRE, written)) {
+            // Agree to framing, after the (unframed) output so far.
+            sbuf_printf(bufp, FRAMED_OUTPUT_ACK, FRAMED_OUTPUT_VERSION);
+            client->framed_output_acked = true;
+            written = bufp->len - LWS_PRE;
+        }
+        {
+            // Framing and lws_write (including TLS) only use bufp and
+            // this wsi, so worker threads can run meanwhile.
+            service_unlock unlock;
+            if (framed && written > 0) {
+                struct sbuf fbuf;
+                sbuf_init(&fbuf);
+                sbuf_blank(&fbuf, LWS_PRE);
+                frame_output(&fbuf, bufp->buffer + LWS_PRE, written,
+                             &in_control);
+                sbuf_free(bufp);
+                *bufp = fbuf;
+                written = bufp->len - LWS_PRE;
+            }
+            if (written > 0
+                && lws_write(wsi, (unsigned char*) bufp->buffer+LWS_PRE,
+                             written, LWS_WRITE_BINARY) != written)
+                lwsl_err("lws_write\n");
+        }
+        client->framed_in_control = in_control;
+        if (written > 0) {
+            client->bytes_written += written;
+            server_stats.ws_frames_written++;
+            server_stats.ws_bytes_written += written;
+        }
+        if (client->ob_read_time != 0 && written > 0) {
+            histogram_add(&server_stats.output_latency,
+                          (monotonic_ns() - client->ob_read_time) / 1000);
+            client->ob_read_time = 0;
+        }
     }
     sbuf_free(bufp);
     return to_proxy && client->pclient == NULL ? -1 : 0;
@@ -1654,11 +2054,12 @@ callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
 {
     struct tty_client *tclient = (struct tty_client *) user;
     struct pty_client *pclient = tclient == NULL ? NULL : tclient->pclient;
+    callback_timer timer(CALLBACK_PROXY, reason, pclient, tclient);
     ssize_t n;
     if (tclient==NULL)
-        lwsl_info("callback_proxy wsi:%p reason:%d - no client\n", wsi, reason);
+        lwsl_hot("callback_proxy wsi:%p reason:%d - no client\n", wsi, reason);
     else
-        lwsl_info("callback_proxy wsi:%p reason:%d fd:%d conn#%d\n", wsi, reason, tclient==NULL? -99 : tclient->proxy_fd_in, tclient->connection_number);
+        lwsl_hot("callback_proxy wsi:%p reason:%d fd:%d conn#%d\n", wsi, reason, tclient==NULL? -99 : tclient->proxy_fd_in, tclient->connection_number);
     switch (reason) {
     case LWS_CALLBACK_RAW_CLOSE_FILE:
         lwsl_notice("proxy RAW_CLOSE_FILE\n");
@@ -1675,8 +2076,8 @@ callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
             if (output_interval) {
                 lwsl_info("- CALLBACK_TIMER send ping\n");
                 printf_to_browser(tclient, URGENT_WRAP(""));
-                lws_callback_on_writable(tclient->out_wsi);
-                lws_set_timer_usecs(tclient->out_wsi, output_interval * (LWS_USEC_PER_SEC / 1000));
+                wsi_writable(tclient->out_wsi);
+                wsi_set_timer(tclient->out_wsi, output_interval * (LWS_USEC_PER_SEC / 1000));
             }
         }
         return 0;
@@ -1690,14 +2091,14 @@ callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
         if (tclient->proxyMode == proxy_remote && tclient->options) {
             long input_timeout = tclient->options->remote_input_timeout;
             if (input_timeout)
-                lws_set_timer_usecs(tclient->wsi, input_timeout * (LWS_USEC_PER_SEC / 1000));
+                wsi_set_timer(tclient->wsi, input_timeout * (LWS_USEC_PER_SEC / 1000));
         }
         // read data, send to
         sbuf_extend(&tclient->inb, 1024);
         n = read(tclient->proxy_fd_in,
                          tclient->inb.buffer + tclient->inb.len,
                          tclient->inb.size - tclient->inb.len);
-        lwsl_info("proxy RAW_RX_FILE n:%ld avail:%zu-%zu\n",
+        lwsl_hot("proxy RAW_RX_FILE n:%ld avail:%zu-%zu\n",
                     (long) n, tclient->inb.size, tclient->inb.len);
         if (n <= 0) {
             return n < 0 && errno == EAGAIN ? 0 : -1;
@@ -1723,10 +2124,15 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
 {
     struct tty_client *client = WSI_GET_TCLIENT(wsi);
     struct pty_client *pclient = client == NULL ? NULL : client->pclient;
-    lwsl_info("callback_tty %p reason:%d conn#%d\n", wsi, (int) reason,
+    callback_timer timer(CALLBACK_TTY, reason, pclient, client);
+    lwsl_hot("callback_tty %p reason:%d conn#%d\n", wsi, (int) reason,
               client == NULL ? -1 : client->connection_number);
 
     switch (reason) {
+    case LWS_CALLBACK_TIMER: // see reportEvent
+        if (pclient != NULL && pclient->resize_pending)
+            apply_window_size(pclient);
+        break;
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
         lwsl_notice("callback_tty FILTER_PROTOCOL_CONNECTION\n");
         if (server->options.once && ! NO_TCLIENTS) {
@@ -1832,10 +2238,12 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
             }
 
             if (reconnect_value >= 0) {
+                if (pclient != NULL)
+                    pclient->reconnect_count++;
                 client->confirmed_count = reconnect_value;
                 client->sent_count = reconnect_value; // FIXME
                 client->initialized = 1;
-                lws_callback_on_writable(wsi);
+                wsi_writable(wsi);
             }
         }
         if (client->connection_number < 0)
@@ -1951,7 +2359,7 @@ make_proxy(struct options *options, struct pty_client *pclient, enum proxy_mode
         pout_lws = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd, "proxy-out", NULL);
         lws_set_wsi_user(pout_lws, tclient);
         lwsl_notice("- make_proxy out-conn#%d wsi:%p\n", tclient->connection_number, pout_lws);
-        lws_rx_flow_control(pout_lws, 0);
+        wsi_rx_flow(pout_lws, 0);
     }
     tclient->wsi = pin_lws;
     tclient->out_wsi = pout_lws;
@@ -2045,7 +2453,7 @@ display_session(struct options *options, struct pty_client *pclient,
         else
             printf_to_browser(tclient, URGENT_WRAP("\033]%d;%d,%s\007"),
                                -port, paneOp, url);
-        lws_callback_on_writable(tclient->out_wsi);
+        wsi_writable(tclient->out_wsi);
     } else {
         char *encoded = port == -104 || port == -105
             ? url_encode(url, 0)
@@ -2068,13 +2476,20 @@ display_session(struct options *options, struct pty_client *pclient,
             sbuf_printf(&sb, ";window=%d", wnum);
             if (options->headless)
                 sbuf_printf(&sb, ";headless=true");
-            const char *verbosity = get_setting(options->settings, "log.js-verbosity");
+            if (ws_socket_name != NULL) {
+                // For front-ends that can connect to it (Electron)
+                char *encoded_socket = url_encode(ws_socket_name, 0);
+                sbuf_printf(&sb, ";unix-socket=%s",
+                            encoded_socket ? encoded_socket : ws_socket_name);
+                free(encoded_socket);
+            }
+            const char *verbosity = setting_string(options, log_js_verbosity_opt);
             if (verbosity) // as OPTION_NUMBER_TYPE does not need encoding
                 sbuf_printf(&sb, ";js-verbosity=%s", verbosity);
-            const char *js_string_max = get_setting(options->settings, "log.js-string-max");
+            const char *js_string_max = setting_string(options, log_js_string_max_opt);
             if (js_string_max) // as OPTION_NUMBER_TYPE does not need encoding
                 sbuf_printf(&sb, ";log-string-max=%s", js_string_max);
-            const char *log_to_server = get_setting(options->settings, "log.js-to-server");
+            const char *log_to_server = setting_string(options, log_js_to_server_opt);
             if (log_to_server && (strcmp(log_to_server, "yes") == 0
                                   || strcmp(log_to_server, "true") == 0
                                   || strcmp(log_to_server, "both") == 0)) {
@@ -2110,6 +2525,11 @@ int new_action(int argc, arglist_t argv,
           return EXIT_FAILURE;
         skip = optind;
     }
+    if (upgrade_pending) {
+        // It wouldn't be handed over (see upgrade.cc).
+        printf_error(opts, "domterm: the server is being upgraded - try again");
+        return EXIT_FAILURE;
+    }
     arglist_t args = argc == skip ? default_command(opts) : (argv+skip);
     const char *argv0 = args[0];
     const char *cmd = find_in_path(argv0);
@@ -2122,10 +2542,11 @@ int new_action(int argc, arglist_t argv,
     struct pty_client *pclient = create_pclient(cmd, args, opts, false, NULL);
     int r = display_session(opts, pclient, NULL, http_port);
     if (r == EXIT_FAILURE) {
-        lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_SYNC);
+        wsi_kill(pclient->pty_wsi);
     }
     else if (opts->session_name) {
         pclient->session_name = strdup(opts->session_name);
+        pty_clients_by_name.add(pclient->session_name, pclient);
         opts->session_name = NULL;
     }
     return r;
@@ -2172,7 +2593,7 @@ int attach_action(int argc, arglist_t argv, struct lws *wsi, struct options *opt
     }
     if (requesting == NULL && (requesting = pclient->first_tclient) != NULL) {
         requesting->requesting_contents = 1;
-        lws_callback_on_writable(requesting->out_wsi);
+        wsi_writable(requesting->out_wsi);
     }
     lwsl_notice("reattach sess:%ld rcoud:%ld\n", pclient->session_number, rcount);
     if (is_reattach) {
@@ -2207,30 +2628,11 @@ request_upload_settings()
     struct tty_client *tclient;
     FORALL_WSCLIENT(tclient) {
         tclient->uploadSettingsNeeded = true;
-        lws_callback_on_writable(tclient->wsi);
+        wsi_writable(tclient->wsi);
     }
 }
 
 #if REMOTE_SSH
-static bool
-word_matches(const char *p1, const char *p2)
-{
-    if (p1 == p2)
-        return true;
-    if (! p1 || ! p2)
-        return false;
-    for (;;) {
-        char c1 = *p1++;
-        char c2 = *p2++;
-        bool end1 = c1 == '\0' || c1 == ';';
-        bool end2 = c2 == '\0' || c2 == ';';
-        if (end1 && end2)
-            return true;
-        if (end1 || end2 || c1 != c2)
-            return false;
-    }
-}
-
 struct test_host_data {
     const char *host;
 };
@@ -2317,7 +2719,7 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
     } else {
         host_spec = strdup(host_arg);
     }
-    const char *ssh_cmd = get_setting(opts->settings, "command.ssh");
+    const char *ssh_cmd = setting_string(opts, command_ssh_opt);
     char *ssh_expanded = expand_host_conditional(ssh_cmd, host_spec);
     static const char *ssh_default = "ssh";
     if (ssh_expanded == NULL)
@@ -2331,7 +2733,7 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
         free((void*)ssh_args);
         return NULL;
     }
-    const char *domterm_cmd = get_setting(opts->settings, "command.remote-domterm");
+    const char *domterm_cmd = setting_string(opts, command_remote_domterm_opt);
     char *dt_expanded = expand_host_conditional(domterm_cmd, host_spec);
     if (dt_expanded == NULL)
         dt_expanded = strdup("domterm");
@@ -2361,12 +2763,10 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
             tn += 5;
             // char *semi = strchr(tn, ';');
             lwsl_notice("remote tty:%s\n", tn);
-            FOREACH_PCLIENT(p) {
-                if (word_matches(p->ttyname, tn)) {
-                    lwsl_notice("- matches pty #%d pty:%d\n", p->session_number, p->pty);
-                    cur_pclient = p;
-                    break;
-                }
+            struct pty_client *p = find_session_by_tty(tn);
+            if (p != NULL) {
+                lwsl_notice("- matches pty #%d pty:%d\n", p->session_number, p->pty);
+                cur_pclient = p;
             }
         }
         //char *tn = strstr(
@@ -2403,8 +2803,8 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
         pclient->preserve_mode = 0;
         char tbuf[20];
         sprintf(tbuf, "%d", pclient->session_number);
-        set_setting(&opts->cmd_settings, LOCAL_SESSIONNUMBER_KEY, tbuf);
-        set_setting(&opts->cmd_settings, REMOTE_HOSTUSER_KEY, host_spec);
+        set_cmd_setting(opts, LOCAL_SESSIONNUMBER_KEY, tbuf);
+        set_cmd_setting(opts, REMOTE_HOSTUSER_KEY, host_spec);
         lwsl_notice("handle_remote pcl:%p\n", pclient);
         if (tclient == NULL)
             make_proxy(opts, pclient, proxy_command_local);
@@ -2435,6 +2835,9 @@ handle_command(int argc, arglist_t argv, struct lws *wsi, struct options *opts)
     struct command *command = argc == 0 ? NULL : find_command(argv0);
     if (command != NULL) {
         lwsl_notice("handle command '%s'\n", command->name);
+        if ((command->options & COMMAND_OFFLOAD) != 0
+            && offload_command(command, argc, argv, wsi, opts))
+            return EXIT_WAIT; // finished by the worker
         return (*command->action)(argc, argv, wsi, opts);
     }
     if (strchr(argv0, '@') != NULL || strncmp(argv0, "ssh://", 6) == 0) {
@@ -2450,9 +2853,30 @@ handle_command(int argc, arglist_t argv, struct lws *wsi, struct options *opts)
     return 0;
 }
 
+static ssize_t
+read_pty_output(struct pty_client *pclient, int fd, char *buf, size_t length)
+{
+    if (pclient->uring != NULL && fd == pclient->pty)
+        return uring_pty_read(pclient, buf, length);
+    server_stats.pty_read_syscalls++;
+    return read(fd, buf, length);
+}
+
+/* Value for handle_process_output to return when read returned n <= 0:
+ * close on end of file or an error, but not if there was nothing to read
+ * (yet), or if the read was interrupted. */
+static int
+read_failed(ssize_t n)
+{
+    return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+}
+
 int
 handle_process_output(struct lws *wsi, struct pty_client *pclient,
                       int fd_in, struct stderr_client *stderr_client) {
+            int spliced;
+            if (fd_in == pclient->pty && splice_relay_output(pclient, &spliced))
+                return spliced;
             long min_unconfirmed = LONG_MAX;
             int avail = INT_MAX;
             int tclients_seen = 0;
@@ -2486,15 +2910,19 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                               pclient->session_number, min_unconfirmed,
                               last_sent_count,
                               last_confirmed_count);
-                    lws_rx_flow_control(wsi, 0|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+                    wsi_rx_flow(wsi, 0|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
 #endif
                     pclient->paused = 1;
+                    pclient->paused_since = monotonic_ns();
+                    pclient->pause_count++;
+                    server_stats.pause_count++;
                 }
                 return 0;
             }
             if (avail >= eof_len) {
                 char *data_start = NULL;
                 int data_length = 0, read_length = 0;
+                int64_t read_time = 0;
                 FOREACH_WSCLIENT(tclient, pclient) {
                     if (! tclient->out_wsi)
                         continue;
@@ -2507,10 +2935,10 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                             // it's safe to access data_start[-1].
                             char save_byte = data_start[-1];
                             n = read(fd_in, data_start-1, avail+1);
-                            lwsl_info("RAW_RX pty %d session %d read %ld tclient#%d a\n",
+                            lwsl_hot("RAW_RX pty %d session %d read %ld tclient#%d a\n",
                                       fd_in, pclient->session_number, (long) n, tclient->connection_number);
-                            if (n == 0)
-                                return -1;
+                            if (n <= 0)
+                                return read_failed(n);
                             char pcmd = data_start[-1];
                             data_start[-1] = save_byte;
 #if TIOCPKT_IOCTL
@@ -2536,12 +2964,13 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                                 read_length = n > 0 ? n - 1 : n;
 #endif
                         } else {
-                            n = read(fd_in, data_start, avail);
-                            lwsl_info("RAW_RX pty %d session %d read %ld tclient#%d\n",
+                            n = read_pty_output(pclient, fd_in,
+                                                data_start, avail);
+                            lwsl_hot("RAW_RX pty %d session %d read %ld tclient#%d\n",
                                       fd_in, pclient->session_number,
                                       (long) n, tclient->connection_number);
-                            if (n == 0)
-                                return -1;
+                            if (n <= 0)
+                                return read_failed(n);
                             read_length = n;
                         }
                         data_length += read_length;
@@ -2551,7 +2980,19 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                     }
                     tclient->ob.len += data_length;
                     tclient->ocount += read_length;
-                    lws_callback_on_writable(tclient->out_wsi);
+                    if (read_length > 0 && tclient->ob_read_time == 0
+                        && tclient->proxyMode == no_proxy) {
+                        if (read_time == 0)
+                            read_time = monotonic_ns();
+                        tclient->ob_read_time = read_time;
+                    }
+                    wsi_writable(tclient->out_wsi);
+                }
+                if (read_length > 0) {
+                    pclient->bytes_read += read_length;
+                    server_stats.pty_bytes_read += read_length;
+                    if (pclient->recording)
+                        recording_output(pclient, data_start, read_length);
                 }
                 if (should_backup_output(pclient)) {
                     backup_output(pclient, data_start, data_length);
@@ -2564,10 +3005,18 @@ int
 callback_pty(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
     struct pty_client *pclient = (struct pty_client *) user;
+    callback_timer timer(CALLBACK_PTY, reason, pclient, NULL);
     switch (reason) {
     case LWS_CALLBACK_RAW_RX_FILE: {
-            lwsl_info("callback_pty LWS_CALLBACK_RAW_RX_FILE wsi:%p len:%zu\n",
+            lwsl_hot("callback_pty LWS_CALLBACK_RAW_RX_FILE wsi:%p len:%zu\n",
                       wsi, len);
+            if (upgrade_handed_off || upgrade_pending) {
+                // Being handed over: the new server reads it
+                // once the old one lets go (see upgrade.cc).
+                wsi_rx_flow(wsi, 0);
+                return 0;
+            }
+
             struct tty_client *tclient = pclient->first_tclient;
             if (pclient->is_ssh_pclient
                 && tclient && tclient->options
@@ -2605,6 +3054,8 @@ extern int
 callback_ssh_stderr(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
     struct stderr_client *sclient = (struct stderr_client *) user;
+    callback_timer timer(CALLBACK_SSH_STDERR, reason,
+                         sclient ? sclient->pclient : NULL, NULL);
     switch (reason) {
     case LWS_CALLBACK_RAW_RX_FILE: {
         struct pty_client *pclient = sclient->pclient;
@@ -2622,7 +3073,7 @@ callback_ssh_stderr(struct lws *wsi, enum lws_callback_reasons reason, void *use
                     json_object *jstr = json_object_new_string_len(buf, nr);
                     printf_to_browser(tclient, URGENT_WRAP("\033]232;%s\007"),
                                       json_object_to_json_string(jstr));
-                    lws_callback_on_writable(tclient->out_wsi);
+                    wsi_writable(tclient->out_wsi);
                     json_object_put(jstr);
                 }
                 free(buf);
@@ -0,0 +1,373 @@
+/* Recording the output of a session, in asciicast (version 2) format.
+ * See https://docs.asciinema.org/manual/asciicast/v2/
+ * Each line after the header is [TIME, "o", DATA] for output,
+ * or [TIME, "r", "COLSxROWS"] for a resize.
+ *
+ * Records are formatted into a per-session buffer on the event loop;
+ * full buffers (and idle ones, see flush_recordings) are handed to a
+ * background thread that does the actual writes.
+ */
+#include "server.h"
+#include <time.h>
+
+#define RECORDING_BUFFER_SIZE 65536
+#define RECORDING_IDLE_FLUSH_NS 1000000000 // 1 second
+
+struct recording {
+    int fd;
+    char *filename;
+    int64_t start_time; // monotonic_ns() when started
+    int64_t last_submit; // monotonic_ns() when buf was last submitted
+    struct sbuf buf;
+    // Incomplete UTF-8 sequence at the end of the previous output chunk.
+    unsigned char partial[4];
+    int npartial;
+};
+
+int recording_count = 0;
+
+/* Background writer.
+ * A job writes data to fd (if len > 0) and then closes fd if close_fd. */
+struct write_job {
+    struct write_job *next;
+    int fd;
+    bool close_fd;
+    char *data;
+    size_t len;
+};
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_idle = PTHREAD_COND_INITIALIZER;
+static bool writer_busy = false; // writing a job (not on the queue)
+static struct write_job *jobs_first = NULL, **jobs_last = &jobs_first;
+static pid_t writer_pid = -1; // process the writer thread is running in
+
+static void *
+recording_writer(void *)
+{
+    pthread_mutex_lock(&writer_lock);
+    for (;;) {
+        while (jobs_first == NULL)
+            pthread_cond_wait(&writer_cond, &writer_lock);
+        struct write_job *job = jobs_first;
+        jobs_first = job->next;
+        if (jobs_first == NULL)
+            jobs_last = &jobs_first;
+        writer_busy = true;
+        pthread_mutex_unlock(&writer_lock);
+        const char *p = job->data;
+        size_t len = job->len;
+        while (len > 0) {
+            ssize_t n = write(job->fd, p, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            p += n;
+            len -= n;
+        }
+        if (job->close_fd)
+            close(job->fd);
+        free(job->data);
+        free(job);
+        pthread_mutex_lock(&writer_lock);
+        writer_busy = false;
+        if (jobs_first == NULL)
+            pthread_cond_broadcast(&writer_idle);
+    }
+    return NULL;
+}
+
+static void
+submit_write(int fd, struct sbuf *buf, bool close_fd)
+{
+    struct write_job *job = (struct write_job *)
+        xmalloc(sizeof(struct write_job));
+    job->next = NULL;
+    job->fd = fd;
+    job->close_fd = close_fd;
+    job->len = buf->len;
+    job->data = buf->buffer; // job takes ownership
+    sbuf_init(buf);
+    pthread_mutex_lock(&writer_lock);
+    // Threads don't survive fork (for example daemon), so (re)start
+    // the writer the first time it is needed in this process.
+    if (writer_pid != getpid()) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, recording_writer, NULL) == 0) {
+            pthread_detach(thread);
+            writer_pid = getpid();
+        }
+    }
+    *jobs_last = job;
+    jobs_last = &job->next;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+}
+
+static void
+recording_submit(struct recording *rec, bool close_fd)
+{
+    rec->last_submit = monotonic_ns();
+    submit_write(rec->fd, &rec->buf, close_fd);
+}
+
+static void
+append_time(struct recording *rec)
+{
+    sbuf_printf(&rec->buf, "[%.6f, ",
+                (monotonic_ns() - rec->start_time) * 1e-9);
+}
+
+/* Append bytes as a JSON string body, replacing invalid UTF-8 by U+FFFD.
+ * Return the number of trailing bytes that may start an incomplete
+ * UTF-8 sequence (and were not appended). */
+static size_t
+append_json_chars(struct sbuf *buf, const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+    while (p < end) {
+        unsigned char ch = *p;
+        if (ch < 0x80) {
+            if (ch == '"' || ch == '\\') {
+                char esc[2] = { '\\', (char) ch };
+                sbuf_append(buf, esc, 2);
+            } else if (ch < 0x20 || ch == 0x7f)
+                sbuf_printf(buf, "\\u%04x", ch);
+            else
+                sbuf_append(buf, (const char *) p, 1);
+            p++;
+            continue;
+        }
+        int n = ch >= 0xF0 && ch < 0xF5 ? 4
+            : ch >= 0xE0 && ch < 0xF0 ? 3
+            : ch >= 0xC2 && ch < 0xE0 ? 2
+            : 0;
+        if (n == 0) {
+            sbuf_append(buf, "\xEF\xBF\xBD", 3);
+            p++;
+            continue;
+        }
+        // The second byte is restricted, to exclude overlong forms,
+        // surrogates (ED A0..BF) and values above U+10FFFF.
+        unsigned char lo = ch == 0xE0 ? 0xA0 : ch == 0xF0 ? 0x90 : 0x80;
+        unsigned char hi = ch == 0xED ? 0x9F : ch == 0xF4 ? 0x8F : 0xBF;
+        int i = 1;
+        if (p + 1 < end && p[1] >= lo && p[1] <= hi) {
+            i = 2;
+            while (i < n && p + i < end && (p[i] & 0xC0) == 0x80)
+                i++;
+        }
+        if (i < n) {
+            if (p + i == end)
+                return end - p; // incomplete - maybe completed later
+            sbuf_append(buf, "\xEF\xBF\xBD", 3);
+            p += i;
+            continue;
+        }
+        sbuf_append(buf, (const char *) p, n);
+        p += n;
+    }
+    return 0;
+}
+
+void
+recording_output(struct pty_client *pclient, const char *data, size_t len)
+{
+    struct recording *rec = pclient->recording;
+    if (rec == NULL || len == 0)
+        return;
+    append_time(rec);
+    sbuf_append(&rec->buf, "\"o\", \"", 6);
+    const unsigned char *p = (const unsigned char *) data;
+    struct sbuf joined;
+    sbuf_init(&joined);
+    if (rec->npartial > 0) {
+        // Prepend the incomplete sequence left from the previous chunk.
+        sbuf_append(&joined, (const char *) rec->partial, rec->npartial);
+        sbuf_append(&joined, data, len);
+        p = (const unsigned char *) joined.buffer;
+        len = joined.len;
+        rec->npartial = 0;
+    }
+    size_t left = append_json_chars(&rec->buf, p, len);
+    if (left > 0) {
+        memcpy(rec->partial, p + len - left, left);
+        rec->npartial = left;
+    }
+    sbuf_free(&joined);
+    sbuf_append(&rec->buf, "\"]\n", 3);
+    if (rec->buf.len >= RECORDING_BUFFER_SIZE)
+        recording_submit(rec, false);
+}
+
+void
+recording_resize(struct pty_client *pclient)
+{
+    struct recording *rec = pclient->recording;
+    if (rec == NULL)
+        return;
+    append_time(rec);
+    sbuf_printf(&rec->buf, "\"r\", \"%dx%d\"]\n",
+                pclient->ncols, pclient->nrows);
+}
+
+/* Open filename and start recording pclient to it.
+ * If resume_ns >= 0, continue a recording (made by an old server)
+ * that has been going for resume_ns: append to the file, without a
+ * header unless it is empty.  Otherwise replace the file.
+ * Returns NULL on success, or an error message (strerror). */
+static const char *
+recording_open(struct pty_client *pclient, const char *filename,
+               int64_t resume_ns)
+{
+    if (pclient->recording != NULL)
+        recording_stop(pclient);
+    int fd = open(filename,
+                  O_WRONLY|O_CREAT|O_CLOEXEC
+                  |(resume_ns >= 0 ? O_APPEND : O_TRUNC), 0600);
+    if (fd < 0)
+        return strerror(errno);
+    struct recording *rec = (struct recording *)
+        xmalloc(sizeof(struct recording));
+    rec->fd = fd;
+    rec->filename = xstrdup(filename);
+    rec->start_time = monotonic_ns() - (resume_ns > 0 ? resume_ns : 0);
+    rec->last_submit = monotonic_ns();
+    rec->npartial = 0;
+    sbuf_init(&rec->buf);
+    if (resume_ns < 0 || lseek(fd, 0, SEEK_END) == 0) {
+        json_object *header = json_object_new_object();
+        json_object_object_add(header, "version", json_object_new_int(2));
+        json_object_object_add(header, "width",
+                               json_object_new_int(pclient->ncols > 0 ? pclient->ncols : 80));
+        json_object_object_add(header, "height",
+                               json_object_new_int(pclient->nrows > 0 ? pclient->nrows : 24));
+        json_object_object_add(header, "timestamp",
+                               json_object_new_int64((int64_t) time(NULL)));
+        if (pclient->session_name)
+            json_object_object_add(header, "title",
+                                   json_object_new_string(pclient->session_name));
+        sbuf_printf(&rec->buf, "%s\n",
+                    json_object_to_json_string_ext(header, JSON_C_TO_STRING_PLAIN));
+        json_object_put(header);
+    }
+    pclient->recording = rec;
+    recording_count++;
+    lwsl_notice("session %d: recording to %s\n",
+                pclient->session_number, filename);
+    return NULL;
+}
+
+/* Start recording pclient to filename, replacing any existing file.
+ * Returns NULL on success, or an error message (strerror). */
+const char *
+recording_start(struct pty_client *pclient, const char *filename)
+{
+    return recording_open(pclient, filename, -1);
+}
+
+/* Continue a recording of pclient, started elapsed_ns ago
+ * (see recording_elapsed) by the old server, during an upgrade. */
+const char *
+recording_resume(struct pty_client *pclient, const char *filename,
+                 int64_t elapsed_ns)
+{
+    return recording_open(pclient, filename,
+                          elapsed_ns >= 0 ? elapsed_ns : 0);
+}
+
+/* How long pclient has been recorded, or -1 if it isn't. */
+int64_t
+recording_elapsed(struct pty_client *pclient)
+{
+    struct recording *rec = pclient->recording;
+    return rec ? monotonic_ns() - rec->start_time : -1;
+}
+
+void
+recording_stop(struct pty_client *pclient)
+{
+    struct recording *rec = pclient->recording;
+    if (rec == NULL)
+        return;
+    if (rec->npartial > 0) {
+        append_time(rec);
+        sbuf_printf(&rec->buf, "\"o\", \"\xEF\xBF\xBD\"]\n");
+    }
+    recording_submit(rec, true);
+    lwsl_notice("session %d: stopped recording to %s\n",
+                pclient->session_number, rec->filename);
+    free(rec->filename);
+    free(rec);
+    pclient->recording = NULL;
+    recording_count--;
+}
+
+/* Wait until the background writer has written (and closed)
+ * everything submitted so far. */
+void
+recording_drain()
+{
+    pthread_mutex_lock(&writer_lock);
+    while (writer_pid == getpid() && (jobs_first != NULL || writer_busy))
+        pthread_cond_wait(&writer_idle, &writer_lock);
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/* Stop all recordings, and wait until they have been written,
+ * before the server exits (or hands its sessions to a new one). */
+void
+recordings_finish()
+{
+    FOREACH_PCLIENT(pclient) {
+        recording_stop(pclient);
+    }
+    recording_drain();
+}
+
+/* Called from the main loop: hand off output that has been waiting
+ * for a while, so the file is reasonably up to date. */
+void
+flush_recordings()
+{
+    int64_t now = monotonic_ns();
+    FOREACH_PCLIENT(pclient) {
+        struct recording *rec = pclient->recording;
+        if (rec != NULL && rec->buf.len > 0
+            && now - rec->last_submit >= RECORDING_IDLE_FLUSH_NS)
+            recording_submit(rec, false);
+    }
+}
+
+const char *
+recording_filename(struct pty_client *pclient)
+{
+    return pclient->recording ? pclient->recording->filename : NULL;
+}
+
+/* Expand a record.file pattern: %S is the session number,
+ * %P the server's process id, %% a literal '%'. */
+char *
+recording_expand_filename(const char *pattern, struct pty_client *pclient)
+{
+    struct sbuf sb;
+    sbuf_init(&sb);
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '%' && p[1] == 'S') {
+            sbuf_printf(&sb, "%d", pclient->session_number);
+            p++;
+        } else if (*p == '%' && p[1] == 'P') {
+            sbuf_printf(&sb, "%d", getpid());
+            p++;
+        } else if (*p == '%' && p[1] == '%') {
+            sbuf_append(&sb, "%", 1);
+            p++;
+        } else
+            sbuf_append(&sb, p, 1);
+    }
+    char *result = sbuf_strdup(&sb);
+    sbuf_free(&sb);
+    return result;
+}
@@ -2,9 +2,17 @@
 #include "command-connect.h"
 
 #include <sys/file.h>
+#include <netinet/in.h>
 #include <regex.h>
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 extern char **environ;
 
+#ifndef CONTEXT_PORT_NO_LISTEN_SERVER
+#define CONTEXT_PORT_NO_LISTEN_SERVER CONTEXT_PORT_NO_LISTEN
+#endif
+
 #ifndef DEFAULT_SHELL
 #define DEFAULT_SHELL "/bin/bash"
 #endif
@@ -15,27 +23,21 @@ static char *default_size = NULL;
 struct lws *cmdwsi = NULL;
 
 static void make_html_file(int);
-static char *make_socket_name(bool);
 
 /** Returns a fresh copy of the (non-empty) geometry string, or NULL. */
 static const char *
 geometry_option(struct options *options)
 {
-    const char *geometry = get_setting(options->settings, "geometry");
+    const char *geometry = setting_string(options, geometry_opt);
     return geometry && geometry[0] ? geometry : default_size;
 }
 
 static FILE *_logfile = NULL;
-static void lwsl_emit_stderr_with_flush(int level, const char * line) {
-    char buf[50];
-    lwsl_timestamp(level, buf, sizeof(buf));
-    fprintf(_logfile, "%s%s", buf, line);
-    fflush(_logfile);
-}
 
 static void
 daemonize()
 {
+    log_sink_stop(); // the writer thread would not survive the fork
 #if 1
     if (daemon(1, 0) != 0)
         lwsl_err("daemonizing failed\n");
@@ -43,6 +45,7 @@ daemonize()
     if (lws_daemonize(NULL))
         lwsl_err("daemonizing failed\n");
 #endif
+    log_sink_start();
 }
 
 void
@@ -199,24 +202,92 @@ struct lws_context *context;
 struct tty_server *server;
 int http_port;
 struct lws_vhost *vhost;
+struct lws_vhost *unix_vhost; // NULL unless server.unix-socket is set
+int http_listeners[MAX_HTTP_LISTENERS]; // listening sockets of vhost
+int http_listener_count;
+int unix_listener = -1; // listening socket of unix_vhost
 struct lws *focused_wsi = NULL;
 struct lws_context_creation_info info;
 struct cmd_client *cclient;
 
+bool callback_timing_enabled = false;
+static int64_t slow_callback_threshold_ns;
+static struct histogram *callback_histograms[CALLBACK_KINDS][CALLBACK_REASONS];
+const char *callback_kind_names[CALLBACK_KINDS] = {
+    "http", "tty", "pty", "cmd", "proxy", "ssh-stderr", "uring"
+};
+
+void
+set_callback_timing(double threshold_ms)
+{
+    callback_timing_enabled = threshold_ms > 0;
+    slow_callback_threshold_ns = (int64_t) (threshold_ms * 1e6);
+}
+
+struct histogram *
+callback_histogram(int kind, int reason)
+{
+    return callback_histograms[kind][reason];
+}
+
+void
+callback_timer::begin(int kind, int reason, struct pty_client *pclient,
+                      struct tty_client *tclient)
+{
+    this->kind = kind;
+    this->reason = reason < 0 || reason >= CALLBACK_REASONS
+        ? CALLBACK_REASONS - 1 : reason;
+    session = pclient ? pclient->session_number : -1;
+    connection = tclient ? tclient->connection_number : -1;
+    start = monotonic_ns();
+}
+
+void
+callback_timer::done()
+{
+    int64_t elapsed = monotonic_ns() - start;
+    struct histogram *h = callback_histograms[kind][reason];
+    if (h == NULL) {
+        h = (struct histogram *) xmalloc(sizeof(struct histogram));
+        memset(h, 0, sizeof(struct histogram));
+        callback_histograms[kind][reason] = h;
+    }
+    histogram_add(h, elapsed / 1000);
+    if (elapsed >= slow_callback_threshold_ns) {
+        lwsl_warn("slow callback_%s reason:%d session#%d conn#%d: %.3fms\n",
+                  callback_kind_names[kind], reason, session, connection,
+                  elapsed * 1e-6);
+#if HAVE_SYS_SDT_H
+        DTRACE_PROBE5(domterm, slow__callback, kind, reason,
+                      session, connection, elapsed);
+#endif
+    }
+}
+
+/* Callbacks are wrapped by locked_callback (see service-threads.h). */
 static const struct lws_protocols protocols[] = {
         /* http server for (mostly) static data */
-        {"http-only", callback_http, sizeof(struct http_client),  0},
+        {"http-only", locked_callback<callback_http>, sizeof(struct http_client),  0},
 
         /* websockets server for communicating with browser */
-        {"domterm",   callback_tty,
+        {"domterm",   locked_callback<callback_tty>,
          BROKEN_LWS_SET_WSI_USER ? sizeof(struct tty_client*) : 0,  0},
 
         /* callbacks for pty I/O, one pty for each session (process) */
-        {"pty",       callback_pty,  sizeof(struct pty_client),  0},
+        {"pty",       locked_callback<callback_pty>,  sizeof(struct pty_client),  0},
 
         /* Unix domain socket for client to send to commands to server.
            This is the listener socket on the server. */
-        {"cmd",       callback_cmd,  sizeof(struct cmd_client),  0},
+        {"cmd",       locked_callback<callback_cmd>,  sizeof(struct cmd_client),  0},
+
+        /* http listening sockets (see listen_on); accepted
+           connections are adopted by the vhost. */
+        {"http-listen", locked_callback<callback_http_listen>, 0,  0},
+
+        /* connection between old and new server during
+           "upgrade-server" (see upgrade.cc) */
+        {"upgrade",   locked_callback<callback_upgrade>,
+         sizeof(struct upgrade_client),  0},
 
 #if REMOTE_SSH
         /*
@@ -236,14 +307,19 @@ static const struct lws_protocols protocols[] = {
           while "proxy-out" wraps output), but they share the same
           "user-data", the same tty_client instance.
         */
-        { "proxy", callback_proxy, sizeof(struct tty_client),  0},
-        { "proxy-out", callback_proxy, 0,  0},
-        { "ssh-stderr", callback_ssh_stderr, sizeof(struct stderr_client), 0 },
+        { "proxy", locked_callback<callback_proxy>, sizeof(struct tty_client),  0},
+        { "proxy-out", locked_callback<callback_proxy>, 0,  0},
+        { "ssh-stderr", locked_callback<callback_ssh_stderr>, sizeof(struct stderr_client), 0 },
+#endif
+
+#if HAVE_LIBURING
+        /* completions of io_uring reads of ptys (see uring.cc) */
+        {"uring",      locked_callback<callback_uring>,  0,  0},
 #endif
 
 #if HAVE_INOTIFY
         /* calling back for "inotify" to watch settings.ini */
-        {"inotify",    callback_inotify,  0,  0},
+        {"inotify",    locked_callback<callback_inotify>,  0,  0},
 #endif
 
         {NULL,        NULL,          0,                          0}
@@ -299,6 +375,7 @@ static struct lws_http_mount mount_domterm_zip = {
 #define SESSION_NAME_OPTION 2007
 #define SETTINGS_FILE_OPTION 2008
 #define TTY_PACKET_MODE_OPTION 2009
+#define UPGRADE_FD_OPTION 2010
 #define PANE_OPTIONS_START 2100
 /* offsets from PANE_OPTIONS_START match 'N' in '\e[90;Nu' command */
 #define PANE_OPTION (PANE_OPTIONS_START+1)
@@ -349,6 +426,7 @@ static const struct option options[] = {
         {"browser-pipe", no_argument,       NULL, BROWSER_PIPE_OPTION},
 #endif
         {"socket-name",  required_argument, NULL, 'L'},
+        {"upgrade-fd",   required_argument, NULL, UPGRADE_FD_OPTION},
         {"interface",    required_argument, NULL, 'i'},
         {"credential",   required_argument, NULL, 'c'},
         {"uid",          required_argument, NULL, 'u'},
@@ -480,7 +558,7 @@ const char *
 chrome_command(bool app_mode, struct options *options)
 {
     bool free_needed = false;
-    const char *chrome_cmd = get_setting(options->settings, "command.chrome");
+    const char *chrome_cmd = setting_string(options, command_chrome_opt);
     if (chrome_cmd == NULL && (chrome_cmd = getenv("CHROME_BIN")) != NULL
         && access(chrome_cmd, X_OK) == 0) {
         const char *c = maybe_quote_arg(chrome_cmd);
@@ -528,7 +606,7 @@ chrome_command(bool app_mode, struct options *options)
 const char *
 firefox_browser_command(struct options *options)
 {
-    const char *firefox_cmd = get_setting(options->settings, "command.firefox");
+    const char *firefox_cmd = setting_string(options, command_firefox_opt);
     if (firefox_cmd != NULL)
         return firefox_cmd;
     if (is_WindowsSubsystemForLinux())
@@ -606,7 +684,7 @@ static char *
 electron_command(struct options *options)
 {
     char *epath_free_needed = NULL;
-    const char *epath = get_setting(options->settings, "command.electron");
+    const char *epath = setting_string(options, command_electron_opt);
     if (epath == NULL) {
         char *ppath = find_in_path("electron");
         if (ppath == NULL && is_WindowsSubsystemForLinux())
@@ -714,7 +792,7 @@ do_run_browser(struct options *options, const char *url, int port)
     }
     bool do_electron = false, do_Qt = false;
     if (browser_specifier == NULL && port_specified < 0) {
-        const char *default_frontend = get_setting(options->settings, "frontend.default");
+        const char *default_frontend = setting_string(options, default_frontend_opt);
         if (default_frontend == NULL)
             default_frontend = "electron;qt;chrome-app;firefox;browser";
         const char *p = default_frontend;
@@ -809,7 +887,7 @@ do_run_browser(struct options *options, const char *url, int port)
             }
     }
     else if (options->headless) {
-        const char *hcmd = get_setting(options->settings, "command.headless");
+        const char *hcmd = setting_string(options, command_headless_opt);
         if (hcmd) {
             browser_specifier = hcmd;
         } else if ((hcmd = chrome_command(true, options)) != NULL) {
@@ -843,7 +921,7 @@ do_run_browser(struct options *options, const char *url, int port)
         FORALL_WSCLIENT(t) {
             if (t->version_info && strstr(t->version_info, do_pattern)) {
                 browser_run_browser(options, url, t);
-                lws_callback_on_writable(t->wsi);
+                wsi_writable(t->wsi);
                 return EXIT_SUCCESS;
             }
         }
@@ -910,6 +988,7 @@ options::~options()
     free((void*) cwd);
     if (cmd_settings)
         json_object_put(cmd_settings);
+    settings_snapshot_release(settings);
 }
 
 struct options *link_options(struct options *opts)
@@ -968,6 +1047,9 @@ void prescan_options(int argc, arglist_t argv, struct options *opts)
         case 'd':
             opts->debug_level = atoi(optarg);
             break;
+        case UPGRADE_FD_OPTION: // internal - see upgrade.cc
+            upgrade_fd = atoi(optarg);
+            break;
         }
     }
     opterr = 1;
@@ -1057,6 +1139,7 @@ int process_options(int argc, arglist_t argv, struct options *opts)
                 break;
             case VERBOSE_OPTION:
             case SETTINGS_FILE_OPTION:
+            case UPGRADE_FD_OPTION:
             case 'd':
                 break; // handled in prescan_options
             case TAB_OPTION:
@@ -1095,7 +1178,7 @@ int process_options(int argc, arglist_t argv, struct options *opts)
                 }
                 regfree(&rx);
                 //opts->geometry = optarg;
-                set_setting(&opts->cmd_settings, "geometry", optarg);
+                set_cmd_setting(opts, "geometry", optarg);
 
                 free(default_size);
                 char *p = optarg;
@@ -1196,6 +1279,166 @@ int process_options(int argc, arglist_t argv, struct options *opts)
     return 0;
 }
 
+/* Accept connections on a listening socket (see listen_on),
+ * and give them to its vhost as if it had accepted them. */
+int
+callback_http_listen(struct lws *wsi, enum lws_callback_reasons reason,
+                     void *user, void *in, size_t len)
+{
+    if (reason != LWS_CALLBACK_RAW_RX_FILE)
+        return 0;
+    int lfd = lws_get_socket_fd(wsi);
+    struct lws_vhost *vh = lws_get_vhost(wsi);
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+            break;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        // On failure, this closes fd.
+        lws_adopt_socket_vhost(vh, fd);
+    }
+    return 0;
+}
+
+/* Accept connections for vh on the listening socket fd.
+ * We listen ourselves, rather than letting libwebsockets do it,
+ * so we know the sockets to hand to a new server (see upgrade.cc). */
+static void
+listen_on(struct lws_vhost *vh, int fd)
+{
+    lws_sock_file_fd_type lfd;
+    lfd.filefd = fd;
+    setblocking(fd, 0);
+    lws_adopt_descriptor_vhost(vh, LWS_ADOPT_RAW_FILE_DESC, lfd,
+                               "http-listen", NULL);
+}
+
+/* Create the socket for HTTP and WebSocket connections on port
+ * (0 for any free port), on all interfaces: IPv6 (and IPv4 through
+ * the same socket) if we can, else IPv4.  Return -1 on failure. */
+static int
+create_http_socket(int port)
+{
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+    } addr;
+    memset(&addr, 0, sizeof(addr));
+    socklen_t addrlen;
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        int off = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        addr.sin6.sin6_family = AF_INET6;
+        addr.sin6.sin6_addr = in6addr_any;
+        addr.sin6.sin6_port = htons(port);
+        addrlen = sizeof(addr.sin6);
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        addr.sin.sin_family = AF_INET;
+        addr.sin.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin.sin_port = htons(port);
+        addrlen = sizeof(addr.sin);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, &addr.sa, addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/* The port of the listening socket fd, or -1. */
+static int
+socket_port(int fd)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    if (getsockname(fd, (struct sockaddr *) &sa, &salen) != 0)
+        return -1;
+    return sa.ss_family == AF_INET
+        ? ntohs(((struct sockaddr_in *) &sa)->sin_port)
+        : sa.ss_family == AF_INET6
+        ? ntohs(((struct sockaddr_in6 *) &sa)->sin6_port)
+        : -1;
+}
+
+/* Create the (optional) second vhost, which listens for HTTP and
+ * WebSockets on a Unix domain socket next to the command socket.
+ * Only the user can connect to it, so it doesn't need the server key.
+ * After "upgrade-server", the old server's socket (if any) is used. */
+static void
+create_unix_vhost(const char *cname)
+{
+    char *path;
+    if (unix_listener >= 0)
+        path = ws_socket_name; // from upgrade_receive
+    else {
+        const char *setting =
+            setting_string(main_options, server_unix_socket_opt);
+        if (setting == NULL || strcmp(setting, "no") == 0)
+            return;
+        if (strcmp(setting, "yes") == 0) {
+            int clen = strlen(cname);
+            if (endswith(cname, ".socket"))
+                clen -= 7;
+            path = challoc(clen + sizeof("-ws.socket"));
+            sprintf(path, "%.*s-ws.socket", clen, cname);
+        } else
+            path = strdup(setting);
+    }
+#if defined(LWS_WITH_UNIX_SOCK) || defined(LWS_USE_UNIX_SOCK)
+    if (unix_listener < 0)
+        unix_listener = create_unix_socket(path);
+    if (unix_listener < 0) {
+        lwsl_err("cannot listen on unix socket '%s'\n", path);
+        free(path);
+        return;
+    }
+    struct lws_context_creation_info uinfo = info;
+    uinfo.vhost_name = "unix";
+    uinfo.port = CONTEXT_PORT_NO_LISTEN_SERVER; // see listen_on
+    uinfo.iface = path;
+    uinfo.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+#if HAVE_OPENSSL
+    uinfo.ssl_cert_filepath = NULL;
+    uinfo.ssl_private_key_filepath = NULL;
+    uinfo.ssl_ca_filepath = NULL;
+    uinfo.options &= ~LWS_SERVER_OPTION_REQUIRE_VALID_OPENSSL_CLIENT_CERT;
+#if LWS_LIBRARY_VERSION_MAJOR >= 2
+    uinfo.options &= ~LWS_SERVER_OPTION_REDIRECT_HTTP_TO_HTTPS;
+#endif
+#endif
+    unix_vhost = lws_create_vhost(context, &uinfo);
+    if (unix_vhost == NULL) {
+        lwsl_err("cannot create vhost for unix socket '%s'\n", path);
+        close(unix_listener);
+        unix_listener = -1;
+        unlink(path);
+        free(path);
+        return;
+    }
+    listen_on(unix_vhost, unix_listener);
+    ws_socket_name = path;
+    lwsl_notice("listening for WebSockets on '%s'\n", path);
+#else
+    lwsl_warn("server.unix-socket ignored - libwebsockets built without Unix domain socket support\n");
+    if (unix_listener >= 0) {
+        close(unix_listener);
+        unix_listener = -1;
+    }
+    free(path);
+    ws_socket_name = NULL;
+#endif
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1235,7 +1478,7 @@ main(int argc, char **argv)
     set_settings(&opts);
 
     int debug_level = opts.debug_level;
-    const char *logfilefmt = get_setting(opts.settings, "log.file");
+    const char *logfilefmt = setting_string(&opts, log_file_opt);
     if (debug_level == 0 && opts.verbosity > 0) {
          debug_level = LLL_ERR|LLL_WARN|LLL_NOTICE
              |(opts.verbosity > 1 ? LLL_INFO : 0);
@@ -1243,7 +1486,7 @@ main(int argc, char **argv)
              logfilefmt = "notimestamp";
     }
     if (debug_level == 0) {
-        const char *to_server = get_setting(opts.settings, "log.js-to-server");
+        const char *to_server = setting_string(&opts, log_js_to_server_opt);
         if (to_server && (strcmp(to_server, "true") == 0
                           || strcmp(to_server, "yes") == 0
                           || strcmp(to_server, "both") == 0))
@@ -1258,7 +1501,8 @@ main(int argc, char **argv)
         lws_set_log_level(debug_level, lwsl_emit_stderr);
     else if (strcmp(logfilefmt, "stdout") == 0) {
         _logfile = stdout;
-        lws_set_log_level(debug_level, lwsl_emit_stderr_with_flush);
+        log_sink_set_file(_logfile);
+        lws_set_log_level(debug_level, log_sink_emit);
     } else if (strcmp(logfilefmt, "stderr-notimestamp") == 0
                || strcmp(logfilefmt, "notimestamp") == 0)
         lws_set_log_level(debug_level, lwsl_emit_stderr_notimestamp);
@@ -1283,7 +1527,8 @@ main(int argc, char **argv)
         sbuf_append(&sb, "", 1);
         _logfile = fopen((const char *) sb.buffer, "a");
         sbuf_free(&sb);
-        lws_set_log_level(debug_level, lwsl_emit_stderr_with_flush);
+        log_sink_set_file(_logfile);
+        lws_set_log_level(debug_level, log_sink_emit);
     }
 
     lwsl_notice("domterm terminal server %s (git describe: %s)\n",
@@ -1318,7 +1563,7 @@ main(int argc, char **argv)
         check_domterm(&opts);
     }
     int socket = -1;
-    if ((command == NULL ||
+    if (upgrade_fd < 0 && (command == NULL ||
          (command->options &
           (COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER)) != 0))
       socket = client_connect(make_socket_name(false));
@@ -1333,6 +1578,8 @@ main(int argc, char **argv)
         exit(client_send_command(socket, argc, argv, environ));
     }
 
+    if (upgrade_fd >= 0)
+        upgrade_receive(); // sets some options from the old server
     server = tty_server_new();
     server->options = opts;
 
@@ -1385,23 +1632,39 @@ main(int argc, char **argv)
     }
 #endif
 
+    service_threads_init();
+    if (upgrade_fd < 0) { // else we have the old server's
+        int lfd = create_http_socket(info.port);
+        if (lfd < 0) {
+            lwsl_err("cannot listen on port %d: %s\n",
+                     info.port, strerror(errno));
+            return 1;
+        }
+        http_listeners[http_listener_count++] = lfd;
+    }
+    info.port = CONTEXT_PORT_NO_LISTEN_SERVER; // see listen_on
     context = lws_create_context(&info);
     if (context == NULL) {
         lwsl_err("libwebsockets init failed\n");
         return 1;
     }
     vhost = lws_create_vhost(context, &info);
-#if LWS_LIBRARY_VERSION_MAJOR >= 3
-    http_port = lws_get_vhost_port(vhost);
-#else
-    http_port = info.port;
-#endif
+    for (int i = 0; i < http_listener_count; i++)
+        listen_on(vhost, http_listeners[i]);
+    http_port = upgrade_fd >= 0 ? upgrade_http_port
+        : socket_port(http_listeners[0]);
+    uring_init();
 
     char *cname = make_socket_name(false);
     backend_socket_name = cname;
+    create_unix_vhost(cname);
     lwsl_notice("creating server socket: '%s'\n", cname);
     lws_sock_file_fd_type csocket;
-    csocket.filefd = create_command_socket(cname);
+    if (upgrade_fd >= 0) {
+        csocket.filefd = upgrade_command_socket;
+        unlink_command_socket_at_exit(cname);
+    } else
+        csocket.filefd = create_command_socket(cname);
     cmdwsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC,
                                         csocket, "cmd", NULL);
     cclient = (struct cmd_client *) lws_wsi_user(cmdwsi);
@@ -1423,7 +1686,10 @@ main(int argc, char **argv)
     if (opts.once)
         lwsl_info("  once: true\n");
     int ret;
-    if (port_specified >= 0 && server->options.browser_command == NULL) {
+    if (upgrade_fd >= 0) {
+        upgrade_resume();
+        ret = 0;
+    } else if (port_specified >= 0 && server->options.browser_command == NULL) {
         fprintf(stderr, "Server start on port %d. You can browse %s://localhost:%d/\n",
                 http_port, opts.ssl ? "https" : "http", http_port);
         opts.http_server = true;
@@ -1438,13 +1704,26 @@ main(int argc, char **argv)
 
     if (ret == 0)
         maybe_daemonize();
+    log_sink_start();
     watch_settings_file();
+    journal_recover();
 
     // libwebsockets main loop
     while (!force_exit) {
+        int64_t start = monotonic_ns();
         lws_service(context, 100);
+        service_lock_acquire();
+        histogram_add(&server_stats.loop_iteration,
+                      (monotonic_ns() - start) / 1000);
+        if (recording_count > 0)
+            flush_recordings();
+        compress_idle_sessions();
+        if (upgrade_handed_off)
+            upgrade_exit();
+        service_lock_release();
     }
 
+    recordings_finish();
     lws_context_destroy(context);
 
     // cleanup
@@ -1573,7 +1852,7 @@ domterm_genhtml_dir()
     return dir;
 }
 
-static char *
+char *
 make_socket_name(bool html_filename)
 {
     const char *ddir = html_filename ? domterm_genhtml_dir()
@@ -55,6 +55,7 @@ extern char server_key[SERVER_KEY_LENGTH];
 extern char *main_html_url;
 extern char *main_html_path;
 extern char *backend_socket_name;
+extern char *ws_socket_name;
 extern const char *settings_fname;
 extern struct json_object *settings_json_object;
 extern volatile bool force_exit;
@@ -62,29 +63,15 @@ extern struct lws *cmdwsi;
 extern struct lws_context *context;
 extern struct tty_server *server;
 extern struct lws_vhost *vhost;
+extern struct lws_vhost *unix_vhost;
+#define MAX_HTTP_LISTENERS 8
+extern int http_listeners[MAX_HTTP_LISTENERS];
+extern int http_listener_count;
+extern int unix_listener;
 
-// Assume each T has an index()  method that returns a unique positive integer.
-// This table manages the mapping between T and those indexes.
-template<typename T>
-class id_table {
-    // Invariant for elements array
-    // If SNUM is valid then elements[SNUM].index() == SNUM.
-    // Otherwise (if SNUM is < sz): elements[SNUM] points
-    // to nullptr or the next valid element in elements.
-    T** elements;
-    int sz = 0;
-public:
-    T* first() { return elements == nullptr ? nullptr : elements[1]; }
-    T* next(T* entry) { return elements[entry->index()+1]; }
-    T* operator[](int i) { return elements[i]; } // fast/unsafe lookup
-    int enter(T* entry, int hint);
-    void remove(T* entry);
-    bool valid_index(int i) {
-        return i > 0 && i < sz && elements[i] != nullptr
-            && elements[i]->index() == i;
-    }
-    T* operator()(int i) { return valid_index(i) ? elements[i] : nullptr; }
-};
+#include "id-table.h"
+#include "callback-timing.h"
+#include "service-threads.h"
 
 extern int http_port;
 //extern struct tty_client *focused_client;
@@ -93,6 +80,33 @@ extern struct lws *focused_wsi;
 extern struct cmd_client *cclient;
 extern struct options *main_options;
 extern const char *settings_as_json; // FIXME
+// Changes from generation settings_delta_base to settings_counter, or NULL.
+extern const char *settings_delta_json;
+extern int64_t settings_delta_base;
+extern int64_t settings_counter;
+
+/** Server-wide counters, as shown by "domterm status --verbose"/"--json"
+ * and the /metrics page.  The ws_ fields and output_latency are only
+ * updated for WebSocket (not proxy) connections.
+ * Histograms are in microseconds. */
+struct server_stats {
+    int64_t pty_bytes_read; // bytes read from ptys
+    int64_t pty_read_syscalls; // read calls (or io_uring submits) for ptys
+    int64_t ws_bytes_written; // bytes passed to lws_write
+    int64_t ws_frames_written; // calls to lws_write
+    int64_t pause_count; // times a session was paused by flow control
+    int64_t resize_events; // window size changes reported by windows
+    int64_t resize_applied; // ... of which passed on to the pty
+    int64_t preserved_bytes; // allocated for preserved_output, all sessions
+    int64_t preserved_dropped; // preserved output dropped (memory limits)
+    // From a pty read to the lws_write that sent it.
+    struct histogram output_latency;
+    // Duration of each lws_service call in the main loop.
+    struct histogram loop_iteration;
+    // From accepting a command-socket connection to sending the result.
+    struct histogram command_latency;
+};
+extern struct server_stats server_stats;
 extern char git_describe[];
 #if REMOTE_SSH
 extern int
@@ -124,6 +138,22 @@ enum option_name {
 #undef OPTION_F
 };
 
+/**
+ * Settings pre-processed into arrays indexed by option_name,
+ * so users don't need to look up json objects by string key.
+ * The global snapshot is built once per settings generation.
+ * The snapshot of an options with cmd_settings only records
+ * the overrides, and otherwise defers to its base snapshot.
+ */
+struct settings_snapshot {
+    int reference_count;
+    struct settings_snapshot *base; // NULL for the global snapshot
+    // Value as string (owned, since cmd_settings can be changed
+    // later), or NULL if not set (here).
+    char *str[NO_opt];
+    double num[NO_opt]; // value as number; valid if str is non-NULL
+};
+
 /**
  * Data specific to a pty process.
  * This is the user structure for the libwebsockets "pty" protocol.
@@ -131,7 +161,7 @@ enum option_name {
 class pty_client {
 public:
     int index() { return session_number; }
-    static bool avoid_index(int i);
+    bool avoid_index(int i);
     int pid;
     int pty; // pty master
     int pty_slave;
@@ -141,10 +171,12 @@ public:
     int nrows, ncols;
     float pixh, pixw;
     bool timed_out : 1;
+    bool resize_pending :1; // nrows etc not yet applied - see reportEvent
     bool session_name_unique :1;
     bool is_ssh_pclient :1;
     bool has_primary_window :1;
     bool uses_packet_mode :1;
+    bool adopted :1; // handed over by a previous server (not our child)
     bool exit;
     // Number of "pending" re-attach after detach; -1 is allow infinite.
     int detach_count;
@@ -156,6 +188,13 @@ public:
     char *saved_window_contents;
     long saved_window_sent_count; // corresponding to saved_window_contents
     char *ttyname;
+    char pid_key[16]; // pid in decimal - the key in pty_clients_by_pid
+    int64_t bytes_read; // total read from pty
+    int64_t pause_count; // times paused by flow control
+    int64_t paused_ns; // total time paused (not counting current pause)
+    int64_t paused_since; // monotonic_ns() when last paused
+    int reconnect_count; // connections that used reconnect=
+    struct recording *recording; // if non-NULL, output is being recorded
 
     // The following are used to attach to already-visible session.
     char *preserved_output; // data send since window-contents request
@@ -168,6 +207,18 @@ public:
     int preserve_mode : 3;
 
     long preserved_sent_count;  // sent_count at preserved_output start
+    // Preserved output dropped because of memory limits (total bytes),
+    // and the most recent dropped range (as sent_count values).
+    int64_t preserved_dropped;
+    long dropped_start, dropped_end;
+    // If non-NULL, preserved output and saved window contents
+    // are (being) compressed - see idle-compress.cc.
+    struct compressed_state *compressed;
+    struct journal *journal; // if non-NULL, see journal.cc
+    // If non-NULL, output is read with io_uring - see uring.cc.
+    struct uring_read *uring;
+    int64_t idle_since; // monotonic_ns() of last output or detach
+    int64_t resized_at; // monotonic_ns() when the window size was applied
     // (Should be minumum of saved_window_sent_count (if saved_window_contents)
     // and miniumum of confirmed_count for each tclient.)
 
@@ -180,7 +231,92 @@ public:
 #endif
 };
 
+extern id_numbering client_numbering;
 extern id_table<pty_client> pty_clients;
+// Secondary indexes of pty_clients, by session_name, ttyname, and pid.
+extern string_index<pty_client> pty_clients_by_name;
+extern string_index<pty_client> pty_clients_by_tty;
+extern string_index<pty_client> pty_clients_by_pid;
+extern struct pty_client *find_session(const char *specifier);
+extern size_t session_memory(struct pty_client *pclient);
+// Defaults for memory.session-limit and memory.total-limit (megabytes).
+#define DEFAULT_SESSION_MEMORY_LIMIT 64
+#define DEFAULT_TOTAL_MEMORY_LIMIT 512
+#define DEFAULT_COMPRESS_IDLE 60 // memory.compress-idle (seconds)
+extern void set_preserved_size(struct pty_client *pclient, size_t size);
+extern void session_expand(struct pty_client *pclient);
+extern void session_free_compressed(struct pty_client *pclient);
+extern bool session_compressed_sizes(struct pty_client *pclient,
+                                     size_t *raw, size_t *stored);
+extern void compress_idle_sessions(void);
+extern void compress_for_memory(struct pty_client *except, size_t limit);
+#define DEFAULT_RESIZE_DELAY 50 // terminal.resize-delay (milliseconds)
+#define DEFAULT_COMMAND_THREADS 0 // server.command-threads
+#define DEFAULT_JOURNAL_MAX_SIZE 16 // journal.max-size (megabytes)
+extern void journal_start(struct pty_client *pclient);
+extern void journal_output(struct pty_client *pclient, long count,
+                           const char *data, size_t length);
+extern void journal_window_contents(struct pty_client *pclient, long count,
+                                    const char *contents);
+extern bool journal_read_output(struct pty_client *pclient, long count,
+                                size_t length, struct sbuf *out);
+extern void journal_close(struct pty_client *pclient, bool remove);
+extern const char *journal_filename(struct pty_client *pclient);
+extern bool journal_restore(struct pty_client *pclient, const char *path);
+extern bool is_journal_file(const char *path);
+extern long journal_replay(const char *path, FILE *out);
+extern void journal_recover(void);
+extern void uring_init(void);
+extern void uring_pty_start(struct pty_client *pclient);
+extern void uring_pty_resume(struct pty_client *pclient);
+extern void uring_pty_stop(struct pty_client *pclient);
+extern void uring_pty_close(struct pty_client *pclient);
+extern ssize_t uring_pty_read(struct pty_client *pclient, char *buf,
+                              size_t length);
+extern int callback_uring(struct lws *wsi, enum lws_callback_reasons reason,
+                          void *user, void *in, size_t len);
+extern bool splice_relay_output(struct pty_client *pclient, int *result);
+extern bool splice_relay_flush(struct tty_client *tclient);
+extern void splice_relay_close(struct tty_client *tclient);
+struct thumbnail {
+    struct sbuf data;
+    const char *mime;
+    char *original; // URL of the full-size image
+};
+extern const char *thumbnail_dir(void);
+extern bool image_thumbnail(int fd, const char *mime,
+                            int max_width, int max_height,
+                            struct thumbnail *thumb);
+extern int handle_process_output(struct lws *wsi, struct pty_client *pclient,
+                                 int fd_in,
+                                 struct stderr_client *stderr_client);
+extern bool should_backup_output(struct pty_client *pclient);
+extern void backup_output(struct pty_client *pclient, char *data_start,
+                          int data_length);
+extern struct pty_client *find_session_by_tty(const char *tname);
+extern struct pty_client *adopt_pclient(int master, char *tname,
+                                        bool packet_mode, int session_number,
+                                        const char *cmd, arglist_t argv);
+extern bool upgrade_handed_off;
+extern bool upgrade_pending;
+extern int upgrade_fd;
+extern int upgrade_command_socket;
+extern int upgrade_http_port;
+extern const char *upgrade_server(struct options *opts);
+extern void upgrade_receive(void);
+extern void upgrade_resume(void);
+extern void upgrade_exit(void);
+extern int callback_http_listen(struct lws *wsi,
+                                enum lws_callback_reasons reason,
+                                void *user, void *in, size_t len);
+struct upgrade_client {
+    pid_t child; // in the old server: the new one; else 0
+    json_object *state; // in the old server: the state sent
+    struct options *opts; // the upgrade-server command, if it waits
+    bool done;
+};
+extern int callback_upgrade(struct lws *wsi, enum lws_callback_reasons reason,
+                            void *user, void *in, size_t len);
 
 struct stderr_client {
     struct lws *wsi;
@@ -196,7 +332,7 @@ struct stderr_client {
  */
 struct tty_client {
     int index() { return connection_number; }
-    static bool avoid_index(int i);
+    bool avoid_index(int i);
     struct tty_client *next_tclient; // link in list headed by pty_client:first_tclient [an 'out' field]
     struct pty_client *pclient;
     struct options *options;
@@ -225,8 +361,14 @@ struct tty_client {
     bool close_requested : 1;
     bool close_expected : 1;
     bool detach_on_disconnect : 1;
+    bool framed_output : 1; // client negotiated FRAMED_OUTPUT_PREFIX records
+    bool framed_in_control : 1; // last frame ended inside a control message
+    bool framed_output_acked : 1; // sent FRAMED_OUTPUT_ACK; frame from now on
     bool detachSaveSend; // need to send a detachSaveNeeded command
     bool uploadSettingsNeeded; // need to upload settings to client
+    int64_t settings_sent; // settings_counter last uploaded, or -1
+    int64_t ob_read_time; // monotonic_ns() of oldest pty data in ob, or 0
+    int64_t bytes_written; // total written to wsi or proxy_fd_out
     int main_window; // 0 if top-level, or number of main window
     enum proxy_mode proxyMode;
 
@@ -250,6 +392,11 @@ struct tty_client {
     int pty_window_number; // Numbered within each pty_client; -1 if only one
     bool pty_window_update_needed;
     int proxy_fd_in, proxy_fd_out;
+    // Pipes for splicing output from pty to proxy_fd_out - see splice-relay.cc
+    int splice_pipe[2];
+    int splice_copy_pipe[2]; // for a copy (tee) of output to preserve
+    size_t splice_pending; // bytes in splice_pipe not yet written
+    bool splice_disabled;
     char *ssh_connection_info;
 };
 
@@ -266,6 +413,9 @@ struct cmd_client {
     int socket;
 };
 #define MASK28 0xfffffff
+// Maximum number of unconfirmed bytes before pausing
+// Must be at least as much as "flow-confirm-every" setting.
+#define MAX_UNCONFIRMED 8000
 
 class options {
 public:
@@ -283,7 +433,8 @@ public:
     int verbosity;
     int debug_level;
     struct json_object *cmd_settings = nullptr;
-    struct json_object *settings = nullptr; // merge of cmd_settings and global settings
+    // cmd_settings overlaid on global settings - use setting_string etc
+    struct settings_snapshot *settings = nullptr;
     // Possible memory leak if we start reclaiming options objects.
     const char *browser_command;
     const char *tty_packet_mode;
@@ -363,6 +514,8 @@ extern char* check_browser_specifier(const char *specifier);
 extern void printf_to_browser(struct tty_client *, const char *, ...);
 extern void fatal(const char *format, ...);
 extern const char *find_home(void);
+extern const char *domterm_socket_dir(void);
+extern char *make_socket_name(bool html_filename);
 extern struct options *link_options(struct options *options);
 extern const char *firefox_browser_command(struct options *options);
 extern const char *chrome_command(bool app_mode, struct options *options);
@@ -372,11 +525,16 @@ extern arglist_t default_command(struct options *opts);
 extern void request_upload_settings();
 extern void read_settings_file(struct options*, bool);
 extern void read_settings_emit_notice();
-extern struct json_object *merged_settings(struct json_object *cmd_settings);
 extern void set_settings(struct options *options);
 extern enum option_name lookup_option(const char *name);
 extern const char *get_setting(json_object *opts, const char *key);
+extern const char *setting_string(struct options *opts, enum option_name name);
+extern double setting_number(struct options *opts, enum option_name name,
+                             double dfault);
+extern void settings_snapshot_release(struct settings_snapshot *snap);
 extern void set_setting(struct json_object **, const char *key, const char *val);
+extern void set_cmd_setting(struct options *opts,
+                            const char *key, const char *val);
 extern bool check_option_arg(const char *arg, struct options *opts);
 
 // A "setting" that starts with "`" is an internal setting.
@@ -436,11 +594,34 @@ extern struct resource resources[];
 #define URGENT_WRAP(STR) URGENT_START_STRING STR URGENT_END_STRING
 #define OUT_OF_BAND_WRAP(STR) OUT_OF_BAND_START_STRING STR URGENT_END_STRING
 
+// If the client's VERSION report includes "framing":FRAMED_OUTPUT_VERSION
+// then each WebSocket message starts with FRAMED_OUTPUT_PREFIX
+// followed by records: a kind byte, a 4-byte big-endian payload length,
+// then the payload.  A FRAME_KIND_CONTROL payload is what would otherwise
+// appear between OUT_OF_BAND_START_STRING and URGENT_END_STRING,
+// so the client does not need to scan the data for delimiters.
+// A control message split across writes (possible when relaying
+// output from a remote server) is sent as a FRAME_KIND_CONTROL_BEGIN,
+// optional FRAME_KIND_DATA continuations, then a FRAME_KIND_CONTROL_END.
+// 0xFE (like 0xFD) cannot appear in a UTF-8 sequence.
+// The server agrees by sending FRAMED_OUTPUT_ACK (unframed) at the end
+// of a WebSocket message; the following messages are framed.
+#define FRAMED_OUTPUT_VERSION 1
+#define FRAMED_OUTPUT_ACK OUT_OF_BAND_WRAP("\033]124;%d\007")
+#define FRAMED_OUTPUT_PREFIX 0xFE
+#define FRAME_KIND_DATA 'D'
+#define FRAME_KIND_CONTROL 'C'
+#define FRAME_KIND_CONTROL_BEGIN 'B'
+#define FRAME_KIND_CONTROL_END 'E'
+
 #define COMMAND_ALIAS 1
 #define COMMAND_IN_CLIENT 2
 #define COMMAND_IN_CLIENT_IF_NO_SERVER 4
 #define COMMAND_IN_SERVER 8
 #define COMMAND_CHECK_DOMTERM 16
+/* When received from a client, run the command in a worker thread
+ * (see offload_command), so slow work doesn't hold up the server. */
+#define COMMAND_OFFLOAD 32
 #define REATTACH_COMMAND "INTERNAL-re-attach"
 
 // 0xFD cannot appear in a UTF-8 sequence
@@ -460,6 +641,8 @@ struct command {
 };
 
 extern struct command * find_command(const char *name);
+extern bool offload_command(struct command *command, int argc, arglist_t argv,
+                            struct lws *wsi, struct options *opts);
 extern int attach_action(int, arglist_t, struct lws *, struct options *);
 extern int browse_action(int, arglist_t, struct lws *, struct options *);
 extern int view_saved_action(int, arglist_t, struct lws *, struct options *);
@@ -469,6 +652,34 @@ extern void print_version(FILE*);
 extern char*find_in_path(const char*);
 extern void print_help(FILE*);
 extern bool check_server_key(struct lws *wsi, char *arg, size_t alen);
+extern void print_metrics(struct sbuf *out);
+extern void log_sink_emit(int level, const char *line);
+extern void log_sink_set_file(FILE *file);
+extern void log_sink_start(void);
+extern void log_sink_stop(void);
+extern int64_t log_sink_dropped(void);
+extern int recording_count; // number of sessions being recorded
+extern const char *recording_start(struct pty_client *pclient,
+                                   const char *filename);
+extern const char *recording_resume(struct pty_client *pclient,
+                                    const char *filename, int64_t elapsed_ns);
+extern int64_t recording_elapsed(struct pty_client *pclient);
+extern void recording_stop(struct pty_client *pclient);
+extern void recording_output(struct pty_client *pclient,
+                             const char *data, size_t len);
+extern void recording_resize(struct pty_client *pclient);
+extern void flush_recordings(void);
+extern void recording_drain(void);
+extern void recordings_finish(void);
+extern const char *recording_filename(struct pty_client *pclient);
+extern char *recording_expand_filename(const char *pattern,
+                                       struct pty_client *pclient);
+
+// Logging in per-chunk (output, input, proxy) paths, like lwsl_info,
+// but the arguments are only evaluated if LLL_INFO logging is enabled
+// (for example by --verbose).
+#define lwsl_hot(...) \
+    do { if (lwsl_visible(LLL_INFO)) _lws_log(LLL_INFO, __VA_ARGS__); } while (0)
 
 #ifndef DOMTERM_DIR_RELATIVE
 /* Data directory, relative to binary's parent directory.
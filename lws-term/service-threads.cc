@@ -0,0 +1,260 @@
+/* The service lock, and worker threads for slow commands.
+ * Commands marked COMMAND_OFFLOAD are run by a small pool of worker
+ * threads (server.command-threads).  The worker holds the service lock
+ * while the command collects its data, but not while it formats its
+ * output from that copy, writes it, or waits for its own files.
+ * Changes a worker makes to a wsi are queued for the service thread,
+ * which is woken (lws_cancel_service) and makes them when it gets
+ * LWS_CALLBACK_EVENT_WAIT_CANCELLED.
+ * The result is passed back to the service thread the same way.
+ * (There is only one libwebsockets service thread: libwebsockets
+ * decides which thread services a new connection, so the windows
+ * of a session could not be kept on the thread of its pty.)
+ */
+#include "server.h"
+
+int command_thread_count = 0;
+bool service_locking = false;
+static pthread_mutex_t service_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_local int service_lock_depth = 0;
+static thread_local bool in_worker = false;
+
+enum { DEFER_WRITABLE, DEFER_RX_FLOW, DEFER_KILL, DEFER_TIMER };
+
+struct deferred_op {
+    struct deferred_op *next;
+    struct lws *wsi;
+    int op;
+    lws_usec_t arg;
+};
+// Operations queued by worker threads for the service thread.
+// Protected by the service lock.
+static struct deferred_op *deferred = NULL;
+
+/* Called before creating the context. */
+void
+service_threads_init()
+{
+    int w = (int) setting_number(main_options, server_command_threads_opt,
+                                 DEFAULT_COMMAND_THREADS);
+    command_thread_count = w < 0 ? 0 : w;
+    service_locking = command_thread_count > 0;
+}
+
+void
+service_lock_acquire()
+{
+    if (service_locking && service_lock_depth++ == 0)
+        pthread_mutex_lock(&service_mutex);
+}
+
+void
+service_lock_release()
+{
+    if (service_locking && --service_lock_depth == 0)
+        pthread_mutex_unlock(&service_mutex);
+}
+
+service_unlock::service_unlock()
+{
+    released = service_locking && service_lock_depth == 1;
+    if (released) {
+        service_lock_depth = 0;
+        pthread_mutex_unlock(&service_mutex);
+    }
+}
+
+service_unlock::~service_unlock()
+{
+    if (released) {
+        pthread_mutex_lock(&service_mutex);
+        service_lock_depth = 1;
+    }
+}
+
+static void
+do_op(struct lws *wsi, int op, lws_usec_t arg)
+{
+    switch (op) {
+    case DEFER_WRITABLE:
+        lws_callback_on_writable(wsi);
+        break;
+    case DEFER_RX_FLOW:
+        lws_rx_flow_control(wsi, (int) arg);
+        break;
+    case DEFER_KILL:
+        lws_set_timeout(wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH,
+                        LWS_TO_KILL_SYNC);
+        break;
+    case DEFER_TIMER:
+        lws_set_timer_usecs(wsi, arg);
+        break;
+    }
+}
+
+/* Do op on wsi now, unless we're in a worker thread:
+ * then queue it for the service thread.
+ * Must be called holding the service lock (as callbacks do). */
+static void
+wsi_op(struct lws *wsi, int op, lws_usec_t arg)
+{
+    if (! in_worker || wsi == NULL) {
+        do_op(wsi, op, arg);
+        return;
+    }
+    struct deferred_op **p = &deferred;
+    for (; *p != NULL; p = &(*p)->next) {
+        if ((*p)->wsi == wsi && (*p)->op == op) {
+            (*p)->arg = arg; // replaces the earlier request
+            return;
+        }
+    }
+    struct deferred_op *d = (struct deferred_op *)
+        xmalloc(sizeof(struct deferred_op));
+    d->next = NULL;
+    d->wsi = wsi;
+    d->op = op;
+    d->arg = arg;
+    *p = d;
+    lws_cancel_service(context);
+}
+
+void
+wsi_writable(struct lws *wsi)
+{
+    wsi_op(wsi, DEFER_WRITABLE, 0);
+}
+
+void
+wsi_rx_flow(struct lws *wsi, int enable)
+{
+    wsi_op(wsi, DEFER_RX_FLOW, enable);
+}
+
+/* Close wsi (after flushing pending output). */
+void
+wsi_kill(struct lws *wsi)
+{
+    wsi_op(wsi, DEFER_KILL, 0);
+}
+
+void
+wsi_set_timer(struct lws *wsi, lws_usec_t usecs)
+{
+    wsi_op(wsi, DEFER_TIMER, usecs);
+}
+
+struct offload_job {
+    struct offload_job *next;
+    void (*work)(void *);
+    void (*done)(void *);
+    void *arg;
+};
+
+static pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER; // job added
+static struct offload_job *offload_first = NULL, **offload_last = &offload_first;
+static int offload_threads = 0, offload_idle = 0;
+static pid_t offload_pid = -1; // process the workers are running in
+// Jobs whose work is done, waiting for done to be called.
+// Protected by the service lock.
+static struct offload_job *offload_finished = NULL;
+
+static void *
+offload_worker(void *)
+{
+    in_worker = true; // so wsi changes are queued for the service thread
+    pthread_mutex_lock(&offload_lock);
+    for (;;) {
+        offload_idle++;
+        while (offload_first == NULL)
+            pthread_cond_wait(&offload_cond, &offload_lock);
+        offload_idle--;
+        struct offload_job *job = offload_first;
+        offload_first = job->next;
+        if (offload_first == NULL)
+            offload_last = &offload_first;
+        pthread_mutex_unlock(&offload_lock);
+        service_lock_acquire();
+        (*job->work)(job->arg);
+        job->next = offload_finished;
+        offload_finished = job;
+        service_lock_release();
+        lws_cancel_service(context);
+        pthread_mutex_lock(&offload_lock);
+    }
+    return NULL;
+}
+
+bool
+offload_work(void (*work)(void *), void (*done)(void *), void *arg)
+{
+    if (command_thread_count <= 0)
+        return false;
+    pthread_mutex_lock(&offload_lock);
+    // Threads don't survive fork (for example daemon), so (re)start
+    // workers as they are needed in this process.
+    if (offload_pid != getpid()) {
+        offload_pid = getpid();
+        offload_threads = 0;
+        offload_idle = 0;
+    }
+    if (offload_idle == 0 && offload_threads < command_thread_count) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, offload_worker, NULL) == 0) {
+            pthread_detach(thread);
+            offload_threads++;
+        }
+    }
+    if (offload_threads == 0) {
+        pthread_mutex_unlock(&offload_lock);
+        return false;
+    }
+    struct offload_job *job = (struct offload_job *)
+        xmalloc(sizeof(struct offload_job));
+    job->next = NULL;
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    *offload_last = job;
+    offload_last = &job->next;
+    pthread_cond_signal(&offload_cond);
+    pthread_mutex_unlock(&offload_lock);
+    return true;
+}
+
+/* Called (holding the lock) before each callback,
+ * when service_locking is set. */
+void
+service_callback_hook(struct lws *wsi, enum lws_callback_reasons reason)
+{
+    if (reason == LWS_CALLBACK_EVENT_WAIT_CANCELLED) {
+        struct offload_job *job = offload_finished;
+        offload_finished = NULL;
+        while (job != NULL) {
+            struct offload_job *next = job->next;
+            (*job->done)(job->arg);
+            free(job);
+            job = next;
+        }
+        struct deferred_op *d = deferred;
+        deferred = NULL;
+        while (d != NULL) {
+            struct deferred_op *next = d->next;
+            do_op(d->wsi, d->op, d->arg);
+            free(d);
+            d = next;
+        }
+    } else if (reason == LWS_CALLBACK_WSI_DESTROY) {
+        // Forget queued operations on wsi, before it is freed.
+        struct deferred_op **p = &deferred;
+        while (*p != NULL) {
+            struct deferred_op *d = *p;
+            if (d->wsi == wsi) {
+                *p = d->next;
+                free(d);
+            } else
+                p = &d->next;
+        }
+    }
+}
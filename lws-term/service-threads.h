@@ -0,0 +1,58 @@
+#ifndef SERVICE_THREADS_H
+#define SERVICE_THREADS_H
+
+/** Support for command worker threads (server.command-threads).
+ * Sessions, windows and settings are shared with the workers,
+ * so every callback runs holding the service lock, as do the workers.
+ * A wsi may only be changed by the service thread;
+ * use wsi_writable (etc) instead of lws_callback_on_writable (etc)
+ * for a wsi other than the one the callback is for.
+ * With no workers there is no locking.
+ */
+
+extern int command_thread_count;
+extern bool service_locking;
+extern void service_threads_init(void);
+extern void service_lock_acquire(void);
+extern void service_lock_release(void);
+extern void service_callback_hook(struct lws *wsi,
+                                  enum lws_callback_reasons reason);
+
+extern void wsi_writable(struct lws *wsi);
+extern void wsi_rx_flow(struct lws *wsi, int enable);
+extern void wsi_kill(struct lws *wsi);
+extern void wsi_set_timer(struct lws *wsi, lws_usec_t usecs);
+
+/** Run work(arg) in a command worker thread, then done(arg) in
+ * the main service thread.  Return false (and do neither)
+ * if there are no worker threads. */
+extern bool offload_work(void (*work)(void *), void (*done)(void *),
+                         void *arg);
+
+/** Wrapper for the callbacks in the protocols table. */
+template <lws_callback_function *callback>
+int
+locked_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                void *user, void *in, size_t len)
+{
+    if (! service_locking)
+        return callback(wsi, reason, user, in, len);
+    service_lock_acquire();
+    service_callback_hook(wsi, reason);
+    int r = callback(wsi, reason, user, in, len);
+    service_lock_release();
+    return r;
+}
+
+/** Declare one of these to let worker threads run
+ * until the end of the enclosing block.  Only use it for work
+ * on data private to the current callback (such as writing
+ * a buffer to the callback's own wsi).
+ * Does nothing unless we hold the lock exactly once. */
+class service_unlock {
+    bool released;
+public:
+    service_unlock();
+    ~service_unlock();
+};
+#endif
@@ -13,8 +13,15 @@
 const char* settings_fname = NULL;
 struct json_object *settings_json_object = NULL;
 const char *settings_as_json; // JSON of settings_json_object
+static struct json_object *settings_delta_object = NULL;
+const char *settings_delta_json = NULL; // JSON of settings_delta_object
+int64_t settings_delta_base = -1;
 int64_t settings_counter = 0;
 
+// Editors typically generate multiple events when saving a file,
+// so wait for things to settle before re-reading settings.
+#define SETTINGS_RELOAD_DELAY_MS 150
+
 struct optinfo { enum option_name name; const char *str; int flags; };
 
 #define OPTION_MISC_TYPE 0
@@ -82,6 +89,16 @@ set_setting(struct json_object **settings, const char *key, const char *value)
                            json_object_new_string(value));
 }
 
+/* Like set_setting on opts->cmd_settings, but also drop the
+ * settings snapshot of opts, so setting_string sees the change. */
+void
+set_cmd_setting(struct options *opts, const char *key, const char *value)
+{
+    set_setting(&opts->cmd_settings, key, value);
+    settings_snapshot_release(opts->settings);
+    opts->settings = NULL;
+}
+
 const char *
 get_setting(struct json_object *settings, const char *key)
 {
@@ -93,15 +110,95 @@ get_setting(struct json_object *settings, const char *key)
         return NULL;
 }
 
+static struct settings_snapshot *global_snapshot = NULL;
+
+static struct settings_snapshot *
+new_settings_snapshot(struct json_object *jobj, struct settings_snapshot *base)
+{
+    struct settings_snapshot *snap = (struct settings_snapshot *)
+        xmalloc(sizeof(struct settings_snapshot));
+    snap->reference_count = 1;
+    snap->base = base;
+    if (base != NULL)
+        base->reference_count++;
+    for (int i = 0; i < NO_opt; i++) {
+        snap->str[i] = NULL;
+        snap->num[i] = 0.0;
+    }
+    if (jobj != NULL) {
+        json_object_object_foreach(jobj, key, val) {
+            struct optinfo *opt = lookup_optinfo(key);
+            if (opt != NULL) {
+                free(snap->str[opt->name]); // if key is repeated
+                snap->str[opt->name] = strdup(json_object_get_string(val));
+                snap->num[opt->name] = json_object_get_double(val);
+            }
+        }
+    }
+    return snap;
+}
+
+void
+settings_snapshot_release(struct settings_snapshot *snap)
+{
+    if (snap != NULL && --snap->reference_count == 0) {
+        settings_snapshot_release(snap->base);
+        for (int i = 0; i < NO_opt; i++)
+            free(snap->str[i]);
+        free(snap);
+    }
+}
+
+static void
+set_global_snapshot(struct json_object *jobj)
+{
+    settings_snapshot_release(global_snapshot);
+    global_snapshot = new_settings_snapshot(jobj, NULL);
+}
+
+/* Get the settings snapshot for opts, (re-)creating it if
+ * it doesn't exist or the global settings have changed since.
+ * The global snapshot is shared; otherwise only the command-line
+ * overrides are copied, so this is O(number of overrides). */
+static struct settings_snapshot *
+options_snapshot(struct options *opts)
+{
+    if (global_snapshot == NULL)
+        global_snapshot = new_settings_snapshot(NULL, NULL);
+    struct settings_snapshot *snap = opts->settings;
+    if (snap == NULL
+        || (snap->base != NULL ? snap->base : snap) != global_snapshot) {
+        settings_snapshot_release(snap);
+        if (opts->cmd_settings == NULL) {
+            snap = global_snapshot;
+            snap->reference_count++;
+        } else
+            snap = new_settings_snapshot(opts->cmd_settings, global_snapshot);
+        opts->settings = snap;
+    }
+    return snap;
+}
+
+const char *
+setting_string(struct options *opts, enum option_name name)
+{
+    struct settings_snapshot *snap = options_snapshot(opts);
+    for (; snap != NULL; snap = snap->base) {
+        if (snap->str[name] != NULL)
+            return snap->str[name];
+    }
+    return NULL;
+}
+
 double
-get_setting_d(struct json_object *settings, const char *key, double dfault)
+setting_number(struct options *opts, enum option_name name, double dfault)
 {
-    errno = 0;
-    struct json_object *value;
-    if (settings == NULL
-        || ! json_object_object_get_ex(settings, key, &value))
-        return dfault;
-    return json_object_get_double(value);
+    struct settings_snapshot *snap = options_snapshot(opts);
+    for (; snap != NULL; snap = snap->base) {
+        if (snap->str[name] != NULL)
+            return snap->num[name];
+    }
+    return dfault;
 }
 
 bool
@@ -125,6 +222,8 @@ check_option_arg(const char *arg, struct options *opts)
             printf_error(opts, "value for option '%s' is not a number", key);
     }
     set_setting_ex(&opts->cmd_settings, key, eq+1, opt, opts);
+    settings_snapshot_release(opts->settings);
+    opts->settings = NULL;
     free(key);
     return true;
 }
@@ -139,10 +238,15 @@ callback_inotify(struct lws *wsi, enum lws_callback_reasons reason,
     switch (reason) {
     case LWS_CALLBACK_RAW_RX_FILE: {
         if (read(inotify_fd, buf, sizeof buf) > 0) {
-            read_settings_file(main_options, true);
+            // (Re-)start the timer, so a burst of events causes one re-read.
+            lws_set_timer_usecs(wsi, SETTINGS_RELOAD_DELAY_MS
+                                * (LWS_USEC_PER_SEC / 1000));
         }
         break;
     }
+    case LWS_CALLBACK_TIMER:
+        read_settings_file(main_options, true);
+        break;
     default:
       //fprintf(stderr, "callback_inotify default reason:%d\n", (int) reason);
         break;
@@ -161,11 +265,62 @@ read_settings_emit_notice()
     lwsl_notice("%s: %s\n", read_settings_message, read_settings_filename);
 }
 
+/* Return an object containing the changed settings from old to cur,
+ * with a null value for each removed setting.
+ * Return NULL if there are no changes.
+ */
+static struct json_object *
+settings_delta(struct json_object *old, struct json_object *cur)
+{
+    struct json_object *delta = json_object_new_object();
+    int changes = 0;
+    json_object_object_foreach(cur, key, val) {
+        struct json_object *oval;
+        if (strcmp(key, "##") == 0)
+            continue;
+        if (! json_object_object_get_ex(old, key, &oval)
+            || strcmp(json_object_to_json_string(oval),
+                      json_object_to_json_string(val)) != 0) {
+            json_object_object_add(delta, key, json_object_get(val));
+            changes++;
+        }
+    }
+    json_object_object_foreach(old, okey, oval) {
+        if (strcmp(okey, "##") != 0
+            && ! json_object_object_get_ex(cur, okey, NULL)) {
+            json_object_object_add(delta, okey, NULL);
+            changes++;
+        }
+    }
+    if (changes == 0) {
+        json_object_put(delta);
+        return NULL;
+    }
+    return delta;
+}
+
+struct settings_parse_data {
+    const char *text;
+    struct json_object **settings;
+    struct options *options;
+};
+
+static void
+read_setting(char *key, char *value, void *vdata)
+{
+    struct settings_parse_data *data = (struct settings_parse_data *) vdata;
+    struct optinfo* opt = lookup_optinfo(key);
+    if (opt == NULL) {
+        fprintf(stderr, "error in %s at byte offset %ld - unknown option '%s'\n",
+                settings_fname, (long) (key - data->text), key);
+    }
+    set_setting_ex(data->settings, key, value, opt, data->options);
+}
+
 void
 read_settings_file(struct options *options, bool re_reading)
 {
-    if (settings_json_object != NULL)
-        json_object_put(settings_json_object);
+    struct json_object *old_settings = settings_json_object;
     struct json_object *jobj = json_object_new_object();
     settings_json_object = jobj;
     if (settings_fname == NULL) {
@@ -190,8 +345,15 @@ read_settings_file(struct options *options, bool re_reading)
     read_settings_filename = settings_fname;
     if (re_reading)
         read_settings_emit_notice();
-    if (bad)
+    if (bad) {
+        if (old_settings != NULL)
+            json_object_put(old_settings);
+        settings_delta_json = NULL;
+        settings_delta_base = -1;
+        settings_as_json = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
+        set_global_snapshot(jobj);
         return;
+    }
     json_object_object_add(jobj, "##",
                            json_object_new_int(++settings_counter));
 
@@ -200,130 +362,52 @@ read_settings_file(struct options *options, bool re_reading)
     char *sbuf = (char*) mmap(NULL, slen+1, PROT_READ|PROT_WRITE, MAP_PRIVATE,
                               settings_fd, 0);
     char *send = sbuf + slen;
-    char *sptr = sbuf;
-
-
-    const char *emsg = "";
-    for (;;) {
-    next:
-        if (sptr == send)
-            goto eof;
-        char ch = *sptr;
-        if (ch == '#') {
-          for (;;) {
-            if (sptr == send)
-                goto eof;
-            ch = *sptr++;
-            if (ch == '\r' ||ch == '\n')
-              goto next;
-          }
-        }
-        //char *sline = sptr;
-        while (ch == ' ' || ch == '\t') {
-            ++sptr;
-            if (sptr == send)
-              goto eof;
-            ch = *sptr;
-        }
-        if (ch == '|') {
-            emsg = "\n(continuation marker '|' must follow a single space)";
-            goto err;
-        }
-        if (ch == '\r' || ch == '\n') {
-          sptr++;
-          goto next;
-        }
-        //if (sptr != sline)
-        //  goto err;
-        char *key_start = sptr;
-        char *key_end = NULL;
+    struct settings_parse_data data = { sbuf, &jobj, options };
+    long err_offset;
+    const char *emsg = parse_settings(sbuf, send, read_setting, &data,
+                                      &err_offset);
+    if (emsg != NULL)
+        fprintf(stderr, "error in %s at byte offset %ld%s\n",
+                settings_fname, err_offset, emsg);
 
-        for (;;) {
-            if ((ch == '=' || ch == ' ' || ch == '\t') && key_end == NULL)
-                key_end = sptr;
-            if (ch == '=')
-              break;
-            if (ch == '\r' || ch == '\n')
-                goto err;
-            ++sptr;
-            if (sptr == send)
-              goto err;
-            ch = *sptr;
-        }
-        *key_end = '\0';
-        struct optinfo* opt = lookup_optinfo(key_start);
-        if (opt == NULL) {
-        fprintf(stderr, "error in %s at byte offset %ld - unknown option '%s'\n",
-            settings_fname, (long) (key_start - sbuf), key_start);
+    munmap(sbuf, slen);
+    close(settings_fd);
+    if (old_settings != NULL) {
+        struct json_object *delta = settings_delta(old_settings, jobj);
+        struct json_object *jcounter;
+        if (delta == NULL
+            && json_object_object_get_ex(old_settings, "##", &jcounter)) {
+            // Nothing changed (for example the file was just touched):
+            // keep the old generation, and don't bother the clients.
+            settings_counter--;
+            settings_json_object = old_settings;
+            json_object_put(jobj);
+            return;
         }
-        sptr++; // skip '='
-        while (sptr < send && (*sptr == ' ' || *sptr == '\t'))
-          sptr++;
-        char *value_start = sptr;
-        while (sptr < send && *sptr != '\r' && *sptr != '\n')
-          sptr++;
-        char*value_end = sptr;
-        if (sptr < send)
-          sptr++;
-        if (value_start == value_end) {
-          while (sptr + 2 < send && sptr[0] == ' ' && sptr[1] == '|') {
-            sptr += 2;
-            while (sptr < send && *sptr != '\r' && *sptr != '\n')
-              sptr++;
-            if (sptr < send)
-              sptr++;
-          }
-          char *psrc = value_start;
-          char *pdst = value_start;
-          while (psrc < sptr) {
-            char ch = *psrc++;
-            *pdst++ = ch;
-            if (ch == '\n' && psrc[0] == ' ' && psrc[1] == '|') {
-              if (psrc-1 == value_start)
-                pdst--;
-              psrc += 2;
-            }
-          }
-          value_end = pdst;
+        if (settings_delta_object != NULL)
+            json_object_put(settings_delta_object);
+        settings_delta_object = delta;
+        settings_delta_json = NULL;
+        settings_delta_base = -1;
+        if (delta != NULL
+            && json_object_object_get_ex(old_settings, "##", &jcounter)) {
+            settings_delta_base = json_object_get_int64(jcounter);
+            json_object_object_add(delta, "#base",
+                                   json_object_new_int64(settings_delta_base));
+            json_object_object_add(delta, "##",
+                                   json_object_new_int64(settings_counter));
+            settings_delta_json =
+                json_object_to_json_string_ext(delta, JSON_C_TO_STRING_PLAIN);
         }
-        *value_end = '\0';
-
-        set_setting_ex(&jobj, key_start, value_start, opt, options);
+        json_object_put(old_settings);
     }
- err:
-    fprintf(stderr, "error in %s at byte offset %ld%s\n",
-            settings_fname, (long) (sptr - sbuf), emsg);
- eof:
-
-    munmap(sbuf, slen);
-    close(settings_fd);
     settings_as_json = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
+    set_global_snapshot(jobj);
+    set_callback_timing(global_snapshot->str[log_slow_callback_opt] == NULL ? 0
+                        : global_snapshot->num[log_slow_callback_opt]);
     request_upload_settings();
 }
 
-struct json_object *
-merged_settings(struct json_object *cmd_settings)
-{
-    struct json_object *jsettings = settings_json_object;
-    if (cmd_settings) {
-        if (jsettings == NULL)
-            return json_object_get(cmd_settings);
-#if JSON_C_VERSION_NUM >= ((0 << 16) | (13 << 8))
-        jsettings = NULL;
-        json_object_deep_copy(settings_json_object, &jsettings, NULL);
-#else
-	jsettings = json_tokener_parse(json_object_get_string(settings_json_object));
-#endif
-        json_object_object_foreach(cmd_settings, key, val) {
-            json_object_object_add(jsettings, key, json_object_get(val));
-        }
-        return jsettings;
-    } else if (jsettings == NULL)
-        return json_object_new_object();
-    else
-        return json_object_get(jsettings);
-}
-
 void
 set_settings(struct options *options)
 {
@@ -331,23 +415,22 @@ set_settings(struct options *options)
     set_setting(&options->cmd_settings,
                 SERVER_FOR_CLIPBOARD, "paste,selection-paste");
 #endif
-    if (options->settings != NULL)
-        json_object_put(options->settings);
-    struct json_object *msettings = merged_settings(options->cmd_settings);
-    options->settings = msettings;
+    // cmd_settings may have changed, so force a new snapshot.
+    settings_snapshot_release(options->settings);
+    options->settings = NULL;
 
     if (options->shell_argv)
         free((void*) options->shell_argv);
-    options->shell_argv = parse_args(get_setting(options->settings, "shell.default"), false);
-    double d = get_setting_d(options->settings, "remote-output-interval", 10.0);
+    options->shell_argv = parse_args(setting_string(options, shell_command_opt), false);
+    double d = setting_number(options, remote_output_interval_opt, 10.0);
     options->remote_output_interval = (long) (d * 1000);
-    double d2 = get_setting_d(options->settings, "remote-output-timeout", -1.0);
+    double d2 = setting_number(options, remote_output_timeout_opt, -1.0);
     if (d2 < 0)
         d2  = 2 * d;
     options->remote_output_timeout = (long) (d2 * 1000);
-    d = get_setting_d(options->settings, "remote-input-timeout", -1.0);
+    d = setting_number(options, remote_input_timeout_opt, -1.0);
     if (d < 0)
-        d  = 2 * get_setting_d(options->settings, "remote-input-interval", 10.0);
+        d  = 2 * setting_number(options, remote_input_interval_opt, 10.0);
     options->remote_input_timeout = (long) (d * 1000);
 }
 
@@ -0,0 +1,238 @@
+/* Zero-copy output for the remote end of a --browser-pipe (ssh) session.
+ * Normally pty output is read into the proxy tclient's ob buffer,
+ * copied into a new buffer by handle_output, and written to
+ * proxy_fd_out.  When the proxy is the session's only window and the
+ * server has nothing of its own queued (no control messages, nothing
+ * in ob), handle_process_output instead calls splice_relay_output,
+ * which splices the output from the pty into a pipe and from the pipe
+ * to proxy_fd_out, so it never enters user space.
+ *
+ * Output that is preserved (the default, preserve_mode 1) or recorded
+ * is also tee'd to a second pipe and read from there (splice_relay_copy).
+ * That is two more system calls than a read and write, but the output
+ * is copied to user space once, rather than into ob, into the preserved
+ * output, and again by handle_output for the write.
+ *
+ * Output left in the pipe (proxy_fd_out is full) is written by
+ * handle_output (splice_relay_flush) before anything else, so the
+ * byte stream is unchanged; meanwhile output takes the normal path.
+ * If the pty or proxy_fd_out does not support splice, the session
+ * quietly goes back to the normal path.
+ */
+#include "server.h"
+
+#if HAVE_SPLICE && REMOTE_SSH
+
+#define SPLICE_FLAGS (SPLICE_F_MOVE|SPLICE_F_NONBLOCK)
+
+static bool
+open_pipe(int *fds)
+{
+    if (fds[0] >= 0)
+        return true;
+    if (pipe2(fds, O_CLOEXEC|O_NONBLOCK) == 0)
+        return true;
+    fds[0] = fds[1] = -1;
+    return false;
+}
+
+static void
+close_pipe(int *fds)
+{
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    fds[0] = fds[1] = -1;
+}
+
+/* Give up on splicing for tclient; move what is still in the pipe
+ * to the front of ob, to be written by handle_output as usual. */
+static void
+splice_relay_disable(struct tty_client *tclient)
+{
+    tclient->splice_disabled = true;
+    if (tclient->splice_pending > 0) {
+        struct sbuf buf;
+        sbuf_init(&buf);
+        sbuf_extend(&buf, tclient->splice_pending + tclient->ob.len);
+        while (tclient->splice_pending > 0) {
+            ssize_t n = read(tclient->splice_pipe[0], buf.buffer + buf.len,
+                             tclient->splice_pending);
+            if (n <= 0)
+                break;
+            buf.len += n;
+            tclient->splice_pending -= n;
+        }
+        sbuf_append(&buf, tclient->ob.buffer, tclient->ob.len);
+        sbuf_free(&tclient->ob);
+        tclient->ob = buf;
+        tclient->splice_pending = 0;
+    }
+    close_pipe(tclient->splice_pipe);
+    close_pipe(tclient->splice_copy_pipe);
+}
+
+/* Read length bytes (that are known to be there) from fd into buf. */
+static bool
+read_pipe(int fd, char *buf, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = read(fd, buf, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        length -= n;
+    }
+    return true;
+}
+
+/* Pass the n bytes of output just spliced into tclient's (otherwise
+ * empty) pipe to pclient's preserved output and recording:
+ * tee them to the copy pipe, and read them from that.
+ * If that fails, stop splicing (which moves the output to ob),
+ * and take them from ob. */
+static void
+splice_relay_copy(struct pty_client *pclient, struct tty_client *tclient,
+                  size_t n)
+{
+    static struct sbuf copy; // reused; only the service thread gets here
+    char *data;
+    ssize_t m = -1;
+    if (open_pipe(tclient->splice_copy_pipe))
+        m = tee(tclient->splice_pipe[0], tclient->splice_copy_pipe[1],
+                n, SPLICE_F_NONBLOCK);
+    copy.len = 0;
+    sbuf_extend(&copy, n);
+    if (m == (ssize_t) n
+        && read_pipe(tclient->splice_copy_pipe[0], copy.buffer, n))
+        data = copy.buffer;
+    else {
+        lwsl_notice("tee for proxy conn#%d failed (%s) - copying output\n",
+                    tclient->connection_number,
+                    m < 0 ? strerror(errno) : "short copy");
+        splice_relay_disable(tclient);
+        data = tclient->ob.buffer;
+        if (n > tclient->ob.len)
+            n = tclient->ob.len;
+    }
+    if (pclient->recording)
+        recording_output(pclient, data, n);
+    if (should_backup_output(pclient))
+        backup_output(pclient, data, n);
+}
+
+/* Write output still in tclient's pipe to proxy_fd_out.
+ * Return true if the pipe is (now) empty. */
+bool
+splice_relay_flush(struct tty_client *tclient)
+{
+    while (tclient->splice_pending > 0) {
+        ssize_t n = splice(tclient->splice_pipe[0], NULL,
+                           tclient->proxy_fd_out, NULL,
+                           tclient->splice_pending, SPLICE_FLAGS);
+        if (n > 0) {
+            tclient->splice_pending -= n;
+            tclient->bytes_written += n;
+        } else if (n < 0 && errno == EAGAIN)
+            return false;
+        else {
+            lwsl_notice("splice to proxy conn#%d failed (%s) - copying output\n",
+                        tclient->connection_number,
+                        n < 0 ? strerror(errno) : "no progress");
+            splice_relay_disable(tclient);
+        }
+    }
+    return true;
+}
+
+/* Called by handle_process_output for output from pclient's pty.
+ * Return false if the output should be handled the normal way;
+ * otherwise set *result to the value handle_process_output returns. */
+bool
+splice_relay_output(struct pty_client *pclient, int *result)
+{
+    struct tty_client *tclient = NULL;
+    FOREACH_WSCLIENT(t, pclient) {
+        if (! t->out_wsi)
+            continue;
+        if (tclient != NULL)
+            return false;
+        tclient = t;
+    }
+    if (tclient == NULL || tclient->proxyMode != proxy_remote
+        || tclient->splice_disabled || tclient->proxy_fd_out < 0
+        || pclient->uring != NULL || pclient->uses_packet_mode
+        || pclient->paused)
+        return false;
+    // Anything from the server must go first, the normal way.
+    if (tclient->splice_pending > 0 || tclient->ob.len > 0
+        || tclient->initialized != 2 || tclient->uploadSettingsNeeded
+        || tclient->pty_window_update_needed || tclient->detachSaveSend
+        || tclient->requesting_contents == 1)
+        return false;
+    long unconfirmed =
+        ((tclient->sent_count - tclient->confirmed_count) & MASK28)
+        + tclient->ocount;
+    if (unconfirmed >= MAX_UNCONFIRMED)
+        return false; // let handle_process_output pause the session
+    if (! open_pipe(tclient->splice_pipe)) {
+        splice_relay_disable(tclient);
+        return false;
+    }
+
+    server_stats.pty_read_syscalls++;
+    ssize_t n = splice(pclient->pty, NULL, tclient->splice_pipe[1], NULL,
+                       MAX_UNCONFIRMED - unconfirmed, SPLICE_FLAGS);
+    lwsl_hot("RAW_RX pty %d session %d spliced %ld conn#%d\n",
+             pclient->pty, pclient->session_number, (long) n,
+             tclient->connection_number);
+    if (n < 0) {
+        if (errno == EAGAIN) {
+            *result = 0;
+            return true;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            lwsl_notice("cannot splice from pty of session %d - copying output\n",
+                        pclient->session_number);
+            splice_relay_disable(tclient);
+        }
+        return false; // a read gets the same error
+    }
+    if (n == 0) {
+        *result = -1;
+        return true;
+    }
+    tclient->splice_pending = n;
+    tclient->sent_count = (tclient->sent_count + n) & MASK28;
+    pclient->bytes_read += n;
+    server_stats.pty_bytes_read += n;
+    if (should_backup_output(pclient) || pclient->recording)
+        splice_relay_copy(pclient, tclient, n);
+
+    if (tclient->options && tclient->options->remote_output_interval)
+        wsi_set_timer(tclient->out_wsi,
+                      tclient->options->remote_output_interval
+                      * (LWS_USEC_PER_SEC / 1000));
+    if (! splice_relay_flush(tclient) || tclient->splice_disabled)
+        wsi_writable(tclient->out_wsi);
+    *result = 0;
+    return true;
+}
+
+void
+splice_relay_close(struct tty_client *tclient)
+{
+    close_pipe(tclient->splice_pipe);
+    close_pipe(tclient->splice_copy_pipe);
+    tclient->splice_pending = 0;
+}
+
+#else /* ! (HAVE_SPLICE && REMOTE_SSH) */
+
+bool splice_relay_output(struct pty_client *, int *) { return false; }
+bool splice_relay_flush(struct tty_client *) { return true; }
+void splice_relay_close(struct tty_client *) { }
+#endif
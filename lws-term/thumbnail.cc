@@ -0,0 +1,693 @@
+/* Downscaled copies of images, for "imgcat --fit".
+ * A PNG or JPEG image larger than the window is decoded, scaled down
+ * (averaging the source pixels under each result pixel) and encoded
+ * again in the same format; imgcat inlines that instead of the original.
+ *
+ * Decoding is a row at a time, straight into the scaler, so memory use
+ * depends on the width of the image and the size of the result, not on
+ * the size of the image.  Files over THUMBNAIL_MAX_BYTES and images over
+ * THUMBNAIL_MAX_PIXELS (going by their headers) are not scaled at all,
+ * so a small file can't make us decode a huge image.
+ *
+ * Both go in a cache directory (thumbnails in the socket directory),
+ * named by a hash of the original's contents: the scaled copy as
+ * HASH-WxH.EXT, so the same image at the same size is only scaled once,
+ * and a copy of the original as HASH.EXT.  The server serves the
+ * originals at /thumbnails/HASH.EXT (see callback_http), so imgcat
+ * links the scaled image to the full-size one without putting it in
+ * the output.  HASH is a 128-bit SipHash-2-4, keyed with a random
+ * secret kept in the cache directory, so the names can't be guessed
+ * from an image (to find out whether someone has viewed it), nor
+ * collisions made on purpose; hence no server key is needed.
+ * Files are touched when used, and when the cache grows past
+ * THUMBNAIL_CACHE_MAX the least recently used are removed.
+ */
+#include "server.h"
+#include <setjmp.h>
+#include <dirent.h>
+#if HAVE_LIBPNG
+#include <png.h>
+#endif
+#if HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#define THUMBNAIL_JPEG_QUALITY 85
+#define THUMBNAIL_MAX_BYTES (64 << 20)
+#define THUMBNAIL_MAX_PIXELS (64 << 20)
+#define THUMBNAIL_MAX_DIMENSION 65535
+/* Limit on the decoders' own allocations (progressive JPEGs keep all
+ * their coefficients; PNG text and profile chunks get decompressed). */
+#define THUMBNAIL_MAX_MEMORY (256 << 20)
+#define THUMBNAIL_CACHE_MAX (256 << 20)
+#define THUMBNAIL_IO_CHUNK 65536
+
+/* The cache directory, created if needed; NULL if it can't be. */
+const char *
+thumbnail_dir()
+{
+    static char *dir = NULL;
+    if (dir == NULL) {
+        const char *sdir = domterm_socket_dir();
+        char *d = challoc(strlen(sdir) + sizeof("/thumbnails"));
+        sprintf(d, "%s/thumbnails", sdir);
+        if (mkdir(d, S_IRWXU) != 0 && errno != EEXIST) {
+            free(d);
+            return NULL;
+        }
+        dir = d;
+    }
+    return dir;
+}
+
+#define THUMBNAIL_KEY_LENGTH 16
+
+/* The secret hash key of the cache, created if needed; NULL if
+ * it can't be.  It is kept in the cache so names stay valid when
+ * the server is restarted. */
+static const unsigned char *
+thumbnail_key(const char *dir)
+{
+    static unsigned char key[THUMBNAIL_KEY_LENGTH];
+    static bool have_key = false;
+    if (have_key)
+        return key;
+    char *path = challoc(strlen(dir) + sizeof("/key"));
+    sprintf(path, "%s/key", dir);
+    int fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        char nkey[THUMBNAIL_KEY_LENGTH];
+        generate_random_string(nkey, THUMBNAIL_KEY_LENGTH);
+        bool ok = write(fd, nkey, THUMBNAIL_KEY_LENGTH)
+            == THUMBNAIL_KEY_LENGTH;
+        close(fd);
+        if (! ok)
+            unlink(path);
+    }
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+        return NULL;
+    have_key = read(fd, key, THUMBNAIL_KEY_LENGTH) == THUMBNAIL_KEY_LENGTH;
+    close(fd);
+    return have_key ? key : NULL;
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do {                                                   \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);   \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                        \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                        \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);   \
+    } while (0)
+
+static uint64_t
+load_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 8; --i >= 0; )
+        v = (v << 8) | p[i];
+    return v;
+}
+
+/* SipHash-2-4 with 128-bit output, fed a piece at a time. */
+struct siphash {
+    uint64_t v0, v1, v2, v3;
+    unsigned char tail[8];
+    uint64_t length;
+};
+
+static void
+siphash_init(struct siphash *h, const unsigned char *key)
+{
+    uint64_t k0 = load_le64(key), k1 = load_le64(key + 8);
+    h->v0 = k0 ^ 0x736f6d6570736575ULL;
+    h->v1 = k1 ^ 0x646f72616e646f6dULL ^ 0xee;
+    h->v2 = k0 ^ 0x6c7967656e657261ULL;
+    h->v3 = k1 ^ 0x7465646279746573ULL;
+    h->length = 0;
+}
+
+static void
+siphash_update(struct siphash *h, const unsigned char *data, size_t length)
+{
+    uint64_t v0 = h->v0, v1 = h->v1, v2 = h->v2, v3 = h->v3;
+    size_t ntail = h->length & 7;
+    h->length += length;
+    while (length > 0) {
+        uint64_t m;
+        if (ntail > 0 || length < 8) {
+            size_t n = 8 - ntail;
+            if (n > length)
+                n = length;
+            memcpy(h->tail + ntail, data, n);
+            data += n;
+            length -= n;
+            ntail += n;
+            if (ntail < 8)
+                break;
+            ntail = 0;
+            m = load_le64(h->tail);
+        } else {
+            m = load_le64(data);
+            data += 8;
+            length -= 8;
+        }
+        v3 ^= m;
+        SIPROUND; SIPROUND;
+        v0 ^= m;
+    }
+    h->v0 = v0; h->v1 = v1; h->v2 = v2; h->v3 = v3;
+}
+
+/* Finish the hash, as hex in out (33 bytes). */
+static void
+siphash_final(struct siphash *h, char *out)
+{
+    uint64_t v0 = h->v0, v1 = h->v1, v2 = h->v2, v3 = h->v3;
+    uint64_t b = h->length << 56;
+    for (int i = h->length & 7; --i >= 0; )
+        b |= (uint64_t) h->tail[i] << (8 * i);
+    v3 ^= b;
+    SIPROUND; SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xee;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    uint64_t h0 = v0 ^ v1 ^ v2 ^ v3;
+    v1 ^= 0xdd;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    uint64_t h1 = v0 ^ v1 ^ v2 ^ v3;
+    sprintf(out, "%016llx%016llx",
+            (unsigned long long) h0, (unsigned long long) h1);
+}
+
+/* Hash the first length bytes of fd, as hex in out (33 bytes). */
+static bool
+content_hash(const unsigned char *key, int fd, off_t length, char *out)
+{
+    struct siphash h;
+    siphash_init(&h, key);
+    unsigned char *buf = (unsigned char *) xmalloc(THUMBNAIL_IO_CHUNK);
+    off_t pos = 0;
+    while (pos < length) {
+        ssize_t n = pread(fd, buf, THUMBNAIL_IO_CHUNK, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        siphash_update(&h, buf, n);
+        pos += n;
+    }
+    free(buf);
+    if (pos != length)
+        return false;
+    siphash_final(&h, out);
+    return true;
+}
+
+/* Scales an image down as its rows are decoded: each destination pixel
+ * is the average of the source pixels it covers.  Source rows are added
+ * into sums for the current destination row, which is finished when its
+ * last source row has been added.  With 4 channels (RGBA) the colours
+ * are weighted by alpha. */
+struct scaler {
+    int sw, sh, dw, dh, nchan;
+    int *xmap;      // destination column of each source column
+    int *xcount;    // number of source columns of each destination column
+    uint64_t *sum;  // dw * nchan sums for the current destination row
+    int dy;         // current destination row
+    int y0, y1;     // source rows of row dy
+    int sy;         // next source row
+    unsigned char *dst;
+};
+
+static void
+scaler_init(struct scaler *s, int sw, int sh, int nchan, int dw, int dh)
+{
+    s->sw = sw;
+    s->sh = sh;
+    s->dw = dw;
+    s->dh = dh;
+    s->nchan = nchan;
+    s->xmap = (int *) xmalloc(sw * sizeof(int));
+    s->xcount = (int *) xmalloc(dw * sizeof(int));
+    for (int x = 0; x < dw; x++) {
+        int x0 = (int) ((int64_t) x * sw / dw);
+        int x1 = (int) ((int64_t) (x + 1) * sw / dw);
+        s->xcount[x] = x1 - x0;
+        for (int sx = x0; sx < x1; sx++)
+            s->xmap[sx] = x;
+    }
+    s->sum = (uint64_t *) xmalloc((size_t) dw * nchan * sizeof(uint64_t));
+    memset(s->sum, 0, (size_t) dw * nchan * sizeof(uint64_t));
+    s->dy = 0;
+    s->y0 = 0;
+    s->y1 = sh / dh;
+    s->sy = 0;
+    s->dst = (unsigned char *) xmalloc((size_t) dw * dh * nchan);
+}
+
+static void
+scaler_add_row(struct scaler *s, const unsigned char *row)
+{
+    int nchan = s->nchan;
+    if (s->dy >= s->dh)
+        return;
+    uint64_t *sum = s->sum;
+    const unsigned char *p = row;
+    for (int sx = 0; sx < s->sw; sx++, p += nchan) {
+        uint64_t *q = sum + s->xmap[sx] * nchan;
+        if (nchan == 4) {
+            q[0] += p[0] * p[3];
+            q[1] += p[1] * p[3];
+            q[2] += p[2] * p[3];
+            q[3] += p[3];
+        } else {
+            for (int c = 0; c < nchan; c++)
+                q[c] += p[c];
+        }
+    }
+    if (++s->sy < s->y1)
+        return;
+    unsigned char *d = s->dst + (size_t) s->dy * s->dw * nchan;
+    for (int x = 0; x < s->dw; x++, d += nchan, sum += nchan) {
+        uint64_t count = (uint64_t) (s->y1 - s->y0) * s->xcount[x];
+        if (nchan == 4) {
+            d[3] = (unsigned char) (sum[3] / count);
+            for (int c = 0; c < 3; c++)
+                d[c] = sum[3] == 0 ? 0 : (unsigned char) (sum[c] / sum[3]);
+        } else {
+            for (int c = 0; c < nchan; c++)
+                d[c] = (unsigned char) (sum[c] / count);
+        }
+    }
+    memset(s->sum, 0, (size_t) s->dw * nchan * sizeof(uint64_t));
+    s->dy++;
+    s->y0 = s->y1;
+    s->y1 = (int) ((int64_t) (s->dy + 1) * s->sh / s->dh);
+}
+
+static void
+scaler_free(struct scaler *s)
+{
+    free(s->xmap);
+    free(s->xcount);
+    free(s->sum);
+    free(s->dst);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Set *dw and *dh to the size of a w by h image scaled to fit in
+ * max_width by max_height.  Return false if it already fits,
+ * or is too big to scale. */
+static bool
+fit_size(int w, int h, int max_width, int max_height, int *dw, int *dh)
+{
+    if (w <= max_width && h <= max_height)
+        return false;
+    if (w > THUMBNAIL_MAX_DIMENSION || h > THUMBNAIL_MAX_DIMENSION
+        || (int64_t) w * h > THUMBNAIL_MAX_PIXELS)
+        return false;
+    if ((int64_t) w * max_height > (int64_t) h * max_width) {
+        *dw = max_width;
+        *dh = (int) ((int64_t) h * max_width / w);
+    } else {
+        *dh = max_height;
+        *dw = (int) ((int64_t) w * max_height / h);
+    }
+    if (*dw < 1)
+        *dw = 1;
+    if (*dh < 1)
+        *dh = 1;
+    return true;
+}
+
+#if HAVE_LIBPNG
+static bool
+scale_png(FILE *in, int max_width, int max_height, struct sbuf *out)
+{
+    struct scaler sc; // address taken, so kept in memory
+    memset(&sc, 0, sizeof(sc));
+    unsigned char *volatile row = NULL;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+                                             NULL, NULL, NULL);
+    png_infop info = png == NULL ? NULL : png_create_info_struct(png);
+    if (info == NULL) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        free(row);
+        scaler_free(&sc);
+        return false;
+    }
+    png_init_io(png, in);
+    png_set_user_limits(png, THUMBNAIL_MAX_DIMENSION,
+                        THUMBNAIL_MAX_DIMENSION);
+    png_set_chunk_malloc_max(png, THUMBNAIL_MAX_MEMORY);
+    png_read_info(png, info);
+    int sw = png_get_image_width(png, info);
+    int sh = png_get_image_height(png, info);
+    int color_type = png_get_color_type(png, info);
+    int dw, dh;
+    // Interlaced images can only be scaled after decoding all of them.
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE
+        || ! fit_size(sw, sh, max_width, max_height, &dw, &dh)) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return false;
+    }
+    png_set_expand(png);
+    png_set_strip_16(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY
+        || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xFF, PNG_FILLER_AFTER);
+    png_read_update_info(png, info);
+    if (png_get_rowbytes(png, info) != (size_t) sw * 4) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return false;
+    }
+    scaler_init(&sc, sw, sh, 4, dw, dh);
+    row = (unsigned char *) xmalloc((size_t) sw * 4);
+    for (int y = 0; y < sh; y++) {
+        png_read_row(png, row, NULL);
+        scaler_add_row(&sc, row);
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    free(row);
+
+    png_image simage;
+    memset(&simage, 0, sizeof(simage));
+    simage.version = PNG_IMAGE_VERSION;
+    simage.width = dw;
+    simage.height = dh;
+    simage.format = PNG_FORMAT_RGBA;
+    png_alloc_size_t size = 0;
+    bool ok = png_image_write_to_memory(&simage, NULL, &size, 0,
+                                        sc.dst, 0, NULL);
+    if (ok) {
+        sbuf_extend(out, size);
+        ok = png_image_write_to_memory(&simage, out->buffer + out->len,
+                                       &size, 0, sc.dst, 0, NULL);
+        if (ok)
+            out->len += size;
+    }
+    scaler_free(&sc);
+    return ok;
+}
+#endif
+
+#if HAVE_LIBJPEG
+struct jpeg_error_jump {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void
+jpeg_error_longjmp(j_common_ptr cinfo)
+{
+    longjmp(((struct jpeg_error_jump *) cinfo->err)->jump, 1);
+}
+
+static bool
+scale_jpeg(FILE *in, int max_width, int max_height, struct sbuf *out)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_jump err;
+    struct scaler sc; // address taken, so kept in memory
+    memset(&sc, 0, sizeof(sc));
+    unsigned char *volatile row = NULL;
+    unsigned char *mem = NULL; // address taken, so kept in memory
+    unsigned long mem_size = 0;
+    volatile bool compressing = false;
+    dinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_longjmp;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&dinfo);
+        if (compressing)
+            jpeg_destroy_compress(&cinfo);
+        free(row);
+        scaler_free(&sc);
+        free(mem);
+        return false;
+    }
+    jpeg_create_decompress(&dinfo);
+    dinfo.mem->max_memory_to_use = THUMBNAIL_MAX_MEMORY;
+    jpeg_stdio_src(&dinfo, in);
+    jpeg_read_header(&dinfo, TRUE);
+    int dw, dh;
+    if (! fit_size(dinfo.image_width, dinfo.image_height,
+                   max_width, max_height, &dw, &dh)) {
+        jpeg_destroy_decompress(&dinfo);
+        return false;
+    }
+    // Let the decoder do most of the scaling, by 1/2, 1/4 or 1/8.
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = 1;
+    while (dinfo.scale_denom < 8
+           && dinfo.image_width / (dinfo.scale_denom * 2) >= (unsigned) dw
+           && dinfo.image_height / (dinfo.scale_denom * 2) >= (unsigned) dh)
+        dinfo.scale_denom *= 2;
+    dinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&dinfo);
+    int sw = dinfo.output_width, sh = dinfo.output_height;
+    scaler_init(&sc, sw, sh, 3, dw, dh);
+    row = (unsigned char *) xmalloc((size_t) sw * 3);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW r = row;
+        jpeg_read_scanlines(&dinfo, &r, 1);
+        scaler_add_row(&sc, row);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_longjmp;
+    jpeg_create_compress(&cinfo);
+    compressing = true;
+    jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    cinfo.image_width = dw;
+    cinfo.image_height = dh;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, THUMBNAIL_JPEG_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW r = sc.dst + (size_t) cinfo.next_scanline * dw * 3;
+        jpeg_write_scanlines(&cinfo, &r, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    sbuf_append(out, (const char *) mem, mem_size);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    scaler_free(&sc);
+    free(mem);
+    return true;
+}
+#endif
+
+static bool
+read_file(const char *path, struct sbuf *out)
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        sbuf_extend(out, st.st_size);
+        ok = read(fd, out->buffer + out->len, st.st_size) == st.st_size;
+        if (ok)
+            out->len += st.st_size;
+    }
+    close(fd);
+    return ok;
+}
+
+/* Write data to path, atomically (so readers never see part of it).
+ * If data is NULL, copy the first length bytes of fd_in instead,
+ * a chunk at a time. */
+static void
+write_file(const char *path, const char *data, size_t length, int fd_in)
+{
+    size_t plen = strlen(path);
+    char *tmp = challoc(plen + 20);
+    sprintf(tmp, "%s.%d", path, getpid());
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    bool ok = fd >= 0;
+    char *buf = data != NULL ? NULL : challoc(THUMBNAIL_IO_CHUNK);
+    off_t pos = 0;
+    while (ok && length > 0) {
+        size_t count = length;
+        if (buf != NULL) {
+            ssize_t n = pread(fd_in, buf, count < THUMBNAIL_IO_CHUNK
+                              ? count : THUMBNAIL_IO_CHUNK, pos);
+            if (n < 0 && errno == EINTR)
+                continue;
+            ok = n > 0;
+            if (! ok)
+                break;
+            pos += n;
+            count = n;
+            data = buf;
+        }
+        while (ok && count > 0) {
+            ssize_t n = write(fd, data, count);
+            ok = n > 0;
+            if (ok) {
+                data += n;
+                count -= n;
+                length -= n;
+            }
+        }
+    }
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    if (! ok || rename(tmp, path) != 0)
+        unlink(tmp);
+    free(tmp);
+}
+
+struct cache_entry {
+    char *name;
+    time_t mtime;
+    off_t size;
+};
+
+static int
+compare_cache_entries(const void *a, const void *b)
+{
+    time_t ta = ((const struct cache_entry *) a)->mtime;
+    time_t tb = ((const struct cache_entry *) b)->mtime;
+    return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+/* If the cache is over THUMBNAIL_CACHE_MAX bytes, remove the least
+ * recently used files (going by mtime) until it is under 3/4 of that. */
+static void
+thumbnail_prune(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    struct cache_entry *entries = NULL;
+    size_t count = 0, allocated = 0;
+    off_t total = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        if (ent->d_name[0] == '.' || strcmp(ent->d_name, "key") == 0
+            || fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+            || ! S_ISREG(st.st_mode))
+            continue;
+        if (count == allocated) {
+            allocated = allocated ? 2 * allocated : 64;
+            entries = (struct cache_entry *)
+                xrealloc(entries, allocated * sizeof(struct cache_entry));
+        }
+        entries[count].name = strdup(ent->d_name);
+        entries[count].mtime = st.st_mtime;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    if (total > THUMBNAIL_CACHE_MAX) {
+        qsort(entries, count, sizeof(struct cache_entry),
+              compare_cache_entries);
+        for (size_t i = 0;
+             i < count && total > THUMBNAIL_CACHE_MAX / 4 * 3; i++) {
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0)
+                total -= entries[i].size;
+        }
+    }
+    closedir(d);
+    for (size_t i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+}
+
+/* Make a copy of the image in fd (a regular file) of type mime that fits
+ * in max_width by max_height pixels.  Return false if it already fits,
+ * or it isn't a PNG or JPEG, or is too big, or can't be decoded.
+ * Otherwise, set thumb's data to the encoded copy (of type thumb->mime),
+ * and thumb->original to the URL (relative to the server) of the original.
+ * The file offset of fd is left unspecified. */
+bool
+image_thumbnail(int fd, const char *mime, int max_width, int max_height,
+                struct thumbnail *thumb)
+{
+    const char *ext;
+    bool (*scale)(FILE *, int, int, struct sbuf *);
+    if (strcmp(mime, "image/png") == 0) {
+        ext = "png";
+#if HAVE_LIBPNG
+        scale = scale_png;
+#else
+        return false;
+#endif
+    } else if (strcmp(mime, "image/jpeg") == 0) {
+        ext = "jpg";
+#if HAVE_LIBJPEG
+        scale = scale_jpeg;
+#else
+        return false;
+#endif
+    } else
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ! S_ISREG(st.st_mode)
+        || st.st_size > THUMBNAIL_MAX_BYTES
+        || max_width <= 0 || max_height <= 0)
+        return false;
+    const char *dir = thumbnail_dir();
+    const unsigned char *key = dir == NULL ? NULL : thumbnail_key(dir);
+    char hash[33];
+    if (key == NULL || ! content_hash(key, fd, st.st_size, hash))
+        return false;
+    size_t dlen = strlen(dir) + 80;
+    char *path = challoc(dlen);
+    snprintf(path, dlen, "%s/%s-%dx%d.%s",
+             dir, hash, max_width, max_height, ext);
+    sbuf_init(&thumb->data);
+    bool added = false;
+    bool ok = read_file(path, &thumb->data);
+    if (ok)
+        utimensat(AT_FDCWD, path, NULL, 0);
+    else {
+        thumb->data.len = 0;
+        int fd2 = lseek(fd, 0, SEEK_SET) == 0 ? dup(fd) : -1;
+        FILE *in = fd2 < 0 ? NULL : fdopen(fd2, "rb");
+        if (in == NULL && fd2 >= 0)
+            close(fd2);
+        ok = in != NULL
+            && (*scale)(in, max_width, max_height, &thumb->data);
+        if (in != NULL)
+            fclose(in);
+        if (ok) {
+            write_file(path, thumb->data.buffer, thumb->data.len, -1);
+            added = true;
+        }
+    }
+    if (ok) {
+        // Keep a copy of the original for the server.  (Not a link:
+        // the user's file may change, or lose its permissions.)
+        // Touching it also tells thumbnail_prune it's in use.
+        snprintf(path, dlen, "%s/%s.%s", dir, hash, ext);
+        if (utimensat(AT_FDCWD, path, NULL, 0) != 0) {
+            write_file(path, NULL, st.st_size, fd);
+            added = true;
+        }
+        thumb->mime = mime;
+        thumb->original = challoc(60);
+        sprintf(thumb->original, "/thumbnails/%s.%s", hash, ext);
+    } else
+        sbuf_free(&thumb->data);
+    free(path);
+    if (added)
+        thumbnail_prune(dir);
+    return ok;
+}
@@ -0,0 +1,760 @@
+/* Upgrading the server without stopping the sessions.
+ * "domterm upgrade-server" starts a new server process (a fresh exec
+ * of the ldomterm executable, which may have been replaced by a new
+ * build) with --upgrade-fd=FD, one end of a socketpair, and sends it:
+ * - a header: the length of the state and the number of descriptors;
+ * - the state (JSON): options, server key and http port, and for each
+ *   session its number, name, pid, window size, counts, and so on;
+ * - the preserved output and saved window contents of each session
+ *   (their lengths are in the state);
+ * - the descriptors (SCM_RIGHTS): the command socket, the http
+ *   listening socket(s), the server.unix-socket listening socket (if any),
+ *   and the pty master of each session.
+ * The old server stops reading the ptys before taking their state.
+ * The new server re-creates the sessions, takes over the sockets
+ * (so no connection is refused) and replies with UPGRADE_ACK.
+ * The old server then replies with UPGRADE_RELEASE and exits without
+ * closing the sessions, and only then does the new server start reading
+ * the ptys - so output is never read by a server that then goes away.
+ * Both wait for the other in the main loop (see callback_upgrade),
+ * so the old server keeps serving its windows in the meantime; new
+ * sessions are refused then, as they wouldn't be handed over.
+ * Browser windows lose their connections, and reconnect (as they do
+ * after a network problem, using reconnect=) to the new server,
+ * which replays the output they haven't seen.
+ * If the new server fails (or doesn't reply within UPGRADE_TIMEOUT_MS),
+ * the old one kills it and continues.
+ *
+ * The shells are not children of the new server, so it can't wait
+ * for them: they are reaped by init, and the session ends when the
+ * pty is closed - see pclient->adopted.
+ */
+#include "server.h"
+#include "command-connect.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define UPGRADE_VERSION 1
+#define UPGRADE_ACK 'k'
+#define UPGRADE_RELEASE 'r'
+#define UPGRADE_TIMEOUT_MS 30000 // for the new server to take over
+#define UPGRADE_FDS_PER_MESSAGE 64
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+int upgrade_fd = -1; // in a new server: from --upgrade-fd
+int upgrade_command_socket = -1;
+int upgrade_http_port = -1;
+bool upgrade_handed_off = false; // in the old server, after success
+bool upgrade_pending = false; // while the ptys are being handed over
+
+// State received by a new server (between upgrade_receive and
+// upgrade_resume).
+static json_object *upgrade_state;
+static int *upgrade_fds;
+static int upgrade_nfds;
+static char **upgrade_buffers; // output and window contents of session i
+                               // are at 2*i and 2*i+1 (or NULL)
+
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool
+read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool
+send_fds(int sock, const int *fds, int nfds)
+{
+    for (int i = 0; i < nfds; i += UPGRADE_FDS_PER_MESSAGE) {
+        int n = nfds - i;
+        if (n > UPGRADE_FDS_PER_MESSAGE)
+            n = UPGRADE_FDS_PER_MESSAGE;
+        union { // for alignment
+            char buf[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } u;
+        char byte = 'F';
+        struct iovec iov;
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = u.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds + i, sizeof(int) * n);
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1)
+            return false;
+    }
+    return true;
+}
+
+static bool
+receive_fds(int sock, int *fds, int nfds)
+{
+    for (int i = 0; i < nfds; ) {
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } u;
+        char byte;
+        struct iovec iov;
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        if (recvmsg(sock, &msg, 0) != 1)
+            return false;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+            return false;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n <= 0 || i + n > nfds)
+            return false;
+        memcpy(fds + i, CMSG_DATA(cmsg), sizeof(int) * n);
+        for (int j = i; j < i + n; j++)
+            fcntl(fds[j], F_SETFD, FD_CLOEXEC);
+        i += n;
+    }
+    return true;
+}
+
+static void
+set_int(json_object *obj, const char *key, int64_t value)
+{
+    json_object_object_add(obj, key, json_object_new_int64(value));
+}
+
+static void
+set_string(json_object *obj, const char *key, const char *value)
+{
+    if (value != NULL)
+        json_object_object_add(obj, key, json_object_new_string(value));
+}
+
+static int64_t
+get_int(json_object *obj, const char *key, int64_t dflt)
+{
+    json_object *jval;
+    return json_object_object_get_ex(obj, key, &jval)
+        ? json_object_get_int64(jval) : dflt;
+}
+
+static const char *
+get_string(json_object *obj, const char *key)
+{
+    json_object *jval;
+    return json_object_object_get_ex(obj, key, &jval)
+        ? json_object_get_string(jval) : NULL;
+}
+
+/* The state of a session.  Its buffers are written separately
+ * (by write_buffers), unless it has a journal. */
+static json_object *
+session_state(struct pty_client *pclient, int fd_index)
+{
+    json_object *jsession = json_object_new_object();
+    set_int(jsession, "session", pclient->session_number);
+    set_int(jsession, "fd", fd_index);
+    set_int(jsession, "pid", pclient->pid);
+    set_string(jsession, "tty", pclient->ttyname);
+    set_string(jsession, "name", pclient->session_name);
+    set_int(jsession, "name-unique", pclient->session_name_unique);
+    set_string(jsession, "cmd", pclient->cmd);
+    json_object *jargv = json_object_new_array();
+    for (const char *const*p = pclient->argv; p && *p; p++)
+        json_object_array_add(jargv, json_object_new_string(*p));
+    json_object_object_add(jsession, "argv", jargv);
+    set_int(jsession, "rows", pclient->nrows);
+    set_int(jsession, "cols", pclient->ncols);
+    json_object_object_add(jsession, "pixh",
+                           json_object_new_double(pclient->pixh));
+    json_object_object_add(jsession, "pixw",
+                           json_object_new_double(pclient->pixw));
+    set_int(jsession, "packet-mode", pclient->uses_packet_mode);
+    set_int(jsession, "primary-window", pclient->has_primary_window);
+    set_int(jsession, "detach-count", pclient->detach_count);
+    set_int(jsession, "preserve-mode", pclient->preserve_mode);
+    set_int(jsession, "bytes-read", pclient->bytes_read);
+    set_int(jsession, "reconnects", pclient->reconnect_count);
+    set_int(jsession, "dropped", pclient->preserved_dropped);
+    set_string(jsession, "recording", recording_filename(pclient));
+    set_int(jsession, "recording-ns", recording_elapsed(pclient));
+    const char *journal = journal_filename(pclient);
+    if (journal != NULL) {
+        // The new server reads the buffers from the journal.
+        set_string(jsession, "journal", journal);
+        return jsession;
+    }
+    session_expand(pclient);
+    set_int(jsession, "sent-count", pclient->preserved_sent_count);
+    if (pclient->preserved_output != NULL) {
+        size_t length = pclient->preserved_end - pclient->preserved_start;
+        set_int(jsession, "output", length);
+    }
+    if (pclient->saved_window_contents != NULL) {
+        set_int(jsession, "window", strlen(pclient->saved_window_contents));
+        set_int(jsession, "window-count", pclient->saved_window_sent_count);
+    }
+    return jsession;
+}
+
+/* Write the preserved output and saved window contents of the
+ * sessions, in the order (and with the lengths) of the state. */
+static bool
+write_buffers(int sock, json_object *jsessions)
+{
+    int n = json_object_array_length(jsessions);
+    for (int i = 0; i < n; i++) {
+        json_object *jsession = json_object_array_get_idx(jsessions, i);
+        struct pty_client *pclient =
+            pty_clients(get_int(jsession, "session", -1));
+        long output = get_int(jsession, "output", -1);
+        long window = get_int(jsession, "window", -1);
+        if ((output > 0
+             && ! write_all(sock, pclient->preserved_output
+                            + pclient->preserved_start, output))
+            || (window > 0
+                && ! write_all(sock, pclient->saved_window_contents,
+                               window)))
+            return false;
+    }
+    return true;
+}
+
+static void
+restart_recordings(json_object *jsessions)
+{
+    int n = json_object_array_length(jsessions);
+    for (int i = 0; i < n; i++) {
+        json_object *jsession = json_object_array_get_idx(jsessions, i);
+        const char *fname = get_string(jsession, "recording");
+        struct pty_client *pclient =
+            pty_clients(get_int(jsession, "session", -1));
+        if (fname != NULL && pclient != NULL)
+            recording_resume(pclient, fname,
+                             get_int(jsession, "recording-ns", 0));
+    }
+}
+
+/* Start (or resume) reading the ptys, once they are ours. */
+static void
+read_ptys()
+{
+    upgrade_pending = false;
+    FOREACH_PCLIENT(pclient) {
+        uring_pty_start(pclient);
+        if (pclient->uring == NULL && ! pclient->paused)
+            wsi_rx_flow(pclient->pty_wsi,
+                        1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+    }
+}
+
+/* In the old server, when the new one failed: kill it,
+ * and continue the sessions. */
+static void
+upgrade_abandon(pid_t child, json_object *jstate)
+{
+    kill(child, SIGKILL);
+    while (waitpid(child, NULL, 0) == -1 && errno == EINTR)
+        ;
+    json_object *jsessions = NULL;
+    json_object_object_get_ex(jstate, "sessions", &jsessions);
+    if (jsessions != NULL)
+        restart_recordings(jsessions);
+    read_ptys();
+}
+
+/* Hand over the sessions to a new server.
+ * Return NULL if it has been started, or an error message.
+ * When the new server has taken over (or failed), the command
+ * is finished by callback_upgrade, if opts is from a client. */
+const char *
+upgrade_server(struct options *opts)
+{
+    if (upgrade_pending)
+        return "an upgrade is already in progress";
+    FOREACH_PCLIENT(pclient) {
+        if (pclient->is_ssh_pclient)
+            return "sessions using ssh can't be handed over";
+    }
+    if (http_listener_count == 0)
+        return "no http listening socket";
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return strerror(errno);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    // Arguments of the new server - prepared before the fork,
+    // as the child should only exec.
+    const char *args[20];
+    int nargs = 0;
+    char fd_arg[40], debug_arg[20];
+    args[nargs++] = get_executable_path();
+    snprintf(fd_arg, sizeof(fd_arg), "--upgrade-fd=%d", sv[1]);
+    args[nargs++] = fd_arg;
+    if (main_options->settings_file) {
+        args[nargs++] = "--settings";
+        args[nargs++] = main_options->settings_file;
+    }
+    if (main_options->socket_name) {
+        args[nargs++] = "--socket-name";
+        args[nargs++] = main_options->socket_name;
+    }
+    if (main_options->debug_level) {
+        snprintf(debug_arg, sizeof(debug_arg), "%d",
+                 main_options->debug_level);
+        args[nargs++] = "-d";
+        args[nargs++] = debug_arg;
+    }
+    for (int i = 0; i < main_options->verbosity && i < 2; i++)
+        args[nargs++] = "--verbose";
+    char port_arg[20];
+    if (! server->client_can_close) { // started with --port
+        snprintf(port_arg, sizeof(port_arg), "%d", http_port);
+        args[nargs++] = "--port";
+        args[nargs++] = port_arg;
+    }
+    args[nargs] = NULL;
+    int maxfd = sysconf(_SC_OPEN_MAX);
+
+    pid_t child = fork();
+    if (child == 0) {
+        // Don't keep browser connections (and so on) open.
+        for (int fd = 3; fd < maxfd; fd++)
+            if (fd != sv[1])
+                close(fd);
+        execv(args[0], (char *const*) args);
+        _exit(127);
+    }
+    close(sv[1]);
+    if (child < 0) {
+        close(sv[0]);
+        return strerror(errno);
+    }
+    lwsl_notice("upgrade-server: started %s (pid %d)\n", args[0], child);
+
+    json_object *jstate = json_object_new_object();
+    set_int(jstate, "version", UPGRADE_VERSION);
+    set_int(jstate, "port", http_port);
+    json_object_object_add(jstate, "key",
+                           json_object_new_string_len(server_key,
+                                                      SERVER_KEY_LENGTH));
+    set_int(jstate, "readonly", server->options.readonly);
+    set_int(jstate, "check-origin", server->options.check_origin);
+    set_int(jstate, "once", server->options.once);
+    set_int(jstate, "http-server", main_options->http_server);
+    set_int(jstate, "reconnect", server->options.reconnect);
+    set_int(jstate, "signal", server->options.sig_code);
+    set_string(jstate, "credential", server->options.credential);
+#if HAVE_OPENSSL
+    set_int(jstate, "ssl", main_options->ssl);
+    set_string(jstate, "ssl-cert", main_options->cert_path);
+    set_string(jstate, "ssl-key", main_options->key_path);
+    set_string(jstate, "ssl-ca", main_options->ca_path);
+#endif
+    int nfds = 0;
+    int *fds = (int *) xmalloc((2 + http_listener_count
+                                + server->session_count) * sizeof(int));
+    set_int(jstate, "command", nfds);
+    fds[nfds++] = cclient->socket;
+    json_object *jlisteners = json_object_new_array();
+    for (int i = 0; i < http_listener_count; i++) {
+        json_object_array_add(jlisteners, json_object_new_int(nfds));
+        fds[nfds++] = http_listeners[i];
+    }
+    json_object_object_add(jstate, "listeners", jlisteners);
+    if (unix_listener >= 0) {
+        set_int(jstate, "unix-listener", nfds);
+        set_string(jstate, "unix-socket", ws_socket_name);
+        fds[nfds++] = unix_listener;
+    }
+    // Stop reading the ptys (output already read is preserved),
+    // until the new server has them or has failed.
+    upgrade_pending = true;
+    FOREACH_PCLIENT(pclient) {
+        uring_pty_stop(pclient);
+        wsi_rx_flow(pclient->pty_wsi, 0);
+    }
+    json_object *jsessions = json_object_new_array();
+    FOREACH_PCLIENT(pclient) {
+        json_object_array_add(jsessions, session_state(pclient, nfds));
+        fds[nfds++] = pclient->pty;
+    }
+    json_object_object_add(jstate, "sessions", jsessions);
+    // The new server continues recordings (in the same files),
+    // so write out what we have first.
+    recordings_finish();
+
+    const char *text = json_object_to_json_string_ext(jstate,
+                                                      JSON_C_TO_STRING_PLAIN);
+    uint32_t header[2];
+    header[0] = strlen(text);
+    header[1] = nfds;
+    // The new server reads all this as soon as it starts.
+    struct timeval timeout;
+    timeout.tv_sec = UPGRADE_TIMEOUT_MS / 1000;
+    timeout.tv_usec = 0;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    bool ok = write_all(sv[0], (const char *) header, sizeof(header))
+        && write_all(sv[0], text, header[0])
+        && write_buffers(sv[0], jsessions)
+        && send_fds(sv[0], fds, nfds);
+    free(fds);
+    struct lws *wsi = NULL;
+    if (ok) {
+        // Wait for the reply in the main loop.
+        lws_sock_file_fd_type lfd;
+        lfd.filefd = sv[0];
+        wsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC,
+                                         lfd, "upgrade", NULL);
+    }
+    if (wsi == NULL) {
+        lwsl_err("upgrade-server: new server (pid %d) failed\n", child);
+        close(sv[0]);
+        upgrade_abandon(child, jstate);
+        json_object_put(jstate);
+        return "the new server failed to start (see its log)";
+    }
+    struct upgrade_client *uc = (struct upgrade_client *) lws_wsi_user(wsi);
+    uc->child = child;
+    uc->state = jstate;
+    uc->opts = opts->fd_cmd_socket >= 0 ? opts : NULL;
+    uc->done = false;
+    lws_set_timer_usecs(wsi, UPGRADE_TIMEOUT_MS * (LWS_USEC_PER_SEC / 1000));
+    return NULL;
+}
+
+/* The other server has replied (or not, or gone): in the old server,
+ * finish the upgrade-server command; in the new one, start reading. */
+static void
+upgrade_done(struct lws *wsi, struct upgrade_client *uc, const char *err)
+{
+    uc->done = true;
+    if (uc->child == 0) {
+        if (err != NULL)
+            lwsl_warn("upgrade: %s - taking over anyway\n", err);
+        read_ptys();
+        lwsl_notice("upgrade: reading the sessions\n");
+        return;
+    }
+    json_object *jsessions = NULL;
+    json_object_object_get_ex(uc->state, "sessions", &jsessions);
+    int nsessions = jsessions ? json_object_array_length(jsessions) : 0;
+    if (err != NULL) {
+        lwsl_err("upgrade-server: new server (pid %d): %s\n",
+                 uc->child, err);
+        upgrade_abandon(uc->child, uc->state);
+    } else {
+        char release = UPGRADE_RELEASE;
+        if (write(lws_get_socket_fd(wsi), &release, 1) != 1)
+            lwsl_warn("upgrade-server: can't reply to the new server\n");
+        lwsl_notice("upgrade-server: %d sessions handed over to pid %d\n",
+                    nsessions, uc->child);
+        upgrade_handed_off = true; // see upgrade_exit
+    }
+    struct options *opts = uc->opts;
+    if (opts != NULL) {
+        if (err != NULL)
+            printf_error(opts, "domterm upgrade-server: %s", err);
+        else {
+            FILE *out = fdopen(dup(opts->fd_out), "w");
+            fprintf(out, "handed over %d session%s to a new server\n",
+                    nsessions, nsessions == 1 ? "" : "s");
+            fclose(out);
+        }
+        finish_client_command(opts, err ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    json_object_put(uc->state);
+    uc->state = NULL;
+}
+
+/* The connection between the old and the new server, after the
+ * new one has the state: wait for its UPGRADE_ACK (in the old server)
+ * or for UPGRADE_RELEASE (in the new one), but not forever. */
+int
+callback_upgrade(struct lws *wsi, enum lws_callback_reasons reason,
+                 void *user, void *in, size_t len)
+{
+    struct upgrade_client *uc = (struct upgrade_client *) user;
+    const char *err;
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE: {
+        char reply = 0;
+        ssize_t n = read(lws_get_socket_fd(wsi), &reply, 1);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        if (uc->child == 0)
+            err = n == 1 && reply == UPGRADE_RELEASE ? NULL
+                : "the old server went away";
+        else
+            err = n == 1 && reply == UPGRADE_ACK ? NULL
+                : "failed to start (see its log)";
+        break;
+    }
+    case LWS_CALLBACK_TIMER:
+        err = "no reply";
+        break;
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        if (! uc->done)
+            upgrade_done(wsi, uc, "connection closed");
+        return 0;
+    default:
+        return 0;
+    }
+    upgrade_done(wsi, uc, err);
+    return -1;
+}
+
+/* Called from the main loop of the old server after the new server
+ * has taken over (so the reply to the command has been sent). */
+void
+upgrade_exit()
+{
+    FOREACH_PCLIENT(pclient) {
+        journal_close(pclient, false); // now written by the new server
+    }
+    lwsl_notice("upgrade-server: exiting\n");
+    log_sink_stop();
+    // Not exit: atexit handlers would remove the command socket.
+    _exit(0);
+}
+
+/* In the new server, before the lws context is created:
+ * read the state from the old server, and set options from it. */
+void
+upgrade_receive()
+{
+    int fd = upgrade_fd;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    uint32_t header[2];
+    if (! read_all(fd, (char *) header, sizeof(header)))
+        fatal("upgrade: can't read state from the old server");
+    char *text = challoc(header[0] + 1);
+    if (! read_all(fd, text, header[0]))
+        fatal("upgrade: can't read state from the old server");
+    text[header[0]] = '\0';
+    upgrade_state = json_tokener_parse(text);
+    free(text);
+    if (upgrade_state == NULL
+        || get_int(upgrade_state, "version", -1) != UPGRADE_VERSION)
+        fatal("upgrade: invalid state from the old server");
+
+    json_object *jsessions = NULL;
+    json_object_object_get_ex(upgrade_state, "sessions", &jsessions);
+    int nsessions = jsessions ? json_object_array_length(jsessions) : 0;
+    upgrade_buffers = (char **) xmalloc((2 * nsessions + 1) * sizeof(char*));
+    for (int i = 0; i < nsessions; i++) {
+        json_object *jsession = json_object_array_get_idx(jsessions, i);
+        long output = get_int(jsession, "output", -1);
+        long window = get_int(jsession, "window", -1);
+        upgrade_buffers[2*i] = output < 0 ? NULL : challoc(output + 1);
+        upgrade_buffers[2*i+1] = window < 0 ? NULL : challoc(window + 1);
+        if ((output > 0 && ! read_all(fd, upgrade_buffers[2*i], output))
+            || (window >= 0
+                && ! read_all(fd, upgrade_buffers[2*i+1], window)))
+            fatal("upgrade: can't read session buffers");
+        if (window >= 0)
+            upgrade_buffers[2*i+1][window] = '\0';
+    }
+    upgrade_nfds = header[1];
+    upgrade_fds = (int *) xmalloc(upgrade_nfds * sizeof(int));
+    if (! receive_fds(fd, upgrade_fds, upgrade_nfds))
+        fatal("upgrade: can't receive file descriptors");
+
+    struct options *opts = main_options;
+    upgrade_http_port = get_int(upgrade_state, "port", -1);
+    const char *key = get_string(upgrade_state, "key");
+    if (key == NULL || strlen(key) != SERVER_KEY_LENGTH)
+        fatal("upgrade: invalid state from the old server");
+    memcpy(server_key, key, SERVER_KEY_LENGTH);
+    upgrade_command_socket =
+        upgrade_fds[get_int(upgrade_state, "command", 0)];
+    // Connections are accepted on the old server's listening sockets.
+    json_object *jlisteners = NULL;
+    json_object_object_get_ex(upgrade_state, "listeners", &jlisteners);
+    int nlisteners = jlisteners ? json_object_array_length(jlisteners) : 0;
+    for (int i = 0; i < nlisteners && i < MAX_HTTP_LISTENERS; i++) {
+        json_object *jindex = json_object_array_get_idx(jlisteners, i);
+        http_listeners[http_listener_count++] =
+            upgrade_fds[json_object_get_int(jindex)];
+    }
+    const char *unix_socket = get_string(upgrade_state, "unix-socket");
+    if (unix_socket != NULL) {
+        unix_listener = upgrade_fds[get_int(upgrade_state, "unix-listener", 0)];
+        ws_socket_name = strdup(unix_socket);
+    }
+    opts->readonly = get_int(upgrade_state, "readonly", 0);
+    opts->check_origin = get_int(upgrade_state, "check-origin", 0);
+    opts->once = get_int(upgrade_state, "once", 0);
+    opts->http_server = get_int(upgrade_state, "http-server", 0);
+    opts->reconnect = get_int(upgrade_state, "reconnect", opts->reconnect);
+    opts->sig_code = get_int(upgrade_state, "signal", opts->sig_code);
+    const char *credential = get_string(upgrade_state, "credential");
+    if (credential != NULL)
+        opts->credential = strdup(credential);
+#if HAVE_OPENSSL
+    opts->ssl = get_int(upgrade_state, "ssl", 0);
+    const char *path;
+    if ((path = get_string(upgrade_state, "ssl-cert")) != NULL)
+        opts->cert_path = strdup(path);
+    if ((path = get_string(upgrade_state, "ssl-key")) != NULL)
+        opts->key_path = strdup(path);
+    if ((path = get_string(upgrade_state, "ssl-ca")) != NULL)
+        opts->ca_path = strdup(path);
+#endif
+    opts->do_daemonize = -1; // already where the old server was
+}
+
+static void
+resume_session(json_object *jsession, char *output, char *window)
+{
+    int fd = upgrade_fds[get_int(jsession, "fd", 0)];
+    json_object *jargv = NULL;
+    json_object_object_get_ex(jsession, "argv", &jargv);
+    int argc = jargv ? json_object_array_length(jargv) : 0;
+    const char **argv = (const char **) xmalloc((argc + 1) * sizeof(char*));
+    for (int i = 0; i < argc; i++)
+        argv[i] = json_object_get_string(json_object_array_get_idx(jargv, i));
+    argv[argc] = NULL;
+    const char *cmd = get_string(jsession, "cmd");
+    const char *tty = get_string(jsession, "tty");
+    bool packet_mode = get_int(jsession, "packet-mode", 0);
+    struct pty_client *pclient =
+        adopt_pclient(fd, strdup(tty ? tty : ""), packet_mode,
+                      get_int(jsession, "session", -1),
+                      cmd ? strdup(cmd) : NULL, argv);
+    free(argv);
+    pclient->uses_packet_mode = packet_mode;
+    pclient->pid = get_int(jsession, "pid", -1);
+    if (pclient->pid > 0) {
+        snprintf(pclient->pid_key, sizeof(pclient->pid_key), "%d",
+                 pclient->pid);
+        pty_clients_by_pid.add(pclient->pid_key, pclient);
+    }
+    const char *name = get_string(jsession, "name");
+    if (name != NULL) {
+        pclient->session_name = strdup(name);
+        pty_clients_by_name.add(pclient->session_name, pclient);
+        pclient->session_name_unique = get_int(jsession, "name-unique", 0);
+    }
+    pclient->nrows = get_int(jsession, "rows", -1);
+    pclient->ncols = get_int(jsession, "cols", -1);
+    json_object *jval;
+    if (json_object_object_get_ex(jsession, "pixh", &jval))
+        pclient->pixh = json_object_get_double(jval);
+    if (json_object_object_get_ex(jsession, "pixw", &jval))
+        pclient->pixw = json_object_get_double(jval);
+    pclient->has_primary_window = get_int(jsession, "primary-window", 0);
+    pclient->detach_count = get_int(jsession, "detach-count", 0);
+    pclient->preserve_mode = get_int(jsession, "preserve-mode", 1);
+    pclient->bytes_read = get_int(jsession, "bytes-read", 0);
+    pclient->reconnect_count = get_int(jsession, "reconnects", 0);
+    pclient->preserved_dropped = get_int(jsession, "dropped", 0);
+    wsi_rx_flow(pclient->pty_wsi, 0); // until the old server lets go
+    const char *journal = get_string(jsession, "journal");
+    if (journal != NULL) {
+        if (! journal_restore(pclient, journal))
+            lwsl_err("upgrade: can't restore session %d from %s\n",
+                     pclient->session_number, journal);
+    } else {
+        pclient->preserved_sent_count = get_int(jsession, "sent-count", 0);
+        if (output != NULL) {
+            size_t length = get_int(jsession, "output", 0);
+            pclient->preserved_output = output;
+            pclient->preserved_start = 0;
+            pclient->preserved_end = length;
+            set_preserved_size(pclient, length + 1);
+        }
+        if (window != NULL) {
+            pclient->saved_window_contents = window;
+            pclient->saved_window_sent_count =
+                get_int(jsession, "window-count", 0);
+        }
+    }
+    const char *recording = get_string(jsession, "recording");
+    if (recording != NULL) {
+        const char *err =
+            recording_resume(pclient, recording,
+                             get_int(jsession, "recording-ns", 0));
+        if (err)
+            lwsl_err("cannot record session %d to %s: %s\n",
+                     pclient->session_number, recording, err);
+    }
+    lwsl_notice("upgrade: resumed session %d (pid %d)\n",
+                pclient->session_number, pclient->pid);
+}
+
+/* In the new server, after the vhost and command socket are set up
+ * (and the listening sockets adopted): take over the sessions, and
+ * tell the old server we're done.  We start reading the ptys when it
+ * replies (see callback_upgrade). */
+void
+upgrade_resume()
+{
+    upgrade_pending = true;
+    json_object *jsessions = NULL;
+    json_object_object_get_ex(upgrade_state, "sessions", &jsessions);
+    int nsessions = jsessions ? json_object_array_length(jsessions) : 0;
+    for (int i = 0; i < nsessions; i++)
+        resume_session(json_object_array_get_idx(jsessions, i),
+                       upgrade_buffers[2*i], upgrade_buffers[2*i+1]);
+    char ack = UPGRADE_ACK;
+    struct lws *wsi = NULL;
+    if (write(upgrade_fd, &ack, 1) != 1)
+        lwsl_err("upgrade: can't reply to the old server\n");
+    else {
+        lws_sock_file_fd_type lfd;
+        lfd.filefd = upgrade_fd;
+        wsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC,
+                                         lfd, "upgrade", NULL);
+    }
+    if (wsi != NULL)
+        lws_set_timer_usecs(wsi,
+                            UPGRADE_TIMEOUT_MS * (LWS_USEC_PER_SEC / 1000));
+    else {
+        close(upgrade_fd);
+        read_ptys();
+    }
+    lwsl_notice("upgrade: took over %d sessions on port %d\n",
+                nsessions, upgrade_http_port);
+    free(upgrade_buffers);
+    free(upgrade_fds);
+    json_object_put(upgrade_state);
+    upgrade_state = NULL;
+}
@@ -0,0 +1,428 @@
+/* Reading pty output with io_uring (if built with liburing).
+ * Instead of libwebsockets polling each pty and handle_process_output
+ * calling read for each event, each session has a read
+ * (IORING_OP_READ with IOSQE_BUFFER_SELECT) in flight, into a buffer
+ * from a shared pool (a provided-buffer ring).  Completions are reaped
+ * from shared memory when the ring's fd (adopted as the "uring" wsi)
+ * is readable, and the reads of all the sessions that completed are
+ * re-armed with a single io_uring_submit, so busy sessions share one
+ * system call instead of a read each.  The data is queued in the
+ * session's pending buffer, which handle_process_output then reads
+ * (see uring_pty_read) as it would the pty.
+ *
+ * (Multishot reads would save the re-arming, but some kernels list
+ * IORING_OP_READ_MULTISHOT and then fail it with EOPNOTSUPP for ptys.)
+ *
+ * When a session is paused by flow control its read is cancelled,
+ * and re-armed by uring_pty_resume.  The pty wsi stays (with POLLIN
+ * disabled), so hangup and closing work as before.
+ *
+ * If io_uring or provided buffer rings are not available (kernels
+ * before 5.19, seccomp), or the server.io-uring setting is "no", ptys
+ * are polled as before.  If a read fails with EOPNOTSUPP or EINVAL,
+ * that session (and later ones) fall back to polling.
+ */
+#include "server.h"
+
+#if HAVE_LIBURING
+#include <liburing.h>
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 256 // must be a power of 2
+#define URING_BUF_SIZE 16384
+#define URING_BGID 1 // buffer group id
+
+struct uring_read {
+    struct pty_client *pclient; // NULL after the session is closed
+    struct sbuf pending; // output read but not handled yet
+    size_t pending_start;
+    bool armed; // a read is in flight
+    bool cancelling; // and we asked to cancel it
+    bool eof;
+    bool unsupported; // read failed with EOPNOTSUPP or EINVAL
+    bool touched; // in reaped list
+    struct uring_read *next_reaped;
+};
+
+static struct io_uring ring;
+static struct io_uring_buf_ring *buf_ring;
+static char *buf_pool;
+static bool uring_ready = false;
+static bool uring_batching = false; // in callback_uring: submit at the end
+static bool uring_unsubmitted = false; // prepared sqes not yet submitted
+
+void
+uring_init()
+{
+    const char *enable = setting_string(main_options, server_io_uring_opt);
+    if (enable != NULL && strcmp(enable, "no") == 0)
+        return;
+    int r = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+    if (r < 0) {
+        lwsl_notice("io_uring not available (%s) - polling ptys\n",
+                    strerror(-r));
+        return;
+    }
+    struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    bool can_read = probe != NULL
+        && io_uring_opcode_supported(probe, IORING_OP_READ);
+    if (probe != NULL)
+        io_uring_free_probe(probe);
+    if (can_read) // fails before Linux 5.19
+        buf_ring = io_uring_setup_buf_ring(&ring, URING_BUF_COUNT,
+                                           URING_BGID, 0, &r);
+    if (! can_read || buf_ring == NULL) {
+        lwsl_notice("io_uring lacks buffer rings - polling ptys\n");
+        io_uring_queue_exit(&ring);
+        return;
+    }
+    buf_pool = challoc(URING_BUF_COUNT * URING_BUF_SIZE);
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+        io_uring_buf_ring_add(buf_ring, buf_pool + i * URING_BUF_SIZE,
+                              URING_BUF_SIZE, i,
+                              io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+    io_uring_buf_ring_advance(buf_ring, URING_BUF_COUNT);
+
+    lws_sock_file_fd_type fd;
+    fd.filefd = ring.ring_fd;
+    if (lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd,
+                                   "uring", NULL) == NULL) {
+        lwsl_err("cannot adopt io_uring fd - polling ptys\n");
+        io_uring_free_buf_ring(&ring, buf_ring, URING_BUF_COUNT, URING_BGID);
+        io_uring_queue_exit(&ring);
+        free(buf_pool);
+        return;
+    }
+    uring_ready = true;
+    lwsl_notice("reading pty output with io_uring\n");
+}
+
+static void
+uring_submit()
+{
+    if (uring_unsubmitted) {
+        uring_unsubmitted = false;
+        io_uring_submit(&ring);
+        server_stats.pty_read_syscalls++;
+    }
+}
+
+/* Get an sqe, to be submitted by uring_prepared. */
+static struct io_uring_sqe *
+get_sqe()
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL) { // submission queue full
+        uring_submit();
+        sqe = io_uring_get_sqe(&ring);
+    }
+    return sqe;
+}
+
+/* Submit the sqe just prepared, unless callback_uring will. */
+static void
+uring_prepared()
+{
+    uring_unsubmitted = true;
+    if (! uring_batching)
+        uring_submit();
+}
+
+static void
+uring_arm(struct uring_read *ur)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_read(sqe, ur->pclient->pty, NULL, URING_BUF_SIZE, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data(sqe, ur);
+    ur->armed = true;
+    ur->cancelling = false;
+    uring_prepared();
+}
+
+static void
+uring_cancel(struct uring_read *ur)
+{
+    if (! ur->armed || ur->cancelling)
+        return;
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_cancel(sqe, ur, 0);
+    io_uring_sqe_set_data(sqe, NULL);
+    ur->cancelling = true;
+    uring_prepared();
+}
+
+/* Start reading pclient's pty with io_uring, if we can. */
+void
+uring_pty_start(struct pty_client *pclient)
+{
+    if (! uring_ready || pclient->uses_packet_mode
+        || pclient->uring != NULL)
+        return;
+    struct uring_read *ur = (struct uring_read *)
+        xmalloc(sizeof(struct uring_read));
+    memset(ur, 0, sizeof(struct uring_read));
+    sbuf_init(&ur->pending);
+    ur->pclient = pclient;
+    pclient->uring = ur;
+    // The wsi stays, for hangup and close, but we do the reading.
+    wsi_rx_flow(pclient->pty_wsi, 0);
+    uring_arm(ur);
+}
+
+/* Called (as if read) by handle_process_output. */
+ssize_t
+uring_pty_read(struct pty_client *pclient, char *buf, size_t length)
+{
+    struct uring_read *ur = pclient->uring;
+    size_t avail = ur->pending.len - ur->pending_start;
+    if (avail == 0) {
+        if (ur->eof)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (length > avail)
+        length = avail;
+    memcpy(buf, ur->pending.buffer + ur->pending_start, length);
+    ur->pending_start += length;
+    if (ur->pending_start == ur->pending.len) {
+        ur->pending_start = 0;
+        ur->pending.len = 0;
+        if (ur->pending.size > 4 * URING_BUF_SIZE) {
+            sbuf_free(&ur->pending);
+            sbuf_init(&ur->pending);
+        }
+    }
+    return length;
+}
+
+/* At end of file, pass on output still pending, even to paused
+ * windows (flow control no longer matters), so it isn't lost. */
+static void
+uring_flush_pending(struct uring_read *ur)
+{
+    struct pty_client *pclient = ur->pclient;
+    char *data = ur->pending.buffer + ur->pending_start;
+    size_t length = ur->pending.len - ur->pending_start;
+    if (length == 0)
+        return;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        if (! tclient->out_wsi)
+            continue;
+        sbuf_append(&tclient->ob, data, length);
+        tclient->ocount += length;
+        wsi_writable(tclient->out_wsi);
+    }
+    pclient->bytes_read += length;
+    server_stats.pty_bytes_read += length;
+    if (pclient->recording)
+        recording_output(pclient, data, length);
+    if (should_backup_output(pclient))
+        backup_output(pclient, data, length);
+    ur->pending.len = ur->pending_start = 0;
+}
+
+/* Stop reading pclient with io_uring because the kernel can't,
+ * and poll its pty instead. */
+static void
+uring_fallback(struct uring_read *ur)
+{
+    struct pty_client *pclient = ur->pclient;
+    lwsl_notice("io_uring read of session %d pty unsupported"
+                " - polling ptys\n", pclient->session_number);
+    uring_ready = false; // for later sessions
+    pclient->uring = NULL;
+    if (! pclient->paused) // else unpausing enables POLLIN
+        wsi_rx_flow(pclient->pty_wsi, 1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+    sbuf_free(&ur->pending);
+    free(ur);
+}
+
+/* Pass pending output to handle_process_output,
+ * and re-arm or cancel the read as flow control requires. */
+static void
+uring_deliver(struct uring_read *ur)
+{
+    struct pty_client *pclient = ur->pclient;
+    while ((ur->pending.len > 0 || ur->eof) && ! pclient->paused) {
+        size_t before = ur->pending.len - ur->pending_start;
+        if (handle_process_output(pclient->pty_wsi, pclient,
+                                  pclient->pty, NULL) < 0)
+            break;
+        if (ur->pending.len - ur->pending_start == before)
+            break; // no progress
+    }
+    if (ur->eof) {
+        // As on hangup when polling: close (after the output we read).
+        uring_flush_pending(ur);
+        wsi_kill(pclient->pty_wsi);
+    } else if (ur->unsupported) {
+        if (ur->pending.len == 0)
+            uring_fallback(ur);
+    } else if (pclient->paused)
+        uring_cancel(ur);
+    else if (! ur->armed && ur->pending.len == 0)
+        uring_arm(ur);
+}
+
+/* Called when pclient is unpaused. */
+void
+uring_pty_resume(struct pty_client *pclient)
+{
+    if (pclient->uring != NULL)
+        uring_deliver(pclient->uring);
+}
+
+static void
+recycle_buffer(int bid)
+{
+    io_uring_buf_ring_add(buf_ring, buf_pool + bid * URING_BUF_SIZE,
+                          URING_BUF_SIZE, bid,
+                          io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+/* Handle the completions in the ring, queuing (touched) sessions
+ * with new output or state on *reaped. */
+static void
+uring_reap(struct uring_read **reaped)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+        count++;
+        struct uring_read *ur = (struct uring_read *)
+            io_uring_cqe_get_data(cqe);
+        if (ur == NULL) // completion of a cancel request
+            continue;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0 && ur->pclient != NULL)
+                sbuf_append(&ur->pending, buf_pool + bid * URING_BUF_SIZE,
+                            cqe->res);
+            recycle_buffer(bid);
+        }
+        // Each read completes once.
+        ur->armed = false;
+        ur->cancelling = false;
+        if (ur->pclient == NULL) {
+            sbuf_free(&ur->pending);
+            free(ur);
+            continue;
+        }
+        // ENOBUFS (pool empty), ECANCELED, and EAGAIN or EINTR
+        // (nothing to read after all) are re-armed as needed.
+        // 0 (end of file) and errors (EIO after hangup) are final.
+        switch (cqe->res) {
+        case -ENOBUFS: case -ECANCELED: case -EAGAIN: case -EINTR:
+            break;
+        case -EOPNOTSUPP: case -EINVAL:
+            ur->unsupported = true;
+            break;
+        default:
+            if (cqe->res <= 0)
+                ur->eof = true;
+        }
+        if (ur->pclient != NULL && ! ur->touched) {
+            ur->touched = true;
+            ur->next_reaped = *reaped;
+            *reaped = ur;
+        }
+    }
+    io_uring_cq_advance(&ring, count);
+}
+
+static void
+uring_deliver_reaped(struct uring_read *reaped)
+{
+    while (reaped != NULL) {
+        struct uring_read *ur = reaped;
+        reaped = ur->next_reaped;
+        ur->touched = false;
+        if (ur->pclient != NULL)
+            uring_deliver(ur);
+    }
+}
+
+/* Stop using io_uring for pclient, for example before handing its pty
+ * to a new server.  Output read but not yet handled is preserved. */
+void
+uring_pty_stop(struct pty_client *pclient)
+{
+    struct uring_read *ur = pclient->uring;
+    if (ur == NULL)
+        return;
+    uring_cancel(ur);
+    uring_submit();
+    struct uring_read *reaped = NULL;
+    while (ur->armed) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&ring, &cqe) < 0)
+            break;
+        uring_reap(&reaped);
+    }
+    // Deliver to the other sessions only - not re-arming ur.
+    for (struct uring_read **p = &reaped; *p != NULL; ) {
+        if (*p == ur)
+            *p = ur->next_reaped;
+        else
+            p = &(*p)->next_reaped;
+    }
+    ur->touched = false;
+    uring_deliver_reaped(reaped);
+    if (ur->pending.len > ur->pending_start && should_backup_output(pclient))
+        backup_output(pclient, ur->pending.buffer + ur->pending_start,
+                      ur->pending.len - ur->pending_start);
+    pclient->uring = NULL;
+    if (ur->armed) // io_uring_wait_cqe failed - leave it to uring_reap
+        ur->pclient = NULL;
+    else {
+        sbuf_free(&ur->pending);
+        free(ur);
+    }
+}
+
+/* Called when pclient is closed. */
+void
+uring_pty_close(struct pty_client *pclient)
+{
+    struct uring_read *ur = pclient->uring;
+    if (ur == NULL)
+        return;
+    pclient->uring = NULL;
+    ur->pclient = NULL;
+    if (ur->armed)
+        uring_cancel(ur); // ur is freed on the final completion
+    else {
+        sbuf_free(&ur->pending);
+        free(ur);
+    }
+}
+
+int
+callback_uring(struct lws *wsi, enum lws_callback_reasons reason,
+               void *user, void *in, size_t len)
+{
+    callback_timer timer(CALLBACK_URING, reason, NULL, NULL);
+    if (reason == LWS_CALLBACK_RAW_RX_FILE) {
+        struct uring_read *reaped = NULL;
+        uring_batching = true;
+        uring_reap(&reaped);
+        uring_deliver_reaped(reaped);
+        uring_batching = false;
+        uring_submit(); // re-arm them all at once
+    }
+    return 0;
+}
+
+#else /* ! HAVE_LIBURING */
+
+void uring_init() { }
+void uring_pty_start(struct pty_client *) { }
+void uring_pty_resume(struct pty_client *) { }
+void uring_pty_stop(struct pty_client *) { }
+void uring_pty_close(struct pty_client *) { }
+ssize_t uring_pty_read(struct pty_client *, char *, size_t) { return -1; }
+#endif
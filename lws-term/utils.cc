@@ -19,10 +19,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "whereami.h"
+#include <time.h>
 #if HAVE_GETRANDOM
 #include <sys/random.h>
-#else
-#include <time.h>
 #endif
 
 void *
@@ -92,30 +91,141 @@ get_sig(const char *sig_name) {
     return -1;
 }
 
-// https://github.com/darkk/redsocks/blob/master/base64.c
-char *
-base64_encode(const unsigned char *buffer, size_t length) {
-    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    char *ret, *dst;
-    unsigned i_bits = 0;
-    int i_shift = 0;
-    int bytes_remaining = (int) length;
-
-    ret = dst = challoc((size_t) (((length + 2) / 3 * 4) + 1));
-    while (bytes_remaining) {
-        i_bits = (i_bits << 8) + *buffer++;
-        bytes_remaining--;
-        i_shift += 8;
-
-        do {
-            *dst++ = b64[(i_bits << 6 >> i_shift) & 0x3f];
-            i_shift -= 6;
-        } while (i_shift > 6 || (bytes_remaining == 0 && i_shift > 0));
+static const char b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define BASE64_SIMD 1
+
+/* Vectorized base64 encoding, after Wojciech Muła and Daniel Lemire,
+ * "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+ * Each 32-bit lane gets 3 input bytes, which are split into 4 6-bit
+ * indices, which are then mapped to ASCII by adding an offset
+ * that depends on the range of the index. */
+
+__attribute__((target("ssse3")))
+static inline __m128i
+base64_lookup_ssse3(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                           4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+    __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                    '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                    '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                    '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+/* Encode 12 bytes at a time (reading 16); return bytes consumed. */
+__attribute__((target("ssse3")))
+static size_t
+base64_encode_ssse3(const unsigned char *src, size_t length, char *dst)
+{
+    size_t i = 0;
+    for (; i + 16 <= length; i += 12, dst += 16)
+        _mm_storeu_si128((__m128i *) dst,
+                         base64_lookup_ssse3(
+                             _mm_loadu_si128((const __m128i *) (src + i))));
+    return i;
+}
+
+/* Encode 24 bytes at a time (reading 28); return bytes consumed. */
+__attribute__((target("avx2")))
+static size_t
+base64_encode_avx2(const unsigned char *src, size_t length, char *dst)
+{
+    const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1,
+                                         10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    for (; i + 28 <= length; i += 24, dst += 32) {
+        __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *) (src + i))),
+            _mm_loadu_si128((const __m128i *) (src + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+        __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        range = _mm256_or_si256(range,
+                                _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i *) dst,
+                            _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range),
+                                            indices));
     }
-    while ((dst - ret) & 3)
-        *dst++ = '=';
-    *dst = '\0';
+    return i;
+}
+#endif
+
+/* Encode length bytes as base64 into dst, which must have room for
+ * (length + 2) / 3 * 4 chars.  No terminating null is written.
+ * Returns the number of chars written.
+ * If length is a multiple of 3 there is no padding, so a long input
+ * can be encoded in pieces. */
+size_t
+base64_encode_to(const unsigned char *src, size_t length, char *dst)
+{
+    char *start = dst;
+    size_t i = 0;
+#if BASE64_SIMD
+    static int simd = -1; // 0: none, 1: ssse3, 2: avx2
+    if (simd < 0) {
+        __builtin_cpu_init();
+        simd = __builtin_cpu_supports("avx2") ? 2
+            : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    if (simd == 2)
+        i = base64_encode_avx2(src, length, dst);
+    else if (simd == 1)
+        i = base64_encode_ssse3(src, length, dst);
+    dst += i / 3 * 4;
+#endif
+    for (; i + 3 <= length; i += 3) {
+        unsigned v = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+        dst[0] = b64_chars[v >> 18];
+        dst[1] = b64_chars[(v >> 12) & 0x3f];
+        dst[2] = b64_chars[(v >> 6) & 0x3f];
+        dst[3] = b64_chars[v & 0x3f];
+        dst += 4;
+    }
+    if (i < length) {
+        unsigned v = src[i] << 16;
+        if (i + 1 < length)
+            v |= src[i+1] << 8;
+        dst[0] = b64_chars[v >> 18];
+        dst[1] = b64_chars[(v >> 12) & 0x3f];
+        dst[2] = i + 1 < length ? b64_chars[(v >> 6) & 0x3f] : '=';
+        dst[3] = '=';
+        dst += 4;
+    }
+    return dst - start;
+}
 
+char *
+base64_encode(const unsigned char *buffer, size_t length) {
+    char *ret = challoc((size_t) (((length + 2) / 3 * 4) + 1));
+    ret[base64_encode_to(buffer, length, ret)] = '\0';
     return ret;
 }
 
@@ -728,6 +838,102 @@ check_conditional(const char *tmplate, test_function_t tester, void* data)
     return tmplate[0] ? tmplate : NULL;
 }
 
+/** Parse the text of a settings file, calling handler for each setting.
+ * The text is modified in place (keys and values are nul-terminated),
+ * and there must be room for one byte at end.
+ * Return NULL on success; otherwise an error message (to append
+ * to a location), and set *error_offset.
+ */
+const char *
+parse_settings(char *text, char *end, setting_handler_t handler, void *data,
+               long *error_offset)
+{
+    char *sptr = text;
+    char *send = end;
+    const char *emsg = "";
+    for (;;) {
+    next:
+        if (sptr == send)
+            return NULL;
+        char ch = *sptr;
+        if (ch == '#') {
+          for (;;) {
+            if (sptr == send)
+                return NULL;
+            ch = *sptr++;
+            if (ch == '\r' ||ch == '\n')
+              goto next;
+          }
+        }
+        while (ch == ' ' || ch == '\t') {
+            ++sptr;
+            if (sptr == send)
+                return NULL;
+            ch = *sptr;
+        }
+        if (ch == '|') {
+            emsg = "\n(continuation marker '|' must follow a single space)";
+            goto err;
+        }
+        if (ch == '\r' || ch == '\n') {
+          sptr++;
+          goto next;
+        }
+        char *key_start = sptr;
+        char *key_end = NULL;
+
+        for (;;) {
+            if ((ch == '=' || ch == ' ' || ch == '\t') && key_end == NULL)
+                key_end = sptr;
+            if (ch == '=')
+              break;
+            if (ch == '\r' || ch == '\n')
+                goto err;
+            ++sptr;
+            if (sptr == send)
+              goto err;
+            ch = *sptr;
+        }
+        *key_end = '\0';
+        sptr++; // skip '='
+        while (sptr < send && (*sptr == ' ' || *sptr == '\t'))
+          sptr++;
+        char *value_start = sptr;
+        while (sptr < send && *sptr != '\r' && *sptr != '\n')
+          sptr++;
+        char*value_end = sptr;
+        if (sptr < send)
+          sptr++;
+        if (value_start == value_end) {
+          while (sptr + 2 < send && sptr[0] == ' ' && sptr[1] == '|') {
+            sptr += 2;
+            while (sptr < send && *sptr != '\r' && *sptr != '\n')
+              sptr++;
+            if (sptr < send)
+              sptr++;
+          }
+          char *psrc = value_start;
+          char *pdst = value_start;
+          while (psrc < sptr) {
+            char ch = *psrc++;
+            *pdst++ = ch;
+            if (ch == '\n' && psrc[0] == ' ' && psrc[1] == '|') {
+              if (psrc-1 == value_start)
+                pdst--;
+              psrc += 2;
+            }
+          }
+          value_end = pdst;
+        }
+        *value_end = '\0';
+
+        handler(key_start, value_start, data);
+    }
+ err:
+    *error_offset = sptr - text;
+    return emsg;
+}
+
 const char *
 getenv_from_array(const char* key, arglist_t envarray)
 {
@@ -866,3 +1072,46 @@ printf_error(struct options *opts, const char *format, ...)
     write(opts->fd_err, buf->buffer, buf->len);
     sbuf_free(buf);
 }
+
+int64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+histogram_add(struct histogram *h, int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    int i = 0;
+    for (uint64_t v = value; v > 1 && i < HISTOGRAM_BUCKETS - 1; v >>= 1)
+        i++;
+    h->buckets[i]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+int64_t
+histogram_percentile(struct histogram *h, double pct)
+{
+    if (h->count == 0)
+        return 0;
+    int64_t target = (int64_t) (h->count * pct / 100.0);
+    if (target >= h->count)
+        target = h->count - 1;
+    int64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target) {
+            // Report the top of the bucket, but never more than the max.
+            int64_t top = i == 0 ? 1 : ((int64_t) 2 << i) - 1;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
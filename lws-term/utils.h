@@ -49,6 +49,11 @@ get_sig(const char *sig_name);
 char *
 base64_encode(const unsigned char *buffer, size_t length);
 
+// Encode to base64 in dst (with room for (length+2)/3*4 chars),
+// without a terminating null; returns the number of chars written
+size_t
+base64_encode_to(const unsigned char *src, size_t length, char *dst);
+
 argblob_t copy_strings(const char*const* strs);
 
 struct sbuf {
@@ -77,6 +82,28 @@ extern void sbuf_copy_file(struct sbuf *buf, FILE*in);
 
 extern const char *extract_command_from_list(const char *, const char **,
                                              const char**, const char **);
+
+// Nanoseconds from CLOCK_MONOTONIC (arbitrary origin).
+extern int64_t monotonic_ns(void);
+
+// Fixed-size histogram of non-negative samples, with power-of-2 buckets:
+// buckets[0] counts 0 and 1, and buckets[i] counts [2**i, 2**(i+1)).
+#define HISTOGRAM_BUCKETS 40
+struct histogram {
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+    int64_t buckets[HISTOGRAM_BUCKETS];
+};
+extern void histogram_add(struct histogram *h, int64_t value);
+// Estimate of the value below which pct percent of the samples lie.
+extern int64_t histogram_percentile(struct histogram *h, double pct);
+
+typedef void (*setting_handler_t)(char *key, char *value, void *data);
+extern const char *parse_settings(char *text, char *end,
+                                  setting_handler_t handler, void *data,
+                                  long *error_offset);
+
 typedef bool (*test_function_t)(const char *clause, void* data);
 extern const char *check_conditional(const char *, test_function_t, void*);
 #endif //TTYD_UTIL_H
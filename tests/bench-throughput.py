@@ -0,0 +1,422 @@
+#!/usr/bin/env python3
+"""End-to-end throughput and latency benchmark for the domterm server.
+
+Starts a private domterm server (its own --socket-name and --settings),
+and runs a set of synthetic producers, each in its own session.
+Instead of a browser, each session's "headless" front-end is this script
+(in --consume mode): a minimal WebSocket client that negotiates framed
+output, counts bytes exactly like hlib/terminal.js, and sends RECEIVED
+confirmations, so server flow control behaves as with a real client.
+
+For each producer it reports the throughput seen by the consumer
+(MB/s and WebSocket messages/sec), and the server's own counters
+from "domterm status --verbose": pauses (flow control) and p50/p99
+latency from reading the pty to the lws_write that sends the data.
+
+With --sessions N each producer runs in N sessions at once (each with
+its own consumer), and the throughput is the total.  The "reads/MB"
+column is the server's pty read system calls per megabyte of output;
+use --set server.io-uring=no (for example) to compare server settings.
+
+Input data is generated from a fixed seed, so results are comparable
+between commits (on the same machine).  Needs only python3 and a shell.
+
+Usage: bench-throughput.py [--domterm PATH] [--size MB] [--sessions N]
+                           [--set NAME=VALUE]... [PRODUCER...]
+"""
+
+import argparse
+import base64
+import json
+import os
+import random
+import re
+import shlex
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.parse
+
+FRAMED_OUTPUT_PREFIX = 0xFE
+URGENT_STATELESS_COUNTED = 0x15
+URGENT_FIRST_NONCOUNTED = 0x16
+URGENT_FIRST_COUNTED = 0x17
+OUT_OF_BAND_START = 0x13
+URGENT_END = 0x14
+MASK28 = 0xFFFFFFF
+CONFIRM_EVERY = 500  # default of the flow-confirm-every setting
+DONE_MARKER = b"@@domterm-bench-done@@"
+
+# ---------------------------------------------------------------------------
+# Minimal WebSocket client (RFC 6455), enough for the domterm protocol.
+
+class WebSocket:
+    def __init__(self, host, port, path, protocol):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        key = base64.b64encode(os.urandom(16)).decode()
+        request = ("GET %s HTTP/1.1\r\n"
+                   "Host: %s:%d\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: %s\r\n"
+                   "Sec-WebSocket-Version: 13\r\n"
+                   "Sec-WebSocket-Protocol: %s\r\n"
+                   "\r\n") % (path, host, port, key, protocol)
+        self.sock.sendall(request.encode())
+        self.buf = b""
+        while b"\r\n\r\n" not in self.buf:
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise ConnectionError("connection closed during handshake")
+            self.buf += chunk
+        head, self.buf = self.buf.split(b"\r\n\r\n", 1)
+        if b" 101 " not in head.split(b"\r\n", 1)[0]:
+            raise ConnectionError("handshake failed: %r" % head)
+
+    def _read(self, n):
+        while len(self.buf) < n:
+            chunk = self.sock.recv(1 << 16)
+            if not chunk:
+                raise EOFError()
+            self.buf += chunk
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def send(self, payload, opcode=0x2):
+        header = bytearray([0x80 | opcode])
+        n = len(payload)
+        if n < 126:
+            header.append(0x80 | n)
+        elif n < 65536:
+            header.append(0x80 | 126)
+            header += struct.pack(">H", n)
+        else:
+            header.append(0x80 | 127)
+            header += struct.pack(">Q", n)
+        mask = os.urandom(4)
+        masked = bytes(b ^ mask[i & 3] for i, b in enumerate(payload))
+        self.sock.sendall(bytes(header) + mask + masked)
+
+    def recv(self):
+        """Return the next complete data message, or None on close."""
+        message = b""
+        while True:
+            b0, b1 = self._read(2)
+            opcode = b0 & 0x0F
+            n = b1 & 0x7F
+            if n == 126:
+                n = struct.unpack(">H", self._read(2))[0]
+            elif n == 127:
+                n = struct.unpack(">Q", self._read(8))[0]
+            mask = self._read(4) if b1 & 0x80 else None
+            payload = self._read(n)
+            if mask:
+                payload = bytes(b ^ mask[i & 3] for i, b in enumerate(payload))
+            if opcode == 0x8:
+                return None
+            if opcode == 0x9:
+                self.send(payload, 0xA)
+                continue
+            if opcode == 0xA:
+                continue
+            message += payload
+            if b0 & 0x80:
+                return message
+
+    def close(self):
+        try:
+            self.send(b"", 0x8)
+        except OSError:
+            pass
+        self.sock.close()
+
+# ---------------------------------------------------------------------------
+# Consumer: the "headless browser" for one session.
+
+class Counter:
+    """Track _receivedCount the way hlib/terminal.js does."""
+    def __init__(self):
+        self.received = 0
+        self.stack = []  # [saved_count, counted (None if unknown)]
+
+    def _push(self):
+        self.stack.append([self.received, None])
+
+    def _payload(self, data):
+        if self.stack and self.stack[-1][1] is None and data:
+            ch = data[0]
+            counted = ch in (URGENT_STATELESS_COUNTED, URGENT_FIRST_COUNTED)
+            self.stack[-1][1] = counted
+            if counted or ch == URGENT_FIRST_NONCOUNTED:
+                data = data[1:]
+        self.received = (self.received + len(data)) & MASK28
+
+    def _pop(self):
+        if self.stack:
+            saved, counted = self.stack.pop()
+            if counted:
+                self.received = (self.received + 2) & MASK28
+            else:
+                self.received = saved
+
+    def framed(self, msg):
+        """Process a message starting with FRAMED_OUTPUT_PREFIX.
+        Return the DATA payloads (outside control messages)."""
+        data = []
+        i = 1
+        while i + 5 <= len(msg):
+            kind = msg[i]
+            n = struct.unpack(">I", msg[i+1:i+5])[0]
+            payload = msg[i+5:i+5+n]
+            i += 5 + n
+            if kind in (ord('C'), ord('B')):
+                self._push()
+            if kind == ord('D') and not self.stack:
+                data.append(payload)
+            self._payload(payload)
+            if kind in (ord('C'), ord('E')):
+                self._pop()
+        return data
+
+    def unframed(self, msg):
+        """Process a message in the old format (in-band \\023 ... \\024)."""
+        data = []
+        start = 0
+        for i, ch in enumerate(msg):
+            if ch == OUT_OF_BAND_START:
+                if not self.stack:
+                    data.append(msg[start:i])
+                self._payload(msg[start:i])
+                self._push()
+                start = i + 1
+            elif ch == URGENT_END and self.stack:
+                self._payload(msg[start:i])
+                self._pop()
+                start = i + 1
+        if not self.stack:
+            data.append(msg[start:])
+        self._payload(msg[start:])
+        return data
+
+def report_event(ws, name, data=""):
+    ws.send(b"\xfd" + ("%s %s\n" % (name, data)).encode())
+
+def consume(url, results):
+    """Connect to the session named by url, as a browser would."""
+    parsed = urllib.parse.urlsplit(url)
+    with open(urllib.parse.unquote(parsed.path)) as f:
+        html = f.read()
+    port = int(re.search(r"http://localhost:(\d+)/", html).group(1))
+    key = re.search(r"DomTerm_server_key = '([^']*)'", html).group(1)
+    params = [p for p in re.split("[;&]", parsed.fragment) if "=" in p]
+    params += ["server-key=" + key, "main-window=true"]
+    ws = WebSocket("localhost", port, "/replsrc?" + "&".join(params), "domterm")
+    report_event(ws, "VERSION", json.dumps({"bench": 1, "framing": 1}))
+    report_event(ws, "WS", "24 80 480 800")
+    counter = Counter()
+    confirmed = 0
+    nbytes = 0
+    nmessages = 0
+    first = last = None
+    tail = b""
+    done = False
+    while not done:
+        msg = ws.recv()
+        if msg is None:
+            break
+        now = time.monotonic()
+        if first is None:
+            first = now
+        last = now
+        nbytes += len(msg)
+        nmessages += 1
+        if msg[0] == FRAMED_OUTPUT_PREFIX:
+            data = counter.framed(msg)
+        else:
+            data = counter.unframed(msg)
+        for chunk in data:
+            if DONE_MARKER in tail + chunk:
+                done = True
+            tail = (tail + chunk)[-len(DONE_MARKER):]
+        if ((counter.received - confirmed) & MASK28) > CONFIRM_EVERY:
+            confirmed = counter.received
+            report_event(ws, "RECEIVED", confirmed)
+    ws.close()
+    result = {"bytes": nbytes, "messages": nmessages,
+              "first": first, "last": last,
+              "complete": done}
+    name = "result-%d" % os.getpid()
+    tmp = os.path.join(results, name + ".tmp")
+    with open(tmp, "w") as f:
+        json.dump(result, f)
+    os.rename(tmp, os.path.join(results, name + ".json"))
+
+# ---------------------------------------------------------------------------
+# Producers.  Each writes about size bytes to its pty.
+
+def make_text_file(path, size):
+    rnd = random.Random(31)
+    words = ["lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+             "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"]
+    with open(path, "w") as f:
+        written = 0
+        while written < size:
+            line = " ".join(rnd.choice(words)
+                            for _ in range(rnd.randint(3, 14))) + "\n"
+            f.write(line)
+            written += len(line)
+
+def make_escape_file(path, size):
+    rnd = random.Random(33)
+    with open(path, "w") as f:
+        written = 0
+        while written < size:
+            parts = []
+            for _ in range(rnd.randint(4, 12)):
+                parts.append("\033[%d;%dm" % (rnd.randint(0, 1),
+                                              rnd.randint(30, 37)))
+                parts.append("x" * rnd.randint(1, 8))
+            parts.append("\033[0m\033[K")
+            if rnd.random() < 0.2:
+                parts.append("\033[%d;%dH" % (rnd.randint(1, 24),
+                                              rnd.randint(1, 80)))
+            line = "".join(parts) + "\r\n"
+            f.write(line)
+            written += len(line)
+
+SMALL_WRITES = ("import os, sys\n"
+                "n = int(sys.argv[1])\n"
+                "for i in range(n):\n"
+                "    os.write(1, b'line %8d small write\\n' % i)\n")
+
+def producers(workdir, size):
+    text = os.path.join(workdir, "text.txt")
+    escapes = os.path.join(workdir, "escapes.txt")
+    make_text_file(text, size)
+    make_escape_file(escapes, size)
+    small = os.path.join(workdir, "small-writes.py")
+    with open(small, "w") as f:
+        f.write(SMALL_WRITES)
+    q = shlex.quote
+    return {
+        "bulk-cat": "cat %s" % q(text),
+        "yes-flood": "yes 'y' | head -c %d" % size,
+        "small-writes": "%s %s %d" % (q(sys.executable), q(small), size // 32),
+        "escape-heavy": "cat %s" % q(escapes),
+    }
+
+# ---------------------------------------------------------------------------
+# Driver.
+
+def domterm(args, cmd, *rest, check=True):
+    return subprocess.run([args.domterm, "--socket-name=" + args.socket,
+                           "--settings=" + args.settings] + list(cmd),
+                          *rest, check=check, timeout=args.timeout,
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          universal_newlines=True)
+
+def server_stats(args):
+    out = domterm(args, ["status", "--verbose"]).stdout
+    stats = {}
+    for line in out.splitlines():
+        if line.startswith("Output"):
+            for key, value in re.findall(r"([\w-]+):(\d+)", line):
+                stats[key] = int(value)
+    return stats
+
+def run_producer(args, name, command):
+    results = os.path.join(args.workdir, "results")
+    shutil.rmtree(results, ignore_errors=True)
+    os.mkdir(results)
+    consumer = "%s %s --consume --results %s '%%U'" % (
+        sys.executable, os.path.abspath(__file__), results)
+    with open(args.settings, "w") as f:
+        f.write("command.headless = %s\n" % consumer)
+        for setting in args.set:
+            f.write("%s\n" % setting.replace("=", " = ", 1))
+    # Keep the session (and thus the server) alive after the producer
+    # finishes, so we can read the server's counters.
+    script = "%s; printf '\\n%s\\n'; exec sleep 3600" % (
+        command, DONE_MARKER.decode())
+    try:
+        for i in range(args.sessions):
+            domterm(args, ["--headless", "sh", "-c", script])
+        deadline = time.monotonic() + args.timeout
+        while True:
+            files = [f for f in os.listdir(results) if f.endswith(".json")]
+            if len(files) >= args.sessions:
+                break
+            if time.monotonic() > deadline:
+                raise TimeoutError("no result from consumer")
+            time.sleep(0.05)
+        parts = []
+        for name in files:
+            with open(os.path.join(results, name)) as f:
+                parts.append(json.load(f))
+        firsts = [p["first"] for p in parts if p["first"] is not None]
+        lasts = [p["last"] for p in parts if p["last"] is not None]
+        result = {"bytes": sum(p["bytes"] for p in parts),
+                  "messages": sum(p["messages"] for p in parts),
+                  "seconds": max(lasts) - min(firsts) if firsts else 0.0,
+                  "complete": all(p["complete"] for p in parts)}
+        result.update(server_stats(args))
+    finally:
+        domterm(args, ["kill-server"], check=False)
+    return result
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--domterm",
+                        default=os.path.join(os.path.dirname(__file__),
+                                             "..", "bin", "domterm"))
+    parser.add_argument("--size", type=int, default=16,
+                        help="megabytes of output per producer")
+    parser.add_argument("--sessions", type=int, default=1,
+                        help="concurrent sessions per producer")
+    parser.add_argument("--set", action="append", default=[],
+                        metavar="NAME=VALUE",
+                        help="add a server setting")
+    parser.add_argument("--timeout", type=float, default=300)
+    parser.add_argument("--consume", action="store_true",
+                        help=argparse.SUPPRESS)
+    parser.add_argument("--results", help=argparse.SUPPRESS)
+    parser.add_argument("names", nargs="*")
+    args = parser.parse_args()
+    if args.consume:
+        consume(args.names[0], args.results)
+        return 0
+    args.domterm = os.path.abspath(args.domterm)
+    args.workdir = tempfile.mkdtemp(prefix="domterm-bench-")
+    args.socket = os.path.join(args.workdir, "bench.socket")
+    args.settings = os.path.join(args.workdir, "settings.ini")
+    try:
+        all_producers = producers(args.workdir, args.size << 20)
+        names = args.names or list(all_producers)
+        print("%-14s %9s %11s %7s %9s %9s %8s" % (
+            "producer", "MB/s", "messages/s", "pauses",
+            "p50(us)", "p99(us)", "reads/MB"))
+        failed = False
+        for name in names:
+            if name not in all_producers:
+                print("unknown producer: %s" % name, file=sys.stderr)
+                return 1
+            r = run_producer(args, name, all_producers[name])
+            secs = max(r["seconds"], 1e-9)
+            mbytes = max(r.get("pty-read", 0), 1) / (1 << 20)
+            print("%-14s %9.1f %11.0f %7d %9d %9d %8.1f%s" % (
+                name, r["bytes"] / secs / (1 << 20), r["messages"] / secs,
+                r.get("pauses", -1), r.get("p50", -1), r.get("p99", -1),
+                r.get("pty-syscalls", 0) / mbytes,
+                "" if r["complete"] else "  (incomplete)"))
+            failed = failed or not r["complete"]
+        return 1 if failed else 0
+    finally:
+        shutil.rmtree(args.workdir, ignore_errors=True)
+
+if __name__ == "__main__":
+    sys.exit(main())